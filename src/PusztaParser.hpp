@@ -2,6 +2,7 @@
 #define PUSZTAPARSER_HPP
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <variant>
 #include <iostream>
@@ -11,10 +12,13 @@
 #include <memory>
 #include <cctype>
 #include <stdexcept>
+#include <functional>
 
 #include "laky_shader.h"
 #include "lakys-freetype-handler.hpp"
 #include "lakys-string-helper.hpp"
+#include "lakys-subresource.hpp"
+#include "lakys-logger.hpp"
 
 using namespace std;
 
@@ -38,6 +42,12 @@ class Text
 		{
 			text = new_text;
 		}
+
+		// Heap bytes held, roughly
+		size_t memory_usage() const
+		{
+			return text.capacity();
+		}
 };
 
 class Element
@@ -75,6 +85,29 @@ class Element
 		{
 			return is_closing;
 		}
+
+		// Heap bytes held, roughly: the strings plus a tree node per attribute
+		size_t memory_usage() const
+		{
+			size_t bytes = tag.capacity();
+			for (const auto& attr : attributes) bytes += 64 + attr.first.capacity() + attr.second.capacity();
+			for (const auto& rule : style) bytes += 64 + rule.first.capacity() + rule.second.capacity();
+			return bytes;
+		}
+
+		// Attribute value by (case-insensitive) name, "" if it isn't there
+		string get_attribute_value(const string& name) const
+		{
+			return find_attribute(attributes, name);
+		}
+
+		static string find_attribute(const map<string, string>& attributes, const string& name)
+		{
+			for (const auto& attr : attributes) {
+				if (to_lowercase(attr.first) == name) return attr.second;
+			}
+			return "";
+		}
 };
 
 using Token = std::variant<Text, Element>;
@@ -116,7 +149,7 @@ tuple<string, map<string, string>, bool> parse_tag(string body) {
 	string tag_name = "";
 	map<string, string> attributes;
 
-	cout << "Starting parsing tag " << body << endl;
+	LOG_TRACE(LogCategory::Parser, "Starting parsing tag " << body);
 
 	int i = 0;
 	bool is_closing = false;
@@ -243,6 +276,43 @@ class Layout
 
 		string page_title;
 
+		map<string, PageResource> resources; // Fetched subresources by URL
+
+		// The tokens the last render() put on screen
+		size_t first_visible = 0, last_visible = 0;
+		bool any_visible = false;
+
+		// Reports the things a tag wants loaded: stylesheets, preloaded fonts, scripts
+		// and images. token is where the tag goes among the page's tokens.
+		static void discover_subresource(const string& tag_name, const map<string, string>& attributes, bool is_closing, size_t token, const function<void(const Subresource&)>& on_subresource)
+		{
+			if (is_closing) return;
+
+			if (tag_name == "link")
+			{
+				vector<string> rels = split(to_lowercase(Element::find_attribute(attributes, "rel")), " ");
+				string href = Element::find_attribute(attributes, "href");
+				if (href.empty()) return;
+
+				if (find(rels.begin(), rels.end(), "stylesheet") != rels.end())
+				{
+					on_subresource(Subresource{ ResourceKind::Stylesheet, href, token });
+				}
+				else if (find(rels.begin(), rels.end(), "preload") != rels.end() && to_lowercase(Element::find_attribute(attributes, "as")) == "font")
+				{
+					on_subresource(Subresource{ ResourceKind::Font, href, token });
+				}
+			}
+			else if (tag_name == "script" || tag_name == "img")
+			{
+				string src = Element::find_attribute(attributes, "src");
+				if (!src.empty())
+				{
+					on_subresource(Subresource{ tag_name == "img" ? ResourceKind::Image : ResourceKind::Script, src, token });
+				}
+			}
+		}
+
 	public:
 		Layout(Shader& shader, float start_x, float start_y, map<string,string> types)
 		: s(shader), start_x(start_x), start_y(start_y), weight(400.0f), style("regular"), font_types(types), base_font_size(12.0f), glyph_px(48.0f), cursor_x(start_x), cursor_y(start_y) // Initializer list???? what the C++
@@ -252,7 +322,7 @@ class Layout
 
 			try
 			{
-				std::cout << "Setting font: " << this->font_types[this->style] << std::endl;
+				LOG_DEBUG(LogCategory::Layout, "Setting font: " << this->font_types[this->style]);
 				this->font = this->font_types[this->style];
 			}
 			catch(const std::exception& e)
@@ -306,12 +376,78 @@ class Layout
 			return this->page_title;
 		}
 
+		// Swaps in a page that was lexed elsewhere (e.g. on the page loader thread)
+		void set_page(vector<Token> new_tokens, const string& title)
+		{
+			this->tokens = move(new_tokens);
+			this->page_title = title;
+			this->resources.clear();
+		}
+
+		// Hands the page over (to the back/forward cache), leaving the layout empty
+		void take_page(vector<Token>& out_tokens, map<string, PageResource>& out_resources)
+		{
+			out_tokens = move(this->tokens);
+			out_resources = move(this->resources);
+			this->tokens.clear();
+			this->resources.clear();
+		}
+
+		// Puts a page from take_page() back, subresources and all
+		void restore_page(vector<Token> saved_tokens, const string& title, map<string, PageResource> saved_resources)
+		{
+			this->tokens = move(saved_tokens);
+			this->page_title = title;
+			this->resources = move(saved_resources);
+		}
+
+		// Subresources arrive one by one after the page itself
+		void add_resource(PageResource resource)
+		{
+			string url = resource.url;
+			this->resources[url] = move(resource);
+		}
+
+		const PageResource* get_resource(const string& url) const
+		{
+			auto it = this->resources.find(url);
+			return it != this->resources.end() ? &it->second : nullptr;
+		}
+
+		const map<string, PageResource>& get_resources() const
+		{
+			return this->resources;
+		}
+
+		size_t resource_count() const
+		{
+			return this->resources.size();
+		}
+
+		// Which tokens were on screen last frame, so what's there can be loaded first.
+		// False if nothing was.
+		bool get_visible_tokens(size_t& first, size_t& last) const
+		{
+			first = this->first_visible;
+			last = this->last_visible;
+			return this->any_visible;
+		}
+
 		void lex(string body)
+		{
+			this->tokens = tokenize(body, this->page_title);
+		}
+
+		// Doesn't touch the Layout, so it's safe to run off the render thread.
+		// title is only overwritten if the page has a <title>. Subresources are
+		// reported to on_subresource as soon as their tag is seen, even inside <head>.
+		static vector<Token> tokenize(string_view body, string& title, const function<void(const Subresource&)>& on_subresource = nullptr)
 		{
 			string buffer = "";
 			vector<Token> out;
 			bool in_tag = false;
 			string body_clean = "";
+			body_clean.reserve(body.size());
 			int skip_depth = 0;
 			bool in_title = false;
 
@@ -349,7 +485,7 @@ class Layout
 					}
 					else if(!text_trimmed.empty() && in_title)
 					{
-						this->page_title = buffer;
+						title = buffer;
 					}
 					buffer.clear();
 				}
@@ -387,6 +523,11 @@ class Layout
 							in_title = !in_title;
 						}
 
+						if(on_subresource)
+						{
+							discover_subresource(tagName, attributes, is_closing, out.size(), on_subresource);
+						}
+
 						// Check if tag is in the skip list
 						if(find(tags_to_skip.begin(), tags_to_skip.end(), tagName) != tags_to_skip.end())
 						{
@@ -403,13 +544,13 @@ class Layout
 
 						if(tagName != "--" && skip_depth == 0)
 						{
-							cout << "Rendering tag: " << tagName << (is_closing ? " (closing)" : "") << endl;
+							LOG_TRACE(LogCategory::Parser, "Rendering tag: " << tagName << (is_closing ? " (closing)" : ""));
 							Element elementToken(tagName, attributes, is_closing);
 							out.emplace_back(elementToken);
 						}
 						else
 						{
-							cout << "Skipping tag: " << tagName << endl;
+							LOG_TRACE(LogCategory::Parser, "Skipping tag: " << tagName);
 						}
 						buffer.clear();
 					}
@@ -434,7 +575,7 @@ class Layout
 				}
 			}
 
-			this->tokens = out;
+			return out;
 
 		}
 
@@ -526,7 +667,7 @@ class Layout
 
 				if (line.empty() && cursor_x > start_x + 100.0f) 
 				{
-					std::cout << "DEBUG: Resetting cursor_x from " << cursor_x << " to " << start_x << std::endl;
+					LOG_TRACE(LogCategory::Layout, "Resetting cursor_x from " << cursor_x << " to " << start_x);
 					cursor_x = start_x;
 				}
 
@@ -760,10 +901,17 @@ class Layout
 
 			//cout << "Font size: " << font_size << "pt, Scale: " << scale << ", Line height: " << line_height << endl;
 
-			for (const auto& tok : this->tokens)
+			this->any_visible = false;
+			for (size_t i = 0; i < this->tokens.size(); i++)
 			{
+				if (cursor_y >= -line_height && cursor_y <= screen_height + line_height)
+				{
+					if (!this->any_visible) this->first_visible = i;
+					this->last_visible = i;
+					this->any_visible = true;
+				}
 
-				token(tok, screen_width, screen_height);
+				token(this->tokens[i], screen_width, screen_height);
 				if (font_size != last_font_size) 
 				{
 					desired_px = pixel_dpi(font_size, dpi_scale);
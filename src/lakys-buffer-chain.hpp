@@ -0,0 +1,220 @@
+#pragma once
+
+#ifndef LAKYS_BUFFER_CHAIN_HPP
+#define LAKYS_BUFFER_CHAIN_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+
+using namespace std;
+
+// Receive buffer made of segments that never move once written, so bytes read
+// off a socket stay where they landed. Sockets write straight into prepare(),
+// readers look at the data through views, and take() only copies when the data
+// ended up spread over more than one segment.
+class BufferChain
+{
+private:
+    // The string is sized to the whole segment the first time it's written to,
+    // so its zero-fill happens once and not on every read; used says how much is data
+    struct Segment
+    {
+        string bytes;
+        size_t used = 0;
+
+        size_t free() const { return this->bytes.capacity() - this->used; }
+    };
+
+    vector<Segment> segments;
+    size_t total = 0;
+    size_t prepared_from = 0;  // Used size of the tail before prepare()
+    bool prepared = false;
+
+    size_t next_capacity = 16384;
+    static const size_t MAX_SEGMENT = 1 << 20;
+
+    void add_segment(size_t capacity)
+    {
+        this->segments.emplace_back();
+        this->segments.back().bytes.reserve(capacity);
+
+        // Grow the next one so long bodies don't end up in hundreds of pieces
+        this->next_capacity = min(max(this->next_capacity * 2, capacity), (size_t)MAX_SEGMENT);
+    }
+
+public:
+    // Makes sure the next n bytes go into a single segment (e.g. a body of known length)
+    void reserve(size_t n)
+    {
+        if(this->segments.empty() || this->segments.back().free() < n)
+        {
+            add_segment(n);
+        }
+    }
+
+    // Returns at least min_size writable bytes at the end of the chain, the
+    // actual amount goes in available. Call commit() with what was written.
+    char* prepare(size_t min_size, size_t& available)
+    {
+        if(this->segments.empty() || this->segments.back().free() < min_size)
+        {
+            add_segment(max(min_size, this->next_capacity));
+        }
+
+        Segment& tail = this->segments.back();
+        this->prepared_from = tail.used;
+        this->prepared = true;
+
+        // Stays within the reserved capacity, so nothing is reallocated. Only
+        // zero-fills the first time round, commit() doesn't shrink it again.
+        if(tail.bytes.size() < tail.bytes.capacity()) tail.bytes.resize(tail.bytes.capacity());
+        available = tail.bytes.size() - this->prepared_from;
+        return &tail.bytes[this->prepared_from];
+    }
+
+    void commit(size_t n)
+    {
+        if(!this->prepared) return;
+
+        this->segments.back().used = this->prepared_from + n;
+        this->total += n;
+        this->prepared = false;
+    }
+
+    void append(const char* data, size_t len)
+    {
+        while(len > 0)
+        {
+            size_t available;
+            char* out = prepare(1, available);
+            size_t take = min(available, len);
+            memcpy(out, data, take);
+            commit(take);
+            data += take;
+            len -= take;
+        }
+    }
+
+    // Tail segment for code that appends to a string itself (e.g. decompressors).
+    // Call appended() afterwards so the chain's size stays right.
+    string& append_target(size_t min_free)
+    {
+        if(this->segments.empty() || this->segments.back().free() < min_free)
+        {
+            add_segment(max(min_free, this->next_capacity));
+        }
+
+        // The string's size has to be the data for appending, shrinking doesn't fill
+        Segment& tail = this->segments.back();
+        tail.bytes.resize(tail.used);
+        this->prepared_from = tail.used;
+        return tail.bytes;
+    }
+
+    void appended()
+    {
+        Segment& tail = this->segments.back();
+        tail.used = tail.bytes.size();
+        this->total += tail.used - this->prepared_from;
+    }
+
+    size_t size() const
+    {
+        return this->total;
+    }
+
+    bool empty() const
+    {
+        return this->total == 0;
+    }
+
+    size_t segment_count() const
+    {
+        return this->segments.size();
+    }
+
+    // The data as one view per segment, in order
+    vector<string_view> views() const
+    {
+        vector<string_view> out;
+        for(const Segment& segment : this->segments)
+        {
+            if(segment.used > 0) out.emplace_back(segment.bytes.data(), segment.used);
+        }
+        return out;
+    }
+
+    bool is_contiguous() const
+    {
+        return views().size() <= 1;
+    }
+
+    // A single view over everything, only valid when is_contiguous()
+    string_view contiguous_view() const
+    {
+        for(const Segment& segment : this->segments)
+        {
+            if(segment.used > 0) return string_view(segment.bytes.data(), segment.used);
+        }
+        return string_view();
+    }
+
+    // Hands the data over as one string. Free when it's all in one segment,
+    // otherwise the segments are joined once. The chain is empty afterwards.
+    string take()
+    {
+        string out;
+
+        if(is_contiguous())
+        {
+            for(Segment& segment : this->segments)
+            {
+                if(segment.used > 0)
+                {
+                    segment.bytes.resize(segment.used);
+                    out = move(segment.bytes);
+                    break;
+                }
+            }
+        }
+        else
+        {
+            out.reserve(this->total);
+            for(const Segment& segment : this->segments)
+            {
+                out.append(segment.bytes.data(), segment.used);
+            }
+        }
+
+        clear();
+        return out;
+    }
+
+    // Empties the chain but keeps the tail segment's memory for what comes next,
+    // for data that's handed on as soon as it arrives
+    void drain()
+    {
+        if(this->segments.size() > 1)
+        {
+            this->segments.erase(this->segments.begin(), this->segments.end() - 1);
+        }
+        if(!this->segments.empty())
+        {
+            this->segments.back().used = 0;
+        }
+        this->total = 0;
+        this->prepared = false;
+    }
+
+    void clear()
+    {
+        this->segments.clear();
+        this->total = 0;
+        this->prepared = false;
+        this->next_capacity = 16384;
+    }
+};
+
+#endif
@@ -0,0 +1,547 @@
+#pragma once
+
+#ifndef LAKYS_CONNECTION_POOL_HPP
+#define LAKYS_CONNECTION_POOL_HPP
+
+#include <string>
+#include <iostream>
+#include <map>
+#include <set>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "socket/TcpSslClientSocket.hpp"
+#include "lakys-http2.hpp"
+#include "lakys-request-timeouts.hpp"
+
+using namespace std;
+
+// Keeps persistent HTTP/1.1 connections around so navigations, reloads and
+// redirect hops to the same host don't pay for a new TCP (and TLS) handshake.
+//
+// Hosts that pick HTTP/2 during the TLS handshake get a single shared session
+// instead, every request to them becomes a stream on it.
+class ConnectionPool
+{
+private:
+    struct IdleConnection
+    {
+        unique_ptr<TcpClientSocket> socket;
+        chrono::steady_clock::time_point idle_since;
+    };
+
+    // Keyed by "scheme://host:port"
+    map<string, vector<IdleConnection>> idle;
+    map<string, int> open_count; // Idle + checked out connections per host
+    map<string, int> warming;    // Speculative connections still handshaking
+    map<string, int> waiters;    // acquire() calls blocked on the host's limit
+
+    map<string, shared_ptr<HTTP2Connection>> sessions;
+    set<string> multiplexed;     // Origins that spoke HTTP/2 to us, as "scheme://authority"
+    set<string> connecting;      // HTTP/2 origins someone is opening a new session to
+
+    mutex pool_mutex;
+    condition_variable slot_freed;
+
+    chrono::seconds idle_timeout;
+    int max_per_host;
+
+    // Replay mode: connect to a loopback stand-in server instead, 0 = don't
+    int loopback_http_port = 0;
+    int loopback_https_port = 0;
+
+    static string key_for(const string& scheme, const string& host, int port)
+    {
+        return scheme + "://" + host + ":" + to_string(port);
+    }
+
+    void discard(const string& key, unique_ptr<TcpClientSocket> socket)
+    {
+        socket->closeConnection();
+        forget(key);
+    }
+
+    // A connection to the host is gone, its slot is free again (pool_mutex held)
+    void forget(const string& key)
+    {
+        if(--this->open_count[key] <= 0)
+        {
+            this->open_count.erase(key);
+        }
+        this->slot_freed.notify_all();
+    }
+
+    // Takes the host's most recently used idle connection, it's the least likely
+    // to have been dropped. nullptr if there's none (pool_mutex held).
+    unique_ptr<TcpClientSocket> pop_idle(const string& key)
+    {
+        auto found = this->idle.find(key);
+        if(found == this->idle.end() || found->second.empty()) return nullptr;
+
+        unique_ptr<TcpClientSocket> socket = move(found->second.back().socket);
+        found->second.pop_back();
+        if(found->second.empty())
+        {
+            this->idle.erase(found);
+        }
+        return socket;
+    }
+
+    // Whether an idle connection that was just taken out is still open. The server
+    // may have closed it meanwhile; finding out peeks at the socket, so it's done
+    // with pool_mutex let go and only for the one being handed out.
+    bool still_open(const string& key, unique_ptr<TcpClientSocket>& socket)
+    {
+        if(!socket->isStale()) return true;
+
+        socket->closeConnection();
+        socket.reset();
+
+        lock_guard<mutex> lock(this->pool_mutex);
+        forget(key);
+        return false;
+    }
+
+public:
+
+    enum class Slot
+    {
+        Idle, // Here's a kept-alive connection
+        New,  // Open one with make_socket(), it already counts against the limit
+        Busy  // The host is at its limit, try again once something is released
+    };
+
+    ConnectionPool() : idle_timeout(30), max_per_host(6) {}
+
+    // The way URLs spell it, without a default port
+    static string origin_for(const string& scheme, const string& host, int port)
+    {
+        bool default_port = (scheme == "https" && port == 443) || (scheme == "http" && port == 80);
+        return scheme + "://" + host + (default_port ? "" : ":" + to_string(port));
+    }
+
+    static ConnectionPool& instance()
+    {
+        static ConnectionPool pool;
+        return pool;
+    }
+
+    void set_idle_timeout(int seconds)
+    {
+        lock_guard<mutex> lock(this->pool_mutex);
+        this->idle_timeout = chrono::seconds(seconds);
+    }
+
+    // Sends every new connection to 127.0.0.1 on these ports (0, 0 to stop), see ReplayServer.
+    // Connections that are already open are closed, they lead to the real hosts.
+    void set_loopback(int http_port, int https_port)
+    {
+        clear();
+        lock_guard<mutex> lock(this->pool_mutex);
+        this->loopback_http_port = http_port;
+        this->loopback_https_port = https_port;
+    }
+
+    void set_max_per_host(int max_connections)
+    {
+        lock_guard<mutex> lock(this->pool_mutex);
+        this->max_per_host = max(1, max_connections);
+        this->slot_freed.notify_all();
+    }
+
+    // Hands out an idle connection to the host if there is a healthy one, otherwise
+    // opens a new one. Blocks while the host is at its connection limit.
+    // The returned socket may have failed to connect; check isConnected().
+    // A new TLS connection sends early_data with its handshake if it can, see
+    // TcpSslClientSocket::setEarlyData(). offer_http2 = false keeps a new one on
+    // HTTP/1.1, for callers that want connections of their own (DownloadManager).
+    unique_ptr<TcpClientSocket> acquire(const string& scheme, const string& host, int port, bool* reused = nullptr,
+                                        const string& early_data = "", bool offer_http2 = true)
+    {
+        string key = key_for(scheme, host, port);
+
+        prune();
+        while(true)
+        {
+            unique_ptr<TcpClientSocket> idle_socket;
+            {
+                unique_lock<mutex> lock(this->pool_mutex);
+
+                idle_socket = pop_idle(key);
+                if(!idle_socket)
+                {
+                    // A preconnect that's already handshaking will be ready sooner than a new connection
+                    this->waiters[key]++;
+                    this->slot_freed.wait(lock, [&] {
+                        return !this->idle[key].empty() || (this->warming[key] == 0 && this->open_count[key] < this->max_per_host);
+                    });
+                    if(--this->waiters[key] == 0)
+                    {
+                        this->waiters.erase(key);
+                    }
+                    if(this->warming[key] == 0)
+                    {
+                        this->warming.erase(key);
+                    }
+
+                    // Someone gave a connection back while we were waiting
+                    idle_socket = pop_idle(key);
+                }
+
+                if(!idle_socket)
+                {
+                    this->idle.erase(key);
+                    this->open_count[key]++;
+                    break;
+                }
+            }
+
+            if(still_open(key, idle_socket))
+            {
+                if(reused) *reused = true;
+                return idle_socket;
+            }
+        }
+
+        if(reused) *reused = false;
+
+        unique_ptr<TcpClientSocket> socket = make_socket(scheme, host, port);
+        TcpSslClientSocket* ssl_socket = dynamic_cast<TcpSslClientSocket*>(socket.get());
+        if(ssl_socket && !early_data.empty()) ssl_socket->setEarlyData(early_data);
+        if(ssl_socket && !offer_http2) ssl_socket->setOfferHttp2(false);
+        socket->openConnection();
+
+        return socket;
+    }
+
+    // acquire() for callers that mustn't block (FetchEngine). Nothing is connected
+    // here: for New, the caller opens the connection and hands it to release() when
+    // done, whether or not it ever connected. allow_idle = false asks for a fresh
+    // connection only, e.g. to hedge a request that's stuck on a kept-alive one.
+    // A blocked acquire() gets the host's next connection first: that's the page
+    // itself, which has to come before anything it refers to.
+    Slot try_acquire(const string& scheme, const string& host, int port, unique_ptr<TcpClientSocket>& socket, bool allow_idle = true)
+    {
+        string key = key_for(scheme, host, port);
+
+        prune();
+        while(true)
+        {
+            {
+                lock_guard<mutex> lock(this->pool_mutex);
+                if(this->waiters.count(key)) return Slot::Busy;
+
+                if(allow_idle) socket = pop_idle(key);
+                if(!socket)
+                {
+                    // A preconnect that's already handshaking will be ready sooner than a new connection
+                    auto warm = this->warming.find(key);
+                    bool warming = allow_idle && warm != this->warming.end() && warm->second > 0;
+                    if(warming || this->open_count[key] >= this->max_per_host)
+                    {
+                        return Slot::Busy;
+                    }
+
+                    this->open_count[key]++;
+                    return Slot::New;
+                }
+            }
+
+            if(still_open(key, socket)) return Slot::Idle;
+        }
+    }
+
+    // Not connected yet, set up with the configured connect timeout. Pool keys stay
+    // the real host's, only the address changes.
+    // Resolves the host, so it blocks for as long as DNS takes.
+    unique_ptr<TcpClientSocket> make_socket(const string& scheme, const string& host, int port)
+    {
+        int loopback_port;
+        {
+            lock_guard<mutex> lock(this->pool_mutex);
+            loopback_port = scheme == "https" ? this->loopback_https_port : this->loopback_http_port;
+        }
+
+        string address = loopback_port ? "127.0.0.1" : host;
+        if(loopback_port) port = loopback_port;
+
+        unique_ptr<TcpClientSocket> socket;
+        if(scheme == "https")
+        {
+            socket = make_unique<TcpSslClientSocket>(address.c_str(), port);
+        }
+        else
+        {
+            socket = make_unique<TcpClientSocket>(address.c_str(), port);
+        }
+        socket->setConnectTimeout(RequestTimeouts::instance().get_limits().connect_ms);
+        return socket;
+    }
+
+    // The HTTP/2 session to the host, if there is one. While another request is
+    // still opening one to a host known to speak HTTP/2, waits for it rather than
+    // opening a second connection. nullptr means go through acquire(), and hand
+    // the connection to promote() if it turns out to be HTTP/2.
+    shared_ptr<HTTP2Connection> acquire_session(const string& scheme, const string& host, int port)
+    {
+        if(scheme != "https") return nullptr; // No cleartext HTTP/2, browsers don't do h2c either
+
+        string key = key_for(scheme, host, port);
+        unique_lock<mutex> lock(this->pool_mutex);
+
+        while(true)
+        {
+            auto found = this->sessions.find(key);
+            if(found != this->sessions.end())
+            {
+                if(found->second->is_usable()) return found->second;
+
+                // Closing talks to the server, not while holding up the pool
+                shared_ptr<HTTP2Connection> finished = found->second;
+                this->sessions.erase(found);
+                if(!finished->is_winding_down())
+                {
+                    lock.unlock();
+                    finished->close();
+                    lock.lock();
+                }
+                continue;
+            }
+
+            if(!this->multiplexed.count(origin_for(scheme, host, port))) return nullptr;
+
+            if(!this->connecting.count(key))
+            {
+                // Our turn, acquire() opens it
+                this->connecting.insert(key);
+                return nullptr;
+            }
+            this->slot_freed.wait(lock);
+        }
+    }
+
+    // A connection from acquire() negotiated HTTP/2: it becomes the host's shared
+    // session. If another one beat it to that, the new connection is closed and
+    // the existing session returned. nullptr if the session couldn't start.
+    shared_ptr<HTTP2Connection> promote(const string& scheme, const string& host, int port, unique_ptr<TcpClientSocket> socket)
+    {
+        string key = key_for(scheme, host, port);
+
+        unique_ptr<TcpSslClientSocket> ssl_socket(dynamic_cast<TcpSslClientSocket*>(socket.get()));
+        if(ssl_socket) socket.release();
+
+        lock_guard<mutex> lock(this->pool_mutex);
+        this->connecting.erase(key);
+        this->multiplexed.insert(origin_for(scheme, host, port));
+
+        // The socket no longer counts against the HTTP/1.1 limit
+        if(--this->open_count[key] <= 0)
+        {
+            this->open_count.erase(key);
+        }
+        this->slot_freed.notify_all();
+
+        auto found = this->sessions.find(key);
+        if(found != this->sessions.end() && found->second->is_usable())
+        {
+            if(ssl_socket) ssl_socket->closeConnection();
+            return found->second;
+        }
+        if(!ssl_socket) return nullptr;
+
+        shared_ptr<HTTP2Connection> session = make_shared<HTTP2Connection>(move(ssl_socket));
+        if(!session->start()) return nullptr;
+
+        LOG_DEBUG(LogCategory::Net, "HTTP/2 session to " << host << ":" << port);
+        this->sessions[key] = session;
+        return session;
+    }
+
+    // A new connection to the host settled on HTTP/1.1 after all (it changed its
+    // mind, or we stopped offering h2)
+    void demote(const string& scheme, const string& host, int port)
+    {
+        lock_guard<mutex> lock(this->pool_mutex);
+        this->multiplexed.erase(origin_for(scheme, host, port));
+        if(this->connecting.erase(key_for(scheme, host, port)))
+        {
+            this->slot_freed.notify_all();
+        }
+    }
+
+    // Whether requests to the origin ("scheme://host[:port]") are streams on one
+    // connection, so the per-host connection limit doesn't apply to them
+    bool is_multiplexed(const string& origin)
+    {
+        lock_guard<mutex> lock(this->pool_mutex);
+        return this->multiplexed.count(origin) > 0;
+    }
+
+    // Opens a connection ahead of the request that's expected to need it and parks it
+    // as idle, so acquire() hands it out. Blocks while connecting; returns false if
+    // the host already has one waiting or is at its limit, or the connection failed.
+    bool preconnect(const string& scheme, const string& host, int port, int connect_timeout_ms)
+    {
+        string key = key_for(scheme, host, port);
+
+        prune();
+        {
+            lock_guard<mutex> lock(this->pool_mutex);
+
+            auto found = this->idle.find(key);
+            if((found != this->idle.end() && !found->second.empty()) || this->open_count[key] >= this->max_per_host)
+            {
+                return false;
+            }
+
+            this->open_count[key]++;
+            this->warming[key]++;
+        }
+
+        unique_ptr<TcpClientSocket> socket = make_socket(scheme, host, port);
+        socket->setConnectTimeout(connect_timeout_ms);
+        socket->openConnection();
+
+        bool connected = socket->isConnected();
+
+        lock_guard<mutex> lock(this->pool_mutex);
+        if(--this->warming[key] <= 0)
+        {
+            this->warming.erase(key);
+        }
+
+        if(!connected)
+        {
+            discard(key, move(socket));
+            return false;
+        }
+
+        this->idle[key].push_back({ move(socket), chrono::steady_clock::now() });
+        this->slot_freed.notify_all();
+        return true;
+    }
+
+    // Gives a connection back. Only pass reusable = true when the whole response was
+    // read and the server didn't ask to close, otherwise the connection is dropped.
+    void release(const string& scheme, const string& host, int port, unique_ptr<TcpClientSocket> socket, bool reusable)
+    {
+        if(!socket) return;
+
+        string key = key_for(scheme, host, port);
+        lock_guard<mutex> lock(this->pool_mutex);
+
+        // Whoever was waiting for this to become an HTTP/2 session can stop
+        if(this->connecting.erase(key))
+        {
+            this->slot_freed.notify_all();
+        }
+
+        if(!reusable || !socket->isConnected())
+        {
+            discard(key, move(socket));
+            return;
+        }
+
+        this->idle[key].push_back({ move(socket), chrono::steady_clock::now() });
+        this->slot_freed.notify_all();
+    }
+
+    // Drops idle connections that timed out and HTTP/2 sessions that are done.
+    // Ones the server closed are found when they're handed out, see still_open().
+    // Closing talks to the server, so that waits until pool_mutex is let go.
+    void prune()
+    {
+        vector<unique_ptr<TcpClientSocket>> expired;
+        vector<shared_ptr<HTTP2Connection>> finished;
+        {
+            lock_guard<mutex> lock(this->pool_mutex);
+            auto now = chrono::steady_clock::now();
+
+            for(auto it = this->idle.begin(); it != this->idle.end(); )
+            {
+                vector<IdleConnection>& list = it->second;
+                for(size_t i = 0; i < list.size(); )
+                {
+                    if(now - list[i].idle_since > this->idle_timeout)
+                    {
+                        expired.push_back(move(list[i].socket));
+                        list.erase(list.begin() + i);
+                        forget(it->first);
+                    }
+                    else
+                    {
+                        i++;
+                    }
+                }
+
+                if(list.empty())
+                {
+                    it = this->idle.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+
+            for(auto it = this->sessions.begin(); it != this->sessions.end(); )
+            {
+                if(!it->second->is_usable() || it->second->is_idle_for(this->idle_timeout))
+                {
+                    if(!it->second->is_winding_down()) finished.push_back(it->second);
+                    it = this->sessions.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        for(unique_ptr<TcpClientSocket>& socket : expired)
+        {
+            socket->closeConnection();
+        }
+        for(shared_ptr<HTTP2Connection>& session : finished)
+        {
+            session->close();
+        }
+    }
+
+    // Closes every idle connection and HTTP/2 session
+    void clear()
+    {
+        vector<unique_ptr<TcpClientSocket>> sockets;
+        map<string, shared_ptr<HTTP2Connection>> closing;
+        {
+            lock_guard<mutex> lock(this->pool_mutex);
+            closing.swap(this->sessions);
+            this->multiplexed.clear();
+            this->connecting.clear();
+
+            for(auto& entry : this->idle)
+            {
+                for(IdleConnection& connection : entry.second)
+                {
+                    sockets.push_back(move(connection.socket));
+                    forget(entry.first);
+                }
+            }
+            this->idle.clear();
+            this->slot_freed.notify_all();
+        }
+
+        for(auto& entry : closing)
+        {
+            entry.second->close();
+        }
+        for(unique_ptr<TcpClientSocket>& socket : sockets)
+        {
+            socket->closeConnection();
+        }
+    }
+};
+
+#endif
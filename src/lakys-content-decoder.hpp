@@ -0,0 +1,297 @@
+#pragma once
+
+#ifndef LAKYS_CONTENT_DECODER_HPP
+#define LAKYS_CONTENT_DECODER_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <zlib.h>
+#include "lakys-string-helper.hpp"
+
+// Brotli is optional, build with PUSZTA_NO_BROTLI to go without it
+#ifndef PUSZTA_NO_BROTLI
+#include <brotli/decode.h>
+#endif
+
+using namespace std;
+
+// Value for the Accept-Encoding request header, only what we can decode
+#ifndef PUSZTA_NO_BROTLI
+const string ACCEPT_ENCODING = "gzip, deflate, br";
+#else
+const string ACCEPT_ENCODING = "gzip, deflate";
+#endif
+
+// Streaming decoder for one Content-Encoding. Compressed bytes go in as they come
+// off the socket and the decoded bytes are appended to the output right away.
+class ContentDecoder
+{
+public:
+    enum class Coding
+    {
+        Gzip,
+        Deflate,
+        Brotli
+    };
+
+private:
+    Coding coding;
+    bool started = false;
+    bool finished = false;
+    bool failed = false;
+
+    z_stream zs;
+
+#ifndef PUSZTA_NO_BROTLI
+    BrotliDecoderState* brotli = nullptr;
+#endif
+
+    // "deflate" is supposed to be zlib wrapped, but some servers send raw deflate
+    bool start_zlib(const unsigned char* data, size_t len)
+    {
+        int window_bits = MAX_WBITS;
+
+        if(this->coding == Coding::Gzip)
+        {
+            window_bits = 16 + MAX_WBITS;
+        }
+        else if(len >= 2)
+        {
+            bool zlib_header = (data[0] & 0x0F) == 8 && ((data[0] << 8) | data[1]) % 31 == 0;
+            if(!zlib_header) window_bits = -MAX_WBITS;
+        }
+
+        this->zs = {};
+        return inflateInit2(&this->zs, window_bits) == Z_OK;
+    }
+
+    bool write_zlib(const unsigned char* data, size_t len, string& out)
+    {
+        unsigned char chunk[16384];
+
+        this->zs.next_in = const_cast<unsigned char*>(data);
+        this->zs.avail_in = (uInt)len;
+
+        while(this->zs.avail_in > 0 && !this->finished)
+        {
+            this->zs.next_out = chunk;
+            this->zs.avail_out = sizeof(chunk);
+
+            int result = inflate(&this->zs, Z_NO_FLUSH);
+            out.append((const char*)chunk, sizeof(chunk) - this->zs.avail_out);
+
+            if(result == Z_STREAM_END)
+            {
+                // gzip allows several members back to back
+                if(this->coding == Coding::Gzip && this->zs.avail_in > 0)
+                {
+                    inflateReset(&this->zs);
+                    continue;
+                }
+                this->finished = true;
+            }
+            else if(result == Z_BUF_ERROR)
+            {
+                // Needs more input
+                if(this->zs.avail_out != 0) break;
+            }
+            else if(result != Z_OK)
+            {
+                return false;
+            }
+        }
+
+        // Drain whatever is still buffered inside zlib
+        while(!this->finished && this->zs.avail_out == 0)
+        {
+            this->zs.next_out = chunk;
+            this->zs.avail_out = sizeof(chunk);
+
+            int result = inflate(&this->zs, Z_NO_FLUSH);
+            out.append((const char*)chunk, sizeof(chunk) - this->zs.avail_out);
+
+            if(result == Z_STREAM_END) this->finished = true;
+            else if(result != Z_OK && result != Z_BUF_ERROR) return false;
+        }
+
+        return true;
+    }
+
+#ifndef PUSZTA_NO_BROTLI
+    bool write_brotli(const unsigned char* data, size_t len, string& out)
+    {
+        unsigned char chunk[16384];
+        size_t available_in = len;
+        const uint8_t* next_in = data;
+
+        while(true)
+        {
+            size_t available_out = sizeof(chunk);
+            uint8_t* next_out = chunk;
+
+            BrotliDecoderResult result = BrotliDecoderDecompressStream(this->brotli, &available_in, &next_in, &available_out, &next_out, nullptr);
+            out.append((const char*)chunk, sizeof(chunk) - available_out);
+
+            if(result == BROTLI_DECODER_RESULT_SUCCESS)
+            {
+                this->finished = true;
+                return true;
+            }
+            if(result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT)
+            {
+                return true;
+            }
+            if(result == BROTLI_DECODER_RESULT_ERROR)
+            {
+                return false;
+            }
+            // NEEDS_MORE_OUTPUT: go around again
+        }
+    }
+#endif
+
+public:
+    explicit ContentDecoder(Coding coding) : coding(coding)
+    {
+        this->zs = {};
+#ifndef PUSZTA_NO_BROTLI
+        if(coding == Coding::Brotli)
+        {
+            this->brotli = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+            this->started = true;
+        }
+#endif
+    }
+
+    ~ContentDecoder()
+    {
+        if(this->coding != Coding::Brotli && this->started)
+        {
+            inflateEnd(&this->zs);
+        }
+#ifndef PUSZTA_NO_BROTLI
+        if(this->brotli)
+        {
+            BrotliDecoderDestroyInstance(this->brotli);
+        }
+#endif
+    }
+
+    ContentDecoder(const ContentDecoder&) = delete;
+    ContentDecoder& operator=(const ContentDecoder&) = delete;
+
+    // Returns a decoder for a single coding name, nullptr for identity or unknown codings
+    static unique_ptr<ContentDecoder> for_coding(const string& name)
+    {
+        if(name == "gzip" || name == "x-gzip") return make_unique<ContentDecoder>(Coding::Gzip);
+        if(name == "deflate") return make_unique<ContentDecoder>(Coding::Deflate);
+#ifndef PUSZTA_NO_BROTLI
+        if(name == "br") return make_unique<ContentDecoder>(Coding::Brotli);
+#endif
+        return nullptr;
+    }
+
+    static bool is_supported(const string& name)
+    {
+        return name == "identity" || for_coding(name) != nullptr;
+    }
+
+    // Decodes a piece of the body and appends the result to out. Returns false on corrupt data.
+    bool write(const char* data, size_t len, string& out)
+    {
+        if(this->failed) return false;
+        if(this->finished || len == 0) return true; // Anything after the end of the stream is ignored
+
+        const unsigned char* bytes = (const unsigned char*)data;
+
+        if(!this->started && this->coding != Coding::Brotli)
+        {
+            if(!start_zlib(bytes, len))
+            {
+                this->failed = true;
+                return false;
+            }
+            this->started = true;
+        }
+
+        bool ok;
+#ifndef PUSZTA_NO_BROTLI
+        if(this->coding == Coding::Brotli)
+        {
+            ok = write_brotli(bytes, len, out);
+        }
+        else
+#endif
+        {
+            ok = write_zlib(bytes, len, out);
+        }
+
+        if(!ok) this->failed = true;
+        return ok;
+    }
+
+    bool is_finished() const
+    {
+        return this->finished;
+    }
+};
+
+// All codings from a Content-Encoding header, applied in reverse order when decoding
+class ContentDecoderChain
+{
+private:
+    vector<unique_ptr<ContentDecoder>> decoders; // Outermost coding first
+
+public:
+    // Returns false if one of the codings isn't something we can decode
+    bool set_encoding(const string& content_encoding)
+    {
+        this->decoders.clear();
+
+        vector<string> codings = split(to_lowercase(content_encoding), ",");
+        for(auto it = codings.rbegin(); it != codings.rend(); ++it)
+        {
+            string name = *it;
+            name.erase(name.find_last_not_of(" \t") + 1);
+            name.erase(0, name.find_first_not_of(" \t"));
+
+            if(name.empty() || name == "identity") continue;
+
+            unique_ptr<ContentDecoder> decoder = ContentDecoder::for_coding(name);
+            if(!decoder)
+            {
+                this->decoders.clear();
+                return false;
+            }
+            this->decoders.push_back(move(decoder));
+        }
+
+        return true;
+    }
+
+    bool empty() const
+    {
+        return this->decoders.empty();
+    }
+
+    bool write(const char* data, size_t len, string& out)
+    {
+        if(this->decoders.size() == 1)
+        {
+            return this->decoders[0]->write(data, len, out);
+        }
+
+        string current(data, len);
+        for(size_t i = 0; i < this->decoders.size(); i++)
+        {
+            string decoded;
+            if(!this->decoders[i]->write(current.data(), current.size(), decoded)) return false;
+            current = move(decoded);
+        }
+        out += current;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,1034 @@
+#pragma once
+
+#ifndef LAKYS_DOWNLOAD_MANAGER_HPP
+#define LAKYS_DOWNLOAD_MANAGER_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <climits>
+#include "lakys-logger.hpp"
+#include "lakys-string-helper.hpp"
+#include "lakys-http-headers.hpp"
+#include "lakys-http-reader.hpp"
+#include "lakys-connection-pool.hpp"
+#include "lakys-request-timeouts.hpp"
+
+using namespace std;
+
+// Saves responses that aren't pages to show (archives, images, anything sent as
+// an attachment) into downloads/, without ever holding the whole body in memory:
+// it's streamed into a .part file as it arrives.
+//
+// Servers that take Range requests get big files split into pieces fetched in
+// parallel, each over an HTTP/1.1 connection of its own and written at its own
+// offset. A connection that runs out of work takes half of the biggest piece
+// still going. What's on disk is noted next to the .part file every second, so
+// a download that was paused, failed or cut short by quitting carries on from
+// there; If-Range makes sure the pieces are still of the same file.
+//
+// Everything runs on threads of its own, the UI only calls get_downloads().
+class DownloadManager
+{
+public:
+    enum class State
+    {
+        Running,
+        Paused,
+        Done,
+        Failed,
+        Cancelled
+    };
+
+    // A download as the UI sees it
+    struct Info
+    {
+        int id = 0;
+        string url;
+        string path;             // Where the file ends up once it's complete
+        State state = State::Running;
+        long long size = -1;     // -1 if the server didn't say
+        long long received = 0;  // Bytes on disk
+        double bytes_per_second = 0;
+        int connections = 0;     // Pieces being fetched right now
+        string error;
+    };
+
+private:
+    // [start, end] of the file, end is -1 for "to the end" when the size isn't known
+    struct Piece
+    {
+        long long start = 0;
+        long long end = -1;
+        long long done = 0;      // Bytes from start that are on disk
+        bool finished = false;   // For open-ended pieces: the response ended
+        bool active = false;     // A worker is fetching it
+
+        long long length() const
+        {
+            return this->end - this->start + 1;
+        }
+
+        bool is_complete() const
+        {
+            return this->finished || (this->end >= 0 && this->done >= length());
+        }
+    };
+
+    struct Download
+    {
+        int id = 0;
+        string url;
+        string scheme;
+        string host;
+        int port = 80;
+        string path;
+
+        string file_path;    // downloads/<name>
+        string part_path;    // Where the bytes go until it's complete
+        string state_path;   // What of the .part file is done, for resuming
+
+        // Guarded by downloads_mutex from here on
+        long long size = -1;
+        bool probed = false;   // A response said how big the file is and whether it can be split
+        bool ranges = false;   // The server answers Range requests
+        string validator;      // Strong ETag or Last-Modified, sent as If-Range
+        vector<Piece> pieces;
+        int running_workers = 0;
+        bool failed = false;   // A worker gave up, the others stop too
+        bool restart = false;  // The server sent the whole file where a piece was asked for
+        bool cancel_requested = false;
+        string error;
+        long long saved = -1;  // received when the state file was last written
+
+        chrono::steady_clock::time_point sampled_at;
+        long long sampled_bytes = 0;
+        double rate = 0;
+
+        condition_variable changed;
+        thread runner;
+
+        atomic<State> state{ State::Running };
+        atomic<long long> received{ 0 };
+        TransferProgress progress; // cancelled pauses (or cancels) every worker
+        chrono::steady_clock::time_point started;
+        long long started_at_bytes = 0; // Already on disk when this run started
+    };
+
+    map<int, shared_ptr<Download>> downloads;
+    mutex downloads_mutex;
+    int next_id = 1;
+
+    string directory = "downloads";
+    int max_connections = 4;
+    long long min_piece = 1024 * 1024;  // Smaller than this isn't worth its own connection
+    static const int MAX_FAILURES = 5;  // In a row, per connection
+
+    DownloadManager() {}
+
+    ~DownloadManager()
+    {
+        shutdown();
+    }
+
+    // http(s)://host[:port]/path into its parts
+    static bool parse_url(const string& url, Download& download)
+    {
+        size_t scheme_end = url.find("://");
+        if(scheme_end == string::npos) return false;
+
+        download.scheme = url.substr(0, scheme_end);
+        if(download.scheme != "http" && download.scheme != "https") return false;
+
+        size_t host_start = scheme_end + 3;
+        size_t path_start = url.find('/', host_start);
+        string authority = url.substr(host_start, path_start == string::npos ? string::npos : path_start - host_start);
+        download.path = path_start == string::npos ? "/" : url.substr(path_start);
+        download.path = download.path.substr(0, download.path.find('#'));
+
+        download.port = download.scheme == "https" ? 443 : 80;
+        size_t colon = authority.find(':');
+        if(colon != string::npos)
+        {
+            download.port = atoi(authority.c_str() + colon + 1);
+            authority = authority.substr(0, colon);
+        }
+        download.host = authority;
+        return !download.host.empty() && download.port > 0;
+    }
+
+    // Content-Disposition's filename, or the last part of the path
+    static string file_name_for(const HTTPHeaders& fields, const string& path)
+    {
+        string name;
+
+        string disposition(fields.get("Content-Disposition"));
+        size_t found = to_lowercase(disposition).find("filename=");
+        if(found != string::npos)
+        {
+            name = disposition.substr(found + 9);
+            if(!name.empty() && name[0] == '"')
+            {
+                name = name.substr(1, name.find('"', 1) - 1);
+            }
+            else
+            {
+                name = name.substr(0, name.find(';'));
+            }
+        }
+
+        if(name.empty())
+        {
+            name = path.substr(0, path.find('?'));
+        }
+
+        // Never a path of its own, and nothing a file system would choke on
+        name = name.substr(name.find_last_of("/\\") + 1);
+        for(char& c : name)
+        {
+            if(string_view("<>:\"|?*").find(c) != string_view::npos || (unsigned char)c < 32) c = '_';
+        }
+        if(name.empty() || name == "." || name == "..") name = "download";
+        return name;
+    }
+
+    // name in the downloads directory, numbered if something's already called that
+    string unique_path(const string& name)
+    {
+        size_t dot = name.find_last_of('.');
+        string stem = dot == string::npos || dot == 0 ? name : name.substr(0, dot);
+        string extension = dot == string::npos || dot == 0 ? "" : name.substr(dot);
+
+        error_code error;
+        string candidate = this->directory + "/" + name;
+        for(int i = 1; filesystem::exists(candidate, error) || filesystem::exists(candidate + ".part", error) || taken(candidate); i++)
+        {
+            candidate = this->directory + "/" + stem + " (" + to_string(i) + ")" + extension;
+        }
+        return candidate;
+    }
+
+    // Caller must hold downloads_mutex
+    bool taken(const string& file_path) const
+    {
+        for(const auto& entry : this->downloads)
+        {
+            if(entry.second->file_path == file_path) return true;
+        }
+        return false;
+    }
+
+    // Splits [from, size) into up to max_connections pieces. Caller must hold downloads_mutex.
+    void plan_locked(Download& download, long long from)
+    {
+        long long left = download.size - from;
+        long long count = max(1LL, min((long long)this->max_connections, left / this->min_piece));
+        long long each = left / count;
+
+        for(long long i = 0; i < count; i++)
+        {
+            Piece piece;
+            piece.start = from + i * each;
+            piece.end = i == count - 1 ? download.size - 1 : piece.start + each - 1;
+            download.pieces.push_back(piece);
+        }
+    }
+
+    // The next piece for a worker, -1 once there's nothing left for it. Before the
+    // first response nobody knows if the file can be split, so the others wait.
+    int claim(Download& download)
+    {
+        unique_lock<mutex> lock(this->downloads_mutex);
+        while(true)
+        {
+            if(download.progress.cancelled || download.failed || download.restart) return -1;
+
+            for(size_t i = 0; i < download.pieces.size(); i++)
+            {
+                Piece& piece = download.pieces[i];
+                if(!piece.active && !piece.is_complete())
+                {
+                    piece.active = true;
+                    return (int)i;
+                }
+            }
+
+            if(!download.probed)
+            {
+                download.changed.wait(lock);
+                continue;
+            }
+            if(!download.ranges) return -1;
+
+            // Take the back half of whatever has the most left to go
+            int biggest = -1;
+            long long most_left = 0;
+            for(size_t i = 0; i < download.pieces.size(); i++)
+            {
+                const Piece& piece = download.pieces[i];
+                long long left = piece.end < 0 ? 0 : piece.length() - piece.done;
+                if(piece.active && left > most_left)
+                {
+                    biggest = (int)i;
+                    most_left = left;
+                }
+            }
+            if(biggest < 0 || most_left < 2 * this->min_piece) return -1;
+
+            Piece& old_piece = download.pieces[biggest];
+            Piece stolen;
+            stolen.start = old_piece.start + old_piece.done + most_left / 2;
+            stolen.end = old_piece.end;
+            stolen.active = true;
+            old_piece.end = stolen.start - 1;
+            download.pieces.push_back(stolen);
+            return (int)download.pieces.size() - 1;
+        }
+    }
+
+    // The response to a piece's request, once its headers are in. Returns false
+    // if it's no use for the piece.
+    bool check_response(Download& download, int index, long long from, const HTTPResponseReader& reader, string& error)
+    {
+        const HTTPHeaders& fields = reader.get_fields();
+        int status = reader.get_status();
+
+        lock_guard<mutex> lock(this->downloads_mutex);
+        Piece& piece = download.pieces[index];
+
+        if(status == 206)
+        {
+            // bytes first-last/size
+            string content_range(fields.get("Content-Range"));
+            long long first = -1, last = -1, size = -1;
+            size_t dash = content_range.find('-');
+            size_t slash = content_range.find('/');
+            if(content_range.rfind("bytes ", 0) == 0 && dash != string::npos && slash != string::npos)
+            {
+                first = atoll(content_range.c_str() + 6);
+                last = atoll(content_range.c_str() + dash + 1);
+                if(content_range.compare(slash + 1, 1, "*") != 0) size = atoll(content_range.c_str() + slash + 1);
+            }
+            if(first != from || last < first)
+            {
+                error = "Unexpected Content-Range: " + content_range;
+                return false;
+            }
+
+            if(!download.probed)
+            {
+                download.probed = true;
+                download.ranges = size > 0;
+                download.size = size;
+                download.validator = validator_for(fields);
+
+                // The first piece was the whole file, now it's one of several
+                if(download.ranges)
+                {
+                    download.pieces.clear();
+                    plan_locked(download, 0);
+                    download.pieces[0].active = true;
+                    LOG_DEBUG(LogCategory::Net, "Downloading " << download.url << " in " << download.pieces.size() << " pieces");
+                }
+                download.changed.notify_all();
+            }
+            return true;
+        }
+
+        if(status == 200)
+        {
+            // The whole file: fine for a first request, but it doesn't fit a piece
+            if(from == 0 && !download.probed)
+            {
+                download.probed = true;
+                download.ranges = false;
+                if(fields.get(HeaderId::ContentEncoding).empty())
+                {
+                    long long length = atoll(string(fields.get(HeaderId::ContentLength)).c_str());
+                    download.size = fields.has(HeaderId::ContentLength) ? length : -1;
+                }
+                piece.end = download.size > 0 ? download.size - 1 : -1;
+                download.changed.notify_all();
+                return true;
+            }
+
+            LOG_WARN(LogCategory::Net, "The server sent all of " << download.url << " instead of a piece, starting over");
+            download.restart = true;
+            download.changed.notify_all();
+            return false;
+        }
+
+        error = "HTTP Error " + to_string(status);
+
+        // The server won't change its mind about those, unlike with 5xx, 408 and 429
+        if(status >= 400 && status < 500 && status != 408 && status != 429)
+        {
+            download.failed = true;
+            download.changed.notify_all();
+        }
+        return false;
+    }
+
+    // If-Range takes a strong ETag or a date, weak ETags don't count
+    static string validator_for(const HTTPHeaders& fields)
+    {
+        string etag(fields.get(HeaderId::ETag));
+        if(!etag.empty() && etag.rfind("W/", 0) != 0) return etag;
+        return string(fields.get(HeaderId::LastModified));
+    }
+
+    // Fetches what's left of the piece into the .part file. Returns true once the
+    // piece is complete (or another worker took over the rest of it).
+    bool fetch_piece(Download& download, int index, string& error)
+    {
+        long long from, to;
+        bool probing;
+        string validator;
+        {
+            lock_guard<mutex> lock(this->downloads_mutex);
+            const Piece& piece = download.pieces[index];
+            from = piece.start + piece.done;
+            to = piece.end;
+            probing = !download.probed;
+            validator = download.validator;
+        }
+
+        string authority = download.host;
+        if(download.port != (download.scheme == "https" ? 443 : 80)) authority += ":" + to_string(download.port);
+
+        string request = "GET " + download.path + " HTTP/1.1\r\n";
+        request += "Host: " + authority + "\r\n";
+        request += "Connection: keep-alive\r\n";
+        request += "User-Agent: " + USER_AGENT + "\r\n";
+        // Ranges count bytes of the file as stored, so no compression
+        request += "Accept-Encoding: identity\r\n";
+        request += "Range: bytes=" + to_string(from) + "-" + (to >= 0 ? to_string(to) : "") + "\r\n";
+        if(!probing && !validator.empty())
+        {
+            request += "If-Range: " + validator + "\r\n";
+        }
+        request += "\r\n";
+
+        fstream file(download.part_path, ios::in | ios::out | ios::binary);
+        file.seekp(from);
+        if(!file)
+        {
+            error = "Could not write " + download.part_path;
+            return false;
+        }
+
+        // Our own HTTP/1.1 connections: an HTTP/2 session would send every piece down the one TCP connection
+        ConnectionPool& pool = ConnectionPool::instance();
+        bool reused = false;
+        unique_ptr<TcpClientSocket> socket = pool.acquire(download.scheme, download.host, download.port, &reused, "", false);
+        if(!socket->isConnected())
+        {
+            error = "Could not connect to " + download.host + ": " + socket->getMessage();
+            pool.release(download.scheme, download.host, download.port, move(socket), false);
+            return false;
+        }
+
+        RequestTimeouts::Limits limits = RequestTimeouts::instance().get_limits();
+        HTTPResponseReader reader;
+        reader.set_progress(&download.progress);
+        reader.set_timeouts(limits.first_byte_ms, limits.idle_ms, chrono::steady_clock::now());
+
+        bool accepted = false;
+        reader.set_header_check([&](const HTTPResponseReader& response) {
+            accepted = check_response(download, index, from, response, error);
+            return accepted;
+        });
+
+        // Writes at most up to the piece's end, which moves when another worker takes half
+        bool write_failed = false;
+        reader.set_body_sink([&](const char* data, size_t len) {
+            long long left;
+            {
+                lock_guard<mutex> lock(this->downloads_mutex);
+                const Piece& piece = download.pieces[index];
+                left = piece.end < 0 ? LLONG_MAX : piece.length() - piece.done;
+            }
+
+            size_t take = (size_t)min((long long)len, max(0LL, left));
+            file.write(data, take);
+            if(!file)
+            {
+                write_failed = true;
+                return false;
+            }
+
+            {
+                lock_guard<mutex> lock(this->downloads_mutex);
+                Piece& piece = download.pieces[index];
+                long long before = piece.done;
+                piece.done += take;
+                if(piece.end >= 0) piece.done = min(piece.done, piece.length());
+                download.received += piece.done - before;
+            }
+
+            // The rest of the response belongs to someone else's piece
+            return take == len;
+        });
+
+        bool complete = false;
+        if(socket->sendData((void*)request.c_str(), request.size()))
+        {
+            complete = reader.read_from(*socket);
+        }
+        else
+        {
+            error = "Could not send the request to " + download.host;
+        }
+
+        // Stopping mid-body leaves the connection unusable, only a finished response gives it back
+        pool.release(download.scheme, download.host, download.port, move(socket), complete && reader.keep_alive());
+        file.close();
+
+        lock_guard<mutex> lock(this->downloads_mutex);
+        if(write_failed)
+        {
+            // Most likely the disk is full, trying again won't help
+            error = "Could not write " + download.part_path;
+            download.failed = true;
+            return false;
+        }
+
+        Piece& piece = download.pieces[index];
+        if(accepted && complete && piece.end < 0)
+        {
+            piece.finished = true;
+        }
+        if(piece.is_complete()) return true;
+
+        if(error.empty())
+        {
+            if(reader.has_timed_out()) error = download.host + " stopped sending";
+            else if(!reader.has_headers()) error = "No response from " + download.host;
+            else error = "The connection to " + download.host + " was cut short";
+        }
+        return false;
+    }
+
+    void work(shared_ptr<Download> download)
+    {
+        int failures = 0;
+
+        while(true)
+        {
+            int index = claim(*download);
+            if(index < 0) break;
+
+            string error;
+            bool ok = fetch_piece(*download, index, error);
+            bool give_up;
+            {
+                lock_guard<mutex> lock(this->downloads_mutex);
+                download->pieces[index].active = false;
+                download->changed.notify_all();
+
+                if(ok)
+                {
+                    failures = 0;
+                    continue;
+                }
+                if(download->progress.cancelled || download->restart) break;
+
+                give_up = download->failed || ++failures >= MAX_FAILURES;
+                if(give_up && download->error.empty())
+                {
+                    LOG_ERROR(LogCategory::Net, "Download of " << download->url << " failed: " << error);
+                    download->failed = true;
+                    download->error = error;
+                }
+            }
+            if(give_up) break;
+
+            // Give the server a moment, a bit longer each time
+            LOG_WARN(LogCategory::Net, error << ", retrying " << download->url);
+            for(int waited = 0; waited < failures * 500 && !download->progress.cancelled; waited += 100)
+            {
+                this_thread::sleep_for(chrono::milliseconds(100));
+            }
+        }
+
+        lock_guard<mutex> lock(this->downloads_mutex);
+        download->running_workers--;
+        download->changed.notify_all();
+    }
+
+    // Caller must hold downloads_mutex
+    void save_state_locked(Download& download)
+    {
+        if(download.saved == download.received) return;
+
+        ostringstream state;
+        state << "url " << download.url << "\n";
+        state << "size " << download.size << "\n";
+        state << "ranges " << (download.ranges ? 1 : 0) << "\n";
+        state << "validator " << download.validator << "\n";
+        for(const Piece& piece : download.pieces)
+        {
+            state << "piece " << piece.start << " " << piece.end << " " << piece.done << " " << (piece.finished ? 1 : 0) << "\n";
+        }
+
+        // Written aside and moved over, so a crash never leaves half a state file
+        string temporary = download.state_path + ".tmp";
+        {
+            ofstream file(temporary, ios::binary | ios::trunc);
+            file << state.str();
+            if(!file) return;
+        }
+        error_code error;
+        filesystem::rename(temporary, download.state_path, error);
+        if(!error) download.saved = download.received;
+    }
+
+    static bool load_state(const string& state_path, Download& download)
+    {
+        ifstream file(state_path, ios::binary);
+        if(!file.is_open()) return false;
+
+        string line;
+        while(getline(file, line))
+        {
+            istringstream fields(line);
+            string key;
+            fields >> key;
+
+            if(key == "url") download.url = line.substr(4);
+            else if(key == "size") fields >> download.size;
+            else if(key == "ranges") { int ranges = 0; fields >> ranges; download.ranges = ranges != 0; }
+            else if(key == "validator") download.validator = line.size() > 10 ? line.substr(10) : "";
+            else if(key == "piece")
+            {
+                Piece piece;
+                int finished = 0;
+                fields >> piece.start >> piece.end >> piece.done >> finished;
+                piece.finished = finished != 0;
+                download.pieces.push_back(piece);
+            }
+        }
+
+        // Without ranges there's nothing to pick up, it starts over
+        download.probed = download.ranges && download.size > 0 && !download.pieces.empty();
+        if(!download.probed) download.pieces.clear();
+
+        long long received = 0;
+        for(const Piece& piece : download.pieces) received += piece.done;
+        download.received = received;
+        download.saved = received;
+        return !download.url.empty();
+    }
+
+    // Drives one run of a download: workers fetch pieces until they're all on disk,
+    // or it's paused, cancelled or fails. Runs on the download's own thread.
+    void run(shared_ptr<Download> download)
+    {
+        error_code error;
+        filesystem::create_directories(this->directory, error);
+
+        while(true)
+        {
+            int workers;
+            {
+                lock_guard<mutex> lock(this->downloads_mutex);
+                if(download->pieces.empty())
+                {
+                    if(download->probed && download->ranges) plan_locked(*download, 0);
+                    else download->pieces.push_back(Piece());
+
+                    // Nothing on disk is any use
+                    ofstream(download->part_path, ios::binary | ios::trunc);
+                }
+                else if(!filesystem::exists(download->part_path, error))
+                {
+                    ofstream(download->part_path, ios::binary);
+                }
+
+                workers = download->probed && !download->ranges ? 1 : this->max_connections;
+                download->running_workers = workers;
+            }
+
+            vector<thread> threads;
+            for(int i = 0; i < workers; i++)
+            {
+                threads.emplace_back(&DownloadManager::work, this, download);
+            }
+
+            // Note down what's on disk every second until they're done
+            {
+                unique_lock<mutex> lock(this->downloads_mutex);
+                while(download->running_workers > 0)
+                {
+                    download->changed.wait_for(lock, chrono::seconds(1));
+                    save_state_locked(*download);
+                }
+            }
+            for(thread& worker : threads)
+            {
+                worker.join();
+            }
+
+            lock_guard<mutex> lock(this->downloads_mutex);
+            if(!download->restart) break;
+
+            // Whatever's on disk may be of another version of the file
+            download->restart = false;
+            download->probed = false;
+            download->ranges = false;
+            download->size = -1;
+            download->validator.clear();
+            download->pieces.clear();
+            download->received = 0;
+            if(download->progress.cancelled) break;
+        }
+
+        finish(*download);
+    }
+
+    // After a run: moves the file into place, or leaves it to be resumed
+    void finish(Download& download)
+    {
+        lock_guard<mutex> lock(this->downloads_mutex);
+        error_code error;
+
+        if(download.cancel_requested)
+        {
+            filesystem::remove(download.part_path, error);
+            filesystem::remove(download.state_path, error);
+            download.state = State::Cancelled;
+            LOG_INFO(LogCategory::Net, "Cancelled the download of " << download.url);
+            return;
+        }
+
+        bool complete = !download.pieces.empty();
+        for(const Piece& piece : download.pieces)
+        {
+            complete = complete && piece.is_complete();
+        }
+
+        if(complete)
+        {
+            filesystem::rename(download.part_path, download.file_path, error);
+            if(error)
+            {
+                download.error = "Could not move the file into place: " + error.message();
+                download.state = State::Failed;
+                return;
+            }
+            filesystem::remove(download.state_path, error);
+
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - download.started).count();
+            long long fetched = download.received - download.started_at_bytes;
+            LOG_INFO(LogCategory::Net, "Downloaded " << download.url << " to " << download.file_path << ", " << download.received
+                     << " bytes (" << fetched << " this time) at " << (int)(fetched / max(seconds, 0.001) / 1024) << " KB/s");
+            download.state = State::Done;
+            return;
+        }
+
+        // A failure before anything arrived (e.g. a 404) leaves nothing worth keeping
+        if(download.failed && download.received == 0)
+        {
+            filesystem::remove(download.part_path, error);
+            filesystem::remove(download.state_path, error);
+        }
+        else
+        {
+            download.saved = -1;
+            save_state_locked(download);
+        }
+        download.state = download.failed ? State::Failed : State::Paused;
+    }
+
+    // Caller must hold downloads_mutex; the previous run must have finished
+    void launch_locked(shared_ptr<Download> download)
+    {
+        if(download->runner.joinable()) download->runner.join();
+
+        download->progress.cancelled = false;
+        download->failed = false;
+        download->restart = false;
+        download->cancel_requested = false;
+        download->error.clear();
+        download->started = chrono::steady_clock::now();
+        download->started_at_bytes = download->received;
+        download->sampled_at = download->started;
+        download->sampled_bytes = download->received;
+        download->rate = 0;
+        download->state = State::Running;
+        download->runner = thread(&DownloadManager::run, this, download);
+    }
+
+public:
+    static DownloadManager& instance()
+    {
+        static DownloadManager manager;
+        return manager;
+    }
+
+    // Whether a response is a file to save rather than a page to show: sent as an
+    // attachment, or of a type that isn't text
+    static bool is_download(const HTTPHeaders& fields)
+    {
+        if(fields.get_status() != 200) return false;
+
+        string disposition = to_lowercase(string(fields.get("Content-Disposition")));
+        if(disposition.rfind("attachment", 0) == 0) return true;
+
+        string type = to_lowercase(string(fields.get(HeaderId::ContentType)));
+        type = type.substr(0, type.find(';'));
+        if(type.empty()) return false;
+
+        return type.rfind("text/", 0) != 0 && type.find("xml") == string::npos && type.find("json") == string::npos &&
+               type.find("javascript") == string::npos;
+    }
+
+    // How many connections one download may use, and the smallest piece worth one
+    void set_max_connections(int connections)
+    {
+        lock_guard<mutex> lock(this->downloads_mutex);
+        this->max_connections = max(1, connections);
+    }
+
+    int get_max_connections()
+    {
+        lock_guard<mutex> lock(this->downloads_mutex);
+        return this->max_connections;
+    }
+
+    void set_min_piece(long long bytes)
+    {
+        lock_guard<mutex> lock(this->downloads_mutex);
+        this->min_piece = max(16384LL, bytes);
+    }
+
+    // Downloads whatever's at url. response_headers are from a response that was
+    // just turned away for being a file, they save asking the server again.
+    // An unfinished download of the same URL is resumed instead. Returns its id,
+    // -1 if url can't be downloaded.
+    int start(const string& url, const string& response_headers = "")
+    {
+        lock_guard<mutex> lock(this->downloads_mutex);
+
+        for(auto& entry : this->downloads)
+        {
+            shared_ptr<Download>& existing = entry.second;
+            if(existing->url != url) continue;
+            State state = existing->state;
+            if(state == State::Running) return existing->id;
+            if(state == State::Paused || state == State::Failed)
+            {
+                launch_locked(existing);
+                return existing->id;
+            }
+        }
+
+        auto download = make_shared<Download>();
+        download->url = url;
+        if(!parse_url(url, *download))
+        {
+            LOG_ERROR(LogCategory::Net, "Can't download " << url);
+            return -1;
+        }
+
+        HTTPHeaders fields;
+        if(!response_headers.empty()) fields.parse(response_headers);
+
+        download->id = this->next_id++;
+        download->file_path = unique_path(file_name_for(fields, download->path));
+        download->part_path = download->file_path + ".part";
+        download->state_path = download->part_path + ".state";
+
+        // Enough to split it right away, no need to learn it from the first piece
+        bool ranges = equals_ignore_case(fields.get("Accept-Ranges"), "bytes");
+        if(fields.get_status() == 200 && ranges && fields.get(HeaderId::ContentEncoding).empty() && fields.has(HeaderId::ContentLength))
+        {
+            download->size = atoll(string(fields.get(HeaderId::ContentLength)).c_str());
+            download->ranges = download->size > 0;
+            download->probed = download->ranges;
+            download->validator = validator_for(fields);
+        }
+
+        LOG_INFO(LogCategory::Net, "Downloading " << url << " to " << download->file_path);
+        this->downloads[download->id] = download;
+        launch_locked(download);
+        return download->id;
+    }
+
+    // Picks up downloads an earlier run didn't finish, paused where they stopped
+    void load_unfinished()
+    {
+        error_code error;
+        if(!filesystem::is_directory(this->directory, error)) return;
+
+        lock_guard<mutex> lock(this->downloads_mutex);
+        for(const auto& entry : filesystem::directory_iterator(this->directory, error))
+        {
+            string state_path = entry.path().generic_string();
+            const string suffix = ".part.state";
+            if(state_path.size() <= suffix.size() || state_path.compare(state_path.size() - suffix.size(), suffix.size(), suffix) != 0) continue;
+
+            auto download = make_shared<Download>();
+            if(!load_state(state_path, *download) || !parse_url(download->url, *download)) continue;
+
+            download->file_path = state_path.substr(0, state_path.size() - suffix.size());
+            download->part_path = download->file_path + ".part";
+            download->state_path = state_path;
+            if(taken(download->file_path)) continue;
+
+            download->id = this->next_id++;
+            download->state = State::Paused;
+            this->downloads[download->id] = download;
+            LOG_DEBUG(LogCategory::Net, "Unfinished download of " << download->url << ", " << download->received << " bytes in");
+        }
+    }
+
+    // Stops fetching; what's on disk stays for resume()
+    void pause(int id)
+    {
+        lock_guard<mutex> lock(this->downloads_mutex);
+        auto found = this->downloads.find(id);
+        if(found == this->downloads.end() || found->second->state != State::Running) return;
+
+        found->second->progress.cancelled = true;
+        found->second->changed.notify_all();
+    }
+
+    void resume(int id)
+    {
+        lock_guard<mutex> lock(this->downloads_mutex);
+        auto found = this->downloads.find(id);
+        if(found == this->downloads.end()) return;
+
+        State state = found->second->state;
+        if(state == State::Paused || state == State::Failed)
+        {
+            launch_locked(found->second);
+        }
+    }
+
+    // Stops and throws away what was downloaded so far
+    void cancel(int id)
+    {
+        lock_guard<mutex> lock(this->downloads_mutex);
+        auto found = this->downloads.find(id);
+        if(found == this->downloads.end()) return;
+
+        Download& download = *found->second;
+        download.cancel_requested = true;
+        if(download.state == State::Running)
+        {
+            download.progress.cancelled = true;
+            download.changed.notify_all();
+            return;
+        }
+
+        // Nothing's running to clean up after itself
+        if(download.state == State::Paused || download.state == State::Failed)
+        {
+            error_code error;
+            filesystem::remove(download.part_path, error);
+            filesystem::remove(download.state_path, error);
+            download.state = State::Cancelled;
+        }
+    }
+
+    // Forgets finished and cancelled downloads (the files stay)
+    void clear_finished()
+    {
+        lock_guard<mutex> lock(this->downloads_mutex);
+        for(auto it = this->downloads.begin(); it != this->downloads.end(); )
+        {
+            State state = it->second->state;
+            if(state == State::Done || state == State::Cancelled)
+            {
+                if(it->second->runner.joinable()) it->second->runner.join();
+                it = this->downloads.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    // Every download, oldest first. Throughput is averaged over the time since the last call.
+    vector<Info> get_downloads()
+    {
+        lock_guard<mutex> lock(this->downloads_mutex);
+        auto now = chrono::steady_clock::now();
+
+        vector<Info> out;
+        for(auto& entry : this->downloads)
+        {
+            Download& download = *entry.second;
+
+            double elapsed = chrono::duration<double>(now - download.sampled_at).count();
+            if(elapsed >= 0.5)
+            {
+                double rate = (download.received - download.sampled_bytes) / elapsed;
+                download.rate = download.rate == 0 ? rate : download.rate * 0.6 + rate * 0.4;
+                download.sampled_at = now;
+                download.sampled_bytes = download.received;
+            }
+
+            Info info;
+            info.id = download.id;
+            info.url = download.url;
+            info.path = download.file_path;
+            info.state = download.state;
+            info.size = download.size;
+            info.received = download.received;
+            info.bytes_per_second = info.state == State::Running ? download.rate : 0;
+            info.error = download.error;
+            for(const Piece& piece : download.pieces)
+            {
+                if(piece.active) info.connections++;
+            }
+            out.push_back(info);
+        }
+        return out;
+    }
+
+    bool has_running()
+    {
+        lock_guard<mutex> lock(this->downloads_mutex);
+        for(auto& entry : this->downloads)
+        {
+            if(entry.second->state == State::Running) return true;
+        }
+        return false;
+    }
+
+    // Pauses everything and waits for it to be written down, to be resumed next time
+    void shutdown()
+    {
+        vector<shared_ptr<Download>> running;
+        {
+            lock_guard<mutex> lock(this->downloads_mutex);
+            for(auto& entry : this->downloads)
+            {
+                entry.second->progress.cancelled = true;
+                entry.second->changed.notify_all();
+                running.push_back(entry.second);
+            }
+        }
+
+        for(shared_ptr<Download>& download : running)
+        {
+            if(download->runner.joinable()) download->runner.join();
+        }
+    }
+};
+
+#endif
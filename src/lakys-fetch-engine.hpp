@@ -0,0 +1,1007 @@
+#pragma once
+
+#ifndef LAKYS_FETCH_ENGINE_HPP
+#define LAKYS_FETCH_ENGINE_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include "lakys-logger.hpp"
+#include "lakys-network-thread.hpp"
+#include "lakys-connection-pool.hpp"
+#include "lakys-socket-handler.hpp"
+#include "lakys-request-timeouts.hpp"
+
+using namespace std;
+
+struct FetchOptions
+{
+    bool revalidate = false;
+    TransferProgress* progress = nullptr; // Has to outlive the fetch; cancelling it cancels the fetch
+    int urgency = 3;                      // RFC 9218 style, lower gets a connection to the host first
+};
+
+// What fetch() hands to its callback, the same things HTTP would have said
+struct FetchResult
+{
+    string url;            // After redirects
+    int status = 0;        // 0 if there was no response
+    string headers;
+    string content_type;
+    string body;           // Or the error text, like HTTP::request()
+    bool cancelled = false;
+    bool multiplexed = false; // Nothing was fetched: the host speaks HTTP/2, go through HTTP instead
+};
+
+// GETs without a thread per request: every connection is a non-blocking socket
+// on the network thread, connecting (Happy Eyeballs), handshaking, writing and
+// reading as its socket gets ready, so dozens of fetches share one thread.
+//
+// HTTP still makes every decision (redirects, cache, archive, cookies of the
+// future), this only moves the bytes between begin_exchange() and
+// finish_exchange(). Those two may read and write the disk, so they run on the
+// resolver thread and only the sockets are left to the network thread.
+// Connections come from and go back to ConnectionPool, so
+// they're shared with the blocking requests and count against the same limits.
+// Fetches waiting for one of a busy host's connections get it most urgent first.
+//
+// HTTP/1.1 only. Its new TLS connections don't offer h2; for hosts that already
+// have an HTTP/2 session the result comes back marked multiplexed, and the
+// caller makes the request through HTTP, as a stream on that session.
+//
+// Connections keep to RequestTimeouts' limits, and a request that's slow to get
+// its first byte is hedged: a second connection sends it again, and whichever
+// of the two starts answering first finishes the fetch.
+class FetchEngine
+{
+public:
+    using Callback = function<void(FetchResult&)>;
+
+private:
+    struct Fetch
+    {
+        uint64_t id = 0;
+        string url;
+        FetchOptions options;
+        Callback callback;
+
+        HTTP http;
+        HTTPExchange exchange;
+        string scheme;       // Connection scheme, http or https
+        string host;
+        int port = 0;
+        string key;          // Pool key, what waiting is grouped by
+        uint64_t connection = 0; // 0 while waiting for one
+        uint64_t hedge = 0;      // The second connection racing the first one, see start_hedge()
+        bool hedged = false;     // Once per exchange is enough
+        bool ready = false;      // begin_exchange() left it to the network, see prepare()
+    };
+
+    enum class Phase
+    {
+        Resolving,
+        Connecting,
+        Handshaking,
+        Sending,
+        Receiving
+    };
+
+    struct Connection
+    {
+        uint64_t id = 0;
+        shared_ptr<Fetch> fetch; // nullptr once cancelled while resolving
+        string scheme;
+        string host;
+        int port = 0;
+        string key;
+        bool hedge = false; // Sends the request its fetch already sent on another connection
+
+        Phase phase = Phase::Resolving;
+        unique_ptr<TcpClientSocket> socket;
+        SOCKET descriptor = INVALID_SOCKET; // Watched once connected
+        bool reused = false;
+
+        // Happy Eyeballs: attempts in flight, and when the next one starts
+        vector<ResolvedAddress> addresses;
+        size_t next_address = 0;
+        vector<SOCKET> attempts;
+        uint64_t attempt_timer = 0;
+        int last_error = 0;
+        chrono::steady_clock::time_point connect_start;
+
+        string request;
+        size_t written = 0;
+        unique_ptr<HTTPResponseReader> reader;
+
+        uint64_t deadline_timer = 0; // See arm_deadline()
+    };
+
+    // Network thread only
+    map<uint64_t, shared_ptr<Fetch>> fetches;
+    map<string, deque<shared_ptr<Fetch>>> waiting;
+    map<uint64_t, unique_ptr<Connection>> connections;
+    uint64_t next_connection = 1;
+    uint64_t tick_timer = 0;
+    bool stopped = false;
+
+    atomic<uint64_t> next_fetch{ 1 };
+    atomic<bool> started{ false };
+
+    FetchEngine() {}
+
+    static bool is_cancelled(const Fetch& fetch)
+    {
+        return fetch.options.progress && fetch.options.progress->cancelled;
+    }
+
+    Connection* find_connection(uint64_t id)
+    {
+        auto found = this->connections.find(id);
+        return found == this->connections.end() ? nullptr : found->second.get();
+    }
+
+    void start(shared_ptr<Fetch> fetch)
+    {
+        if(this->stopped)
+        {
+            complete_cancelled(fetch);
+            return;
+        }
+
+        this->fetches[fetch->id] = fetch;
+        try
+        {
+            fetch->http.set(fetch->url);
+        }
+        catch (const exception&)
+        {
+            complete(fetch, "");
+            return;
+        }
+
+        fetch->http.set_revalidate(fetch->options.revalidate);
+        fetch->http.set_progress(fetch->options.progress);
+        fetch->http.set_defer_redirects(true);
+        begin(fetch);
+    }
+
+    // (Again, after a redirect.) Answers right away what doesn't need the network,
+    // queues the rest for a connection to its host.
+    void begin(shared_ptr<Fetch> fetch)
+    {
+        NetworkThread::instance().resolve<string>(
+            [fetch] { return prepare(*fetch); },
+            [this, fetch](string& result) { on_prepared(fetch, move(result)); });
+    }
+
+    // Resolver thread: the cache, the archive or the disk may answer, through as
+    // many redirects as they know of. Nothing else touches the fetch meanwhile.
+    static string prepare(Fetch& fetch)
+    {
+        string result;
+        fetch.ready = false;
+        while(!is_cancelled(fetch))
+        {
+            fetch.exchange = HTTPExchange();
+            fetch.hedged = false;
+            if(fetch.http.begin_exchange(fetch.exchange, result))
+            {
+                fetch.ready = true;
+                break;
+            }
+            if(!fetch.http.take_pending_redirect()) break;
+        }
+        return result;
+    }
+
+    void on_prepared(shared_ptr<Fetch> fetch, string result)
+    {
+        if(!this->fetches.count(fetch->id)) return; // Cancelled meanwhile
+
+        if(is_cancelled(*fetch))
+        {
+            complete_cancelled(fetch);
+            return;
+        }
+        if(!fetch->ready)
+        {
+            complete(fetch, move(result));
+            return;
+        }
+
+        ConnectionPool& pool = ConnectionPool::instance();
+        fetch->scheme = fetch->exchange.connection_scheme;
+        fetch->host = fetch->http.get_host();
+        fetch->port = fetch->http.get_port();
+        fetch->key = fetch->scheme + "://" + fetch->host + ":" + to_string(fetch->port);
+
+        if(pool.is_multiplexed(ConnectionPool::origin_for(fetch->scheme, fetch->host, fetch->port)))
+        {
+            complete_multiplexed(fetch);
+            return;
+        }
+
+        // Behind everything as urgent or more, ahead of the rest
+        deque<shared_ptr<Fetch>>& queue = this->waiting[fetch->key];
+        auto position = find_if(queue.begin(), queue.end(), [&](const shared_ptr<Fetch>& queued) {
+            return queued->options.urgency > fetch->options.urgency;
+        });
+        queue.insert(position, fetch);
+        dispatch(fetch->key);
+        arm_tick();
+    }
+
+    // Gives waiting fetches to the host connections, as many as the pool allows.
+    // Anything it sets off may queue more for the host, so the queue is looked up
+    // again every time round.
+    void dispatch(const string& key)
+    {
+        ConnectionPool& pool = ConnectionPool::instance();
+
+        while(true)
+        {
+            auto queue = this->waiting.find(key);
+            if(queue == this->waiting.end()) return;
+            if(queue->second.empty())
+            {
+                this->waiting.erase(queue);
+                return;
+            }
+
+            shared_ptr<Fetch> fetch = queue->second.front();
+            unique_ptr<TcpClientSocket> socket;
+            ConnectionPool::Slot slot = pool.try_acquire(fetch->scheme, fetch->host, fetch->port, socket);
+            if(slot == ConnectionPool::Slot::Busy) return;
+            queue->second.pop_front();
+
+            // A preconnected socket may have picked HTTP/2, it becomes the host's session
+            TcpSslClientSocket* ssl_socket = dynamic_cast<TcpSslClientSocket*>(socket.get());
+            if(ssl_socket && ssl_socket->negotiatedProtocol() == "h2")
+            {
+                pool.promote(fetch->scheme, fetch->host, fetch->port, move(socket));
+                complete_multiplexed(fetch);
+                continue;
+            }
+
+            Connection& connection = add_connection(fetch);
+            fetch->connection = connection.id;
+
+            if(slot == ConnectionPool::Slot::Idle)
+            {
+                connection.socket = move(socket);
+                connection.reused = true;
+                connection.socket->setBlocking(false);
+                watch(connection, connection.socket->getDescriptor());
+                start_exchange(connection);
+            }
+            else
+            {
+                resolve(connection);
+            }
+        }
+    }
+
+    Connection& add_connection(shared_ptr<Fetch> fetch)
+    {
+        unique_ptr<Connection> created = make_unique<Connection>();
+        Connection& connection = *created;
+        connection.id = this->next_connection++;
+        connection.fetch = fetch;
+        connection.scheme = fetch->scheme;
+        connection.host = fetch->host;
+        connection.port = fetch->port;
+        connection.key = fetch->key;
+        this->connections[connection.id] = move(created);
+        return connection;
+    }
+
+    // The socket's constructor looks the host up, which blocks, so it's made on
+    // the resolver thread
+    void resolve(Connection& connection)
+    {
+        uint64_t id = connection.id;
+        string scheme = connection.scheme, host = connection.host;
+        int port = connection.port;
+
+        NetworkThread::instance().resolve<unique_ptr<TcpClientSocket>>(
+            [scheme, host, port] { return ConnectionPool::instance().make_socket(scheme, host, port); },
+            [this, id](unique_ptr<TcpClientSocket>& socket) { on_resolved(id, move(socket)); });
+    }
+
+    void on_resolved(uint64_t id, unique_ptr<TcpClientSocket> socket)
+    {
+        Connection* connection = find_connection(id);
+        if(!connection) return;
+
+        connection->socket = move(socket);
+        if(!connection->fetch)
+        {
+            close_connection(*connection, false);
+            return;
+        }
+
+        // A hedge is better off on another of the host's addresses, the first one may be the trouble
+        if(connection->hedge)
+        {
+            Connection* first = find_connection(connection->fetch->connection);
+            if(first && first != connection && first->socket) connection->socket->avoidAddressOf(*first->socket);
+        }
+
+        connection->addresses = connection->socket->getConnectOrder();
+        connection->phase = Phase::Connecting;
+        connection->connect_start = chrono::steady_clock::now();
+        arm_deadline(*connection);
+        next_attempt(*connection);
+    }
+
+    // Starts connecting to the next address, and the one after that in
+    // ConnectionAttemptDelayMs unless this one is done by then (RFC 8305)
+    void next_attempt(Connection& connection)
+    {
+        NetworkThread& network = NetworkThread::instance();
+        if(connection.attempt_timer)
+        {
+            network.cancel_timer(connection.attempt_timer);
+            connection.attempt_timer = 0;
+        }
+
+        while(connection.next_address < connection.addresses.size())
+        {
+            bool connected;
+            int error;
+            SOCKET sock = HappyEyeballs::startAttempt(connection.addresses[connection.next_address++], connected, error);
+            if(sock == INVALID_SOCKET)
+            {
+                connection.last_error = error;
+                continue;
+            }
+            if(connected)
+            {
+                on_connected(connection, sock);
+                return;
+            }
+
+            uint64_t id = connection.id;
+            connection.attempts.push_back(sock);
+            network.watch(sock, EventLoop::Writable, [this, id, sock](int) { on_attempt_ready(id, sock); });
+
+            if(connection.next_address < connection.addresses.size())
+            {
+                connection.attempt_timer = network.add_timer(HappyEyeballs::ConnectionAttemptDelayMs, [this, id] {
+                    Connection* later = find_connection(id);
+                    if(!later) return;
+                    later->attempt_timer = 0;
+                    next_attempt(*later);
+                });
+            }
+            return;
+        }
+
+        if(connection.attempts.empty())
+        {
+            connection.socket->connectionFailed(connection.last_error, elapsed_ms(connection.connect_start));
+            fail_connection(connection);
+        }
+    }
+
+    void on_attempt_ready(uint64_t id, SOCKET sock)
+    {
+        Connection* connection = find_connection(id);
+        if(!connection) return;
+
+        NetworkThread::instance().unwatch(sock);
+        vector<SOCKET>& attempts = connection->attempts;
+        attempts.erase(find(attempts.begin(), attempts.end(), sock));
+
+        int error = HappyEyeballs::attemptError(sock);
+        if(error == 0)
+        {
+            on_connected(*connection, sock);
+            return;
+        }
+
+        // Don't wait out the delay before trying the next address
+        HappyEyeballs::closeSocket(sock);
+        connection->last_error = error;
+        next_attempt(*connection);
+    }
+
+    void close_attempts(Connection& connection)
+    {
+        NetworkThread& network = NetworkThread::instance();
+        if(connection.attempt_timer)
+        {
+            network.cancel_timer(connection.attempt_timer);
+            connection.attempt_timer = 0;
+        }
+        for(SOCKET sock : connection.attempts)
+        {
+            network.unwatch(sock);
+            HappyEyeballs::closeSocket(sock);
+        }
+        connection.attempts.clear();
+    }
+
+    void on_connected(Connection& connection, SOCKET sock)
+    {
+        close_attempts(connection);
+        connection.socket->adoptConnection(sock, elapsed_ms(connection.connect_start));
+        watch(connection, sock);
+
+        TcpSslClientSocket* ssl_socket = dynamic_cast<TcpSslClientSocket*>(connection.socket.get());
+        if(!ssl_socket)
+        {
+            start_exchange(connection);
+            return;
+        }
+
+        // Sent with the handshake if the session we resume allows it (0-RTT)
+        if(connection.request.empty())
+        {
+            Fetch& fetch = *connection.fetch;
+            connection.request = fetch.http.request_head(fetch.exchange);
+        }
+        ssl_socket->setEarlyData(connection.request);
+
+        if(!ssl_socket->beginHandshake(false))
+        {
+            fail_connection(connection);
+            return;
+        }
+        connection.phase = Phase::Handshaking;
+        continue_handshake(connection);
+    }
+
+    void watch(Connection& connection, SOCKET sock)
+    {
+        uint64_t id = connection.id;
+        connection.descriptor = sock;
+        NetworkThread::instance().watch(sock, EventLoop::Writable, [this, id](int events) { on_ready(id, events); });
+    }
+
+    void on_ready(uint64_t id, int events)
+    {
+        Connection* connection = find_connection(id);
+        if(!connection) return;
+
+        // Each phase waits for what it needs, errors and hangups come as both and
+        // its next read or write finds out what went wrong. The handshake may want
+        // either, continue_handshake() says which.
+        switch(connection->phase)
+        {
+            case Phase::Handshaking:
+                continue_handshake(*connection);
+                break;
+            case Phase::Sending:
+                if(events & EventLoop::Writable) send_request(*connection);
+                break;
+            case Phase::Receiving:
+                if(events & EventLoop::Readable) receive(*connection);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void continue_handshake(Connection& connection)
+    {
+        TcpSslClientSocket* ssl_socket = static_cast<TcpSslClientSocket*>(connection.socket.get());
+
+        bool want_write;
+        int result = ssl_socket->continueHandshake(want_write);
+        if(result < 0)
+        {
+            fail_connection(connection);
+        }
+        else if(result == 0)
+        {
+            NetworkThread::instance().modify(connection.descriptor, want_write ? EventLoop::Writable : EventLoop::Readable);
+        }
+        else
+        {
+            LOG_DEBUG(LogCategory::Net, "SSL connection established with " << connection.host);
+            start_exchange(connection);
+        }
+    }
+
+    void start_exchange(Connection& connection)
+    {
+        Fetch& fetch = *connection.fetch;
+
+        // A hedge resends what the first connection sent, the exchange is theirs
+        if(!connection.hedge)
+        {
+            fetch.http.connection_opened(fetch.exchange, *connection.socket, connection.reused);
+            if(connection.request.empty()) connection.request = fetch.http.request_head(fetch.exchange);
+            fetch.http.mark_sent(fetch.exchange);
+        }
+
+        // Nothing left to send if it went with the handshake, which a kept-alive
+        // connection's was for an earlier request
+        TcpSslClientSocket* ssl_socket = dynamic_cast<TcpSslClientSocket*>(connection.socket.get());
+        bool early = !connection.reused && ssl_socket && ssl_socket->earlyDataAccepted();
+        if(early)
+        {
+            LOG_DEBUG(LogCategory::Net, "Request to " << connection.host << " went out with the handshake (0-RTT)");
+        }
+
+        RequestTimeouts::Limits limits = RequestTimeouts::instance().get_limits();
+        connection.written = early ? connection.request.size() : 0;
+        connection.reader = make_unique<HTTPResponseReader>();
+        connection.reader->set_progress(fetch.options.progress);
+        connection.reader->set_timeouts(limits.first_byte_ms, limits.idle_ms, fetch.exchange.sent);
+        connection.phase = Phase::Sending;
+        arm_deadline(connection);
+        send_request(connection);
+    }
+
+    // A TLS write that couldn't finish has to be repeated with the same bytes, which
+    // it is: the request stays where it is until it's all out
+    void send_request(Connection& connection)
+    {
+        while(connection.written < connection.request.size())
+        {
+            int n = connection.socket->writeSome(connection.request.data() + connection.written, connection.request.size() - connection.written);
+            if(n < 0)
+            {
+                finish_response(connection, false);
+                return;
+            }
+            if(n == 0)
+            {
+                NetworkThread::instance().modify(connection.descriptor, EventLoop::Writable);
+                return;
+            }
+            connection.written += n;
+        }
+
+        connection.phase = Phase::Receiving;
+        NetworkThread::instance().modify(connection.descriptor, EventLoop::Readable);
+        arm_deadline(connection);
+    }
+
+    void receive(Connection& connection)
+    {
+        char chunk[16384]; // A whole TLS record, so OpenSSL never sits on half of one
+
+        // Let the other connections have a go after a while, the loop comes back
+        // for the rest
+        for(int reads = 0; reads < 64; reads++)
+        {
+            int n = connection.socket->readSome(chunk, sizeof(chunk));
+            if(n == 0) return;
+            if(n < 0)
+            {
+                finish_response(connection, connection.reader->end_of_stream());
+                return;
+            }
+
+            if(connection.fetch->hedge)
+            {
+                settle_race(connection);
+            }
+
+            bool first_bytes = connection.reader->get_bytes_received() == 0;
+            if(!connection.reader->feed(chunk, n))
+            {
+                LOG_ERROR(LogCategory::Http, "Malformed response body");
+                finish_response(connection, false);
+                return;
+            }
+
+            // From here on it's the idle timeout, which may run out sooner
+            if(first_bytes) arm_deadline(connection);
+            if(connection.reader->is_complete())
+            {
+                finish_response(connection, true);
+                return;
+            }
+        }
+    }
+
+    void finish_response(Connection& connection, bool complete)
+    {
+        shared_ptr<Fetch> fetch = connection.fetch;
+        HTTPResponseReader& reader = *connection.reader;
+
+        // Whichever connection is left of the two may still answer
+        if(!reader.has_headers() && drop_racer(connection)) return;
+
+        // The server may have dropped an idle connection just as we picked it up,
+        // that's not an error, just try again on another one
+        if(!reader.has_headers() && connection.reused && !reader.has_timed_out() && !is_cancelled(*fetch))
+        {
+            close_connection(connection, false);
+            fetch->connection = 0;
+            this->waiting[fetch->key].push_front(fetch);
+            post_dispatch(fetch->key);
+            return;
+        }
+
+        // Plain HTTP only sends its SYN with the request, so it's known from here
+        fetch->exchange.timing.fast_open = !connection.reused && connection.socket->usedFastOpen();
+        shared_ptr<HTTPResponseReader> response(move(connection.reader));
+        close_connection(connection, response->keep_alive());
+        fetch->connection = 0;
+
+        // The cache and the stores it updates are on disk, see prepare()
+        NetworkThread::instance().resolve<string>(
+            [fetch, response, complete] { return fetch->http.finish_exchange(fetch->exchange, *response, complete); },
+            [this, fetch](string& body) {
+                if(!this->fetches.count(fetch->id)) return; // Cancelled meanwhile
+
+                if(fetch->http.take_pending_redirect())
+                {
+                    begin(fetch);
+                    return;
+                }
+                complete_fetch(fetch, move(body));
+            });
+    }
+
+    void fail_connection(Connection& connection)
+    {
+        if(drop_racer(connection)) return;
+
+        shared_ptr<Fetch> fetch = connection.fetch;
+        string body = fetch->http.connection_failed(fetch->exchange, *connection.socket);
+        close_connection(connection, false);
+        complete_fetch(fetch, move(body));
+    }
+
+    // Hands the socket back to the pool (blocking again, that's what the pool's
+    // other users expect) and forgets the connection
+    void close_connection(Connection& connection, bool reusable)
+    {
+        close_attempts(connection);
+        if(connection.deadline_timer)
+        {
+            NetworkThread::instance().cancel_timer(connection.deadline_timer);
+        }
+        if(connection.descriptor != INVALID_SOCKET)
+        {
+            NetworkThread::instance().unwatch(connection.descriptor);
+        }
+
+        string key = connection.key;
+        if(connection.socket)
+        {
+            if(reusable) connection.socket->setBlocking(true);
+            ConnectionPool::instance().release(connection.scheme, connection.host, connection.port, move(connection.socket), reusable);
+        }
+        this->connections.erase(connection.id);
+
+        post_dispatch(key);
+    }
+
+    // Forgets the connection without it finishing anything. One still being made
+    // on the resolver thread is closed by on_resolved().
+    void abandon(Connection& connection)
+    {
+        if(connection.phase == Phase::Resolving)
+        {
+            connection.fetch = nullptr;
+        }
+        else
+        {
+            close_connection(connection, false);
+        }
+    }
+
+    // How long until the connection needs looking at again: when its connect or
+    // response timeout runs out, or when it's time to hedge it. -1 for never.
+    long long next_deadline_ms(Connection& connection)
+    {
+        switch(connection.phase)
+        {
+            case Phase::Connecting:
+            case Phase::Handshaking:
+            {
+                int limit = RequestTimeouts::instance().get_limits().connect_ms;
+                if(limit < 0) return -1;
+                return max(0LL, limit - (long long)elapsed_ms(connection.connect_start));
+            }
+            case Phase::Sending:
+            case Phase::Receiving:
+            {
+                long long wait = connection.reader->get_time_left();
+                long long hedge = hedge_wait_ms(connection);
+                if(hedge >= 0 && (wait < 0 || hedge < wait)) wait = hedge;
+                return wait;
+            }
+            default:
+                return -1;
+        }
+    }
+
+    // Only a request that's all sent and still waiting for its first byte is
+    // hedged, and only once
+    long long hedge_wait_ms(Connection& connection)
+    {
+        Fetch& fetch = *connection.fetch;
+        if(connection.hedge || fetch.hedge || fetch.hedged) return -1;
+        if(connection.phase != Phase::Receiving || connection.reader->get_bytes_received() > 0) return -1;
+
+        int delay = RequestTimeouts::instance().hedge_delay_ms(connection.host);
+        if(delay < 0) return -1;
+        return max(0LL, delay - (long long)elapsed_ms(fetch.exchange.sent));
+    }
+
+    // Sets the connection's timer for next_deadline_ms(). It isn't moved along as
+    // bytes come in; on_deadline() finds out whether it's really due.
+    void arm_deadline(Connection& connection)
+    {
+        NetworkThread& network = NetworkThread::instance();
+        if(connection.deadline_timer)
+        {
+            network.cancel_timer(connection.deadline_timer);
+            connection.deadline_timer = 0;
+        }
+        if(!connection.fetch) return;
+
+        long long wait = next_deadline_ms(connection);
+        if(wait < 0) return;
+
+        uint64_t id = connection.id;
+        connection.deadline_timer = network.add_timer((int)wait, [this, id] {
+            Connection* connection = find_connection(id);
+            if(!connection) return;
+            connection->deadline_timer = 0;
+            on_deadline(*connection);
+        });
+    }
+
+    void on_deadline(Connection& connection)
+    {
+        if(!connection.fetch) return;
+
+        if(connection.phase == Phase::Connecting || connection.phase == Phase::Handshaking)
+        {
+            if(next_deadline_ms(connection) == 0)
+            {
+                connection.socket->connectionTimedOut(elapsed_ms(connection.connect_start));
+                fail_connection(connection);
+                return;
+            }
+        }
+        else if(connection.phase == Phase::Sending || connection.phase == Phase::Receiving)
+        {
+            if(connection.reader->get_time_left() == 0)
+            {
+                connection.reader->time_out();
+                finish_response(connection, false);
+                return;
+            }
+            if(hedge_wait_ms(connection) == 0)
+            {
+                start_hedge(connection);
+            }
+        }
+        arm_deadline(connection);
+    }
+
+    // Sends the request again on a new connection of its own, if the host's
+    // limit allows one more, and lets the two race
+    void start_hedge(Connection& first)
+    {
+        shared_ptr<Fetch> fetch = first.fetch;
+        fetch->hedged = true;
+
+        unique_ptr<TcpClientSocket> idle;
+        if(ConnectionPool::instance().try_acquire(fetch->scheme, fetch->host, fetch->port, idle, false) != ConnectionPool::Slot::New) return;
+
+        LOG_INFO(LogCategory::Net, "No answer from " << fetch->host << " after " << (int)elapsed_ms(fetch->exchange.sent) << " ms, hedging " << fetch->exchange.timing.url);
+        fetch->exchange.timing.hedged = true;
+
+        Connection& hedge = add_connection(fetch);
+        hedge.hedge = true;
+        hedge.request = first.request;
+        fetch->hedge = hedge.id;
+        resolve(hedge);
+    }
+
+    // The connection got the first bytes of the answer, the other one can go
+    void settle_race(Connection& winner)
+    {
+        Fetch& fetch = *winner.fetch;
+        uint64_t loser = winner.hedge ? fetch.connection : fetch.hedge;
+        fetch.connection = winner.id;
+        fetch.hedge = 0;
+
+        if(winner.hedge)
+        {
+            LOG_DEBUG(LogCategory::Net, "Hedged request to " << fetch.host << " answered first");
+        }
+
+        Connection* other = find_connection(loser);
+        if(other) abandon(*other);
+    }
+
+    // A racing connection that failed leaves the fetch to the other one. Returns
+    // false if it wasn't racing.
+    bool drop_racer(Connection& connection)
+    {
+        Fetch& fetch = *connection.fetch;
+        if(!fetch.hedge) return false;
+
+        fetch.connection = connection.hedge ? fetch.connection : fetch.hedge;
+        fetch.hedge = 0;
+        close_connection(connection, false);
+        return true;
+    }
+
+    void post_dispatch(const string& key)
+    {
+        NetworkThread::instance().post([this, key] { dispatch(key); });
+    }
+
+    void complete_fetch(shared_ptr<Fetch> fetch, string body)
+    {
+        fetch->connection = 0;
+        complete(fetch, move(body));
+    }
+
+    void complete(shared_ptr<Fetch> fetch, string body)
+    {
+        this->fetches.erase(fetch->id);
+
+        FetchResult result;
+        result.url = fetch->http.get_url();
+        result.status = fetch->http.get_status();
+        result.headers = fetch->http.get_response_headers();
+        result.content_type = fetch->http.get_header("Content-Type");
+        result.body = move(body);
+        fetch->callback(result);
+    }
+
+    void complete_multiplexed(shared_ptr<Fetch> fetch)
+    {
+        this->fetches.erase(fetch->id);
+
+        FetchResult result;
+        result.url = fetch->url;
+        result.multiplexed = true;
+        fetch->callback(result);
+    }
+
+    void complete_cancelled(shared_ptr<Fetch> fetch)
+    {
+        this->fetches.erase(fetch->id);
+
+        FetchResult result;
+        result.url = fetch->url;
+        result.cancelled = true;
+        fetch->callback(result);
+    }
+
+    void cancel_fetch(shared_ptr<Fetch> fetch)
+    {
+        Connection* hedge = find_connection(fetch->hedge);
+        if(hedge) abandon(*hedge);
+        fetch->hedge = 0;
+
+        Connection* connection = find_connection(fetch->connection);
+        if(connection)
+        {
+            abandon(*connection);
+        }
+        else
+        {
+            auto queue = this->waiting.find(fetch->key);
+            if(queue != this->waiting.end())
+            {
+                queue->second.erase(remove(queue->second.begin(), queue->second.end(), fetch), queue->second.end());
+            }
+        }
+
+        fetch->connection = 0;
+        complete_cancelled(fetch);
+    }
+
+    // While anything's going on: notices cancelled progress, and gives hosts that
+    // were busy another try (their connections may have gone back to the pool
+    // from a blocking request, which doesn't tell us)
+    void arm_tick()
+    {
+        if(this->tick_timer || this->fetches.empty()) return;
+        this->tick_timer = NetworkThread::instance().add_timer(100, [this] {
+            this->tick_timer = 0;
+            tick();
+        });
+    }
+
+    void tick()
+    {
+        vector<shared_ptr<Fetch>> cancelled;
+        for(auto& entry : this->fetches)
+        {
+            if(is_cancelled(*entry.second)) cancelled.push_back(entry.second);
+        }
+        for(shared_ptr<Fetch>& fetch : cancelled)
+        {
+            cancel_fetch(fetch);
+        }
+
+        vector<string> keys;
+        for(auto& entry : this->waiting)
+        {
+            keys.push_back(entry.first);
+        }
+        for(const string& key : keys)
+        {
+            dispatch(key);
+        }
+
+        arm_tick();
+    }
+
+    static double elapsed_ms(chrono::steady_clock::time_point since)
+    {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - since).count();
+    }
+
+public:
+    static FetchEngine& instance()
+    {
+        static FetchEngine engine;
+        return engine;
+    }
+
+    // GETs the URL, following redirects, and calls back with the result on the
+    // network thread (right away instead, if that has stopped). Safe from any
+    // thread. Returns an id for cancel().
+    uint64_t fetch(const string& url, const FetchOptions& options, Callback callback)
+    {
+        shared_ptr<Fetch> fetch = make_shared<Fetch>();
+        fetch->id = this->next_fetch++;
+        fetch->url = url;
+        fetch->options = options;
+        fetch->callback = move(callback);
+
+        this->started = true;
+        if(!NetworkThread::instance().post([this, fetch] { start(fetch); }))
+        {
+            FetchResult result;
+            result.url = url;
+            result.cancelled = true;
+            fetch->callback(result);
+        }
+        return fetch->id;
+    }
+
+    void cancel(uint64_t id)
+    {
+        NetworkThread::instance().post([this, id] {
+            auto found = this->fetches.find(id);
+            if(found != this->fetches.end()) cancel_fetch(found->second);
+        });
+    }
+
+    // Cancels everything and takes no new fetches. Before NetworkThread::stop().
+    void stop()
+    {
+        if(!this->started) return;
+
+        NetworkThread::instance().run([this] {
+            this->stopped = true;
+
+            vector<shared_ptr<Fetch>> remaining;
+            for(auto& entry : this->fetches)
+            {
+                remaining.push_back(entry.second);
+            }
+            for(shared_ptr<Fetch>& fetch : remaining)
+            {
+                cancel_fetch(fetch);
+            }
+        });
+    }
+};
+
+#endif
@@ -1,56 +1,344 @@
+#pragma once
+
+#ifndef LAKYS_FILE_LOADER_HPP
+#define LAKYS_FILE_LOADER_HPP
+
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <cctype>
+#include "lakys-logger.hpp"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
-string load_file(string file_path)
+// file:///C:/pages/a.html arrives here as "/C:/pages/a.html" and file:///home/a.html
+// as "/home/a.html". Paths that don't exist from the root are taken relative to
+// the working directory, the way file:///index.html has always worked.
+inline string local_path(const string& url_path)
 {
+	// %20 and friends
+	string file_path;
+	file_path.reserve(url_path.size());
+	for(size_t i = 0; i < url_path.size(); i++)
+	{
+		if(url_path[i] == '%' && i + 2 < url_path.size() && isxdigit((unsigned char)url_path[i + 1]) && isxdigit((unsigned char)url_path[i + 2]))
+		{
+			file_path += (char)stoi(url_path.substr(i + 1, 2), nullptr, 16);
+			i += 2;
+		}
+		else
+		{
+			file_path += url_path[i];
+		}
+	}
 
-	// Remove / from the beginning of the file path
-	if(file_path[0] == '/')
+	if(file_path.size() >= 3 && file_path[0] == '/' && isalpha((unsigned char)file_path[1]) && file_path[2] == ':')
 	{
-		file_path = file_path.substr(1);
+		return file_path.substr(1);
+	}
+
+	error_code error;
+	if(!file_path.empty() && file_path[0] == '/' && !filesystem::exists(file_path, error))
+	{
+		return file_path.substr(1);
 	}
 
-	cout << "Loading " << file_path << endl;
+	return file_path;
+}
+
+// Read-only bytes of a local file. Regular files are memory-mapped, so opening a
+// multi-hundred-MB dump costs nothing until the lexer walks over it; pipes and
+// special files are read into memory instead, and a directory becomes an HTML
+// listing of its entries.
+class FileView
+{
+private:
+	const char* data = nullptr;
+	size_t length = 0;
+	string buffer;  // Streamed files and directory listings
 
-	string full_text;
-	string line;
+	bool mapped = false;
+	bool directory = false;
 
-	ifstream file(file_path);
+#ifdef _WIN32
+	HANDLE file_handle = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
 
-	while(getline(file, line))
+	bool map(const string& path, size_t size)
 	{
-		std::cout << "Line: " << line << endl;
-		full_text += (line + "\n");
+#ifdef _WIN32
+		this->file_handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if(this->file_handle == INVALID_HANDLE_VALUE) return false;
+
+		this->mapping = CreateFileMappingA(this->file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(this->mapping == NULL)
+		{
+			unmap();
+			return false;
+		}
+
+		void* view = MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0);
+		if(view == NULL)
+		{
+			unmap();
+			return false;
+		}
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if(fd < 0) return false;
+
+		void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd); // The mapping keeps the file open
+		if(view == MAP_FAILED) return false;
+
+		// It's read front to back once
+		madvise(view, size, MADV_SEQUENTIAL);
+#endif
+		this->data = (const char*)view;
+		this->length = size;
+		this->mapped = true;
+		return true;
 	}
 
-	std::cout << "Full text: " << full_text << endl;
+	void unmap()
+	{
+#ifdef _WIN32
+		if(this->mapped) UnmapViewOfFile(this->data);
+		if(this->mapping != NULL) CloseHandle(this->mapping);
+		if(this->file_handle != INVALID_HANDLE_VALUE) CloseHandle(this->file_handle);
+		this->mapping = NULL;
+		this->file_handle = INVALID_HANDLE_VALUE;
+#else
+		if(this->mapped) munmap((void*)this->data, this->length);
+#endif
+		this->mapped = false;
+	}
 
-	file.close();
+	// For anything that can't be mapped: pipes, devices, /proc files that claim to be empty
+	bool read_stream(const string& path)
+	{
+		ifstream file(path, ios::binary);
+		if(!file.is_open()) return false;
+
+		char chunk[64 * 1024];
+		while(file.read(chunk, sizeof(chunk)) || file.gcount() > 0)
+		{
+			this->buffer.append(chunk, (size_t)file.gcount());
+		}
+
+		this->data = this->buffer.data();
+		this->length = this->buffer.size();
+		return true;
+	}
+
+	static string escape_html(const string& text)
+	{
+		string out;
+		out.reserve(text.size());
+		for(char c : text)
+		{
+			switch(c)
+			{
+				case '&': out += "&amp;"; break;
+				case '<': out += "&lt;"; break;
+				case '>': out += "&gt;"; break;
+				case '"': out += "&quot;"; break;
+				default: out += c; break;
+			}
+		}
+		return out;
+	}
+
+	bool list_directory(const filesystem::path& path)
+	{
+		error_code error;
+		filesystem::directory_iterator it(path, filesystem::directory_options::skip_permission_denied, error);
+		if(error) return false;
+
+		vector<pair<string, bool>> entries; // Name, is a directory
+		for(const filesystem::directory_entry& entry : it)
+		{
+			entries.emplace_back(entry.path().filename().string(), entry.is_directory(error));
+		}
+
+		// Directories first, then by name
+		sort(entries.begin(), entries.end(), [](const pair<string, bool>& a, const pair<string, bool>& b) {
+			if(a.second != b.second) return a.second;
+			return a.first < b.first;
+		});
+
+		string base = filesystem::absolute(path, error).generic_string();
+		if(base.empty() || base.back() != '/') base += "/";
+		string base_url = base[0] == '/' ? "file://" + base : "file:///" + base;
+		string title = escape_html(base);
+
+		this->buffer = "<html><head><title>Index of " + title + "</title></head><body>\n";
+		this->buffer += "<h1>Index of " + title + "</h1>\n<ul>\n";
+		this->buffer += "<li><a href=\"" + escape_html(base_url) + "..\">../</a></li>\n";
+		for(const pair<string, bool>& entry : entries)
+		{
+			string name = entry.first + (entry.second ? "/" : "");
+			this->buffer += "<li><a href=\"" + escape_html(base_url + name) + "\">" + escape_html(name) + "</a></li>\n";
+		}
+		this->buffer += "</ul>\n</body></html>\n";
+
+		this->data = this->buffer.data();
+		this->length = this->buffer.size();
+		this->directory = true;
+		return true;
+	}
+
+public:
+	FileView() {}
+
+	FileView(const FileView&) = delete;
+	FileView& operator=(const FileView&) = delete;
+
+	~FileView()
+	{
+		close();
+	}
 
-	return full_text;
+	// Takes a filesystem path (see local_path()). Returns false if it can't be read.
+	bool open(const string& path)
+	{
+		close();
+
+		error_code error;
+		filesystem::file_status status = filesystem::status(path, error);
+		if(error)
+		{
+			LOG_ERROR(LogCategory::File, "Can't open " << path << ": " << error.message());
+			return false;
+		}
+
+		if(filesystem::is_directory(status))
+		{
+			return list_directory(path);
+		}
+
+		if(filesystem::is_regular_file(status))
+		{
+			uintmax_t size = filesystem::file_size(path, error);
+			if(!error && size == 0)
+			{
+				// Nothing to map, but some special files only look empty
+				return read_stream(path);
+			}
+			if(!error && map(path, (size_t)size))
+			{
+				LOG_DEBUG(LogCategory::File, "Mapped " << size << " bytes of " << path);
+				return true;
+			}
+		}
+
+		LOG_DEBUG(LogCategory::File, "Reading " << path << " as a stream");
+		return read_stream(path);
+	}
+
+	void close()
+	{
+		unmap();
+		this->buffer.clear();
+		this->data = nullptr;
+		this->length = 0;
+		this->directory = false;
+	}
+
+	// Valid until the view is closed or reopened
+	string_view view() const
+	{
+		return string_view(this->data ? this->data : "", this->length);
+	}
+
+	size_t size() const
+	{
+		return this->length;
+	}
+
+	bool is_mapped() const
+	{
+		return this->mapped;
+	}
+
+	bool is_directory() const
+	{
+		return this->directory;
+	}
+};
+
+// Whether a local file should go through the lexer rather than be shown as text
+inline bool is_html_path(const string& path)
+{
+	size_t dot = path.rfind('.');
+	if(dot == string::npos) return false;
+
+	string extension = path.substr(dot + 1);
+	transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return extension == "html" || extension == "htm" || extension == "xhtml";
 }
 
-bool save_to_file(string file_path, string content)
+// The whole file (or directory listing) as a string, bytes as they are on disk
+string load_file(string file_path)
 {
-		// Remove / from the beginning of the file path
-	if(file_path[0] == '/')
+	file_path = local_path(file_path);
+
+	LOG_DEBUG(LogCategory::File, "Loading " << file_path);
+
+	FileView file;
+	if(!file.open(file_path))
+	{
+		return "";
+	}
+
+	LOG_TRACE(LogCategory::File, "Loaded " << file.size() << " bytes from " << file_path);
+
+	return string(file.view());
+}
+
+bool save_to_file(string file_path, const string& content)
+{
+	// "/C:/..." from a file:// URL, absolute POSIX paths stay as they are
+	if(file_path.size() >= 3 && file_path[0] == '/' && isalpha((unsigned char)file_path[1]) && file_path[2] == ':')
 	{
 		file_path = file_path.substr(1);
 	}
 
-	cout << "Saving to " << file_path << endl;
+	LOG_DEBUG(LogCategory::File, "Saving to " << file_path);
 
-	ofstream file(file_path);
+	// Binary, so nothing gets its line endings rewritten on Windows
+	ofstream file(file_path, ios::binary | ios::trunc);
 	if(!file.is_open())
 	{
-		cout << "Failed to open file for writing: " << file_path << endl;
+		LOG_ERROR(LogCategory::File, "Failed to open file for writing: " << file_path);
 		return false;
 	}
 
-	file << content;
+	file.write(content.data(), content.size());
 	file.close();
 
-}
\ No newline at end of file
+	if(!file)
+	{
+		LOG_ERROR(LogCategory::File, "Failed to write " << file_path);
+		return false;
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,530 @@
+#pragma once
+
+#ifndef LAKYS_HPACK_HPP
+#define LAKYS_HPACK_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <cstdint>
+#include "lakys-string-helper.hpp"
+
+using namespace std;
+
+// HPACK (RFC 7541), the header compression HTTP/2 uses: a static table of common
+// fields, a dynamic table both ends keep in sync, and a Huffman code for strings.
+
+typedef pair<string, string> HeaderField;
+
+// Appendix A
+static const HeaderField HPACK_STATIC_TABLE[] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+static const size_t HPACK_STATIC_TABLE_SIZE = sizeof(HPACK_STATIC_TABLE) / sizeof(HPACK_STATIC_TABLE[0]);
+
+// Appendix B: code and length in bits for every byte value, then EOS
+struct HuffmanCode
+{
+    uint32_t code;
+    uint8_t bits;
+};
+
+static const HuffmanCode HPACK_HUFFMAN[257] = {
+    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 }, { 0xfffffe4, 28 }, { 0xfffffe5, 28 },
+    { 0xfffffe6, 28 }, { 0xfffffe7, 28 }, { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+    { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 }, { 0xfffffed, 28 }, { 0xfffffee, 28 },
+    { 0xfffffef, 28 }, { 0xffffff0, 28 }, { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 }, { 0xffffff8, 28 }, { 0xffffff9, 28 },
+    { 0xffffffa, 28 }, { 0xffffffb, 28 }, { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+    { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 }, { 0x3fa, 10 }, { 0x3fb, 10 },
+    { 0xf9, 8 }, { 0x7fb, 11 }, { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+    { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 }, { 0x1a, 6 }, { 0x1b, 6 },
+    { 0x1c, 6 }, { 0x1d, 6 }, { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+    { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 }, { 0x1ffa, 13 }, { 0x21, 6 },
+    { 0x5d, 7 }, { 0x5e, 7 }, { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+    { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 }, { 0x67, 7 }, { 0x68, 7 },
+    { 0x69, 7 }, { 0x6a, 7 }, { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+    { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 }, { 0xfc, 8 }, { 0x73, 7 },
+    { 0xfd, 8 }, { 0x1ffb, 13 }, { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+    { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 }, { 0x24, 6 }, { 0x5, 5 },
+    { 0x25, 6 }, { 0x26, 6 }, { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+    { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 }, { 0x2b, 6 }, { 0x76, 7 },
+    { 0x2c, 6 }, { 0x8, 5 }, { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+    { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 }, { 0x7fc, 11 }, { 0x3ffd, 14 },
+    { 0x1ffd, 13 }, { 0xffffffc, 28 }, { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+    { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 }, { 0x3fffd6, 22 }, { 0x7fffda, 23 },
+    { 0x7fffdb, 23 }, { 0x7fffdc, 23 }, { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+    { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 }, { 0xffffee, 24 }, { 0x7fffe1, 23 },
+    { 0x7fffe2, 23 }, { 0x7fffe3, 23 }, { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+    { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 }, { 0x3fffda, 22 }, { 0x1fffdd, 21 },
+    { 0xfffe9, 20 }, { 0x3fffdb, 22 }, { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+    { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 }, { 0x1fffdf, 21 }, { 0x3fffdf, 22 },
+    { 0x7fffeb, 23 }, { 0x7fffec, 23 }, { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+    { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 }, { 0xfffea, 20 }, { 0x3fffe2, 22 },
+    { 0x3fffe3, 22 }, { 0x3fffe4, 22 }, { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+    { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 }, { 0x3fffe7, 22 }, { 0x7ffff2, 23 },
+    { 0x3fffe8, 22 }, { 0x1ffffec, 25 }, { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+    { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 }, { 0x7fff2, 19 }, { 0x1fffe3, 21 },
+    { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 }, { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+    { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 }, { 0xffffffd, 28 }, { 0x7ffffe3, 27 },
+    { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 }, { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+    { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 }, { 0x3fffea, 22 }, { 0x3fffeb, 22 },
+    { 0x1ffffee, 25 }, { 0x1ffffef, 25 }, { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+    { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 }, { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 },
+    { 0x7ffffe9, 27 }, { 0x7ffffea, 27 }, { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+    { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 }, { 0x3fffffff, 30 },
+};
+
+// The code is canonical: codes of one length are consecutive, in symbol order.
+// That's all decoding needs, the first code of each length and the symbols by code.
+class HuffmanDecodeTable
+{
+private:
+    uint32_t first_code[31] = {};
+    uint16_t count[31] = {};
+    uint16_t offset[31] = {};
+    uint16_t symbols[257] = {};
+
+public:
+    HuffmanDecodeTable()
+    {
+        for(const HuffmanCode& code : HPACK_HUFFMAN) this->count[code.bits]++;
+
+        uint16_t position = 0;
+        for(int bits = 1; bits <= 30; bits++)
+        {
+            this->offset[bits] = position;
+            position += this->count[bits];
+        }
+
+        uint16_t filled[31] = {};
+        for(int bits = 1; bits <= 30; bits++)
+        {
+            this->first_code[bits] = 0xFFFFFFFF;
+        }
+        for(uint16_t symbol = 0; symbol < 257; symbol++)
+        {
+            const HuffmanCode& code = HPACK_HUFFMAN[symbol];
+            if(filled[code.bits] == 0) this->first_code[code.bits] = code.code;
+            this->symbols[this->offset[code.bits] + filled[code.bits]++] = symbol;
+        }
+    }
+
+    // The symbol for the code, or -1 if no code of that length matches
+    int lookup(uint32_t code, int bits) const
+    {
+        if(this->count[bits] == 0 || code < this->first_code[bits] || code - this->first_code[bits] >= this->count[bits]) return -1;
+        return this->symbols[this->offset[bits] + (code - this->first_code[bits])];
+    }
+};
+
+inline size_t huffman_encoded_size(string_view text)
+{
+    size_t bits = 0;
+    for(unsigned char c : text) bits += HPACK_HUFFMAN[c].bits;
+    return (bits + 7) / 8;
+}
+
+inline void huffman_encode(string_view text, string& out)
+{
+    uint64_t buffer = 0;
+    int buffered = 0;
+
+    for(unsigned char c : text)
+    {
+        buffer = (buffer << HPACK_HUFFMAN[c].bits) | HPACK_HUFFMAN[c].code;
+        buffered += HPACK_HUFFMAN[c].bits;
+        while(buffered >= 8)
+        {
+            buffered -= 8;
+            out += (char)(buffer >> buffered);
+        }
+    }
+
+    // Padded with the start of EOS, all ones
+    if(buffered > 0)
+    {
+        out += (char)((buffer << (8 - buffered)) | (0xFF >> buffered));
+    }
+}
+
+// Returns false on a malformed string: EOS inside it, or bad padding
+inline bool huffman_decode(const uint8_t* data, size_t length, string& out)
+{
+    static const HuffmanDecodeTable table;
+
+    uint32_t code = 0;
+    int bits = 0;
+
+    for(size_t i = 0; i < length; i++)
+    {
+        for(int bit = 7; bit >= 0; bit--)
+        {
+            code = (code << 1) | ((data[i] >> bit) & 1);
+            bits++;
+
+            // Every code is at least 5 bits long
+            if(bits < 5) continue;
+
+            int symbol = table.lookup(code, bits);
+            if(symbol == 256) return false;
+            if(symbol >= 0)
+            {
+                out += (char)symbol;
+                code = 0;
+                bits = 0;
+            }
+            else if(bits >= 30)
+            {
+                return false;
+            }
+        }
+    }
+
+    // Leftovers have to be a prefix of EOS, at most 7 bits
+    return bits <= 7 && code == (1u << bits) - 1;
+}
+
+// Both tables count an entry as its name and value plus 32 (4.1)
+inline size_t hpack_entry_size(const HeaderField& field)
+{
+    return field.first.size() + field.second.size() + 32;
+}
+
+// The shared part of both ends: the dynamic table
+class HPACKTable
+{
+protected:
+    deque<HeaderField> entries; // Newest first
+    size_t size = 0;
+    size_t max_size = 4096;
+
+    void evict_to(size_t limit)
+    {
+        while(this->size > limit && !this->entries.empty())
+        {
+            this->size -= hpack_entry_size(this->entries.back());
+            this->entries.pop_back();
+        }
+    }
+
+    void insert(const HeaderField& field)
+    {
+        size_t entry_size = hpack_entry_size(field);
+
+        // Bigger than the whole table just empties it
+        evict_to(entry_size > this->max_size ? 0 : this->max_size - entry_size);
+        if(entry_size > this->max_size) return;
+
+        this->entries.push_front(field);
+        this->size += entry_size;
+    }
+
+    // 1-based over the static table, then the dynamic one. nullptr if out of range.
+    const HeaderField* at(uint64_t index) const
+    {
+        if(index == 0) return nullptr;
+        if(index <= HPACK_STATIC_TABLE_SIZE) return &HPACK_STATIC_TABLE[index - 1];
+
+        index -= HPACK_STATIC_TABLE_SIZE + 1;
+        return index < this->entries.size() ? &this->entries[(size_t)index] : nullptr;
+    }
+
+public:
+    size_t get_size() const
+    {
+        return this->size;
+    }
+};
+
+class HPACKDecoder : public HPACKTable
+{
+private:
+    size_t settings_limit = 4096; // What we told the peer in SETTINGS_HEADER_TABLE_SIZE
+
+    static bool read_integer(const uint8_t*& data, const uint8_t* end, int prefix_bits, uint64_t& value)
+    {
+        if(data >= end) return false;
+
+        uint64_t max_prefix = (1u << prefix_bits) - 1;
+        value = *data++ & max_prefix;
+        if(value < max_prefix) return true;
+
+        for(int shift = 0; shift <= 56; shift += 7)
+        {
+            if(data >= end) return false;
+            uint8_t byte = *data++;
+            value += (uint64_t)(byte & 0x7F) << shift;
+            if((byte & 0x80) == 0) return true;
+        }
+        return false; // Absurdly long
+    }
+
+    static bool read_string(const uint8_t*& data, const uint8_t* end, string& out)
+    {
+        if(data >= end) return false;
+        bool huffman = (*data & 0x80) != 0;
+
+        uint64_t length;
+        if(!read_integer(data, end, 7, length) || length > (uint64_t)(end - data)) return false;
+
+        out.clear();
+        bool ok = true;
+        if(huffman)
+        {
+            ok = huffman_decode(data, (size_t)length, out);
+        }
+        else
+        {
+            out.assign((const char*)data, (size_t)length);
+        }
+        data += length;
+        return ok;
+    }
+
+public:
+    // Decodes one whole header block. Returns false on a compression error, which
+    // leaves the table out of sync with the peer's, so the connection is done for.
+    bool decode(const uint8_t* data, size_t length, vector<HeaderField>& out)
+    {
+        const uint8_t* end = data + length;
+        bool fields_started = false;
+
+        while(data < end)
+        {
+            uint8_t first = *data;
+
+            if(first & 0x80)
+            {
+                // Indexed field
+                uint64_t index;
+                if(!read_integer(data, end, 7, index)) return false;
+                const HeaderField* field = at(index);
+                if(!field) return false;
+                out.push_back(*field);
+                fields_started = true;
+            }
+            else if((first & 0xE0) == 0x20)
+            {
+                // Dynamic table size update, only allowed before the first field
+                uint64_t new_size;
+                if(fields_started || !read_integer(data, end, 5, new_size) || new_size > this->settings_limit) return false;
+                this->max_size = (size_t)new_size;
+                evict_to(this->max_size);
+            }
+            else
+            {
+                // Literal: with incremental indexing (01), without (0000) or never indexed (0001)
+                bool indexing = (first & 0xC0) == 0x40;
+                uint64_t name_index;
+                if(!read_integer(data, end, indexing ? 6 : 4, name_index)) return false;
+
+                HeaderField field;
+                if(name_index > 0)
+                {
+                    const HeaderField* named = at(name_index);
+                    if(!named) return false;
+                    field.first = named->first;
+                }
+                else if(!read_string(data, end, field.first))
+                {
+                    return false;
+                }
+                if(!read_string(data, end, field.second)) return false;
+
+                if(indexing) insert(field);
+                out.push_back(move(field));
+                fields_started = true;
+            }
+        }
+
+        return true;
+    }
+};
+
+class HPACKEncoder : public HPACKTable
+{
+private:
+    bool size_update_pending = false;
+
+    static void write_integer(string& out, uint8_t first_bits, int prefix_bits, uint64_t value)
+    {
+        uint64_t max_prefix = (1u << prefix_bits) - 1;
+        if(value < max_prefix)
+        {
+            out += (char)(first_bits | value);
+            return;
+        }
+
+        out += (char)(first_bits | max_prefix);
+        value -= max_prefix;
+        while(value >= 0x80)
+        {
+            out += (char)((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        out += (char)value;
+    }
+
+    static void write_string(string& out, string_view text)
+    {
+        size_t huffman_size = huffman_encoded_size(text);
+        if(huffman_size < text.size())
+        {
+            write_integer(out, 0x80, 7, huffman_size);
+            huffman_encode(text, out);
+        }
+        else
+        {
+            write_integer(out, 0x00, 7, text.size());
+            out.append(text.data(), text.size());
+        }
+    }
+
+    // Exact match first, else a name match (0 if neither); exact says which one it was
+    size_t find(const HeaderField& field, bool& exact) const
+    {
+        size_t name_match = 0;
+        exact = false;
+
+        for(size_t i = 0; i < HPACK_STATIC_TABLE_SIZE; i++)
+        {
+            if(HPACK_STATIC_TABLE[i].first != field.first) continue;
+            if(HPACK_STATIC_TABLE[i].second == field.second)
+            {
+                exact = true;
+                return i + 1;
+            }
+            if(name_match == 0) name_match = i + 1;
+        }
+
+        for(size_t i = 0; i < this->entries.size(); i++)
+        {
+            if(this->entries[i].first != field.first) continue;
+            if(this->entries[i].second == field.second)
+            {
+                exact = true;
+                return HPACK_STATIC_TABLE_SIZE + 1 + i;
+            }
+            if(name_match == 0) name_match = HPACK_STATIC_TABLE_SIZE + 1 + i;
+        }
+
+        return name_match;
+    }
+
+public:
+    // The peer's SETTINGS_HEADER_TABLE_SIZE. We never use more than the default.
+    void set_max_size(size_t peer_limit)
+    {
+        size_t new_size = min(peer_limit, (size_t)4096);
+        if(new_size == this->max_size) return;
+
+        this->max_size = new_size;
+        evict_to(this->max_size);
+        this->size_update_pending = true;
+    }
+
+    // Names have to be lowercase already. Fields that repeat from request to request
+    // (user-agent, accept-encoding, :authority) go into the table; :path and anything
+    // secret don't.
+    void encode(const vector<HeaderField>& fields, string& out)
+    {
+        if(this->size_update_pending)
+        {
+            write_integer(out, 0x20, 5, this->max_size);
+            this->size_update_pending = false;
+        }
+
+        for(const HeaderField& field : fields)
+        {
+            bool exact;
+            size_t index = find(field, exact);
+
+            if(exact)
+            {
+                write_integer(out, 0x80, 7, index);
+                continue;
+            }
+
+            bool secret = field.first == "authorization" || field.first == "cookie";
+            bool worth_indexing = !secret && field.first != ":path" && hpack_entry_size(field) <= this->max_size / 4;
+
+            if(worth_indexing)
+            {
+                write_integer(out, 0x40, 6, index);
+                insert(field);
+            }
+            else
+            {
+                write_integer(out, secret ? 0x10 : 0x00, 4, index);
+            }
+
+            if(index == 0) write_string(out, field.first);
+            write_string(out, field.second);
+        }
+    }
+};
+
+#endif
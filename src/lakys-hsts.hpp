@@ -0,0 +1,238 @@
+#pragma once
+
+#ifndef LAKYS_HSTS_HPP
+#define LAKYS_HSTS_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include "lakys-string-helper.hpp"
+#include "lakys-file-loader.hpp"
+#include "lakys-logger.hpp"
+
+using namespace std;
+
+// HTTP Strict Transport Security (RFC 6797): hosts that told us, over HTTPS, to
+// only ever be contacted over HTTPS, plus the ones on the preload list. http://
+// URLs to them are upgraded before a socket is opened, which saves the round
+// trip to the redirect most of these sites would answer with.
+//
+// Learned policies live in cache/hsts, one "<host> <expires> <include subdomains>"
+// per line. The preload list is assets/hsts_preload.txt, one host per line with
+// an optional "include_subdomains" after it.
+class HSTSStore
+{
+private:
+    struct Policy
+    {
+        time_t expires = 0;             // 0 = never (preloaded)
+        bool include_subdomains = false;
+    };
+
+    unordered_map<string, Policy> preloaded;
+    unordered_map<string, Policy> learned;
+
+    filesystem::path store_path = "cache/hsts";
+    filesystem::path preload_path = "assets/hsts_preload.txt";
+    bool loaded = false;
+
+    mutex hsts_mutex;
+
+    HSTSStore() {}
+
+    // IP literals can't have policies (RFC 6797 8.1.1), only names
+    static bool is_ip_literal(const string& host)
+    {
+        if(host.find(':') != string::npos || host.find('[') != string::npos) return true;
+        return !host.empty() && host.find_first_not_of("0123456789.") == string::npos;
+    }
+
+    void load_locked()
+    {
+        if(this->loaded) return;
+        this->loaded = true;
+
+        ifstream preload(this->preload_path);
+        string line;
+        while(getline(preload, line))
+        {
+            if(!line.empty() && line.back() == '\r') line.pop_back();
+            if(line.empty() || line[0] == '#') continue;
+
+            istringstream fields(line);
+            string host, flag;
+            fields >> host >> flag;
+            if(host.empty()) continue;
+
+            Policy policy;
+            policy.include_subdomains = flag == "include_subdomains";
+            this->preloaded[to_lowercase(host)] = policy;
+        }
+
+        ifstream store(this->store_path);
+        getline(store, line);
+        if(line != "PUSZTA-HSTS 1") return;
+
+        time_t now = time(nullptr);
+        while(getline(store, line))
+        {
+            istringstream fields(line);
+            string host;
+            long long expires = 0;
+            int include_subdomains = 0;
+            if(!(fields >> host >> expires >> include_subdomains)) continue;
+            if((time_t)expires <= now) continue;
+
+            this->learned[host] = { (time_t)expires, include_subdomains != 0 };
+        }
+
+        LOG_DEBUG(LogCategory::Http, "HSTS: " << this->preloaded.size() << " preloaded hosts, " << this->learned.size() << " learned");
+    }
+
+    void save_locked() const
+    {
+        if(this->store_path.empty()) return;
+
+        ostringstream out;
+        out << "PUSZTA-HSTS 1\n";
+        for(const auto& entry : this->learned)
+        {
+            out << entry.first << " " << (long long)entry.second.expires << " " << (entry.second.include_subdomains ? 1 : 0) << "\n";
+        }
+
+        error_code error;
+        filesystem::create_directories(this->store_path.parent_path(), error);
+        save_to_file(this->store_path.string(), out.str());
+    }
+
+    // The host itself, then every parent domain, which only count with include_subdomains
+    bool matches_locked(const string& host, time_t now) const
+    {
+        bool exact = true;
+        for(size_t start = 0; start != string::npos; exact = false)
+        {
+            string domain = host.substr(start);
+
+            auto found = this->learned.find(domain);
+            if(found != this->learned.end() && found->second.expires > now && (exact || found->second.include_subdomains)) return true;
+
+            auto preload = this->preloaded.find(domain);
+            if(preload != this->preloaded.end() && (exact || preload->second.include_subdomains)) return true;
+
+            size_t dot = host.find('.', start);
+            start = dot == string::npos ? string::npos : dot + 1;
+        }
+        return false;
+    }
+
+public:
+    static HSTSStore& instance()
+    {
+        static HSTSStore store;
+        return store;
+    }
+
+    // Where learned policies are kept, "" to keep them in memory only
+    void set_store_path(const string& path)
+    {
+        lock_guard<mutex> lock(this->hsts_mutex);
+        this->store_path = path;
+        this->learned.clear();
+        this->loaded = false;
+    }
+
+    // Whether http:// URLs to the host have to be upgraded to https://
+    bool is_secure_only(const string& host)
+    {
+        if(is_ip_literal(host)) return false;
+
+        lock_guard<mutex> lock(this->hsts_mutex);
+        load_locked();
+        return matches_locked(to_lowercase(host), time(nullptr));
+    }
+
+    // A Strict-Transport-Security field from a response that came over HTTPS.
+    // Ones sent over plain HTTP must be ignored, anyone could have sent those.
+    void observe(const string& host, string_view field)
+    {
+        if(field.empty() || is_ip_literal(host)) return;
+
+        long long max_age = -1;
+        bool include_subdomains = false;
+
+        for(string directive : split(string(field), ";"))
+        {
+            directive.erase(directive.find_last_not_of(" \t") + 1);
+            directive.erase(0, directive.find_first_not_of(" \t"));
+
+            size_t equals = directive.find('=');
+            string name = to_lowercase(directive.substr(0, equals));
+            string value = equals == string::npos ? "" : directive.substr(equals + 1);
+            if(value.size() >= 2 && value.front() == '"' && value.back() == '"')
+            {
+                value = value.substr(1, value.size() - 2);
+            }
+
+            if(name == "max-age")
+            {
+                try {
+                    max_age = stoll(value);
+                } catch (const exception&) {
+                    return; // A broken max-age invalidates the whole field
+                }
+            }
+            else if(name == "includesubdomains")
+            {
+                include_subdomains = true;
+            }
+        }
+
+        if(max_age < 0) return; // Required
+
+        string domain = to_lowercase(host);
+        time_t now = time(nullptr);
+
+        lock_guard<mutex> lock(this->hsts_mutex);
+        load_locked();
+
+        auto found = this->learned.find(domain);
+        if(max_age == 0)
+        {
+            // The host wants out, but can't opt out of the preload list this way
+            if(found == this->learned.end()) return;
+            this->learned.erase(found);
+            LOG_INFO(LogCategory::Http, "HSTS policy for " << domain << " removed");
+            save_locked();
+            return;
+        }
+
+        Policy policy{ now + (time_t)min(max_age, 10LL * 365 * 24 * 3600), include_subdomains };
+
+        // Every response repeats the field, only hit the disk when something really changed
+        bool changed = found == this->learned.end() || found->second.include_subdomains != include_subdomains ||
+                       policy.expires - found->second.expires > 24 * 3600;
+        this->learned[domain] = policy;
+
+        if(changed)
+        {
+            LOG_DEBUG(LogCategory::Http, "HSTS policy for " << domain << ": " << max_age << " s" << (include_subdomains ? ", subdomains too" : ""));
+            save_locked();
+        }
+    }
+
+    void clear()
+    {
+        lock_guard<mutex> lock(this->hsts_mutex);
+        this->learned.clear();
+        this->loaded = true;
+        save_locked();
+    }
+};
+
+#endif
@@ -0,0 +1,562 @@
+#pragma once
+
+#ifndef LAKYS_HTTP_CACHE_HPP
+#define LAKYS_HTTP_CACHE_HPP
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <ctime>
+#include <cstdint>
+#include <algorithm>
+#include <filesystem>
+#include "lakys-string-helper.hpp"
+
+using namespace std;
+
+// Parses an HTTP-date ("Sun, 06 Nov 1994 08:49:37 GMT", plus the two obsolete
+// formats). Returns -1 if it can't be parsed.
+time_t parse_http_date(const string& date)
+{
+    const char* formats[] = {
+        "%a, %d %b %Y %H:%M:%S",  // IMF-fixdate
+        "%A, %d-%b-%y %H:%M:%S",  // RFC 850
+        "%a %b %d %H:%M:%S %Y"    // asctime
+    };
+
+    for(const char* format : formats)
+    {
+        tm parsed = {};
+        istringstream stream(date);
+        stream.imbue(locale::classic());
+        stream >> get_time(&parsed, format);
+        if(stream.fail()) continue;
+
+#ifdef _WIN32
+        return _mkgmtime(&parsed);
+#else
+        return timegm(&parsed);
+#endif
+    }
+
+    return -1;
+}
+
+// A stored response, plus what RFC 9111 needs to work out how old it is
+struct CachedResponse
+{
+    string headers; // Status line and header fields, without the blank line
+    string body;    // Already decoded, so the stored headers don't carry Content-Encoding
+
+    time_t request_time = 0;
+    time_t response_time = 0;
+
+    // Case-insensitive lookup of a header field, "" if missing
+    string header(const string& name) const
+    {
+        string lower = "\r\n" + to_lowercase(this->headers) + "\r\n";
+        string needle = "\r\n" + to_lowercase(name) + ":";
+
+        size_t pos = lower.find(needle);
+        if(pos == string::npos) return "";
+
+        size_t start = pos + needle.size();
+        size_t end = lower.find("\r\n", start);
+
+        // Lowercase copy is only for finding it, hand back the original text
+        string value = this->headers.substr(start - 2, end - start);
+        value.erase(value.find_last_not_of(" \t") + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        return value;
+    }
+
+    // Cache-Control directives, names lowercased ("max-age" -> "3600", "no-cache" -> "")
+    map<string, string> cache_control() const
+    {
+        map<string, string> directives;
+
+        for(string directive : split(header("Cache-Control"), ","))
+        {
+            directive.erase(directive.find_last_not_of(" \t") + 1);
+            directive.erase(0, directive.find_first_not_of(" \t"));
+            if(directive.empty()) continue;
+
+            size_t equals = directive.find('=');
+            string name = to_lowercase(directive.substr(0, equals));
+            string value = equals == string::npos ? "" : directive.substr(equals + 1);
+            if(value.size() >= 2 && value.front() == '"' && value.back() == '"')
+            {
+                value = value.substr(1, value.size() - 2);
+            }
+            directives[name] = value;
+        }
+
+        return directives;
+    }
+
+    // RFC 9111 4.2.1
+    long long freshness_lifetime() const
+    {
+        map<string, string> directives = cache_control();
+
+        auto max_age = directives.find("max-age");
+        if(max_age != directives.end())
+        {
+            try {
+                return stoll(max_age->second);
+            } catch (const exception&) {
+                return 0;
+            }
+        }
+
+        time_t date = parse_http_date(header("Date"));
+        if(date < 0) date = this->response_time;
+
+        string expires_text = header("Expires");
+        if(!expires_text.empty())
+        {
+            // Invalid dates like "0" mean already expired
+            time_t expires = parse_http_date(expires_text);
+            return expires < 0 ? 0 : (long long)(expires - date);
+        }
+
+        // Heuristic: 10% of the time since it was last modified
+        time_t last_modified = parse_http_date(header("Last-Modified"));
+        if(last_modified >= 0 && last_modified < date)
+        {
+            return (long long)(date - last_modified) / 10;
+        }
+
+        return 0;
+    }
+
+    // RFC 9111 4.2.3
+    long long current_age(time_t now) const
+    {
+        long long age_value = 0;
+        try {
+            string age = header("Age");
+            if(!age.empty()) age_value = stoll(age);
+        } catch (const exception&) {
+            age_value = 0;
+        }
+
+        time_t date = parse_http_date(header("Date"));
+        if(date < 0) date = this->response_time;
+
+        long long apparent_age = max(0LL, (long long)(this->response_time - date));
+        long long response_delay = (long long)(this->response_time - this->request_time);
+        long long corrected_age_value = age_value + response_delay;
+        long long corrected_initial_age = max(apparent_age, corrected_age_value);
+        long long resident_time = (long long)(now - this->response_time);
+
+        return corrected_initial_age + resident_time;
+    }
+
+    bool is_fresh(time_t now) const
+    {
+        map<string, string> directives = cache_control();
+        if(directives.count("no-cache")) return false;
+
+        return freshness_lifetime() > current_age(now);
+    }
+
+    bool has_validators() const
+    {
+        return !header("ETag").empty() || !header("Last-Modified").empty();
+    }
+};
+
+// Two tier HTTP cache: a memory LRU in front of a directory on disk. Entries are
+// keyed by "scheme://host:port/path". Only complete 200 responses to GETs are stored.
+class HTTPCache
+{
+private:
+    struct MemoryEntry
+    {
+        CachedResponse response;
+        list<string>::iterator lru_position;
+    };
+
+    unordered_map<string, MemoryEntry> memory;
+    list<string> lru; // Most recently used first
+    size_t memory_bytes = 0;
+    size_t memory_budget = 32 * 1024 * 1024;
+
+    filesystem::path disk_directory = "cache/http";
+    uintmax_t disk_budget = 256ull * 1024 * 1024;
+    bool disk_enabled = true;
+
+    // The directory's files and their sizes, least recently written first. Read
+    // from the directory once, kept up to date by our own writes and removals.
+    struct DiskEntry
+    {
+        uintmax_t size;
+        list<string>::iterator order_position;
+    };
+
+    unordered_map<string, DiskEntry> disk_files; // By file name
+    list<string> disk_order;
+    uintmax_t disk_bytes = 0;
+    bool disk_scanned = false;
+
+    mutex cache_mutex;
+
+    static size_t entry_size(const CachedResponse& response)
+    {
+        return response.headers.size() + response.body.size() + 64;
+    }
+
+    // FNV-1a, only used for naming the files
+    static string file_name_for(const string& key)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for(unsigned char c : key)
+        {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+
+        ostringstream name;
+        name << hex << setw(16) << setfill('0') << hash << ".entry";
+        return name.str();
+    }
+
+public:
+    // Headers that describe the transfer rather than the decoded body we keep
+    static string strip_transfer_headers(const string& headers)
+    {
+        string kept;
+        vector<string> lines = split(headers, "\r\n");
+        for(size_t i = 0; i < lines.size(); i++)
+        {
+            string lower = to_lowercase(lines[i]);
+            if(i > 0 && (lower.rfind("content-encoding:", 0) == 0 || lower.rfind("content-length:", 0) == 0 ||
+                         lower.rfind("transfer-encoding:", 0) == 0 || lower.rfind("connection:", 0) == 0 ||
+                         lower.rfind("keep-alive:", 0) == 0))
+            {
+                continue;
+            }
+
+            if(!kept.empty()) kept += "\r\n";
+            kept += lines[i];
+        }
+        return kept;
+    }
+
+private:
+    // Caller must hold cache_mutex
+    void remember_locked(const string& key, const CachedResponse& response)
+    {
+        forget_memory_locked(key);
+
+        size_t size = entry_size(response);
+        if(size > this->memory_budget / 4) return; // Huge responses only go to disk
+
+        this->lru.push_front(key);
+        this->memory[key] = { response, this->lru.begin() };
+        this->memory_bytes += size;
+
+        while(this->memory_bytes > this->memory_budget && !this->lru.empty())
+        {
+            forget_memory_locked(this->lru.back());
+        }
+    }
+
+    void forget_memory_locked(const string& key)
+    {
+        auto found = this->memory.find(key);
+        if(found == this->memory.end()) return;
+
+        this->memory_bytes -= entry_size(found->second.response);
+        this->lru.erase(found->second.lru_position);
+        this->memory.erase(found);
+    }
+
+    void write_disk_locked(const string& key, const CachedResponse& response)
+    {
+        if(!this->disk_enabled) return;
+
+        error_code error;
+        filesystem::create_directories(this->disk_directory, error);
+        if(error) return;
+
+        filesystem::path file = this->disk_directory / file_name_for(key);
+        filesystem::path temporary = file;
+        temporary += ".tmp";
+
+        uintmax_t size = 0;
+        {
+            ofstream out(temporary, ios::binary | ios::trunc);
+            if(!out.is_open()) return;
+
+            out << "PUSZTA-CACHE 1\n"
+                << key << "\n"
+                << (long long)response.request_time << " " << (long long)response.response_time << "\n"
+                << response.headers.size() << " " << response.body.size() << "\n";
+            out.write(response.headers.data(), response.headers.size());
+            out.write(response.body.data(), response.body.size());
+            size = (uintmax_t)max((streamoff)0, (streamoff)out.tellp());
+        }
+
+        // Readers never see a half written entry
+        filesystem::rename(temporary, file, error);
+        if(error)
+        {
+            filesystem::remove(temporary, error);
+            return;
+        }
+
+        if(!this->disk_scanned) scan_disk_locked();
+        note_disk_file_locked(file.filename().string(), size);
+        trim_disk_locked();
+    }
+
+    bool read_disk_locked(const string& key, CachedResponse& out)
+    {
+        if(!this->disk_enabled) return false;
+
+        ifstream in(this->disk_directory / file_name_for(key), ios::binary);
+        if(!in.is_open()) return false;
+
+        string magic, stored_key;
+        getline(in, magic);
+        getline(in, stored_key);
+        if(magic != "PUSZTA-CACHE 1" || stored_key != key) return false; // Hash collision or old format
+
+        long long request_time, response_time;
+        size_t header_size, body_size;
+        in >> request_time >> response_time >> header_size >> body_size;
+        in.get(); // The newline
+
+        out.request_time = (time_t)request_time;
+        out.response_time = (time_t)response_time;
+        out.headers.resize(header_size);
+        out.body.resize(body_size);
+        in.read(&out.headers[0], header_size);
+        in.read(&out.body[0], body_size);
+
+        return (bool)in;
+    }
+
+    // What earlier runs left in the directory, oldest first
+    void scan_disk_locked()
+    {
+        this->disk_scanned = true;
+
+        error_code error;
+        vector<pair<filesystem::file_time_type, filesystem::path>> files;
+        for(const auto& entry : filesystem::directory_iterator(this->disk_directory, error))
+        {
+            if(!entry.is_regular_file(error)) continue;
+            files.push_back({ entry.last_write_time(error), entry.path() });
+        }
+
+        sort(files.begin(), files.end());
+        for(const auto& file : files)
+        {
+            uintmax_t size = filesystem::file_size(file.second, error);
+            if(!error) note_disk_file_locked(file.second.filename().string(), size);
+        }
+    }
+
+    // The file was (re)written, it's the newest now
+    void note_disk_file_locked(const string& name, uintmax_t size)
+    {
+        forget_disk_file_locked(name);
+
+        this->disk_order.push_back(name);
+        this->disk_files[name] = { size, prev(this->disk_order.end()) };
+        this->disk_bytes += size;
+    }
+
+    void forget_disk_file_locked(const string& name)
+    {
+        auto found = this->disk_files.find(name);
+        if(found == this->disk_files.end()) return;
+
+        this->disk_bytes -= found->second.size;
+        this->disk_order.erase(found->second.order_position);
+        this->disk_files.erase(found);
+    }
+
+    void reset_disk_index_locked(bool scanned)
+    {
+        this->disk_files.clear();
+        this->disk_order.clear();
+        this->disk_bytes = 0;
+        this->disk_scanned = scanned;
+    }
+
+    // Drops the least recently written files once the directory is over budget
+    void trim_disk_locked()
+    {
+        if(this->disk_bytes <= this->disk_budget) return;
+
+        error_code error;
+        while(this->disk_bytes > this->disk_budget * 9 / 10 && !this->disk_order.empty())
+        {
+            string name = this->disk_order.front();
+            filesystem::remove(this->disk_directory / name, error);
+            forget_disk_file_locked(name);
+        }
+    }
+
+public:
+
+    static HTTPCache& instance()
+    {
+        static HTTPCache cache;
+        return cache;
+    }
+
+    void set_memory_budget(size_t bytes)
+    {
+        lock_guard<mutex> lock(this->cache_mutex);
+        this->memory_budget = bytes;
+        while(this->memory_bytes > this->memory_budget && !this->lru.empty())
+        {
+            forget_memory_locked(this->lru.back());
+        }
+    }
+
+    void set_disk_directory(const string& directory, uintmax_t budget_bytes)
+    {
+        lock_guard<mutex> lock(this->cache_mutex);
+        this->disk_directory = directory;
+        this->disk_budget = budget_bytes;
+        this->disk_enabled = !directory.empty();
+        reset_disk_index_locked(false);
+    }
+
+    // Memory first, then disk (which gets promoted into memory)
+    bool lookup(const string& key, CachedResponse& out)
+    {
+        lock_guard<mutex> lock(this->cache_mutex);
+
+        auto found = this->memory.find(key);
+        if(found != this->memory.end())
+        {
+            this->lru.splice(this->lru.begin(), this->lru, found->second.lru_position);
+            out = found->second.response;
+            return true;
+        }
+
+        if(read_disk_locked(key, out))
+        {
+            remember_locked(key, out);
+            return true;
+        }
+
+        return false;
+    }
+
+    // Stores a response if RFC 9111 lets us and it could ever be reused
+    void store(const string& key, const string& headers, const string& body, time_t request_time, time_t response_time)
+    {
+        CachedResponse response;
+        response.headers = strip_transfer_headers(headers);
+        response.request_time = request_time;
+        response.response_time = response_time;
+
+        map<string, string> directives = response.cache_control();
+        if(directives.count("no-store") || response.header("Vary") == "*")
+        {
+            remove(key);
+            return;
+        }
+
+        // Nothing to revalidate with and never fresh: storing it is pointless
+        if(!response.has_validators() && response.freshness_lifetime() <= 0)
+        {
+            remove(key);
+            return;
+        }
+
+        response.body = body;
+
+        lock_guard<mutex> lock(this->cache_mutex);
+        remember_locked(key, response);
+        write_disk_locked(key, response);
+    }
+
+    // Applies a 304 Not Modified to the stored entry and returns the updated response
+    bool freshen(const string& key, const string& not_modified_headers, time_t request_time, time_t response_time, CachedResponse& out)
+    {
+        CachedResponse stored;
+        if(!lookup(key, stored)) return false;
+
+        // Fields in the 304 replace the stored ones with the same name
+        vector<string> stored_lines = split(stored.headers, "\r\n");
+        vector<string> new_lines = split(strip_transfer_headers(not_modified_headers), "\r\n");
+
+        for(size_t i = 1; i < new_lines.size(); i++)
+        {
+            size_t colon = new_lines[i].find(':');
+            if(colon == string::npos) continue;
+            string name = to_lowercase(new_lines[i].substr(0, colon + 1));
+
+            bool replaced = false;
+            for(size_t j = 1; j < stored_lines.size(); j++)
+            {
+                if(to_lowercase(stored_lines[j]).rfind(name, 0) == 0)
+                {
+                    stored_lines[j] = new_lines[i];
+                    replaced = true;
+                    break;
+                }
+            }
+            if(!replaced) stored_lines.push_back(new_lines[i]);
+        }
+
+        stored.headers.clear();
+        for(size_t i = 0; i < stored_lines.size(); i++)
+        {
+            if(i > 0) stored.headers += "\r\n";
+            stored.headers += stored_lines[i];
+        }
+        stored.request_time = request_time;
+        stored.response_time = response_time;
+
+        {
+            lock_guard<mutex> lock(this->cache_mutex);
+            remember_locked(key, stored);
+            write_disk_locked(key, stored);
+        }
+
+        out = move(stored);
+        return true;
+    }
+
+    void remove(const string& key)
+    {
+        lock_guard<mutex> lock(this->cache_mutex);
+        forget_memory_locked(key);
+
+        error_code error;
+        string name = file_name_for(key);
+        filesystem::remove(this->disk_directory / name, error);
+        forget_disk_file_locked(name);
+    }
+
+    void clear()
+    {
+        lock_guard<mutex> lock(this->cache_mutex);
+        this->memory.clear();
+        this->lru.clear();
+        this->memory_bytes = 0;
+
+        error_code error;
+        filesystem::remove_all(this->disk_directory, error);
+        reset_disk_index_locked(true);
+    }
+};
+
+#endif
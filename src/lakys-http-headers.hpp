@@ -0,0 +1,317 @@
+#pragma once
+
+#ifndef LAKYS_HTTP_HEADERS_HPP
+#define LAKYS_HTTP_HEADERS_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+// Header fields the browser itself looks at. Their name hashes are worked out at
+// compile time, so recognising one while parsing is a single integer compare.
+enum class HeaderId : uint8_t
+{
+    Unknown,
+    Age,
+    CacheControl,
+    Connection,
+    ContentEncoding,
+    ContentLength,
+    ContentType,
+    Date,
+    ETag,
+    Expires,
+    KeepAlive,
+    LastModified,
+    Location,
+    Pragma,
+    SetCookie,
+    StrictTransportSecurity,
+    TransferEncoding,
+    Vary,
+    Count
+};
+
+// FNV-1a over the lowercased name
+constexpr uint32_t header_name_hash(string_view name)
+{
+    uint32_t hash = 2166136261u;
+    for(char c : name)
+    {
+        if(c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+        hash ^= (unsigned char)c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+struct KnownHeader
+{
+    HeaderId id;
+    string_view name;
+    uint32_t hash;
+};
+
+constexpr KnownHeader known_header(HeaderId id, string_view name)
+{
+    return KnownHeader{ id, name, header_name_hash(name) };
+}
+
+// Indexed by HeaderId
+constexpr KnownHeader KNOWN_HEADERS[] = {
+    known_header(HeaderId::Unknown, ""),
+    known_header(HeaderId::Age, "age"),
+    known_header(HeaderId::CacheControl, "cache-control"),
+    known_header(HeaderId::Connection, "connection"),
+    known_header(HeaderId::ContentEncoding, "content-encoding"),
+    known_header(HeaderId::ContentLength, "content-length"),
+    known_header(HeaderId::ContentType, "content-type"),
+    known_header(HeaderId::Date, "date"),
+    known_header(HeaderId::ETag, "etag"),
+    known_header(HeaderId::Expires, "expires"),
+    known_header(HeaderId::KeepAlive, "keep-alive"),
+    known_header(HeaderId::LastModified, "last-modified"),
+    known_header(HeaderId::Location, "location"),
+    known_header(HeaderId::Pragma, "pragma"),
+    known_header(HeaderId::SetCookie, "set-cookie"),
+    known_header(HeaderId::StrictTransportSecurity, "strict-transport-security"),
+    known_header(HeaderId::TransferEncoding, "transfer-encoding"),
+    known_header(HeaderId::Vary, "vary"),
+};
+
+static_assert(sizeof(KNOWN_HEADERS) / sizeof(KNOWN_HEADERS[0]) == (size_t)HeaderId::Count, "KNOWN_HEADERS must list every HeaderId");
+
+// What we say we are, on every request
+const string USER_AGENT = "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/138.0.0.0 Safari/537.36";
+
+inline bool equals_ignore_case(string_view a, string_view b)
+{
+    if(a.size() != b.size()) return false;
+    for(size_t i = 0; i < a.size(); i++)
+    {
+        char x = a[i], y = b[i];
+        if(x >= 'A' && x <= 'Z') x = (char)(x - 'A' + 'a');
+        if(y >= 'A' && y <= 'Z') y = (char)(y - 'A' + 'a');
+        if(x != y) return false;
+    }
+    return true;
+}
+
+// Parses a response header block (status line + fields, CRLF or LF separated) in
+// one pass. Names and values are views into the block, so it must outlive this;
+// nothing is allocated unless a response has more than INLINE_FIELDS fields.
+class HTTPHeaders
+{
+public:
+    struct Field
+    {
+        string_view name;
+        string_view value;
+        uint32_t hash;
+        HeaderId id;
+    };
+
+    static const size_t INLINE_FIELDS = 48;
+
+private:
+    string_view version;
+    string_view reason;
+    int status = 0;
+
+    Field inline_fields[INLINE_FIELDS];
+    vector<Field> overflow;
+    size_t count = 0;
+
+    // First field for each well-known header, 0 = absent, otherwise index + 1
+    uint16_t first_known[(size_t)HeaderId::Count] = {};
+
+    static HeaderId identify(string_view name, uint32_t hash)
+    {
+        for(size_t i = 1; i < (size_t)HeaderId::Count; i++)
+        {
+            if(KNOWN_HEADERS[i].hash == hash && equals_ignore_case(KNOWN_HEADERS[i].name, name))
+            {
+                return KNOWN_HEADERS[i].id;
+            }
+        }
+        return HeaderId::Unknown;
+    }
+
+    static string_view trim(string_view text)
+    {
+        size_t start = 0, end = text.size();
+        while(start < end && (text[start] == ' ' || text[start] == '\t')) start++;
+        while(end > start && (text[end - 1] == ' ' || text[end - 1] == '\t' || text[end - 1] == '\r')) end--;
+        return text.substr(start, end - start);
+    }
+
+    void add(const Field& field)
+    {
+        if(this->count < INLINE_FIELDS)
+        {
+            this->inline_fields[this->count] = field;
+        }
+        else
+        {
+            this->overflow.push_back(field);
+        }
+        this->count++;
+
+        if(field.id != HeaderId::Unknown && this->first_known[(size_t)field.id] == 0 && this->count <= 0xFFFF)
+        {
+            this->first_known[(size_t)field.id] = (uint16_t)this->count;
+        }
+    }
+
+    bool parse_status_line(string_view line)
+    {
+        // HTTP/1.1 200 OK
+        size_t space = line.find(' ');
+        if(space == string_view::npos || line.compare(0, 5, "HTTP/") != 0) return false;
+        this->version = line.substr(0, space);
+
+        size_t i = space + 1;
+        int code = 0, digits = 0;
+        while(i < line.size() && line[i] >= '0' && line[i] <= '9' && digits < 3)
+        {
+            code = code * 10 + (line[i] - '0');
+            i++;
+            digits++;
+        }
+        if(digits != 3) return false;
+        this->status = code;
+
+        this->reason = i < line.size() ? trim(line.substr(i)) : string_view();
+        return true;
+    }
+
+public:
+    // Returns false if the status line is malformed. Broken field lines are skipped.
+    bool parse(string_view block)
+    {
+        clear();
+
+        size_t pos = 0;
+        bool first = true;
+
+        while(pos < block.size())
+        {
+            size_t end = block.find('\n', pos);
+            if(end == string_view::npos) end = block.size();
+            string_view line = block.substr(pos, end - pos);
+            if(!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            pos = end + 1;
+
+            if(first)
+            {
+                if(!parse_status_line(line)) return false;
+                first = false;
+                continue;
+            }
+
+            if(line.empty()) break; // End of the header block
+
+            // obs-fold continuation lines are deprecated (RFC 9112 5.2), drop them
+            if(line[0] == ' ' || line[0] == '\t') continue;
+
+            // Hash the name while looking for the colon
+            uint32_t hash = 2166136261u;
+            size_t colon = 0;
+            while(colon < line.size() && line[colon] != ':')
+            {
+                char c = line[colon];
+                if(c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+                hash ^= (unsigned char)c;
+                hash *= 16777619u;
+                colon++;
+            }
+            if(colon == 0 || colon == line.size()) continue;
+
+            Field field;
+            field.name = line.substr(0, colon);
+            field.value = trim(line.substr(colon + 1));
+            field.hash = hash;
+            field.id = identify(field.name, hash);
+            add(field);
+        }
+
+        return !first;
+    }
+
+    void clear()
+    {
+        this->version = string_view();
+        this->reason = string_view();
+        this->status = 0;
+        this->count = 0;
+        this->overflow.clear();
+        for(uint16_t& index : this->first_known) index = 0;
+    }
+
+    int get_status() const
+    {
+        return this->status;
+    }
+
+    string_view get_version() const
+    {
+        return this->version;
+    }
+
+    string_view get_reason() const
+    {
+        return this->reason;
+    }
+
+    size_t size() const
+    {
+        return this->count;
+    }
+
+    const Field& at(size_t i) const
+    {
+        return i < INLINE_FIELDS ? this->inline_fields[i] : this->overflow[i - INLINE_FIELDS];
+    }
+
+    bool has(HeaderId id) const
+    {
+        return this->first_known[(size_t)id] != 0;
+    }
+
+    // Value of the first field with that id, "" if there isn't one
+    string_view get(HeaderId id) const
+    {
+        uint16_t index = this->first_known[(size_t)id];
+        return index == 0 ? string_view() : at(index - 1).value;
+    }
+
+    // Case-insensitive lookup by name, for headers without an id
+    string_view get(string_view name) const
+    {
+        uint32_t hash = header_name_hash(name);
+        for(size_t i = 0; i < this->count; i++)
+        {
+            const Field& field = at(i);
+            if(field.hash == hash && equals_ignore_case(field.name, name))
+            {
+                return field.value;
+            }
+        }
+        return string_view();
+    }
+
+    // Fields that may repeat (Set-Cookie, Vary, ...), in order
+    template <typename Callback>
+    void for_each(HeaderId id, Callback callback) const
+    {
+        for(size_t i = 0; i < this->count; i++)
+        {
+            if(at(i).id == id) callback(at(i).value);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,737 @@
+#pragma once
+
+#ifndef LAKYS_HTTP_READER_HPP
+#define LAKYS_HTTP_READER_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include "lakys-string-helper.hpp"
+#include "lakys-logger.hpp"
+#include "lakys-content-decoder.hpp"
+#include "lakys-buffer-chain.hpp"
+#include "lakys-http-headers.hpp"
+#include "socket/TcpClientSocket.hpp"
+
+using namespace std;
+
+// Shared with whoever is waiting on a transfer (e.g. the UI thread): how far it got,
+// and a flag to make it give up early
+struct TransferProgress
+{
+    atomic<bool> cancelled{false};
+    atomic<size_t> received{0};      // Bytes off the wire, headers included
+    atomic<long long> expected{-1};  // Content-Length of the current response, -1 if unknown
+    atomic<int> urgency{-1};         // Set to move an HTTP/2 stream to another RFC 9218 urgency, -1 leaves it be
+};
+
+// Reads exactly one HTTP/1.1 response off a connection. The body is framed by
+// Content-Length or chunked transfer coding when the server sends them, so the
+// connection can be reused afterwards; only unframed bodies are read until close.
+// Compressed bodies (Content-Encoding) are decoded as they arrive.
+//
+// The socket writes straight into the body's BufferChain; chunk framing is
+// squeezed out in place, so body bytes are stored once. Headers are a view
+// into the buffer they were received in. Bodies too big to keep in memory go
+// to a sink instead, a read's worth at a time (set_body_sink()).
+class HTTPResponseReader
+{
+private:
+    enum class State
+    {
+        Headers,
+        Body,        // Content-Length framed
+        UntilClose,  // No framing, body ends when the server closes
+        ChunkSize,
+        ChunkData,
+        ChunkDataEnd,
+        Trailers,
+        Done
+    };
+
+    State state = State::Headers;
+
+    string head;               // Received bytes up to (and a bit past) the end of the headers
+    size_t header_length = 0;  // The headers are head[0, header_length), without the blank line
+    BufferChain body;
+    HTTPHeaders fields;        // Views into head
+    int status = 0;
+
+    long long content_length = -1;
+    size_t body_filled = 0;   // Bytes of a Content-Length body received so far
+    size_t chunk_remaining = 0;
+    string line;              // Partial chunk-size / trailer line
+
+    bool close_after = false;
+    bool no_body = false;     // HEAD request, 204 or 304
+
+    ContentDecoderChain decoder;
+    bool decoding = false;
+
+    TransferProgress* progress = nullptr;
+
+    // See set_body_sink() and set_header_check()
+    function<bool(const char*, size_t)> body_sink;
+    function<bool(const HTTPResponseReader&)> header_check;
+    bool stopped = false;
+    bool sink_failed = false;
+
+    size_t bytes_received = 0;
+    chrono::steady_clock::time_point first_byte_time;
+    chrono::steady_clock::time_point last_byte_time;
+    chrono::steady_clock::time_point complete_time;
+
+    // See set_timeouts()
+    int first_byte_timeout_ms = -1;
+    int idle_timeout_ms = -1;
+    chrono::steady_clock::time_point sent_time;
+    bool timed_out = false;
+
+    // How long until the server has been quiet for too long, -1 for no limit
+    long long ms_until_timeout() const
+    {
+        int timeout = this->bytes_received == 0 ? this->first_byte_timeout_ms : this->idle_timeout_ms;
+        if(timeout < 0) return -1;
+
+        chrono::steady_clock::time_point since = this->bytes_received == 0 ? this->sent_time : this->last_byte_time;
+        auto left = since + chrono::milliseconds(timeout) - chrono::steady_clock::now();
+        return max(0LL, (long long)chrono::duration_cast<chrono::milliseconds>(left).count());
+    }
+
+    // With progress or timeouts, wait for data in short slices so cancellation is
+    // noticed even while the server is quiet. Returns false once the transfer was
+    // cancelled or timed out.
+    bool wait_for_data(TcpClientSocket& socket)
+    {
+        bool timed = this->first_byte_timeout_ms >= 0 || this->idle_timeout_ms >= 0;
+        if(!this->progress && !timed) return true;
+
+        while(!this->progress || !this->progress->cancelled)
+        {
+            long long left = ms_until_timeout();
+            if(left == 0)
+            {
+                this->timed_out = true;
+                return false;
+            }
+
+            int slice = left < 0 ? 100 : (int)min(left, 100LL);
+            if(socket.waitReadable(slice)) return true;
+        }
+        return false;
+    }
+
+    void report_received(int n)
+    {
+        this->last_byte_time = chrono::steady_clock::now();
+        if(this->bytes_received == 0)
+        {
+            this->first_byte_time = this->last_byte_time;
+        }
+        this->bytes_received += n;
+
+        if(!this->progress) return;
+
+        this->progress->received += n;
+        if(this->content_length >= 0)
+        {
+            this->progress->expected = this->content_length;
+        }
+    }
+
+    vector<char> raw;          // Encoded bytes on their way to the decoder
+
+    // Case-insensitive substring search, header values are short
+    static bool value_contains(string_view value, string_view token)
+    {
+        if(token.size() > value.size()) return false;
+        for(size_t i = 0; i + token.size() <= value.size(); i++)
+        {
+            if(equals_ignore_case(value.substr(i, token.size()), token)) return true;
+        }
+        return false;
+    }
+
+    // Called once the blank line after the headers has been seen
+    void on_headers_complete()
+    {
+        this->fields.parse(get_headers());
+        this->status = this->fields.get_status();
+
+        string_view connection = this->fields.get(HeaderId::Connection);
+        bool http10 = this->fields.get_version() == "HTTP/1.0";
+        this->close_after = value_contains(connection, "close") || (http10 && !value_contains(connection, "keep-alive"));
+
+        string transfer_encoding = to_lowercase(string(this->fields.get(HeaderId::TransferEncoding)));
+        string_view length = this->fields.get(HeaderId::ContentLength);
+
+        string content_encoding(this->fields.get(HeaderId::ContentEncoding));
+        if(!content_encoding.empty())
+        {
+            if(!this->decoder.set_encoding(content_encoding))
+            {
+                LOG_WARN(LogCategory::Http, "Unsupported Content-Encoding: " << content_encoding);
+            }
+            this->decoding = !this->decoder.empty();
+        }
+
+        if(this->no_body || this->status == 204 || this->status == 304)
+        {
+            this->state = State::Done;
+        }
+        else if(!transfer_encoding.empty())
+        {
+            // Chunked has to be the last coding applied, anything else runs until close
+            size_t chunked_pos = transfer_encoding.rfind("chunked");
+            if(chunked_pos != string::npos && chunked_pos + 7 == transfer_encoding.size())
+            {
+                this->state = State::ChunkSize;
+            }
+            else
+            {
+                this->state = State::UntilClose;
+                this->close_after = true;
+            }
+        }
+        else if(!length.empty())
+        {
+            this->content_length = 0;
+            for(char c : length)
+            {
+                if(c < '0' || c > '9' || this->content_length > (1LL << 50))
+                {
+                    this->content_length = -1;
+                    break;
+                }
+                this->content_length = this->content_length * 10 + (c - '0');
+            }
+
+            if(this->content_length < 0)
+            {
+                this->state = State::UntilClose;
+                this->close_after = true;
+            }
+            else
+            {
+                // We know the exact size, keep it in one segment. Compressed bodies
+                // are decoded into a growing chain instead, their size isn't known,
+                // and sunk bodies never stay long enough to need the room.
+                if(!this->decoding && !this->body_sink)
+                {
+                    this->body.reserve((size_t)this->content_length);
+                }
+                this->state = this->content_length == 0 ? State::Done : State::Body;
+            }
+        }
+        else
+        {
+            this->state = State::UntilClose;
+            this->close_after = true;
+        }
+    }
+
+    // Parses "1a2b;ext=value" into the chunk size
+    bool parse_chunk_size()
+    {
+        string size_text = this->line.substr(0, this->line.find(';'));
+        size_text = trim_spaces(size_text);
+        this->line.clear();
+
+        if(size_text.empty()) return false;
+
+        try {
+            this->chunk_remaining = (size_t)stoull(size_text, nullptr, 16);
+        } catch (const exception&) {
+            return false;
+        }
+
+        this->state = this->chunk_remaining == 0 ? State::Trailers : State::ChunkData;
+        return true;
+    }
+
+    // Keeps len body bytes starting at src. Plain bytes are moved down to data + kept,
+    // which is where they belong once the framing in front of them is dropped.
+    // Encoded bytes go through the decoder into the chain instead.
+    bool emit_body(char* data, size_t& kept, const char* src, size_t len)
+    {
+        if(this->decoding)
+        {
+            string& out = this->body.append_target(len);
+            bool ok = this->decoder.write(src, len, out);
+            this->body.appended();
+            return ok;
+        }
+
+        if(src != data + kept)
+        {
+            memmove(data + kept, src, len);
+        }
+        kept += len;
+        return true;
+    }
+
+    // Runs the body states over data that's already in place. On return the first
+    // kept bytes of data are body; the rest was framing. Returns false on bad framing.
+    bool process_body(char* data, size_t len, size_t& kept)
+    {
+        size_t i = 0;
+        kept = 0;
+
+        while(i < len && this->state != State::Done)
+        {
+            switch(this->state)
+            {
+                case State::Body:
+                {
+                    size_t take = min(len - i, (size_t)this->content_length - this->body_filled);
+                    if(!emit_body(data, kept, data + i, take)) return false;
+                    this->body_filled += take;
+                    i += take;
+
+                    if(this->body_filled == (size_t)this->content_length)
+                    {
+                        this->state = State::Done;
+                    }
+                    break;
+                }
+
+                case State::UntilClose:
+                    if(!emit_body(data, kept, data + i, len - i)) return false;
+                    i = len;
+                    break;
+
+                case State::ChunkSize:
+                    if(take_line(data, len, i) && !parse_chunk_size())
+                    {
+                        return false;
+                    }
+                    break;
+
+                case State::ChunkData:
+                {
+                    size_t take = min(len - i, this->chunk_remaining);
+                    if(!emit_body(data, kept, data + i, take)) return false;
+                    this->chunk_remaining -= take;
+                    i += take;
+
+                    if(this->chunk_remaining == 0)
+                    {
+                        this->state = State::ChunkDataEnd;
+                    }
+                    break;
+                }
+
+                case State::ChunkDataEnd:
+                    // The CRLF after the chunk data
+                    if(take_line(data, len, i))
+                    {
+                        if(!this->line.empty()) return false;
+                        this->state = State::ChunkSize;
+                    }
+                    break;
+
+                case State::Trailers:
+                    // Trailer fields are ignored, an empty line ends the message
+                    if(take_line(data, len, i))
+                    {
+                        if(this->line.empty())
+                        {
+                            this->state = State::Done;
+                        }
+                        this->line.clear();
+                    }
+                    break;
+
+                case State::Headers:
+                case State::Done:
+                    break;
+            }
+        }
+
+        return true;
+    }
+
+    // Hands what's in the chain to the sink, if there is one. Returns false if
+    // the sink couldn't take it.
+    bool flush_body()
+    {
+        if(!this->body_sink || this->body.empty()) return true;
+
+        for(string_view view : this->body.views())
+        {
+            if(!this->body_sink(view.data(), view.size()))
+            {
+                this->sink_failed = true;
+                break;
+            }
+        }
+        this->body.drain();
+        return !this->sink_failed;
+    }
+
+    // Body bytes that arrived somewhere else (after the headers, or through feed())
+    bool take_body_bytes(const char* data, size_t len)
+    {
+        if(len == 0 || this->state == State::Done) return true;
+
+        size_t kept;
+        if(this->decoding)
+        {
+            // Nothing is kept in place, the decoder writes its own output
+            return process_body(const_cast<char*>(data), len, kept) && flush_body();
+        }
+
+        size_t available;
+        char* out = this->body.prepare(len, available);
+        memcpy(out, data, len);
+        bool ok = process_body(out, len, kept);
+        this->body.commit(kept);
+        return ok && flush_body();
+    }
+
+    // Looks for the end of the headers in what has been received so far. Anything
+    // after them is body and gets handed on.
+    bool scan_head(size_t search_from)
+    {
+        while(this->state == State::Headers)
+        {
+            size_t header_end = this->head.find("\r\n\r\n", search_from);
+            if(header_end == string::npos)
+            {
+                return true;
+            }
+
+            // Skip interim responses like 100 Continue
+            if(this->head.compare(0, 5, "HTTP/") == 0 && this->head.size() > 9 && this->head[9] == '1')
+            {
+                this->head.erase(0, header_end + 4);
+                search_from = 0;
+                continue;
+            }
+
+            this->header_length = header_end;
+            on_headers_complete();
+
+            size_t body_start = header_end + 4;
+            if(this->header_check && this->state != State::Done && !this->header_check(*this))
+            {
+                // The connection is left mid-body, it can't be used again
+                this->stopped = true;
+                this->close_after = true;
+                this->head.resize(body_start);
+                return true;
+            }
+
+            bool ok = take_body_bytes(this->head.data() + body_start, this->head.size() - body_start);
+            this->head.resize(body_start);
+            return ok;
+        }
+        return true;
+    }
+
+    static string trim_spaces(const string& text)
+    {
+        size_t first = text.find_first_not_of(" \t");
+        if(first == string::npos) return "";
+        size_t last = text.find_last_not_of(" \t");
+        return text.substr(first, last - first + 1);
+    }
+
+    // Accumulates a CRLF terminated line, returns true once it's complete (without the CRLF)
+    bool take_line(const char* data, size_t len, size_t& i)
+    {
+        while(i < len)
+        {
+            char c = data[i++];
+            if(c == '\n')
+            {
+                if(!this->line.empty() && this->line.back() == '\r') this->line.pop_back();
+                return true;
+            }
+            this->line += c;
+        }
+        return false;
+    }
+
+public:
+
+    void set_progress(TransferProgress* progress)
+    {
+        this->progress = progress;
+    }
+
+    // Gives up on a server that doesn't start answering within first_byte_ms of
+    // sent, or goes quiet for idle_ms after that. -1 for no limit.
+    void set_timeouts(int first_byte_ms, int idle_ms, chrono::steady_clock::time_point sent)
+    {
+        this->first_byte_timeout_ms = first_byte_ms;
+        this->idle_timeout_ms = idle_ms;
+        this->sent_time = sent;
+    }
+
+    // Body bytes go to sink as they arrive (decoded) instead of being kept, so
+    // get_body() stays empty. The sink returns false to end the read there (see
+    // has_sink_failed()), whoever set it knows why and says so.
+    void set_body_sink(function<bool(const char*, size_t)> sink)
+    {
+        this->body_sink = move(sink);
+    }
+
+    // Called once the headers are in, with the body still to come. Returning false
+    // stops reading right there (see was_stopped()), e.g. for a response that's
+    // going to be fetched some other way.
+    void set_header_check(function<bool(const HTTPResponseReader&)> check)
+    {
+        this->header_check = move(check);
+    }
+
+    // Call before reading when the response won't have a body regardless of its headers
+    void expect_no_body()
+    {
+        this->no_body = true;
+    }
+
+    // Feeds received bytes in, for callers doing their own reads (non-blocking
+    // sockets). Returns false if the framing is broken.
+    bool feed(const char* data, size_t len)
+    {
+        bool ok;
+        if(this->state == State::Headers)
+        {
+            // The blank line can straddle two reads, so search a few bytes back
+            size_t search_from = this->head.size() < 3 ? 0 : this->head.size() - 3;
+            this->head.append(data, len);
+            ok = scan_head(search_from);
+        }
+        else
+        {
+            ok = take_body_bytes(data, len);
+        }
+
+        report_received((int)len);
+        if(this->state == State::Done)
+        {
+            this->complete_time = chrono::steady_clock::now();
+        }
+        return ok;
+    }
+
+    // After feed(): the server closed the connection, which is where a body without
+    // framing ends. Returns true if a complete response was fed in.
+    bool end_of_stream()
+    {
+        if(this->state == State::UntilClose)
+        {
+            this->state = State::Done;
+        }
+        if(this->state != State::Done)
+        {
+            this->close_after = true;
+        }
+
+        this->complete_time = chrono::steady_clock::now();
+        return is_complete();
+    }
+
+    // Receives from the socket until the response is complete or the server closes.
+    // Returns true if a complete response was read.
+    bool read_from(TcpClientSocket& socket)
+    {
+        const size_t CHUNK = 16384;
+
+        while(this->state != State::Done && !this->stopped)
+        {
+            int n;
+
+            if(!wait_for_data(socket))
+            {
+                // Cancelled or timed out, the connection is in an unknown state now
+                this->close_after = true;
+                return false;
+            }
+
+            if(this->state == State::Headers)
+            {
+                size_t old_size = this->head.size();
+                this->head.resize(old_size + CHUNK);
+                n = socket.receiveDataInt(&this->head[old_size], CHUNK);
+                this->head.resize(old_size + max(n, 0));
+                if(n <= 0) break;
+
+                if(!scan_head(old_size < 3 ? 0 : old_size - 3))
+                {
+                    if(!this->sink_failed) LOG_ERROR(LogCategory::Http, "Malformed response body");
+                    this->close_after = true;
+                    return false;
+                }
+
+                report_received(n);
+                continue;
+            }
+
+            size_t kept = 0;
+            bool ok;
+
+            if(this->decoding)
+            {
+                // Encoded bytes only pass through, the chain gets the decoded output
+                this->raw.resize(CHUNK);
+                n = socket.receiveDataInt(this->raw.data(), CHUNK);
+                if(n <= 0) break;
+
+                ok = process_body(this->raw.data(), n, kept) && flush_body();
+            }
+            else
+            {
+                // Straight into the chain. A Content-Length body never asks for more
+                // than what's left, so it stays in the segment reserved for it.
+                size_t want = CHUNK;
+                if(this->state == State::Body)
+                {
+                    want = min((size_t)this->content_length - this->body_filled, (size_t)1 << 20);
+                }
+
+                size_t available;
+                char* out = this->body.prepare(min(want, CHUNK), available);
+                n = socket.receiveDataInt(out, min(want, available));
+                if(n <= 0)
+                {
+                    this->body.commit(0);
+                    break;
+                }
+
+                ok = process_body(out, n, kept);
+                this->body.commit(kept);
+                ok = ok && flush_body();
+            }
+
+            if(!ok)
+            {
+                if(!this->sink_failed) LOG_ERROR(LogCategory::Http, "Malformed response body");
+                this->close_after = true;
+                return false;
+            }
+
+            report_received(n);
+        }
+
+        if(this->state == State::UntilClose)
+        {
+            this->state = State::Done;
+        }
+
+        this->complete_time = chrono::steady_clock::now();
+        return is_complete();
+    }
+
+    // Whether the header check stopped the read before the body
+    bool was_stopped() const
+    {
+        return this->stopped;
+    }
+
+    // Whether the read ended because the body sink turned bytes away
+    bool has_sink_failed() const
+    {
+        return this->sink_failed;
+    }
+
+    // Whether read_from() stopped because the server took too long
+    bool has_timed_out() const
+    {
+        return this->timed_out;
+    }
+
+    // For callers doing their own reads: the server has taken too long
+    void time_out()
+    {
+        this->timed_out = true;
+        this->close_after = true;
+        this->complete_time = chrono::steady_clock::now();
+    }
+
+    // Milliseconds until the server counts as too slow (set_timeouts()), -1 for never
+    long long get_time_left() const
+    {
+        return ms_until_timeout();
+    }
+
+    bool has_headers() const
+    {
+        return this->state != State::Headers;
+    }
+
+    bool is_complete() const
+    {
+        return this->state == State::Done;
+    }
+
+    // Whether the connection can carry another request after this response
+    bool keep_alive() const
+    {
+        return is_complete() && !this->close_after;
+    }
+
+    int get_status() const
+    {
+        return this->status;
+    }
+
+    // Raw bytes read_from() (or feed()) received, before any decoding
+    size_t get_bytes_received() const
+    {
+        return this->bytes_received;
+    }
+
+    bool has_first_byte() const
+    {
+        return this->bytes_received > 0;
+    }
+
+    chrono::steady_clock::time_point get_first_byte_time() const
+    {
+        return this->first_byte_time;
+    }
+
+    // When read_from() stopped reading
+    chrono::steady_clock::time_point get_complete_time() const
+    {
+        return this->complete_time;
+    }
+
+    // Status line and header fields, without the blank line. Valid as long as the reader is.
+    string_view get_headers() const
+    {
+        return string_view(this->head.data(), this->header_length);
+    }
+
+    // The parsed header fields, views into get_headers()
+    const HTTPHeaders& get_fields() const
+    {
+        return this->fields;
+    }
+
+    // The (decoded) body where it was received, one view per buffer segment
+    vector<string_view> get_body() const
+    {
+        return this->body.views();
+    }
+
+    size_t get_body_size() const
+    {
+        return this->body.size();
+    }
+
+    // Moves the body out; only joins segments if it didn't arrive in one
+    string take_body()
+    {
+        return this->body.take();
+    }
+};
+
+#endif
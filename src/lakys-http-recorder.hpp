@@ -0,0 +1,123 @@
+#pragma once
+
+#ifndef LAKYS_HTTP_RECORDER_HPP
+#define LAKYS_HTTP_RECORDER_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include "lakys-logger.hpp"
+#include "lakys-file-loader.hpp"
+#include "lakys-http-cache.hpp"
+#include "lakys-page-archive.hpp"
+
+using namespace std;
+
+// Record mode: every response HTTP gets (redirects included, each hop on its own
+// URL) is kept and written out as a page archive when recording stops. Replay it
+// offline with file://, or through a ReplayServer to benchmark against.
+//
+//   PUSZTA_RECORD=session.puszta    record from startup until the browser closes
+class HTTPRecorder
+{
+private:
+    struct Recorded
+    {
+        string url;
+        string headers;
+        string body;
+    };
+
+    mutex record_mutex;
+    atomic<bool> recording{ false };
+    string path;
+
+    vector<Recorded> responses;  // In the order they were first seen, the first page first
+    map<string, size_t> index;   // URL -> position in responses
+
+    HTTPRecorder() {}
+
+public:
+    static HTTPRecorder& instance()
+    {
+        static HTTPRecorder recorder;
+        return recorder;
+    }
+
+    void configure_from_environment()
+    {
+        const char* file = getenv("PUSZTA_RECORD");
+        if(file && *file) start(file);
+    }
+
+    void start(const string& archive_path)
+    {
+        lock_guard<mutex> lock(this->record_mutex);
+        this->path = archive_path;
+        this->responses.clear();
+        this->index.clear();
+        this->recording = true;
+        LOG_INFO(LogCategory::Http, "Recording responses to " << archive_path);
+    }
+
+    bool is_recording() const
+    {
+        return this->recording;
+    }
+
+    // Keeps a copy of a response, the latest one wins if a URL is seen again.
+    // The body is the decoded one, so transfer headers are dropped.
+    void record(const string& url, const string& headers, const string& body)
+    {
+        if(!this->recording) return;
+
+        Recorded response{ url, HTTPCache::strip_transfer_headers(headers), body };
+
+        lock_guard<mutex> lock(this->record_mutex);
+        auto found = this->index.find(url);
+        if(found != this->index.end())
+        {
+            this->responses[found->second] = move(response);
+            return;
+        }
+
+        this->index[url] = this->responses.size();
+        this->responses.push_back(move(response));
+    }
+
+    // Writes the archive. Returns false if nothing was recorded or it couldn't be written.
+    bool stop()
+    {
+        lock_guard<mutex> lock(this->record_mutex);
+        if(!this->recording) return false;
+        this->recording = false;
+
+        if(this->responses.empty())
+        {
+            LOG_WARN(LogCategory::Http, "Nothing was recorded");
+            return false;
+        }
+
+        vector<ArchivedResponse> archived;
+        archived.reserve(this->responses.size());
+        for(const Recorded& response : this->responses)
+        {
+            archived.push_back({ response.url, response.headers, response.body });
+        }
+
+        bool saved = save_to_file(this->path, build_archive(archived));
+        if(saved)
+        {
+            LOG_INFO(LogCategory::Http, "Recorded " << archived.size() << " responses to " << this->path);
+        }
+
+        this->responses.clear();
+        this->index.clear();
+        return saved;
+    }
+};
+
+#endif
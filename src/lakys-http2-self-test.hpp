@@ -0,0 +1,145 @@
+#pragma once
+
+#ifndef LAKYS_HTTP2_SELF_TEST_HPP
+#define LAKYS_HTTP2_SELF_TEST_HPP
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <filesystem>
+#include "lakys-logger.hpp"
+#include "lakys-socket-handler.hpp"
+#include "lakys-connection-pool.hpp"
+#include "lakys-network-thread.hpp"
+#include "lakys-page-archive.hpp"
+#include "lakys-replay-server.hpp"
+
+using namespace std;
+
+// Puts the HTTP/2 client through its paces against ReplayServer's h2 mode on
+// loopback, so the framing and HPACK code get checked without a real server:
+//
+//   - ALPN picks h2, and HTTP/1.1 once we stop offering it
+//   - dozens of requests at once, as streams sharing a connection
+//   - header blocks big enough for HPACK's dynamic table and split over CONTINUATIONs
+//   - refused streams and a GOAWAY, whose streams are sent again elsewhere
+//   - a body bigger than the stream window, only finished if we give credit
+//
+// PUSZTA_SELF_TEST=http2 runs it instead of the browser. Returns true if it all held up.
+inline bool run_http2_self_test()
+{
+    const string origin = "https://h2.self-test";
+    const int small_count = 40;
+
+    // Bodies are views, the strings have to outlive the archive's making
+    vector<string> bodies;
+    bodies.reserve(small_count + 2);
+    vector<ArchivedResponse> responses;
+
+    bodies.push_back("<html><title>HTTP/2 self test</title><p>page</p></html>");
+    responses.push_back({ origin + "/", "HTTP/1.1 200 OK\r\nContent-Type: text/html", bodies.back() });
+
+    for(int i = 0; i < small_count; i++)
+    {
+        bodies.push_back("resource " + to_string(i) + " " + string((size_t)i * 37, (char)('a' + i % 26)));
+        string filler(1500 + i * 10, (char)('A' + i % 26)); // The same names every time, new values: dynamic table churn
+        responses.push_back({ origin + "/r/" + to_string(i), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nX-Filler: " + filler, bodies.back() });
+    }
+
+    string big(3 * 1024 * 1024, '\0'); // Three times the stream window we give servers
+    for(size_t i = 0; i < big.size(); i++) big[i] = (char)((i * 7 + (i >> 10)) & 0xFF);
+    bodies.push_back(move(big));
+    responses.push_back({ origin + "/big", "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream", bodies.back() });
+
+    filesystem::path archive_path = filesystem::temp_directory_path() / "puszta-http2-self-test.puszta";
+    auto archive = make_shared<PageArchive>();
+    if(!save_to_file(archive_path.string(), build_archive(responses)) || !archive->open(archive_path.string()))
+    {
+        LOG_ERROR(LogCategory::Net, "HTTP/2 self test couldn't write its archive to " << archive_path.string());
+        return false;
+    }
+
+    ReplayServer::Options options;
+    options.http2 = true;
+    options.latency_ms = 5;
+    options.max_concurrent_streams = 16;
+    options.header_fragment = 600;
+    options.goaway_after = 30;
+    options.refuse_every = 11;
+
+    ReplayServer server;
+    if(!server.start(archive, options))
+    {
+        filesystem::remove(archive_path);
+        return false;
+    }
+    server.attach();
+
+    bool passed = true;
+    auto check = [&](bool ok, const string& what) {
+        if(ok)
+        {
+            LOG_INFO(LogCategory::Net, "HTTP/2 self test: " << what);
+        }
+        else
+        {
+            LOG_ERROR(LogCategory::Net, "HTTP/2 self test FAILED: " << what);
+            passed = false;
+        }
+    };
+
+    auto fetch = [&](size_t index) {
+        HTTP http;
+        http.set(responses[index].url);
+        string body = http.request();
+        if(http.get_status() == 200 && body == responses[index].body) return true;
+
+        LOG_ERROR(LogCategory::Net, "HTTP/2 self test: " << responses[index].url << " came back " << http.get_status()
+                  << " with " << body.size() << " bytes instead of " << responses[index].body.size());
+        return false;
+    };
+
+    // Everything at once, from as many threads as a page would use
+    atomic<size_t> next{ 0 };
+    atomic<int> good{ 0 };
+    vector<thread> threads;
+    for(int i = 0; i < 8; i++)
+    {
+        threads.emplace_back([&] {
+            for(size_t index = next++; index < responses.size(); index = next++)
+            {
+                if(fetch(index)) good++;
+            }
+        });
+    }
+    for(thread& worker : threads) worker.join();
+
+    ReplayServer::Stats stats = server.get_stats();
+    check(good == (int)responses.size(), to_string(good) + "/" + to_string(responses.size()) + " responses came back whole");
+    check(stats.http2_connections >= 2 && stats.goaways >= 1, "GOAWAY after " + to_string(options.goaway_after) + " streams, the rest went on "
+          + to_string(stats.http2_connections) + " connections in all");
+    check(stats.refused >= 1, to_string(stats.refused) + " refused streams were sent again");
+    check(stats.continuations >= 1, to_string(stats.continuations) + " CONTINUATION frames put back together");
+    check(stats.window_updates >= 1, to_string(stats.window_updates) + " WINDOW_UPDATEs kept the big body coming");
+
+    // Without h2 in ALPN the same server speaks HTTP/1.1
+    bool offered = SslContext::instance().offersHttp2();
+    SslContext::instance().setOfferHttp2(false);
+    ConnectionPool::instance().clear();
+    int http2_before = server.get_stats().http2_connections;
+    int connections_before = server.get_stats().connections;
+    bool fetched = fetch(0);
+    stats = server.get_stats();
+    check(fetched && stats.connections > connections_before && stats.http2_connections == http2_before, "HTTP/1.1 when h2 isn't offered");
+    SslContext::instance().setOfferHttp2(offered);
+
+    ConnectionPool::instance().clear();
+    server.stop();
+    filesystem::remove(archive_path);
+
+    LOG_INFO(LogCategory::Net, "HTTP/2 self test " << (passed ? "passed" : "failed"));
+    return passed;
+}
+
+#endif
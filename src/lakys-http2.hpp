@@ -0,0 +1,859 @@
+#pragma once
+
+#ifndef LAKYS_HTTP2_HPP
+#define LAKYS_HTTP2_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include "lakys-logger.hpp"
+#include "lakys-hpack.hpp"
+#include "lakys-http-reader.hpp"
+#include "socket/TcpSslClientSocket.hpp"
+#include "lakys-network-thread.hpp"
+
+using namespace std;
+
+// Frame types and flags (RFC 9113 6)
+enum class HTTP2Frame : uint8_t
+{
+    Data = 0x0,
+    Headers = 0x1,
+    Priority = 0x2,
+    ResetStream = 0x3,
+    Settings = 0x4,
+    PushPromise = 0x5,
+    Ping = 0x6,
+    GoAway = 0x7,
+    WindowUpdate = 0x8,
+    Continuation = 0x9,
+    PriorityUpdate = 0x10 // RFC 9218
+};
+
+static const uint8_t HTTP2_END_STREAM = 0x1;
+static const uint8_t HTTP2_ACK = 0x1;
+static const uint8_t HTTP2_END_HEADERS = 0x4;
+static const uint8_t HTTP2_PADDED = 0x8;
+static const uint8_t HTTP2_PRIORITY = 0x20;
+
+static const uint32_t HTTP2_NO_ERROR = 0x0;
+static const uint32_t HTTP2_PROTOCOL_ERROR = 0x1;
+static const uint32_t HTTP2_FLOW_CONTROL_ERROR = 0x3;
+static const uint32_t HTTP2_FRAME_SIZE_ERROR = 0x6;
+static const uint32_t HTTP2_REFUSED_STREAM = 0x7;
+static const uint32_t HTTP2_CANCEL = 0x8;
+static const uint32_t HTTP2_COMPRESSION_ERROR = 0x9;
+
+inline void http2_put_u32(string& out, uint32_t value)
+{
+    out += (char)(value >> 24);
+    out += (char)(value >> 16);
+    out += (char)(value >> 8);
+    out += (char)value;
+}
+
+inline uint32_t http2_get_u32(const uint8_t* data)
+{
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+// A frame on the wire: 9 bytes of length, type, flags and stream, then the payload
+inline string http2_frame(HTTP2Frame type, uint8_t flags, uint32_t stream_id, string_view payload)
+{
+    string out;
+    out.reserve(9 + payload.size());
+    out += (char)(payload.size() >> 16);
+    out += (char)(payload.size() >> 8);
+    out += (char)payload.size();
+    out += (char)type;
+    out += (char)flags;
+    http2_put_u32(out, stream_id & 0x7FFFFFFF);
+    out.append(payload.data(), payload.size());
+    return out;
+}
+
+// A GET to send as a stream. Field names must be lowercase.
+struct HTTP2Request
+{
+    string scheme = "https";
+    string authority;
+    string path = "/";
+    vector<HeaderField> fields;
+
+    // RFC 9218 urgency: 0 is the most urgent, 3 the default, 7 the least.
+    // Incremental responses (images) are useful as they arrive, so they share bandwidth.
+    int urgency = 3;
+    bool incremental = false;
+};
+
+// What came back on a stream. Filled in on the network thread.
+struct HTTP2Response
+{
+    int status = 0;
+    vector<HeaderField> fields;  // Without the pseudo-headers
+    string body;                 // As sent, still content-coded
+
+    bool complete = false;       // END_STREAM seen
+    bool failed = false;         // Reset, or the connection went away
+    bool retryable = false;      // The server never looked at it (REFUSED_STREAM, GOAWAY), safe to send again
+    bool timed_out = false;      // Given up on by wait(), the server took too long
+    bool stopped = false;        // wait()'s header check didn't want the body
+
+    size_t bytes_received = 0;   // Frame bytes, headers included
+    bool has_first_byte = false;
+    chrono::steady_clock::time_point first_byte_time;
+    chrono::steady_clock::time_point last_byte_time;
+    chrono::steady_clock::time_point complete_time;
+};
+
+// One HTTP/2 connection with any number of requests in flight on it at once, each
+// its own stream. The network thread takes the frames apart as they arrive and
+// hands them to their streams; requests are written from whichever thread makes
+// them. The socket is non-blocking and every TLS call happens under io_mutex,
+// OpenSSL won't have two threads in the same connection.
+//
+// Always owned by a shared_ptr: the network thread keeps the connection alive
+// for as long as it watches the socket.
+class HTTP2Connection : public enable_shared_from_this<HTTP2Connection>
+{
+private:
+    struct Stream
+    {
+        HTTP2Response response;
+        TransferProgress* progress = nullptr;
+        int urgency = 3;
+        bool incremental = false;
+        chrono::steady_clock::time_point sent;
+        int32_t receive_window = 0;
+        uint32_t unacknowledged = 0; // Bytes received since our last WINDOW_UPDATE for it
+        bool final_headers = false;  // 1xx responses come before the real ones
+    };
+
+    unique_ptr<TcpSslClientSocket> socket;
+    mutex io_mutex;
+
+    mutex state_mutex;
+    condition_variable state_changed;
+    map<uint32_t, Stream> streams;
+    uint32_t next_stream_id = 1;
+    uint32_t max_concurrent_streams = 100; // Until the server says otherwise
+    size_t active_streams = 0;
+
+    HPACKEncoder encoder;  // Only touched under io_mutex, header blocks go out in encoding order
+    HPACKDecoder decoder;  // Network thread only
+
+    // Flow control for what we receive. Sending is just HEADERS, which isn't flow controlled.
+    static const int32_t STREAM_WINDOW = 1024 * 1024;
+    static const int32_t CONNECTION_WINDOW = 16 * 1024 * 1024;
+    uint32_t connection_unacknowledged = 0;
+
+    uint32_t peer_max_frame_size = 16384;
+
+    atomic<bool> closing{ false };
+    atomic<bool> dead{ false };
+    atomic<bool> going_away{ false };
+
+    // Network thread only
+    SOCKET descriptor = INVALID_SOCKET;
+    bool torn_down = false;
+    string read_buffer;
+    size_t read_used = 0;
+    uint32_t continuation_stream = 0; // Set while a header block is split over CONTINUATIONs
+    uint8_t continuation_flags = 0;
+    string header_block;
+
+    chrono::steady_clock::time_point idle_since = chrono::steady_clock::now();
+
+    // Caller must hold io_mutex
+    bool write_locked(const string& bytes)
+    {
+        if(this->dead) return false;
+        if(!this->socket->writeAll(bytes.data(), bytes.size()))
+        {
+            this->dead = true;
+            return false;
+        }
+        return true;
+    }
+
+    bool send(const string& bytes)
+    {
+        lock_guard<mutex> lock(this->io_mutex);
+        return write_locked(bytes);
+    }
+
+    // RFC 7540 weights for servers that still use the dependency tree, from the urgency
+    static uint8_t weight_for(int urgency)
+    {
+        static const uint8_t weights[8] = { 255, 219, 183, 147, 110, 73, 37, 1 };
+        return weights[max(0, min(7, urgency))];
+    }
+
+    static string priority_field(int urgency, bool incremental)
+    {
+        return "u=" + to_string(max(0, min(7, urgency))) + (incremental ? ", i" : "");
+    }
+
+    static void mark_received(HTTP2Response& response)
+    {
+        response.last_byte_time = chrono::steady_clock::now();
+        if(response.has_first_byte) return;
+        response.has_first_byte = true;
+        response.first_byte_time = response.last_byte_time;
+    }
+
+    // Caller must hold state_mutex
+    void finish_locked(uint32_t stream_id, Stream& stream, bool failed, bool retryable)
+    {
+        if(stream.response.complete || stream.response.failed) return;
+
+        stream.response.complete = !failed;
+        stream.response.failed = failed;
+        stream.response.retryable = retryable && stream.response.bytes_received == 0;
+        stream.response.complete_time = chrono::steady_clock::now();
+        this->active_streams--;
+        if(this->active_streams == 0) this->idle_since = chrono::steady_clock::now();
+        this->state_changed.notify_all();
+
+        LOG_TRACE(LogCategory::Net, "HTTP/2 stream " << stream_id << (failed ? " failed" : " done"));
+    }
+
+    void fail_all(bool retryable)
+    {
+        lock_guard<mutex> lock(this->state_mutex);
+        for(auto& entry : this->streams)
+        {
+            finish_locked(entry.first, entry.second, true, retryable);
+        }
+        this->dead = true;
+        this->state_changed.notify_all();
+    }
+
+    void connection_error(uint32_t code, const string& reason)
+    {
+        LOG_WARN(LogCategory::Net, "HTTP/2 connection error " << code << ": " << reason);
+
+        string payload;
+        http2_put_u32(payload, this->next_stream_id > 1 ? this->next_stream_id - 2 : 0);
+        http2_put_u32(payload, code);
+        send(http2_frame(HTTP2Frame::GoAway, 0, 0, payload));
+
+        fail_all(false);
+    }
+
+    void on_settings(uint8_t flags, const uint8_t* payload, uint32_t length)
+    {
+        if(flags & HTTP2_ACK) return;
+
+        for(uint32_t i = 0; i + 6 <= length; i += 6)
+        {
+            uint16_t id = (uint16_t)((payload[i] << 8) | payload[i + 1]);
+            uint32_t value = http2_get_u32(payload + i + 2);
+
+            switch(id)
+            {
+                case 0x1: // HEADER_TABLE_SIZE
+                {
+                    lock_guard<mutex> lock(this->io_mutex);
+                    this->encoder.set_max_size(value);
+                    break;
+                }
+                case 0x3: // MAX_CONCURRENT_STREAMS
+                {
+                    lock_guard<mutex> lock(this->state_mutex);
+                    this->max_concurrent_streams = max(1u, value);
+                    this->state_changed.notify_all();
+                    break;
+                }
+                case 0x5: // MAX_FRAME_SIZE
+                    if(value >= 16384 && value <= 16777215) this->peer_max_frame_size = value;
+                    break;
+                default:
+                    break; // Push is off, and we never send flow-controlled data
+            }
+        }
+
+        send(http2_frame(HTTP2Frame::Settings, HTTP2_ACK, 0, ""));
+    }
+
+    void on_headers(uint32_t stream_id, uint8_t flags, const string& block)
+    {
+        vector<HeaderField> fields;
+        if(!this->decoder.decode((const uint8_t*)block.data(), block.size(), fields))
+        {
+            connection_error(HTTP2_COMPRESSION_ERROR, "bad header block");
+            return;
+        }
+
+        lock_guard<mutex> lock(this->state_mutex);
+        auto found = this->streams.find(stream_id);
+        if(found == this->streams.end()) return; // Cancelled, the block only had to be decoded
+        Stream& stream = found->second;
+
+        mark_received(stream.response);
+        stream.response.bytes_received += block.size();
+        if(stream.progress) stream.progress->received += block.size();
+
+        int status = 0;
+        vector<HeaderField> regular;
+        for(HeaderField& field : fields)
+        {
+            if(field.first == ":status")
+            {
+                status = atoi(field.second.c_str());
+            }
+            else if(!field.first.empty() && field.first[0] != ':')
+            {
+                regular.push_back(move(field));
+            }
+        }
+
+        if(!stream.final_headers)
+        {
+            if(status >= 100 && status < 200) return; // Informational, the real one is still coming
+            stream.final_headers = true;
+            stream.response.status = status;
+            stream.response.fields = move(regular);
+
+            string_view length;
+            for(const HeaderField& field : stream.response.fields)
+            {
+                if(field.first == "content-length") length = field.second;
+            }
+            if(stream.progress && !length.empty())
+            {
+                stream.progress->expected = atoll(string(length).c_str());
+            }
+        }
+        // Else trailers, nothing we use
+
+        if(flags & HTTP2_END_STREAM)
+        {
+            finish_locked(stream_id, stream, false, false);
+        }
+    }
+
+    void on_data(uint32_t stream_id, uint8_t flags, const uint8_t* payload, uint32_t length, uint32_t frame_length)
+    {
+        string window_updates;
+
+        {
+            lock_guard<mutex> lock(this->state_mutex);
+
+            // Flow control counts the whole frame, padding included
+            this->connection_unacknowledged += frame_length;
+            if(this->connection_unacknowledged >= (uint32_t)CONNECTION_WINDOW / 2)
+            {
+                string increment;
+                http2_put_u32(increment, this->connection_unacknowledged);
+                window_updates += http2_frame(HTTP2Frame::WindowUpdate, 0, 0, increment);
+                this->connection_unacknowledged = 0;
+            }
+
+            auto found = this->streams.find(stream_id);
+            if(found != this->streams.end() && !found->second.response.complete && !found->second.response.failed)
+            {
+                Stream& stream = found->second;
+                stream.receive_window -= (int32_t)frame_length;
+                if(stream.receive_window < 0)
+                {
+                    LOG_WARN(LogCategory::Net, "HTTP/2 server overran the window of stream " << stream_id);
+                }
+
+                stream.response.body.append((const char*)payload, length);
+                mark_received(stream.response);
+                stream.response.bytes_received += frame_length;
+                if(stream.progress) stream.progress->received += frame_length;
+
+                stream.unacknowledged += frame_length;
+                if(!(flags & HTTP2_END_STREAM) && stream.unacknowledged >= (uint32_t)STREAM_WINDOW / 2)
+                {
+                    string increment;
+                    http2_put_u32(increment, stream.unacknowledged);
+                    window_updates += http2_frame(HTTP2Frame::WindowUpdate, 0, stream_id, increment);
+                    stream.receive_window += (int32_t)stream.unacknowledged;
+                    stream.unacknowledged = 0;
+                }
+
+                if(flags & HTTP2_END_STREAM)
+                {
+                    finish_locked(stream_id, stream, false, false);
+                }
+            }
+        }
+
+        if(!window_updates.empty()) send(window_updates);
+    }
+
+    void on_reset(uint32_t stream_id, uint32_t code)
+    {
+        lock_guard<mutex> lock(this->state_mutex);
+        auto found = this->streams.find(stream_id);
+        if(found == this->streams.end()) return;
+
+        LOG_DEBUG(LogCategory::Net, "HTTP/2 stream " << stream_id << " reset with " << code);
+        finish_locked(stream_id, found->second, true, code == HTTP2_REFUSED_STREAM);
+    }
+
+    void on_goaway(const uint8_t* payload, uint32_t length)
+    {
+        if(length < 8) return;
+        uint32_t last_stream_id = http2_get_u32(payload) & 0x7FFFFFFF;
+        uint32_t code = http2_get_u32(payload + 4);
+
+        LOG_DEBUG(LogCategory::Net, "HTTP/2 GOAWAY " << code << ", last stream " << last_stream_id);
+        this->going_away = true;
+
+        // Streams after the last one were never processed, they can go out again elsewhere
+        lock_guard<mutex> lock(this->state_mutex);
+        for(auto& entry : this->streams)
+        {
+            if(entry.first > last_stream_id)
+            {
+                finish_locked(entry.first, entry.second, true, true);
+            }
+        }
+        this->state_changed.notify_all();
+    }
+
+    // Returns the bytes of buffer it used, or -1 on a connection error
+    long long process_frames(const uint8_t* data, size_t size, uint32_t& continuation_stream, uint8_t& continuation_flags, string& header_block)
+    {
+        size_t pos = 0;
+
+        while(size - pos >= 9)
+        {
+            const uint8_t* header = data + pos;
+            uint32_t length = ((uint32_t)header[0] << 16) | ((uint32_t)header[1] << 8) | header[2];
+            HTTP2Frame type = (HTTP2Frame)header[3];
+            uint8_t flags = header[4];
+            uint32_t stream_id = http2_get_u32(header + 5) & 0x7FFFFFFF;
+
+            // We never raise SETTINGS_MAX_FRAME_SIZE from its 16 KiB default
+            if(length > 16384)
+            {
+                connection_error(HTTP2_FRAME_SIZE_ERROR, "frame of " + to_string(length) + " bytes");
+                return -1;
+            }
+            if(size - pos < 9 + (size_t)length) break;
+
+            const uint8_t* payload = header + 9;
+            pos += 9 + length;
+
+            // Nothing may come between a HEADERS and its CONTINUATIONs
+            if(continuation_stream != 0 && (type != HTTP2Frame::Continuation || stream_id != continuation_stream))
+            {
+                connection_error(HTTP2_PROTOCOL_ERROR, "interrupted header block");
+                return -1;
+            }
+
+            // Padding and the priority block come off DATA and HEADERS payloads
+            uint32_t content_offset = 0;
+            uint32_t content_length = length;
+            if((type == HTTP2Frame::Data || type == HTTP2Frame::Headers) && (flags & HTTP2_PADDED))
+            {
+                if(length < 1 || payload[0] >= length)
+                {
+                    connection_error(HTTP2_PROTOCOL_ERROR, "bad padding");
+                    return -1;
+                }
+                content_offset = 1;
+                content_length = length - 1 - payload[0];
+            }
+            if(type == HTTP2Frame::Headers && (flags & HTTP2_PRIORITY))
+            {
+                if(content_length < 5)
+                {
+                    connection_error(HTTP2_PROTOCOL_ERROR, "short HEADERS");
+                    return -1;
+                }
+                content_offset += 5;
+                content_length -= 5;
+            }
+
+            switch(type)
+            {
+                case HTTP2Frame::Data:
+                    on_data(stream_id, flags, payload + content_offset, content_length, length);
+                    break;
+
+                case HTTP2Frame::Headers:
+                    header_block.assign((const char*)payload + content_offset, content_length);
+                    if(flags & HTTP2_END_HEADERS)
+                    {
+                        on_headers(stream_id, flags, header_block);
+                    }
+                    else
+                    {
+                        continuation_stream = stream_id;
+                        continuation_flags = flags;
+                    }
+                    break;
+
+                case HTTP2Frame::Continuation:
+                    if(continuation_stream == 0)
+                    {
+                        connection_error(HTTP2_PROTOCOL_ERROR, "stray CONTINUATION");
+                        return -1;
+                    }
+                    header_block.append((const char*)payload, length);
+                    if(flags & HTTP2_END_HEADERS)
+                    {
+                        continuation_stream = 0;
+                        on_headers(stream_id, continuation_flags, header_block);
+                    }
+                    break;
+
+                case HTTP2Frame::ResetStream:
+                    if(length == 4) on_reset(stream_id, http2_get_u32(payload));
+                    break;
+
+                case HTTP2Frame::Settings:
+                    on_settings(flags, payload, length);
+                    break;
+
+                case HTTP2Frame::Ping:
+                    if(!(flags & HTTP2_ACK) && length == 8)
+                    {
+                        send(http2_frame(HTTP2Frame::Ping, HTTP2_ACK, 0, string_view((const char*)payload, 8)));
+                    }
+                    break;
+
+                case HTTP2Frame::GoAway:
+                    on_goaway(payload, length);
+                    break;
+
+                case HTTP2Frame::PushPromise:
+                    // We turned push off in our SETTINGS
+                    connection_error(HTTP2_PROTOCOL_ERROR, "PUSH_PROMISE with push disabled");
+                    return -1;
+
+                default:
+                    break; // WINDOW_UPDATE (we send no data), PRIORITY, extensions
+            }
+
+            if(this->dead) return -1;
+        }
+
+        return (long long)pos;
+    }
+
+    // The network thread calls this whenever the socket has something
+    void on_readable()
+    {
+        char chunk[64 * 1024];
+        bool closed = false;
+        {
+            lock_guard<mutex> lock(this->io_mutex);
+            while(true)
+            {
+                int n = this->socket->readSome(chunk, sizeof(chunk));
+                if(n > 0)
+                {
+                    this->read_buffer.append(chunk, (size_t)n);
+                    continue;
+                }
+                closed = n < 0;
+                break;
+            }
+        }
+
+        long long consumed = process_frames((const uint8_t*)this->read_buffer.data() + this->read_used, this->read_buffer.size() - this->read_used,
+                                            this->continuation_stream, this->continuation_flags, this->header_block);
+        if(consumed >= 0)
+        {
+            this->read_used += (size_t)consumed;
+
+            // Keep the unparsed tail at the front
+            if(this->read_used > 0 && (this->read_used == this->read_buffer.size() || this->read_used > 256 * 1024))
+            {
+                this->read_buffer.erase(0, this->read_used);
+                this->read_used = 0;
+            }
+        }
+
+        if(closed)
+        {
+            LOG_DEBUG(LogCategory::Net, "HTTP/2 connection closed by the server");
+        }
+
+        // After a GOAWAY we only stay for the streams the server still answers
+        bool drained = this->going_away && get_active_streams() == 0;
+        if(closed || consumed < 0 || this->dead || this->closing || drained)
+        {
+            tear_down();
+        }
+    }
+
+    // Network thread only: stops watching and closes the socket. Whatever was
+    // still waiting never got an answer; if the server went away cleanly first,
+    // those are safe to send again on a new connection.
+    void tear_down()
+    {
+        if(this->torn_down) return;
+        this->torn_down = true;
+
+        NetworkThread::instance().unwatch(this->descriptor);
+        fail_all(this->going_away);
+
+        lock_guard<mutex> lock(this->io_mutex);
+        this->socket->setBlocking(true);
+        this->socket->closeConnection();
+    }
+
+public:
+    explicit HTTP2Connection(unique_ptr<TcpSslClientSocket> connected) : socket(move(connected)) {}
+
+    HTTP2Connection(const HTTP2Connection&) = delete;
+    HTTP2Connection& operator=(const HTTP2Connection&) = delete;
+
+    // By now the network thread has let go, or never held on
+    ~HTTP2Connection()
+    {
+        this->socket->setBlocking(true);
+        this->socket->closeConnection();
+    }
+
+    // Sends the preface and our SETTINGS, then starts reading. Returns false if the
+    // connection is already unusable.
+    bool start()
+    {
+        this->socket->setBlocking(false);
+
+        string preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+        string settings;
+        auto setting = [&](uint16_t id, uint32_t value) {
+            settings += (char)(id >> 8);
+            settings += (char)id;
+            http2_put_u32(settings, value);
+        };
+        setting(0x1, 4096);           // HEADER_TABLE_SIZE, the default, said out loud
+        setting(0x2, 0);              // ENABLE_PUSH off
+        setting(0x4, STREAM_WINDOW);  // INITIAL_WINDOW_SIZE
+        preface += http2_frame(HTTP2Frame::Settings, 0, 0, settings);
+
+        // The connection window can only be raised with an update
+        string increment;
+        http2_put_u32(increment, CONNECTION_WINDOW - 65535);
+        preface += http2_frame(HTTP2Frame::WindowUpdate, 0, 0, increment);
+
+        if(!send(preface)) return false;
+
+        shared_ptr<HTTP2Connection> self = shared_from_this();
+        this->descriptor = this->socket->getDescriptor();
+        NetworkThread::instance().post([self] {
+            bool watching = NetworkThread::instance().watch(self->descriptor, EventLoop::Readable, [self](int) {
+                self->on_readable();
+            });
+            if(!watching) self->tear_down();
+        });
+        return true;
+    }
+
+    // Sends the request as a new stream. Blocks while the server's stream limit is
+    // reached. Returns 0 if the connection can't take it; send it elsewhere then.
+    uint32_t submit(const HTTP2Request& request, TransferProgress* progress = nullptr)
+    {
+        unique_lock<mutex> state_lock(this->state_mutex);
+        this->state_changed.wait(state_lock, [&] {
+            return this->dead || this->going_away || this->active_streams < this->max_concurrent_streams;
+        });
+        if(this->dead || this->going_away || this->next_stream_id > 0x7FFFFFFF) return 0;
+
+        vector<HeaderField> fields;
+        fields.reserve(request.fields.size() + 5);
+        fields.push_back({ ":method", "GET" });
+        fields.push_back({ ":scheme", request.scheme });
+        fields.push_back({ ":authority", request.authority });
+        fields.push_back({ ":path", request.path });
+        for(const HeaderField& field : request.fields) fields.push_back(field);
+        fields.push_back({ "priority", priority_field(request.urgency, request.incremental) });
+
+        // Stream ids have to reach the server in increasing order, and header blocks
+        // in the order they were compressed: both happen under io_mutex. That may be
+        // taken while holding state_mutex, so state_mutex waits until it's let go.
+        uint32_t stream_id;
+        bool written;
+        {
+            lock_guard<mutex> io_lock(this->io_mutex);
+
+            stream_id = this->next_stream_id;
+            this->next_stream_id += 2;
+
+            Stream& stream = this->streams[stream_id];
+            stream.progress = progress;
+            stream.urgency = request.urgency;
+            stream.incremental = request.incremental;
+            stream.sent = chrono::steady_clock::now();
+            stream.receive_window = STREAM_WINDOW;
+            this->active_streams++;
+            state_lock.unlock();
+
+            string block;
+            this->encoder.encode(fields, block);
+
+            // Exclusive bit off, no dependency, weight - 1 on the wire
+            string priority;
+            http2_put_u32(priority, 0);
+            priority += (char)(weight_for(request.urgency) - 1);
+
+            size_t first_size = min(block.size(), (size_t)this->peer_max_frame_size - priority.size());
+            string out = http2_frame(HTTP2Frame::Headers, HTTP2_END_STREAM | HTTP2_PRIORITY | (first_size == block.size() ? HTTP2_END_HEADERS : 0),
+                               stream_id, priority + block.substr(0, first_size));
+            for(size_t sent = first_size; sent < block.size(); )
+            {
+                size_t size = min(block.size() - sent, (size_t)this->peer_max_frame_size);
+                bool last = sent + size == block.size();
+                out += http2_frame(HTTP2Frame::Continuation, last ? HTTP2_END_HEADERS : 0, stream_id, string_view(block).substr(sent, size));
+                sent += size;
+            }
+
+            written = write_locked(out);
+        }
+
+        if(!written)
+        {
+            lock_guard<mutex> lock(this->state_mutex);
+            finish_locked(stream_id, this->streams[stream_id], true, true);
+        }
+        return stream_id;
+    }
+
+    // Blocks until the stream is done, then hands its response over. Cancelling the
+    // progress resets the stream, and so does a server that doesn't start answering
+    // within first_byte_ms or then goes quiet for idle_ms (-1 for no limit). A new
+    // urgency in the progress is passed on to the server with reprioritize().
+    // header_check sees the response once its headers are in (under the stream
+    // lock, keep it short); returning false resets the stream there too.
+    HTTP2Response wait(uint32_t stream_id, int first_byte_ms = -1, int idle_ms = -1,
+                       function<bool(const HTTP2Response&)> header_check = nullptr)
+    {
+        unique_lock<mutex> lock(this->state_mutex);
+        auto found = this->streams.find(stream_id);
+        if(found == this->streams.end())
+        {
+            HTTP2Response missing;
+            missing.failed = true;
+            return missing;
+        }
+
+        Stream& stream = found->second;
+        while(true)
+        {
+            if(header_check && stream.final_headers)
+            {
+                stream.response.stopped = !header_check(stream.response);
+                header_check = nullptr;
+            }
+            if(stream.response.complete || stream.response.failed) break;
+
+            // The other streams keep the connection busy, only this one's bytes count
+            int timeout = stream.response.has_first_byte ? idle_ms : first_byte_ms;
+            chrono::steady_clock::time_point since = stream.response.has_first_byte ? stream.response.last_byte_time : stream.sent;
+            bool too_slow = timeout >= 0 && chrono::steady_clock::now() - since >= chrono::milliseconds(timeout);
+            if(too_slow)
+            {
+                stream.response.timed_out = true;
+            }
+
+            if(too_slow || stream.response.stopped || (stream.progress && stream.progress->cancelled))
+            {
+                finish_locked(stream_id, stream, true, false);
+                lock.unlock();
+
+                string code;
+                http2_put_u32(code, HTTP2_CANCEL);
+                send(http2_frame(HTTP2Frame::ResetStream, 0, stream_id, code));
+
+                lock.lock();
+                break;
+            }
+
+            int urgency = stream.progress ? stream.progress->urgency.load() : -1;
+            if(urgency >= 0 && urgency != stream.urgency)
+            {
+                stream.urgency = urgency;
+                lock.unlock();
+                reprioritize(stream_id, urgency, stream.incremental);
+                lock.lock();
+                continue;
+            }
+            this->state_changed.wait_for(lock, chrono::milliseconds(50));
+        }
+
+        HTTP2Response response = move(stream.response);
+        this->streams.erase(stream_id);
+        return response;
+    }
+
+    // Tells the server a stream got more or less urgent, with both the RFC 7540
+    // PRIORITY frame and RFC 9218's PRIORITY_UPDATE
+    void reprioritize(uint32_t stream_id, int urgency, bool incremental = false)
+    {
+        string priority;
+        http2_put_u32(priority, 0);
+        priority += (char)(weight_for(urgency) - 1);
+
+        string update;
+        http2_put_u32(update, stream_id);
+        update += priority_field(urgency, incremental);
+
+        send(http2_frame(HTTP2Frame::Priority, 0, stream_id, priority) + http2_frame(HTTP2Frame::PriorityUpdate, 0, 0, update));
+    }
+
+    // Whether new requests can still go out on it
+    bool is_usable() const
+    {
+        return !this->dead && !this->going_away && !this->closing;
+    }
+
+    // The server sent a GOAWAY but still answers the streams it took before it. The
+    // session closes itself once those are done, closing it now would fail them.
+    bool is_winding_down() const
+    {
+        return this->going_away && !this->dead && !this->closing;
+    }
+
+    bool is_idle_for(chrono::steady_clock::duration duration)
+    {
+        lock_guard<mutex> lock(this->state_mutex);
+        return this->active_streams == 0 && chrono::steady_clock::now() - this->idle_since > duration;
+    }
+
+    size_t get_active_streams()
+    {
+        lock_guard<mutex> lock(this->state_mutex);
+        return this->active_streams;
+    }
+
+    // Says goodbye. Streams still open fail; the socket is closed on the network
+    // thread once it has stopped watching it.
+    void close()
+    {
+        if(this->closing.exchange(true)) return;
+
+        if(!this->dead)
+        {
+            string payload;
+            http2_put_u32(payload, 0);
+            http2_put_u32(payload, HTTP2_NO_ERROR);
+            send(http2_frame(HTTP2Frame::GoAway, 0, 0, payload));
+        }
+        fail_all(false);
+
+        shared_ptr<HTTP2Connection> self = shared_from_this();
+        NetworkThread::instance().post([self] { self->tear_down(); });
+    }
+};
+
+#endif
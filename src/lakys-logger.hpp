@@ -0,0 +1,177 @@
+#pragma once
+
+#ifndef LAKYS_LOGGER_HPP
+#define LAKYS_LOGGER_HPP
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include "lakys-string-helper.hpp"
+
+using namespace std;
+
+enum class LogLevel : int
+{
+    Trace = 0,  // Per-tag / per-line chatter and raw payloads
+    Debug = 1,
+    Info = 2,
+    Warn = 3,
+    Error = 4,
+    Off = 5
+};
+
+enum class LogCategory : int
+{
+    Net,     // Sockets, DNS, TLS, connection pool
+    Http,    // Requests, responses, redirects
+    Cache,
+    Parser,  // Lexer and tag parsing
+    Layout,
+    File,
+    UI,
+    Count
+};
+
+// Calls below this level are compiled out completely, arguments and all.
+// Build with -DPUSZTA_LOG_MIN_LEVEL=0 to keep trace logging in a release build.
+#ifndef PUSZTA_LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define PUSZTA_LOG_MIN_LEVEL 2
+#else
+#define PUSZTA_LOG_MIN_LEVEL 0
+#endif
+#endif
+
+// Runtime side: a level per category, Info unless PUSZTA_LOG says otherwise, e.g.
+//   PUSZTA_LOG=debug              everything at debug
+//   PUSZTA_LOG=warn,http=trace    warnings only, but all of the HTTP traffic
+class Logger
+{
+private:
+    atomic<int> levels[(int)LogCategory::Count];
+    mutex write_mutex;
+
+    Logger()
+    {
+        set_level(LogLevel::Info);
+
+        const char* spec = getenv("PUSZTA_LOG");
+        if(spec) configure(spec);
+    }
+
+    static bool parse_level(const string& name, LogLevel& level)
+    {
+        static const char* names[] = { "trace", "debug", "info", "warn", "error", "off" };
+        for(int i = 0; i <= (int)LogLevel::Off; i++)
+        {
+            if(name == names[i])
+            {
+                level = (LogLevel)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    static Logger& instance()
+    {
+        static Logger logger;
+        return logger;
+    }
+
+    static const char* level_name(LogLevel level)
+    {
+        static const char* names[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "OFF" };
+        return names[(int)level];
+    }
+
+    static const char* category_name(LogCategory category)
+    {
+        static const char* names[] = { "net", "http", "cache", "parser", "layout", "file", "ui" };
+        return names[(int)category];
+    }
+
+    void set_level(LogLevel level)
+    {
+        for(auto& category_level : this->levels) category_level = (int)level;
+    }
+
+    void set_level(LogCategory category, LogLevel level)
+    {
+        this->levels[(int)category] = (int)level;
+    }
+
+    LogLevel get_level(LogCategory category) const
+    {
+        return (LogLevel)this->levels[(int)category].load(memory_order_relaxed);
+    }
+
+    // "level" or "category=level" entries separated by commas, unknown ones are ignored
+    void configure(const string& spec)
+    {
+        for(string entry : split(to_lowercase(spec), ","))
+        {
+            entry.erase(0, entry.find_first_not_of(" "));
+            entry.erase(entry.find_last_not_of(" ") + 1);
+
+            size_t equals = entry.find('=');
+            LogLevel level;
+
+            if(equals == string::npos)
+            {
+                if(parse_level(entry, level)) set_level(level);
+                continue;
+            }
+
+            string category = entry.substr(0, equals);
+            if(!parse_level(entry.substr(equals + 1), level)) continue;
+
+            for(int i = 0; i < (int)LogCategory::Count; i++)
+            {
+                if(category == category_name((LogCategory)i)) set_level((LogCategory)i, level);
+            }
+        }
+    }
+
+    bool enabled(LogLevel level, LogCategory category) const
+    {
+        return (int)level >= this->levels[(int)category].load(memory_order_relaxed);
+    }
+
+    // One line per call, warnings and errors to stderr. No endl: the streams are
+    // only flushed when they want to be (stderr is unbuffered anyway).
+    void write(LogLevel level, LogCategory category, const string& message)
+    {
+        lock_guard<mutex> lock(this->write_mutex);
+        ostream& out = level >= LogLevel::Warn ? cerr : cout;
+        out << "[" << level_name(level) << "][" << category_name(category) << "] " << message << '\n';
+    }
+};
+
+// LOG_DEBUG(LogCategory::Http, "Status " << status) - the message is only built
+// when the level is enabled, and not compiled at all below PUSZTA_LOG_MIN_LEVEL.
+#define PUSZTA_LOG(level, category, message)                                              \
+    do                                                                                    \
+    {                                                                                     \
+        if constexpr((int)(level) >= PUSZTA_LOG_MIN_LEVEL)                                \
+        {                                                                                 \
+            if(Logger::instance().enabled((level), (category)))                           \
+            {                                                                             \
+                ostringstream puszta_log_stream;                                          \
+                puszta_log_stream << message;                                             \
+                Logger::instance().write((level), (category), puszta_log_stream.str());   \
+            }                                                                             \
+        }                                                                                 \
+    } while(0)
+
+#define LOG_TRACE(category, message) PUSZTA_LOG(LogLevel::Trace, category, message)
+#define LOG_DEBUG(category, message) PUSZTA_LOG(LogLevel::Debug, category, message)
+#define LOG_INFO(category, message)  PUSZTA_LOG(LogLevel::Info, category, message)
+#define LOG_WARN(category, message)  PUSZTA_LOG(LogLevel::Warn, category, message)
+#define LOG_ERROR(category, message) PUSZTA_LOG(LogLevel::Error, category, message)
+
+#endif
@@ -0,0 +1,291 @@
+#pragma once
+
+#ifndef LAKYS_NETWORK_THREAD_HPP
+#define LAKYS_NETWORK_THREAD_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <functional>
+#include <cstdlib>
+#include "lakys-logger.hpp"
+#include "socket/EventLoop.hpp"
+
+using namespace std;
+
+// The one thread that waits on sockets for everyone. Non-blocking connections
+// (FetchEngine's, HTTP/2 sessions) register a callback for their socket and get
+// called when it's ready, so any number of them share this thread instead of
+// each blocking one of their own.
+//
+// Everything but post(), run() and resolve() must be called on this thread,
+// which is where every callback runs too. Callbacks shouldn't block.
+//
+// The backend comes from PUSZTA_EVENT_LOOP ("epoll", "io_uring" or "poll"),
+// epoll by default on Linux and poll elsewhere.
+class NetworkThread
+{
+private:
+    unique_ptr<EventLoop> loop;
+    thread worker;
+    thread::id worker_id;
+
+    mutex task_mutex;
+    vector<function<void()>> tasks;
+    atomic<bool> stopping{ false };
+    bool started = false;
+
+    struct Timer
+    {
+        chrono::steady_clock::time_point due;
+        function<void()> callback;
+    };
+    map<uint64_t, Timer> timers;
+    multimap<chrono::steady_clock::time_point, uint64_t> timer_queue;
+    uint64_t next_timer = 1;
+
+    // getaddrinfo() only comes blocking, so lookups get a thread of their own
+    thread resolver;
+    mutex resolve_mutex;
+    condition_variable resolve_ready;
+    deque<function<void()>> lookups;
+
+    NetworkThread() {}
+
+    ~NetworkThread()
+    {
+        stop();
+    }
+
+    void start_locked()
+    {
+        if(this->started) return;
+        this->started = true;
+
+        const char* preferred = getenv("PUSZTA_EVENT_LOOP");
+        this->loop = EventLoop::create(preferred ? preferred : "");
+        if(!this->loop)
+        {
+            LOG_ERROR(LogCategory::Net, "Could not set up the network event loop");
+            this->stopping = true;
+            return;
+        }
+        LOG_INFO(LogCategory::Net, "Network thread using " << this->loop->name());
+
+        this->worker = thread(&NetworkThread::run_loop, this);
+        this->worker_id = this->worker.get_id();
+        this->resolver = thread(&NetworkThread::run_resolver, this);
+    }
+
+    int next_timeout_ms()
+    {
+        if(this->timer_queue.empty()) return -1;
+
+        auto wait = this->timer_queue.begin()->first - chrono::steady_clock::now();
+        long long ms = chrono::duration_cast<chrono::milliseconds>(wait).count() + 1;
+        return (int)max(0LL, min(ms, 60000LL));
+    }
+
+    void run_tasks()
+    {
+        vector<function<void()>> ready;
+        {
+            lock_guard<mutex> lock(this->task_mutex);
+            ready.swap(this->tasks);
+        }
+        for(function<void()>& task : ready)
+        {
+            task();
+        }
+    }
+
+    void run_timers()
+    {
+        auto now = chrono::steady_clock::now();
+        while(!this->timer_queue.empty() && this->timer_queue.begin()->first <= now)
+        {
+            uint64_t id = this->timer_queue.begin()->second;
+            this->timer_queue.erase(this->timer_queue.begin());
+
+            auto found = this->timers.find(id);
+            if(found == this->timers.end()) continue;
+            function<void()> callback = move(found->second.callback);
+            this->timers.erase(found);
+            callback();
+        }
+    }
+
+    void run_loop()
+    {
+        while(!this->stopping)
+        {
+            if(this->loop->poll(next_timeout_ms()) < 0)
+            {
+                LOG_ERROR(LogCategory::Net, "Waiting on sockets failed");
+                this_thread::sleep_for(chrono::milliseconds(10));
+            }
+            run_tasks();
+            run_timers();
+        }
+
+        // Whatever was handed over last still gets to run, e.g. closing sockets
+        run_tasks();
+    }
+
+    void run_resolver()
+    {
+        unique_lock<mutex> lock(this->resolve_mutex);
+        while(true)
+        {
+            this->resolve_ready.wait(lock, [&] { return this->stopping || !this->lookups.empty(); });
+            if(this->stopping) return;
+
+            function<void()> lookup = move(this->lookups.front());
+            this->lookups.pop_front();
+            lock.unlock();
+            lookup();
+            lock.lock();
+        }
+    }
+
+public:
+    static NetworkThread& instance()
+    {
+        static NetworkThread network;
+        return network;
+    }
+
+    // Runs the task on the network thread, soon. Safe from any thread. Returns
+    // false (and drops the task) once the thread has stopped.
+    bool post(function<void()> task)
+    {
+        lock_guard<mutex> lock(this->task_mutex);
+        start_locked();
+        if(this->stopping) return false;
+
+        this->tasks.push_back(move(task));
+        this->loop->wake();
+        return true;
+    }
+
+    // Runs the task on the network thread and waits for it, or runs it right away
+    // when already there. Don't hold locks the network thread's callbacks take.
+    void run(function<void()> task)
+    {
+        if(is_network_thread())
+        {
+            task();
+            return;
+        }
+
+        auto done = make_shared<promise<void>>();
+        future<void> finished = done->get_future();
+        bool posted = post([task, done] {
+            task();
+            done->set_value();
+        });
+
+        // Whatever was posted before stop() still runs, see run_loop()
+        if(posted) finished.wait();
+    }
+
+    bool is_network_thread()
+    {
+        lock_guard<mutex> lock(this->task_mutex);
+        return this_thread::get_id() == this->worker_id;
+    }
+
+    const char* get_backend()
+    {
+        lock_guard<mutex> lock(this->task_mutex);
+        start_locked();
+        return this->loop ? this->loop->name() : "none";
+    }
+
+    // Network thread only from here on
+
+    bool watch(SOCKET socket, int events, EventLoop::Callback callback)
+    {
+        return this->loop->watch(socket, events, move(callback));
+    }
+
+    void modify(SOCKET socket, int events)
+    {
+        this->loop->modify(socket, events);
+    }
+
+    void unwatch(SOCKET socket)
+    {
+        this->loop->unwatch(socket);
+    }
+
+    // Calls back once, after ms milliseconds. Returns an id for cancel_timer().
+    uint64_t add_timer(int ms, function<void()> callback)
+    {
+        uint64_t id = this->next_timer++;
+        auto due = chrono::steady_clock::now() + chrono::milliseconds(ms);
+        this->timers[id] = { due, move(callback) };
+        this->timer_queue.insert({ due, id });
+        return id;
+    }
+
+    void cancel_timer(uint64_t id)
+    {
+        auto found = this->timers.find(id);
+        if(found == this->timers.end()) return;
+
+        auto range = this->timer_queue.equal_range(found->second.due);
+        for(auto it = range.first; it != range.second; ++it)
+        {
+            if(it->second == id)
+            {
+                this->timer_queue.erase(it);
+                break;
+            }
+        }
+        this->timers.erase(found);
+    }
+
+    // Runs a blocking lookup (or anything else that has to block) on the resolver
+    // thread, then hands the result back on the network thread
+    template<typename Result>
+    void resolve(function<Result()> lookup, function<void(Result&)> done)
+    {
+        lock_guard<mutex> lock(this->resolve_mutex);
+        if(this->stopping) return;
+
+        this->lookups.push_back([this, lookup, done] {
+            auto result = make_shared<Result>(lookup());
+            post([done, result] { done(*result); });
+        });
+        this->resolve_ready.notify_one();
+    }
+
+    // Stops both threads. Sockets still watched aren't closed, their owners do that.
+    void stop()
+    {
+        {
+            lock_guard<mutex> lock(this->task_mutex);
+            if(!this->started || this->stopping) return;
+            this->stopping = true;
+            this->loop->wake();
+        }
+        {
+            lock_guard<mutex> lock(this->resolve_mutex);
+            this->resolve_ready.notify_all();
+        }
+
+        if(this->worker.joinable()) this->worker.join();
+        if(this->resolver.joinable()) this->resolver.join();
+    }
+};
+
+#endif
@@ -0,0 +1,120 @@
+#pragma once
+
+#ifndef LAKYS_NETWORK_TIMING_HPP
+#define LAKYS_NETWORK_TIMING_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <chrono>
+
+using namespace std;
+
+// Where the time went for one request (one hop of a redirect chain). Phase
+// durations are -1 when the phase didn't happen, e.g. no DNS/connect/TLS on a
+// reused connection and nothing at all for a cache hit.
+struct RequestTiming
+{
+    string url;
+    int status = 0;
+
+    double start_ms = 0;       // When the request started, on NetworkLog's clock
+    double dns_ms = -1;
+    double connect_ms = -1;
+    double tls_ms = -1;        // performSSLHandshake()
+    double ttfb_ms = -1;       // Request sent -> first response byte (server time + one round trip)
+    double download_ms = -1;   // First byte -> response complete
+    double total_ms = 0;
+
+    size_t bytes_received = 0; // Off the wire, headers included, before decoding
+    int redirect_hop = 0;      // 0 for the URL asked for, n for the nth redirect
+
+    bool reused_connection = false;
+    bool tls_resumed = false;
+    bool fast_open = false;    // Our first bytes went out in the SYN (TCP Fast Open)
+    bool early_data = false;   // The request went out with the TLS handshake (0-RTT)
+    bool from_cache = false;
+    bool from_archive = false; // Replayed from a saved page, see ArchiveReplay
+    bool hedged = false;       // Sent a second time on another connection, see RequestTimeouts
+    bool timed_out = false;
+
+    double end_ms() const
+    {
+        return this->start_ms + this->total_ms;
+    }
+};
+
+// Recent request timings from every thread, for the network panel
+class NetworkLog
+{
+private:
+    mutable mutex log_mutex;
+    deque<RequestTiming> entries;
+    size_t max_entries = 500;
+
+    chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+    double navigation_start = 0;
+
+    NetworkLog() {}
+
+public:
+    static NetworkLog& instance()
+    {
+        static NetworkLog log;
+        return log;
+    }
+
+    // Milliseconds on the log's clock
+    double to_ms(chrono::steady_clock::time_point time) const
+    {
+        return chrono::duration<double, milli>(time - this->epoch).count();
+    }
+
+    double now_ms() const
+    {
+        return to_ms(chrono::steady_clock::now());
+    }
+
+    void add(const RequestTiming& timing)
+    {
+        lock_guard<mutex> lock(this->log_mutex);
+        this->entries.push_back(timing);
+        while(this->entries.size() > this->max_entries)
+        {
+            this->entries.pop_front();
+        }
+    }
+
+    // Marks the start of a page load, the panel shows what came after it
+    void begin_navigation()
+    {
+        lock_guard<mutex> lock(this->log_mutex);
+        this->navigation_start = now_ms();
+    }
+
+    double get_navigation_start() const
+    {
+        lock_guard<mutex> lock(this->log_mutex);
+        return this->navigation_start;
+    }
+
+    vector<RequestTiming> since(double start_ms) const
+    {
+        lock_guard<mutex> lock(this->log_mutex);
+        vector<RequestTiming> out;
+        for(const RequestTiming& timing : this->entries)
+        {
+            if(timing.start_ms >= start_ms) out.push_back(timing);
+        }
+        return out;
+    }
+
+    void clear()
+    {
+        lock_guard<mutex> lock(this->log_mutex);
+        this->entries.clear();
+    }
+};
+
+#endif
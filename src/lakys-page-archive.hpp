@@ -0,0 +1,241 @@
+#pragma once
+
+#ifndef LAKYS_PAGE_ARCHIVE_HPP
+#define LAKYS_PAGE_ARCHIVE_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <algorithm>
+#include "lakys-file-loader.hpp"
+#include "lakys-logger.hpp"
+
+using namespace std;
+
+// A saved page in one file: the document plus its subresources, each with the
+// response headers it came with. The index at the top says where every response
+// is, so a reader only has to map the file and look them up.
+//
+//   PUSZTA-ARCHIVE 1
+//   <entry count>
+//   <offset> <header bytes> <body bytes> <url>     one line per entry, page first
+//   <blank line>
+//   <headers><body><headers><body>...               offsets count from here
+struct ArchivedResponse
+{
+    string url;
+    string headers;     // Status line and fields, without the blank line
+    string_view body;   // Decoded
+};
+
+static const char* ARCHIVE_MAGIC = "PUSZTA-ARCHIVE 1";
+
+inline bool is_archive_path(const string& path)
+{
+    static const string extension = ".puszta";
+    return path.size() > extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+// The archive file's contents, ready for save_to_file()
+inline string build_archive(const vector<ArchivedResponse>& responses)
+{
+    ostringstream index;
+    index << ARCHIVE_MAGIC << "\n" << responses.size() << "\n";
+
+    size_t offset = 0;
+    for(const ArchivedResponse& response : responses)
+    {
+        index << offset << " " << response.headers.size() << " " << response.body.size() << " " << response.url << "\n";
+        offset += response.headers.size() + response.body.size();
+    }
+    index << "\n";
+
+    string archive = index.str();
+    archive.reserve(archive.size() + offset);
+    for(const ArchivedResponse& response : responses)
+    {
+        archive += response.headers;
+        archive.append(response.body.data(), response.body.size());
+    }
+    return archive;
+}
+
+// Reads an archive in place: it stays mapped, and lookups hand out views into it
+class PageArchive
+{
+private:
+    struct Entry
+    {
+        string_view headers;
+        string_view body;
+    };
+
+    FileView file;
+    string page_url;
+    unordered_map<string, Entry> entries;
+
+    bool parse()
+    {
+        string_view data = this->file.view();
+        size_t pos = 0;
+
+        auto next_line = [&](string_view& line) {
+            size_t end = data.find('\n', pos);
+            if(end == string_view::npos) return false;
+            line = data.substr(pos, end - pos);
+            pos = end + 1;
+            return true;
+        };
+
+        string_view line;
+        if(!next_line(line) || line != ARCHIVE_MAGIC) return false;
+        if(!next_line(line)) return false;
+
+        size_t count = 0;
+        istringstream(string(line)) >> count;
+
+        struct IndexLine { size_t offset, header_size, body_size; string url; };
+        vector<IndexLine> index;
+        index.reserve(count);
+
+        for(size_t i = 0; i < count; i++)
+        {
+            if(!next_line(line)) return false;
+
+            IndexLine entry;
+            istringstream fields{ string(line) };
+            fields >> entry.offset >> entry.header_size >> entry.body_size;
+            fields.get(); // The space before the URL
+            getline(fields, entry.url);
+            if(fields.fail() || entry.url.empty()) return false;
+            index.push_back(move(entry));
+        }
+
+        if(!next_line(line) || !line.empty()) return false;
+
+        string_view blob = data.substr(pos);
+        for(const IndexLine& entry : index)
+        {
+            if(entry.offset > blob.size() || entry.header_size + entry.body_size > blob.size() - entry.offset) return false;
+
+            Entry located;
+            located.headers = blob.substr(entry.offset, entry.header_size);
+            located.body = blob.substr(entry.offset + entry.header_size, entry.body_size);
+            this->entries.emplace(entry.url, located);
+        }
+
+        this->page_url = index.empty() ? "" : index[0].url;
+        return !index.empty();
+    }
+
+public:
+    // Takes a filesystem path. Returns false if it isn't a readable archive.
+    bool open(const string& path)
+    {
+        this->entries.clear();
+        this->page_url.clear();
+
+        if(!this->file.open(path)) return false;
+
+        if(!parse())
+        {
+            LOG_ERROR(LogCategory::File, "Not a valid page archive: " << path);
+            this->entries.clear();
+            this->file.close();
+            return false;
+        }
+
+        LOG_INFO(LogCategory::File, "Opened archive " << path << " (" << this->entries.size() << " responses, " << this->file.size() << " bytes)");
+        return true;
+    }
+
+    // The saved page's URL, what to navigate to after opening it
+    const string& get_page_url() const
+    {
+        return this->page_url;
+    }
+
+    bool contains(const string& url) const
+    {
+        return this->entries.count(url) > 0;
+    }
+
+    // Views stay valid as long as the archive is open
+    bool find(const string& url, string_view& headers, string_view& body) const
+    {
+        auto found = this->entries.find(url);
+        if(found == this->entries.end()) return false;
+
+        headers = found->second.headers;
+        body = found->second.body;
+        return true;
+    }
+
+    size_t size() const
+    {
+        return this->entries.size();
+    }
+
+    vector<string> urls() const
+    {
+        vector<string> out;
+        out.reserve(this->entries.size());
+        for(const auto& entry : this->entries) out.push_back(entry.first);
+        return out;
+    }
+};
+
+// The archive requests are currently answered from. While one is mounted the
+// browser is offline: HTTP serves everything from it, and whatever isn't in it
+// fails instead of going to the network, so replays are reproducible.
+class ArchiveReplay
+{
+private:
+    mutable mutex replay_mutex;
+    shared_ptr<const PageArchive> archive;
+    string path;
+
+    ArchiveReplay() {}
+
+public:
+    static ArchiveReplay& instance()
+    {
+        static ArchiveReplay replay;
+        return replay;
+    }
+
+    bool mount(const string& archive_path)
+    {
+        auto opened = make_shared<PageArchive>();
+        if(!opened->open(archive_path)) return false;
+
+        lock_guard<mutex> lock(this->replay_mutex);
+        this->archive = opened;
+        this->path = archive_path;
+        return true;
+    }
+
+    void unmount()
+    {
+        lock_guard<mutex> lock(this->replay_mutex);
+        if(this->archive)
+        {
+            LOG_INFO(LogCategory::File, "Leaving archive " << this->path);
+        }
+        this->archive.reset();
+        this->path.clear();
+    }
+
+    // Hold on to the result while using views from it, a new mount won't pull it away
+    shared_ptr<const PageArchive> get() const
+    {
+        lock_guard<mutex> lock(this->replay_mutex);
+        return this->archive;
+    }
+};
+
+#endif
@@ -0,0 +1,149 @@
+#pragma once
+
+#ifndef LAKYS_PAGE_CACHE_HPP
+#define LAKYS_PAGE_CACHE_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include "PusztaParser.hpp"
+#include "lakys-subresource.hpp"
+#include "lakys-logger.hpp"
+
+using namespace std;
+
+// A page as it was on screen when we navigated away from it
+struct CachedPage
+{
+    string url;
+    vector<Token> tokens;
+    string title;
+    map<string, PageResource> resources;
+    string content;            // The document's source (or text, if it isn't parsed)
+    string headers;            // The document's response headers
+    bool should_parse = false;
+    float scroll_y = 0.0f;     // cursor_y
+
+    size_t bytes = 0;          // Estimated, set by the cache
+};
+
+// Lexed pages from the history, so going back or forward puts them on screen
+// straight away without touching the network. Least recently left pages are
+// dropped first once the memory budget is used up. Render thread only.
+class BackForwardCache
+{
+private:
+    list<CachedPage> entries; // Most recently stored first
+    size_t used = 0;
+    size_t budget;
+
+    static size_t estimate_size(const CachedPage& page)
+    {
+        size_t bytes = sizeof(CachedPage) + page.url.capacity() + page.title.capacity() + page.content.capacity() + page.headers.capacity();
+        bytes += page.tokens.capacity() * sizeof(Token);
+
+        for(const Token& token : page.tokens)
+        {
+            bytes += visit([](const auto& value) { return value.memory_usage(); }, token);
+        }
+
+        for(const auto& resource : page.resources)
+        {
+            const PageResource& fetched = resource.second;
+            bytes += 64 + resource.first.capacity() + fetched.url.capacity() + fetched.content_type.capacity() + fetched.headers.capacity() + fetched.data.capacity();
+        }
+
+        return bytes;
+    }
+
+    void evict_to(size_t limit)
+    {
+        while(this->used > limit && !this->entries.empty())
+        {
+            LOG_DEBUG(LogCategory::Cache, "Back/forward cache dropping " << this->entries.back().url);
+            this->used -= this->entries.back().bytes;
+            this->entries.pop_back();
+        }
+    }
+
+    list<CachedPage>::iterator find(const string& url)
+    {
+        for(auto it = this->entries.begin(); it != this->entries.end(); ++it)
+        {
+            if(it->url == url) return it;
+        }
+        return this->entries.end();
+    }
+
+public:
+    explicit BackForwardCache(size_t budget_bytes = 64 * 1024 * 1024) : budget(budget_bytes) {}
+
+    void set_budget(size_t budget_bytes)
+    {
+        this->budget = budget_bytes;
+        evict_to(this->budget);
+    }
+
+    size_t get_budget() const
+    {
+        return this->budget;
+    }
+
+    size_t get_used() const
+    {
+        return this->used;
+    }
+
+    size_t size() const
+    {
+        return this->entries.size();
+    }
+
+    // Keeps the page, replacing an older copy of the same URL. Pages bigger than
+    // the whole budget aren't kept at all.
+    void store(CachedPage page)
+    {
+        remove(page.url);
+
+        page.bytes = estimate_size(page);
+        if(page.bytes > this->budget)
+        {
+            LOG_DEBUG(LogCategory::Cache, "Page too big for the back/forward cache: " << page.url << " (" << page.bytes << " bytes)");
+            return;
+        }
+
+        evict_to(this->budget - page.bytes);
+        this->used += page.bytes;
+        this->entries.push_front(move(page));
+    }
+
+    // Moves the page out of the cache, it goes back in when it's left again
+    bool take(const string& url, CachedPage& out)
+    {
+        auto it = find(url);
+        if(it == this->entries.end()) return false;
+
+        this->used -= it->bytes;
+        out = move(*it);
+        this->entries.erase(it);
+        return true;
+    }
+
+    void remove(const string& url)
+    {
+        auto it = find(url);
+        if(it == this->entries.end()) return;
+
+        this->used -= it->bytes;
+        this->entries.erase(it);
+    }
+
+    void clear()
+    {
+        this->entries.clear();
+        this->used = 0;
+    }
+};
+
+#endif
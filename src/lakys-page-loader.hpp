@@ -0,0 +1,305 @@
+#pragma once
+
+#ifndef LAKYS_PAGE_LOADER_HPP
+#define LAKYS_PAGE_LOADER_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include "lakys-socket-handler.hpp"
+#include "PusztaParser.hpp"
+#include "lakys-subresource-fetcher.hpp"
+
+using namespace std;
+
+// Everything the render thread needs to show a loaded page
+struct PageResult
+{
+    string url;          // Final URL, after redirects
+    string content;      // Body, or an error message to show instead
+    string headers;      // Response headers, "" for local files
+    vector<Token> tokens;
+    string title;
+    bool should_parse = false;
+    bool reload = false;
+    bool invalid_url = false;
+    int download = -1;   // The navigation turned out to be a file: its DownloadManager id
+};
+
+// Loads pages on a worker thread so the window keeps drawing. Only the latest
+// navigation counts: starting a new one cancels the previous, and its result
+// is thrown away even if it finishes first. With a fetcher attached, the page's
+// subresources are queued on it while the page is being lexed. Files that aren't
+// pages go to the DownloadManager instead of being read in here.
+class PageLoader
+{
+public:
+    enum class Stage
+    {
+        Idle,
+        Requesting,  // DNS, connect, TLS, waiting for the response
+        Parsing,
+        Done
+    };
+
+private:
+    struct Job
+    {
+        string url;
+        bool reload = false;
+
+        SubresourceFetcher* fetcher = nullptr;
+        int generation = 0;
+
+        atomic<Stage> stage{Stage::Requesting};
+        TransferProgress progress;
+        atomic<bool> finished{false};
+
+        mutex result_mutex;
+        PageResult result;
+    };
+
+    shared_ptr<Job> current;
+    bool delivered = true;
+
+    SubresourceFetcher* fetcher = nullptr;
+
+    // Cancelled jobs still running, joined once they notice
+    vector<pair<shared_ptr<Job>, thread>> workers;
+
+    static void run(shared_ptr<Job> job)
+    {
+        PageResult result;
+        result.reload = job->reload;
+
+        try
+        {
+            HTTP http;
+            http.set(job->url);
+            http.set_revalidate(job->reload);
+            http.set_progress(&job->progress);
+
+            // Local pages are lexed straight out of the mapped file, only text
+            // that's shown as it is gets copied
+            FileView file;
+            string_view source;
+
+            // Opening a saved page switches to replaying it, leaving it goes back online
+            shared_ptr<const PageArchive> archive = ArchiveReplay::instance().get();
+            if(http.is_local() && is_archive_path(http.get_local_path()))
+            {
+                if(ArchiveReplay::instance().mount(http.get_local_path()))
+                {
+                    archive = ArchiveReplay::instance().get();
+                    http.set(archive->get_page_url());
+                }
+            }
+            else if(archive && !archive->contains(http.get_url()))
+            {
+                ArchiveReplay::instance().unmount();
+            }
+
+            if(http.is_local())
+            {
+                result.url = http.get_url();
+                if(http.open_local(file))
+                {
+                    result.should_parse = http.local_is_html(file);
+                    if(result.should_parse)
+                    {
+                        source = file.view();
+                    }
+                    else
+                    {
+                        result.content = string(file.view());
+                    }
+                }
+                else
+                {
+                    result.content = "Could not open " + result.url;
+                }
+            }
+            else
+            {
+                http.set_download_handoff(true);
+                result.content = http.request();
+                result.url = http.get_url();
+                result.headers = http.get_response_headers();
+                result.should_parse = http.should_parse;
+
+                if(http.is_download() && !job->progress.cancelled)
+                {
+                    result.download = DownloadManager::instance().start(result.url, result.headers);
+                    if(result.download < 0) result.content = "Could not download " + result.url;
+                }
+            }
+
+            if(!job->progress.cancelled && result.download < 0)
+            {
+                if(result.content.empty() && source.empty())
+                {
+                    result.content = "Failed to load content after redirect. The website may not have sent any data, or there was a parsing error.";
+                }
+                if(source.empty())
+                {
+                    source = result.content;
+                }
+
+                job->stage = Stage::Parsing;
+                result.title = "New Page";
+
+                function<void(const Subresource&)> on_subresource;
+                if(job->fetcher && result.should_parse)
+                {
+                    string base = result.url;
+                    on_subresource = [&job, base](const Subresource& subresource)
+                    {
+                        job->fetcher->fetch(job->generation, resolve_url(base, subresource.url), subresource.kind, subresource.token);
+                    };
+                }
+
+                result.tokens = Layout::tokenize(source, result.title, on_subresource);
+            }
+        }
+        catch (...)
+        {
+            LOG_ERROR(LogCategory::UI, "Invalid URL: " << job->url);
+            result.url = job->url;
+            result.invalid_url = true;
+        }
+
+        {
+            lock_guard<mutex> lock(job->result_mutex);
+            job->result = move(result);
+        }
+        job->stage = Stage::Done;
+        job->finished = true;
+    }
+
+    void join_finished()
+    {
+        for(auto it = this->workers.begin(); it != this->workers.end(); )
+        {
+            if(it->first->finished)
+            {
+                it->second.join();
+                it = this->workers.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+public:
+    PageLoader() = default;
+    PageLoader(const PageLoader&) = delete;
+    PageLoader& operator=(const PageLoader&) = delete;
+
+    ~PageLoader()
+    {
+        shutdown();
+    }
+
+    // Where discovered subresources get queued; must outlive the loader's threads
+    void set_fetcher(SubresourceFetcher* fetcher)
+    {
+        this->fetcher = fetcher;
+    }
+
+    // Starts loading url in the background, cancelling whatever was loading before
+    void load(const string& url, bool reload = false)
+    {
+        cancel();
+        NetworkLog::instance().begin_navigation();
+
+        auto job = make_shared<Job>();
+        job->url = url;
+        job->reload = reload;
+
+        // The page on screen gives up its subresources along with it
+        if(this->fetcher)
+        {
+            job->fetcher = this->fetcher;
+            job->generation = this->fetcher->begin_page();
+        }
+
+        this->current = job;
+        this->delivered = false;
+        this->workers.emplace_back(job, thread(run, job));
+    }
+
+    void cancel()
+    {
+        if(this->current && !this->delivered)
+        {
+            this->current->progress.cancelled = true;
+            if(this->fetcher) this->fetcher->cancel_all();
+        }
+        this->current.reset();
+        this->delivered = true;
+    }
+
+    // Call once per frame from the render thread. Returns true (once) when the
+    // current navigation has finished, with its result moved into out.
+    bool poll(PageResult& out)
+    {
+        join_finished();
+
+        if(!this->current || this->delivered || !this->current->finished)
+        {
+            return false;
+        }
+
+        {
+            lock_guard<mutex> lock(this->current->result_mutex);
+            out = move(this->current->result);
+        }
+        this->delivered = true;
+        return true;
+    }
+
+    bool is_loading() const
+    {
+        return this->current && !this->delivered;
+    }
+
+    Stage get_stage() const
+    {
+        return is_loading() ? this->current->stage.load() : Stage::Idle;
+    }
+
+    string get_url() const
+    {
+        return is_loading() ? this->current->url : "";
+    }
+
+    // Bytes received so far and the expected total (-1 if the server didn't say)
+    size_t get_received() const
+    {
+        return is_loading() ? this->current->progress.received.load() : 0;
+    }
+
+    long long get_expected() const
+    {
+        return is_loading() ? this->current->progress.expected.load() : -1;
+    }
+
+    // Cancels everything and waits for the workers to wind down
+    void shutdown()
+    {
+        cancel();
+        for(auto& worker : this->workers)
+        {
+            worker.first->progress.cancelled = true;
+            worker.second.join();
+        }
+        this->workers.clear();
+    }
+};
+
+#endif
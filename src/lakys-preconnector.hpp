@@ -0,0 +1,216 @@
+#pragma once
+
+#ifndef LAKYS_PRECONNECTOR_HPP
+#define LAKYS_PRECONNECTOR_HPP
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cctype>
+#include "lakys-string-helper.hpp"
+#include "lakys-logger.hpp"
+#include "lakys-connection-pool.hpp"
+#include "lakys-hsts.hpp"
+
+using namespace std;
+
+// Warms up a connection to the host being typed into the URL bar, so by the time
+// Enter is pressed the DNS lookup and TCP (+TLS) handshake are already done and
+// the request picks the connection up from the pool.
+//
+// A host counts as typed once a '/' follows it, or once it has a port or looks
+// like a full name (localhost, an IPv4 address, or a dotted name ending in a
+// plausible TLD) and the user has stopped typing for a moment.
+class Preconnector
+{
+private:
+    struct Origin
+    {
+        string scheme;  // "http" or "https", what the pool is keyed by
+        string host;
+        int port = 0;
+        bool certain = false; // Followed by '/', no need to wait
+
+        bool operator==(const Origin& other) const
+        {
+            return this->scheme == other.scheme && this->host == other.host && this->port == other.port;
+        }
+    };
+
+    mutex hint_mutex;
+    condition_variable hinted;
+
+    Origin pending;
+    bool has_pending = false;
+    chrono::steady_clock::time_point hint_time;
+
+    Origin last_warmed;
+    chrono::steady_clock::time_point last_warmed_time;
+
+    int debounce_ms = 300;
+    int connect_timeout_ms = 5000;
+
+    thread worker;
+    bool stopping = false;
+
+    static bool looks_complete(const string& host)
+    {
+        if(host == "localhost") return true;
+
+        vector<string> labels = split(host, ".");
+        if(labels.size() < 2) return false;
+        for(const string& label : labels)
+        {
+            if(label.empty()) return false;
+        }
+
+        // 1.2.3.4
+        bool numeric = true;
+        for(const string& label : labels)
+        {
+            if(label.find_first_not_of("0123456789") != string::npos) numeric = false;
+        }
+        if(numeric) return labels.size() == 4;
+
+        const string& tld = labels.back();
+        if(tld.size() < 2) return false;
+        for(char c : tld)
+        {
+            if(!isalpha((unsigned char)c)) return false;
+        }
+        return true;
+    }
+
+    // Same split as HTTP::set(), so the pool key matches the real request's
+    static bool parse(const string& text, Origin& origin)
+    {
+        string rest = text;
+        if(rest.rfind("view-source:", 0) == 0) rest = rest.substr(12);
+
+        size_t scheme_end = rest.find("://");
+        if(scheme_end == string::npos) return false;
+
+        origin.scheme = rest.substr(0, scheme_end);
+        if(origin.scheme == "http") origin.port = 80;
+        else if(origin.scheme == "https") origin.port = 443;
+        else return false;
+
+        // Only a '/' says the authority is finished, "host:80" may still become "host:8080"
+        rest = rest.substr(scheme_end + 3);
+        size_t host_end = rest.find('/');
+        origin.certain = host_end != string::npos;
+        string authority = rest.substr(0, host_end);
+
+        size_t colon = authority.find(':');
+        origin.host = authority.substr(0, colon);
+        if(colon != string::npos)
+        {
+            string port = authority.substr(colon + 1);
+            if(port.empty() || port.size() > 5 || port.find_first_not_of("0123456789") != string::npos) return false;
+            origin.port = stoi(port);
+            if(origin.port <= 0 || origin.port > 65535) return false;
+        }
+
+        if(origin.host.empty() || origin.host.find_first_of(" @?#") != string::npos) return false;
+
+        // An explicit port means the host name is done
+        return origin.certain || colon != string::npos || looks_complete(origin.host);
+    }
+
+    void work()
+    {
+        unique_lock<mutex> lock(this->hint_mutex);
+
+        while(true)
+        {
+            this->hinted.wait(lock, [&] { return this->stopping || this->has_pending; });
+            if(this->stopping) return;
+
+            // Wait for the typing to settle, a newer hint restarts the wait
+            if(!this->pending.certain)
+            {
+                auto ready = this->hint_time + chrono::milliseconds(this->debounce_ms);
+                if(chrono::steady_clock::now() < ready)
+                {
+                    this->hinted.wait_until(lock, ready);
+                    continue;
+                }
+            }
+
+            Origin origin = this->pending;
+            this->has_pending = false;
+
+            // Already warm, or warmed recently enough for the pool to still have it
+            if(origin == this->last_warmed && chrono::steady_clock::now() - this->last_warmed_time < chrono::seconds(10))
+            {
+                continue;
+            }
+            this->last_warmed = origin;
+            this->last_warmed_time = chrono::steady_clock::now();
+
+            lock.unlock();
+
+            // The request will be upgraded, warm up the connection it's going to use
+            if(origin.scheme == "http" && HSTSStore::instance().is_secure_only(origin.host))
+            {
+                origin.scheme = "https";
+                if(origin.port == 80) origin.port = 443;
+            }
+
+            LOG_DEBUG(LogCategory::Net, "Preconnecting to " << origin.scheme << "://" << origin.host << ":" << origin.port);
+            if(!ConnectionPool::instance().preconnect(origin.scheme, origin.host, origin.port, this->connect_timeout_ms))
+            {
+                LOG_DEBUG(LogCategory::Net, "No preconnect to " << origin.host << ", already connected or unreachable");
+            }
+            lock.lock();
+        }
+    }
+
+public:
+    Preconnector()
+    {
+        this->worker = thread(&Preconnector::work, this);
+    }
+
+    Preconnector(const Preconnector&) = delete;
+    Preconnector& operator=(const Preconnector&) = delete;
+
+    ~Preconnector()
+    {
+        shutdown();
+    }
+
+    // Call with the URL bar's text whenever it changes
+    void hint(const string& text)
+    {
+        Origin origin;
+        if(!parse(text, origin)) return;
+
+        lock_guard<mutex> lock(this->hint_mutex);
+        if(this->has_pending && origin == this->pending && !origin.certain) return;
+
+        this->pending = origin;
+        this->has_pending = true;
+        this->hint_time = chrono::steady_clock::now();
+        this->hinted.notify_one();
+    }
+
+    void shutdown()
+    {
+        {
+            lock_guard<mutex> lock(this->hint_mutex);
+            if(this->stopping) return;
+            this->stopping = true;
+        }
+        this->hinted.notify_all();
+
+        if(this->worker.joinable())
+        {
+            this->worker.join();
+        }
+    }
+};
+
+#endif
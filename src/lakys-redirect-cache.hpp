@@ -0,0 +1,202 @@
+#pragma once
+
+#ifndef LAKYS_REDIRECT_CACHE_HPP
+#define LAKYS_REDIRECT_CACHE_HPP
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include "lakys-http-cache.hpp"
+#include "lakys-file-loader.hpp"
+#include "lakys-logger.hpp"
+
+using namespace std;
+
+// 301 and 308 answers we've had, so the next navigation to the old URL goes
+// straight to the new one without a round trip to be told so again. They're
+// cacheable like any response (RFC 9110 15.4.2): an explicit max-age or Expires
+// is honoured, no-store isn't remembered, and without either they're kept for
+// a month before asking again.
+//
+// Kept in cache/redirects, one "<expires> <from> <to>" per line.
+class PermanentRedirects
+{
+private:
+    struct Redirect
+    {
+        string target;
+        time_t expires = 0;
+    };
+
+    unordered_map<string, Redirect> redirects; // Keyed by the full URL
+    size_t max_entries = 1024;
+
+    filesystem::path store_path = "cache/redirects";
+    bool loaded = false;
+
+    mutex redirect_mutex;
+
+    static const long long DEFAULT_LIFETIME = 30LL * 24 * 3600;
+
+    PermanentRedirects() {}
+
+    void load_locked()
+    {
+        if(this->loaded) return;
+        this->loaded = true;
+
+        ifstream store(this->store_path);
+        string line;
+        getline(store, line);
+        if(line != "PUSZTA-REDIRECTS 1") return;
+
+        time_t now = time(nullptr);
+        while(getline(store, line))
+        {
+            istringstream fields(line);
+            long long expires = 0;
+            string from, to;
+            if(!(fields >> expires >> from >> to) || (time_t)expires <= now) continue;
+            this->redirects[from] = { to, (time_t)expires };
+        }
+
+        LOG_DEBUG(LogCategory::Http, "Remembering " << this->redirects.size() << " permanent redirects");
+    }
+
+    void save_locked() const
+    {
+        if(this->store_path.empty()) return;
+
+        ostringstream out;
+        out << "PUSZTA-REDIRECTS 1\n";
+        for(const auto& entry : this->redirects)
+        {
+            out << (long long)entry.second.expires << " " << entry.first << " " << entry.second.target << "\n";
+        }
+
+        error_code error;
+        filesystem::create_directories(this->store_path.parent_path(), error);
+        save_to_file(this->store_path.string(), out.str());
+    }
+
+    // Makes room by dropping expired entries, then the ones expiring soonest
+    void trim_locked(time_t now)
+    {
+        for(auto it = this->redirects.begin(); it != this->redirects.end(); )
+        {
+            if(it->second.expires <= now) it = this->redirects.erase(it);
+            else ++it;
+        }
+
+        while(this->redirects.size() >= this->max_entries)
+        {
+            auto oldest = this->redirects.begin();
+            for(auto it = this->redirects.begin(); it != this->redirects.end(); ++it)
+            {
+                if(it->second.expires < oldest->second.expires) oldest = it;
+            }
+            this->redirects.erase(oldest);
+        }
+    }
+
+public:
+    static PermanentRedirects& instance()
+    {
+        static PermanentRedirects store;
+        return store;
+    }
+
+    // Where they're kept, "" to keep them in memory only
+    void set_store_path(const string& path)
+    {
+        lock_guard<mutex> lock(this->redirect_mutex);
+        this->store_path = path;
+        this->redirects.clear();
+        this->loaded = false;
+    }
+
+    // Where the URL permanently moved to, if we know and it hasn't expired
+    bool lookup(const string& url, string& target)
+    {
+        lock_guard<mutex> lock(this->redirect_mutex);
+        load_locked();
+
+        auto found = this->redirects.find(url);
+        if(found == this->redirects.end()) return false;
+
+        if(found->second.expires <= time(nullptr))
+        {
+            this->redirects.erase(found);
+            return false;
+        }
+
+        target = found->second.target;
+        return true;
+    }
+
+    // A 301 or 308 from the network. headers are the response's, target the resolved Location.
+    void remember(const string& url, const string& target, const string& headers, time_t request_time, time_t response_time)
+    {
+        // URLs with spaces would break the file, and aren't valid anyway
+        if(url == target || url.find_first_of(" \r\n") != string::npos || target.find_first_of(" \r\n") != string::npos) return;
+
+        CachedResponse response;
+        response.headers = headers;
+        response.request_time = request_time;
+        response.response_time = response_time;
+
+        map<string, string> directives = response.cache_control();
+        long long lifetime = DEFAULT_LIFETIME;
+        if(directives.count("no-store") || directives.count("no-cache"))
+        {
+            lifetime = 0;
+        }
+        else if(directives.count("max-age") || !response.header("Expires").empty())
+        {
+            lifetime = response.freshness_lifetime() - response.current_age(response_time);
+        }
+
+        lock_guard<mutex> lock(this->redirect_mutex);
+        load_locked();
+
+        if(lifetime <= 0)
+        {
+            if(this->redirects.erase(url)) save_locked();
+            return;
+        }
+
+        trim_locked(response_time);
+        this->redirects[url] = { target, response_time + (time_t)lifetime };
+        LOG_DEBUG(LogCategory::Http, "Remembering " << url << " -> " << target << " for " << lifetime << " s");
+        save_locked();
+    }
+
+    // Drops one, e.g. when following it led into a loop
+    void forget(const string& url)
+    {
+        lock_guard<mutex> lock(this->redirect_mutex);
+        load_locked();
+        if(this->redirects.erase(url)) save_locked();
+    }
+
+    void clear()
+    {
+        lock_guard<mutex> lock(this->redirect_mutex);
+        this->redirects.clear();
+        this->loaded = true;
+        save_locked();
+    }
+
+    size_t size()
+    {
+        lock_guard<mutex> lock(this->redirect_mutex);
+        load_locked();
+        return this->redirects.size();
+    }
+};
+
+#endif
@@ -0,0 +1,998 @@
+#pragma once
+
+#ifndef LAKYS_REPLAY_SERVER_HPP
+#define LAKYS_REPLAY_SERVER_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <csignal>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <openssl/rand.h>
+#include "socket/TcpClientSocket.hpp"
+#include "socket/SslContext.hpp"
+#include "lakys-connection-pool.hpp"
+#include "lakys-http-cache.hpp"
+#include "lakys-hsts.hpp"
+#include "lakys-redirect-cache.hpp"
+#include "lakys-http-headers.hpp"
+#include "lakys-http2.hpp"
+#include "lakys-page-archive.hpp"
+#include "lakys-logger.hpp"
+
+using namespace std;
+
+// Stand-in for the real servers when benchmarking: serves a recorded archive
+// (see HTTPRecorder) over HTTP and HTTPS on loopback, with a simulated round
+// trip time and bandwidth. The connection pool sends every connection here, so
+// the whole pipeline runs as usual, just without the network.
+//
+//   PUSZTA_REPLAY=session.puszta      serve it and load its first page
+//   PUSZTA_REPLAY_LATENCY_MS=80       round trip time, paid once per TCP connect,
+//                                     once more for TLS, and once per response
+//   PUSZTA_REPLAY_KBPS=8000           bandwidth per connection, 0 = unlimited
+//   PUSZTA_REPLAY_HTTP2=1             answer HTTPS over HTTP/2 when the client offers it
+//
+// It also keeps count of the handshake round trips clients wait out before their
+// first request gets here (see Stats): none for the TCP handshake when the first
+// bytes came in the SYN (TCP Fast Open; Linux needs net.ipv4.tcp_fastopen = 3 to
+// take them), none for TLS when the request came as 0-RTT early data. Skipped
+// round trips aren't simulated either.
+class ReplayServer
+{
+public:
+    struct Options
+    {
+        int latency_ms = 0;
+        int bandwidth_kbps = 0;
+
+        // HTTPS connections whose client offers h2 get it (ALPN). The rest are for
+        // putting the client's HTTP/2 through its paces.
+        bool http2 = false;
+        uint32_t max_concurrent_streams = 100;
+        size_t header_fragment = 0; // Splits header blocks into HEADERS + CONTINUATIONs this big, 0 = don't
+        int goaway_after = 0;       // GOAWAY once a connection took this many streams, 0 = never
+        int refuse_every = 0;       // Every nth stream gets RST_STREAM(REFUSED_STREAM), 0 = none
+    };
+
+    struct Stats
+    {
+        int connections = 0;
+        int fast_open = 0;             // The client's first bytes came in its SYN
+        int early_data = 0;            // The first request came with the TLS handshake
+        int handshake_round_trips = 0; // Waited out by clients before sending their first request
+
+        int http2_connections = 0;     // HTTPS connections that settled on h2
+        int streams = 0;               // HTTP/2 requests, refused ones included
+        int refused = 0;
+        int goaways = 0;
+        int continuations = 0;         // CONTINUATION frames sent
+        int window_updates = 0;        // WINDOW_UPDATE frames from clients
+        int priority_updates = 0;      // PRIORITY_UPDATE frames from clients
+    };
+
+private:
+    // An HTTP/2 response on its way out, see serve_http2()
+    struct OutgoingStream
+    {
+        string head;        // Encoded header block
+        string_view body;   // Into the archive
+        size_t sent = 0;
+        bool head_sent = false;
+        long long window = 0;
+        chrono::steady_clock::time_point ready_at; // Once the simulated round trip is over
+    };
+
+    shared_ptr<const PageArchive> archive;
+    Options options;
+
+    SOCKET http_listener = INVALID_SOCKET;
+    SOCKET https_listener = INVALID_SOCKET;
+    int http_port = 0;
+    int https_port = 0;
+
+    SSL_CTX* tls_context = nullptr;
+    X509* certificate = nullptr;
+    EVP_PKEY* key = nullptr;
+
+    atomic<bool> stopping{ false };
+    mutex server_mutex;
+    vector<thread> threads;
+    set<SOCKET> connections; // Open ones, shut down on stop()
+    Stats stats;
+
+    static SOCKET listen_on_loopback(int& port)
+    {
+        SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if(listener == INVALID_SOCKET) return INVALID_SOCKET;
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0; // Any free port
+
+#ifdef TCP_FASTOPEN
+        int fast_open_queue = 64; // Connections that may be waiting with data from their SYN
+        setsockopt(listener, IPPROTO_TCP, TCP_FASTOPEN, (const char*)&fast_open_queue, sizeof(fast_open_queue));
+#endif
+
+        socklen_t length = sizeof(address);
+        if(::bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0 ||
+           getsockname(listener, (sockaddr*)&address, &length) != 0)
+        {
+            closesocket(listener);
+            return INVALID_SOCKET;
+        }
+
+        port = ntohs(address.sin_port);
+        return listener;
+    }
+
+    // A throwaway key and certificate, trusted by our own client only. It's its own
+    // CA and names every recorded host, so it verifies whichever host is asked for.
+    bool create_certificate()
+    {
+        EVP_PKEY_CTX* key_context = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+        if(!key_context) return false;
+        bool generated = EVP_PKEY_keygen_init(key_context) == 1 &&
+                         EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_context, NID_X9_62_prime256v1) == 1 &&
+                         EVP_PKEY_keygen(key_context, &this->key) == 1;
+        EVP_PKEY_CTX_free(key_context);
+        if(!generated) return false;
+
+        // Every server gets its own name, or the client's trust store would keep
+        // matching a previous server's certificate by subject
+        uint32_t serial = 0;
+        RAND_bytes((unsigned char*)&serial, sizeof(serial));
+        string common_name = "Puszta replay " + to_string(serial);
+
+        this->certificate = X509_new();
+        X509_set_version(this->certificate, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(this->certificate), (long)(serial >> 1));
+        X509_gmtime_adj(X509_getm_notBefore(this->certificate), -3600);
+        X509_gmtime_adj(X509_getm_notAfter(this->certificate), 7 * 24 * 3600);
+        X509_set_pubkey(this->certificate, this->key);
+
+        X509_NAME* name = X509_get_subject_name(this->certificate);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)common_name.c_str(), -1, -1, 0);
+        X509_set_issuer_name(this->certificate, name);
+
+        string alt_names = "DNS:localhost,IP:127.0.0.1";
+        set<string> hosts;
+        for(const string& url : this->archive->urls())
+        {
+            if(url.rfind("https://", 0) != 0) continue;
+            string host = url.substr(8, url.find_first_of(":/", 8) - 8);
+            if(!host.empty() && hosts.insert(host).second) alt_names += ",DNS:" + host;
+        }
+
+        X509V3_CTX extension_context;
+        X509V3_set_ctx_nodb(&extension_context);
+        X509V3_set_ctx(&extension_context, this->certificate, this->certificate, nullptr, nullptr, 0);
+
+        const pair<int, string> extensions[] = {
+            { NID_basic_constraints, "critical,CA:TRUE" },
+            { NID_subject_alt_name, alt_names },
+        };
+        for(const auto& entry : extensions)
+        {
+            X509_EXTENSION* extension = X509V3_EXT_conf_nid(nullptr, &extension_context, entry.first, entry.second.c_str());
+            if(!extension) return false;
+            X509_add_ext(this->certificate, extension, -1);
+            X509_EXTENSION_free(extension);
+        }
+
+        if(X509_sign(this->certificate, this->key, EVP_sha256()) == 0) return false;
+
+        // Resumed TLS 1.3 sessions may bring their first request along (0-RTT)
+        this->tls_context = SSL_CTX_new(TLS_server_method());
+        if(!this->tls_context) return false;
+        SSL_CTX_set_alpn_select_cb(this->tls_context, select_protocol, this);
+        return SSL_CTX_use_certificate(this->tls_context, this->certificate) == 1 &&
+               SSL_CTX_use_PrivateKey(this->tls_context, this->key) == 1 &&
+               SSL_CTX_set_max_early_data(this->tls_context, 16384) == 1;
+    }
+
+    // ALPN: h2 if it's on and the client offers it, HTTP/1.1 otherwise
+    static int select_protocol(SSL*, const unsigned char** out, unsigned char* out_length,
+                               const unsigned char* offered, unsigned int offered_length, void* server)
+    {
+        static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+        bool http2 = ((ReplayServer*)server)->options.http2;
+        const unsigned char* ours = http2 ? protocols : protocols + 3;
+        unsigned int ours_length = (unsigned int)(sizeof(protocols) - 1) - (http2 ? 0 : 3);
+
+        if(SSL_select_next_proto((unsigned char**)out, out_length, ours, ours_length, offered, offered_length) != OPENSSL_NPN_NEGOTIATED)
+        {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    static bool picked_http2(SSL* ssl)
+    {
+        const unsigned char* protocol = nullptr;
+        unsigned int length = 0;
+        if(ssl) SSL_get0_alpn_selected(ssl, &protocol, &length);
+        return length == 2 && protocol[0] == 'h' && protocol[1] == '2';
+    }
+
+    void wait_round_trip() const
+    {
+        if(this->options.latency_ms > 0)
+        {
+            this_thread::sleep_for(chrono::milliseconds(this->options.latency_ms));
+        }
+    }
+
+    // Takes the TLS handshake as far as the client's early data, if it sent any.
+    // Whatever came that way is added to pending.
+    static bool read_early_data(SSL* ssl, string& pending, bool& accepted)
+    {
+        char buffer[4096];
+        while(true)
+        {
+            size_t received = 0;
+            int result = SSL_read_early_data(ssl, buffer, sizeof(buffer), &received);
+            if(result == SSL_READ_EARLY_DATA_ERROR) return false;
+
+            pending.append(buffer, received);
+            if(result == SSL_READ_EARLY_DATA_FINISH) break;
+        }
+
+        accepted = SSL_get_early_data_status(ssl) == SSL_EARLY_DATA_ACCEPTED;
+        return true;
+    }
+
+    static int read_some(SOCKET connection, SSL* ssl, char* buffer, int size)
+    {
+        return ssl ? SSL_read(ssl, buffer, size) : (int)recv(connection, buffer, size, 0);
+    }
+
+    static bool write_all(SOCKET connection, SSL* ssl, const char* data, size_t size)
+    {
+        while(size > 0)
+        {
+            int sent = ssl ? SSL_write(ssl, data, (int)size) : (int)send(connection, data, (int)size, 0);
+            if(sent <= 0) return false;
+            data += sent;
+            size -= (size_t)sent;
+        }
+        return true;
+    }
+
+    // Sends at no more than the configured bandwidth, averaged from the first byte
+    bool write_throttled(SOCKET connection, SSL* ssl, string_view data) const
+    {
+        if(this->options.bandwidth_kbps <= 0)
+        {
+            return write_all(connection, ssl, data.data(), data.size());
+        }
+
+        double bytes_per_ms = this->options.bandwidth_kbps / 8.0;
+        size_t chunk = max((size_t)1024, (size_t)(bytes_per_ms * 10)); // ~10 ms worth at a time
+        auto started = chrono::steady_clock::now();
+
+        for(size_t sent = 0; sent < data.size(); )
+        {
+            size_t size = min(chunk, data.size() - sent);
+            if(!write_all(connection, ssl, data.data() + sent, size)) return false;
+            sent += size;
+
+            auto due = started + chrono::microseconds((long long)(sent / bytes_per_ms * 1000.0));
+            this_thread::sleep_until(due);
+        }
+        return true;
+    }
+
+    // The response head for one request, body points into the archive (empty for a 404)
+    string respond(const string& scheme, const string& request, string_view& body, bool& keep_alive) const
+    {
+        size_t line_end = request.find("\r\n");
+        string_view request_line = string_view(request).substr(0, line_end);
+
+        // Only the fields are wanted, so give the parser a status line to chew on
+        HTTPHeaders fields;
+        string block = "HTTP/1.1 200 OK" + request.substr(line_end);
+        fields.parse(block);
+        keep_alive = !equals_ignore_case(fields.get(HeaderId::Connection), "close");
+
+        size_t method_end = request_line.find(' ');
+        size_t target_end = request_line.rfind(' ');
+        string_view method = request_line.substr(0, method_end);
+        string target = method_end < target_end ? string(request_line.substr(method_end + 1, target_end - method_end - 1)) : "/";
+
+        string url = scheme + "://" + string(fields.get("Host")) + target;
+        string_view headers;
+        body = string_view();
+
+        if(method != "GET" || !this->archive->find(url, headers, body))
+        {
+            LOG_WARN(LogCategory::Http, "Replay has no response for " << method << " " << url);
+            static const string message = "Not recorded\n";
+            body = message;
+            return "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: " + to_string(message.size()) + "\r\n\r\n";
+        }
+
+        return string(headers) + "\r\nContent-Length: " + to_string(body.size()) + "\r\n\r\n";
+    }
+
+    void serve(SOCKET connection, bool tls)
+    {
+        string scheme = tls ? "https" : "http";
+        SSL* ssl = nullptr;
+        string pending;
+
+        // With Fast Open, the client's first flight came with its SYN
+        bool fast_open = TcpSocket::synCarriedData(connection);
+        bool early_data = false;
+        int round_trips = 0;
+        if(!fast_open)
+        {
+            wait_round_trip(); // The TCP handshake
+            round_trips++;
+        }
+
+        if(tls)
+        {
+            ssl = SSL_new(this->tls_context);
+            SSL_set_fd(ssl, (int)connection);
+            bool handshaking = read_early_data(ssl, pending, early_data);
+            if(handshaking && !early_data)
+            {
+                wait_round_trip(); // The TLS handshake, the request comes after it
+                round_trips++;
+            }
+            if(!handshaking || SSL_accept(ssl) != 1)
+            {
+                SSL_free(ssl);
+                ssl = nullptr;
+                close_connection(connection);
+                return;
+            }
+        }
+
+        {
+            lock_guard<mutex> lock(this->server_mutex);
+            this->stats.connections++;
+            this->stats.fast_open += fast_open;
+            this->stats.early_data += early_data;
+            this->stats.handshake_round_trips += round_trips;
+        }
+        bool http2 = picked_http2(ssl);
+        LOG_DEBUG(LogCategory::Net, "Replay " << scheme << " connection, " << round_trips << " handshake round trip(s)"
+                  << (fast_open ? ", TCP Fast Open" : "") << (early_data ? ", 0-RTT" : "") << (http2 ? ", h2" : ""));
+
+        if(http2)
+        {
+            serve_http2(connection, ssl, move(pending));
+        }
+        else
+        {
+            serve_http1(connection, ssl, scheme, move(pending));
+        }
+
+        if(ssl)
+        {
+            SSL_shutdown(ssl);
+            SSL_free(ssl);
+        }
+        close_connection(connection);
+    }
+
+    void serve_http1(SOCKET connection, SSL* ssl, const string& scheme, string pending)
+    {
+        char buffer[16 * 1024];
+        bool keep_alive = true;
+
+        while(keep_alive && !this->stopping)
+        {
+            size_t end;
+            while((end = pending.find("\r\n\r\n")) == string::npos)
+            {
+                int received = read_some(connection, ssl, buffer, sizeof(buffer));
+                if(received <= 0 || this->stopping)
+                {
+                    keep_alive = false;
+                    break;
+                }
+                pending.append(buffer, (size_t)received);
+            }
+            if(!keep_alive) break;
+
+            string request = pending.substr(0, end + 4);
+            pending.erase(0, end + 4);
+
+            string_view body;
+            string head = respond(scheme, request, body, keep_alive);
+
+            wait_round_trip(); // Request there, first byte back
+            if(!write_all(connection, ssl, head.data(), head.size()) || !write_throttled(connection, ssl, body))
+            {
+                break;
+            }
+        }
+    }
+
+    // Whether the client sent something, waiting up to timeout_ms for it (-1 for as long as it takes)
+    static bool wait_readable(SOCKET connection, SSL* ssl, int timeout_ms)
+    {
+        if(SSL_pending(ssl) > 0) return true;
+
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(connection, &readable);
+        timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+        return select((int)connection + 1, &readable, nullptr, nullptr, timeout_ms < 0 ? nullptr : &timeout) > 0;
+    }
+
+    // The archived response as HTTP/2 fields, :status first. The archive has no
+    // transfer fields left, and HTTP/2 has no use for connection ones.
+    bool find_http2(const string& url, vector<HeaderField>& fields, string_view& body) const
+    {
+        static const set<string> connection_fields = { "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade" };
+
+        string_view headers;
+        fields.clear();
+        if(!this->archive->find(url, headers, body))
+        {
+            static const string message = "Not recorded\n";
+            body = message;
+            fields = { { ":status", "404" }, { "content-type", "text/plain" }, { "content-length", to_string(message.size()) } };
+            return false;
+        }
+
+        size_t line_end = headers.find("\r\n");
+        string_view status_line = headers.substr(0, line_end);
+        size_t code = status_line.find(' ');
+        fields.push_back({ ":status", code == string_view::npos ? "200" : string(status_line.substr(code + 1, 3)) });
+
+        while(line_end != string_view::npos)
+        {
+            size_t start = line_end + 2;
+            line_end = headers.find("\r\n", start);
+            string_view line = headers.substr(start, line_end == string_view::npos ? string_view::npos : line_end - start);
+
+            size_t colon = line.find(':');
+            if(colon == string_view::npos) continue;
+            string name = to_lowercase(string(line.substr(0, colon)));
+            size_t value_start = line.find_first_not_of(' ', colon + 1);
+            string value = value_start == string_view::npos ? "" : string(line.substr(value_start));
+
+            if(!connection_fields.count(name)) fields.push_back({ move(name), move(value) });
+        }
+        fields.push_back({ "content-length", to_string(body.size()) });
+        return true;
+    }
+
+    // HTTP/2 on a connection that picked it with ALPN. Still one thread per
+    // connection: it takes the client's frames apart as they come, answers each
+    // stream once its simulated round trip is over, and sends DATA round robin as
+    // far as the client's flow control windows let it, so a client that stops
+    // giving credit stalls like it would against a real server.
+    void serve_http2(SOCKET connection, SSL* ssl, string pending)
+    {
+        static const string preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+        HPACKDecoder decoder;
+        HPACKEncoder encoder;
+        map<uint32_t, OutgoingStream> streams;
+        long long connection_window = 65535;
+        long long initial_window = 65535;
+        size_t max_frame_size = 16384;
+        int taken = 0;
+        uint32_t last_stream_id = 0;  // Set by our GOAWAY, later streams are left alone
+        bool going_away = false;
+        bool have_preface = false;
+        uint32_t continuation_stream = 0;
+        uint8_t continuation_flags = 0;
+        string header_block;
+        char buffer[16 * 1024];
+
+        {
+            lock_guard<mutex> lock(this->server_mutex);
+            this->stats.http2_connections++;
+        }
+
+        auto send_frames = [&](const string& frames) {
+            return write_all(connection, ssl, frames.data(), frames.size());
+        };
+
+        auto stream_error = [&](uint32_t stream_id, uint32_t code) {
+            string payload;
+            http2_put_u32(payload, code);
+            return send_frames(http2_frame(HTTP2Frame::ResetStream, 0, stream_id, payload));
+        };
+
+        auto go_away = [&](uint32_t stream_id, uint32_t code) {
+            string payload;
+            http2_put_u32(payload, stream_id);
+            http2_put_u32(payload, code);
+            going_away = true;
+            last_stream_id = stream_id;
+            lock_guard<mutex> lock(this->server_mutex);
+            this->stats.goaways++;
+            return send_frames(http2_frame(HTTP2Frame::GoAway, 0, 0, payload));
+        };
+
+        // Returns false if the connection can't go on
+        auto on_request = [&](uint32_t stream_id, const string& block) {
+            vector<HeaderField> request;
+            if(!decoder.decode((const uint8_t*)block.data(), block.size(), request))
+            {
+                go_away(stream_id, HTTP2_COMPRESSION_ERROR);
+                return false;
+            }
+            if(going_away && stream_id > last_stream_id) return true; // Never looked at, the client sends it again
+
+            taken++;
+            {
+                lock_guard<mutex> lock(this->server_mutex);
+                this->stats.streams++;
+            }
+            if(this->options.refuse_every > 0 && taken % this->options.refuse_every == 0)
+            {
+                lock_guard<mutex> lock(this->server_mutex);
+                this->stats.refused++;
+                return stream_error(stream_id, HTTP2_REFUSED_STREAM);
+            }
+
+            string method, authority, path;
+            for(const HeaderField& field : request)
+            {
+                if(field.first == ":method") method = field.second;
+                else if(field.first == ":authority") authority = field.second;
+                else if(field.first == ":path") path = field.second;
+            }
+
+            string url = "https://" + authority + path;
+            OutgoingStream& stream = streams[stream_id];
+            vector<HeaderField> fields;
+            if(method != "GET" || !find_http2(url, fields, stream.body))
+            {
+                LOG_WARN(LogCategory::Http, "Replay has no response for " << method << " " << url);
+                if(method != "GET") find_http2("", fields, stream.body);
+            }
+            encoder.encode(fields, stream.head);
+            stream.window = initial_window;
+            stream.ready_at = chrono::steady_clock::now() + chrono::milliseconds(max(0, this->options.latency_ms));
+
+            if(this->options.goaway_after > 0 && taken == this->options.goaway_after)
+            {
+                return go_away(stream_id, HTTP2_NO_ERROR);
+            }
+            return true;
+        };
+
+        // Takes apart the whole frames in pending. Returns false if the connection can't go on.
+        auto read_frames = [&]() {
+            size_t pos = 0;
+            bool ok = true;
+
+            while(ok && pending.size() - pos >= 9)
+            {
+                const uint8_t* header = (const uint8_t*)pending.data() + pos;
+                uint32_t length = ((uint32_t)header[0] << 16) | ((uint32_t)header[1] << 8) | header[2];
+                if(pending.size() - pos < 9 + (size_t)length) break;
+
+                HTTP2Frame type = (HTTP2Frame)header[3];
+                uint8_t flags = header[4];
+                uint32_t stream_id = http2_get_u32(header + 5) & 0x7FFFFFFF;
+                const uint8_t* payload = header + 9;
+                pos += 9 + length;
+
+                switch(type)
+                {
+                    case HTTP2Frame::Headers:
+                    {
+                        uint32_t offset = 0;
+                        uint32_t content_length = length;
+                        if((flags & HTTP2_PADDED) && length > 0)
+                        {
+                            offset = 1;
+                            content_length -= min(content_length, 1u + payload[0]);
+                        }
+                        if(flags & HTTP2_PRIORITY)
+                        {
+                            offset += 5;
+                            content_length -= min(content_length, 5u);
+                        }
+                        header_block.assign((const char*)payload + offset, content_length);
+                        if(flags & HTTP2_END_HEADERS)
+                        {
+                            ok = on_request(stream_id, header_block);
+                        }
+                        else
+                        {
+                            continuation_stream = stream_id;
+                            continuation_flags = flags;
+                        }
+                        break;
+                    }
+
+                    case HTTP2Frame::Continuation:
+                        if(stream_id != continuation_stream)
+                        {
+                            go_away(stream_id, HTTP2_PROTOCOL_ERROR);
+                            return false;
+                        }
+                        header_block.append((const char*)payload, length);
+                        if(flags & HTTP2_END_HEADERS)
+                        {
+                            continuation_stream = 0;
+                            ok = on_request(stream_id, header_block);
+                        }
+                        break;
+
+                    case HTTP2Frame::Settings:
+                    {
+                        if(flags & HTTP2_ACK) break;
+                        for(uint32_t i = 0; i + 6 <= length; i += 6)
+                        {
+                            uint16_t id = (uint16_t)((payload[i] << 8) | payload[i + 1]);
+                            uint32_t value = http2_get_u32(payload + i + 2);
+                            if(id == 0x4) // INITIAL_WINDOW_SIZE, open streams move by the difference
+                            {
+                                for(auto& entry : streams) entry.second.window += (long long)value - initial_window;
+                                initial_window = value;
+                            }
+                            else if(id == 0x5 && value >= 16384) // MAX_FRAME_SIZE
+                            {
+                                max_frame_size = value;
+                            }
+                        }
+                        ok = send_frames(http2_frame(HTTP2Frame::Settings, HTTP2_ACK, 0, ""));
+                        break;
+                    }
+
+                    case HTTP2Frame::WindowUpdate:
+                    {
+                        if(length != 4) break;
+                        long long increment = http2_get_u32(payload) & 0x7FFFFFFF;
+                        if(stream_id == 0)
+                        {
+                            connection_window += increment;
+                        }
+                        else
+                        {
+                            auto found = streams.find(stream_id);
+                            if(found != streams.end()) found->second.window += increment;
+                        }
+                        lock_guard<mutex> lock(this->server_mutex);
+                        this->stats.window_updates++;
+                        break;
+                    }
+
+                    case HTTP2Frame::Ping:
+                        if(!(flags & HTTP2_ACK) && length == 8)
+                        {
+                            ok = send_frames(http2_frame(HTTP2Frame::Ping, HTTP2_ACK, 0, string_view((const char*)payload, 8)));
+                        }
+                        break;
+
+                    case HTTP2Frame::ResetStream:
+                        streams.erase(stream_id);
+                        break;
+
+                    case HTTP2Frame::GoAway:
+                        return false; // The client is done with us
+
+                    case HTTP2Frame::PriorityUpdate:
+                    {
+                        lock_guard<mutex> lock(this->server_mutex);
+                        this->stats.priority_updates++;
+                        break;
+                    }
+
+                    default:
+                        break; // DATA (we only take GETs), PRIORITY, extensions
+                }
+            }
+
+            pending.erase(0, pos);
+            return ok;
+        };
+
+        // One frame's worth of every stream that's ready and has window left.
+        // Returns false if the connection can't go on; progressed says if anything went out.
+        auto write_frames = [&](bool& progressed) {
+            progressed = false;
+            auto now = chrono::steady_clock::now();
+
+            for(auto it = streams.begin(); it != streams.end(); )
+            {
+                uint32_t stream_id = it->first;
+                OutgoingStream& stream = it->second;
+                if(now < stream.ready_at)
+                {
+                    ++it;
+                    continue;
+                }
+
+                if(!stream.head_sent)
+                {
+                    size_t fragment = this->options.header_fragment > 0 ? min(this->options.header_fragment, max_frame_size) : max_frame_size;
+                    string out;
+                    int continuations = 0;
+                    for(size_t offset = 0; offset < stream.head.size(); offset += fragment)
+                    {
+                        string_view piece = string_view(stream.head).substr(offset, fragment);
+                        uint8_t flags = offset + piece.size() == stream.head.size() ? HTTP2_END_HEADERS : 0;
+                        if(offset == 0)
+                        {
+                            if(stream.body.empty()) flags |= HTTP2_END_STREAM;
+                            out += http2_frame(HTTP2Frame::Headers, flags, stream_id, piece);
+                        }
+                        else
+                        {
+                            out += http2_frame(HTTP2Frame::Continuation, flags, stream_id, piece);
+                            continuations++;
+                        }
+                    }
+                    if(!send_frames(out)) return false;
+                    {
+                        lock_guard<mutex> lock(this->server_mutex);
+                        this->stats.continuations += continuations;
+                    }
+
+                    stream.head_sent = true;
+                    progressed = true;
+                    if(stream.body.empty())
+                    {
+                        it = streams.erase(it);
+                        continue;
+                    }
+                }
+
+                long long size = min({ (long long)max_frame_size, (long long)(stream.body.size() - stream.sent), stream.window, connection_window });
+                if(size > 0)
+                {
+                    bool last = stream.sent + (size_t)size == stream.body.size();
+                    string out = http2_frame(HTTP2Frame::Data, last ? HTTP2_END_STREAM : 0, stream_id, stream.body.substr(stream.sent, (size_t)size));
+                    if(!write_throttled(connection, ssl, out)) return false;
+
+                    stream.sent += (size_t)size;
+                    stream.window -= size;
+                    connection_window -= size;
+                    progressed = true;
+                    if(last)
+                    {
+                        it = streams.erase(it);
+                        continue;
+                    }
+                }
+                ++it;
+            }
+            return true;
+        };
+
+        string settings;
+        settings += (char)0;
+        settings += (char)0x3; // MAX_CONCURRENT_STREAMS
+        http2_put_u32(settings, this->options.max_concurrent_streams);
+        if(!send_frames(http2_frame(HTTP2Frame::Settings, 0, 0, settings))) return;
+
+        while(!this->stopping)
+        {
+            if(!have_preface && pending.size() >= preface.size())
+            {
+                if(pending.compare(0, preface.size(), preface) != 0) break;
+                pending.erase(0, preface.size());
+                have_preface = true;
+            }
+            if(have_preface && !read_frames()) break;
+
+            bool progressed = false;
+            if(!write_frames(progressed)) break;
+            if(going_away && streams.empty()) break;
+
+            // Sleep until the client says something or the next stream's round trip is over
+            int timeout_ms = progressed ? 0 : -1;
+            auto now = chrono::steady_clock::now();
+            for(const auto& entry : streams)
+            {
+                if(progressed || entry.second.ready_at <= now) continue;
+                int until_ready = (int)chrono::ceil<chrono::milliseconds>(entry.second.ready_at - now).count();
+                if(timeout_ms < 0 || until_ready < timeout_ms) timeout_ms = until_ready;
+            }
+            if(!wait_readable(connection, ssl, timeout_ms)) continue;
+
+            int received = read_some(connection, ssl, buffer, sizeof(buffer));
+            if(received <= 0) break;
+            pending.append(buffer, (size_t)received);
+        }
+
+        // After a GOAWAY the client may still be sending streams we ignore. Closing
+        // on unread data resets the connection, which can drop the GOAWAY before the
+        // client reads it, so say we're done and read until it hangs up too.
+        if(going_away && !this->stopping)
+        {
+            SSL_shutdown(ssl);
+            shutdown(connection, 1);
+            auto give_up = chrono::steady_clock::now() + chrono::seconds(2);
+            while(!this->stopping && chrono::steady_clock::now() < give_up)
+            {
+                if(!wait_readable(connection, ssl, 100)) continue;
+                if(read_some(connection, ssl, buffer, sizeof(buffer)) <= 0) break;
+            }
+        }
+    }
+
+    void close_connection(SOCKET connection)
+    {
+        {
+            lock_guard<mutex> lock(this->server_mutex);
+            this->connections.erase(connection);
+        }
+        closesocket(connection);
+    }
+
+    void accept_loop(SOCKET listener, bool tls)
+    {
+        while(!this->stopping)
+        {
+            SOCKET connection = accept(listener, nullptr, nullptr);
+            if(connection == INVALID_SOCKET) break;
+
+            lock_guard<mutex> lock(this->server_mutex);
+            if(this->stopping)
+            {
+                closesocket(connection);
+                break;
+            }
+            this->connections.insert(connection);
+            this->threads.emplace_back(&ReplayServer::serve, this, connection, tls);
+        }
+    }
+
+public:
+    ReplayServer() {}
+
+    ReplayServer(const ReplayServer&) = delete;
+    ReplayServer& operator=(const ReplayServer&) = delete;
+
+    ~ReplayServer()
+    {
+        stop();
+        if(this->tls_context) SSL_CTX_free(this->tls_context);
+        if(this->certificate) X509_free(this->certificate);
+        if(this->key) EVP_PKEY_free(this->key);
+    }
+
+    bool start(shared_ptr<const PageArchive> served, const Options& server_options)
+    {
+        this->archive = served;
+        this->options = server_options;
+
+#ifndef _WIN32
+        // A client hanging up mid-response shouldn't take the whole process down
+        signal(SIGPIPE, SIG_IGN);
+#endif
+
+        if(!create_certificate())
+        {
+            LOG_ERROR(LogCategory::Net, "Replay server couldn't make its certificate");
+            return false;
+        }
+
+        this->http_listener = listen_on_loopback(this->http_port);
+        this->https_listener = listen_on_loopback(this->https_port);
+        if(this->http_listener == INVALID_SOCKET || this->https_listener == INVALID_SOCKET)
+        {
+            LOG_ERROR(LogCategory::Net, "Replay server couldn't listen on loopback");
+            return false;
+        }
+
+        this->threads.emplace_back(&ReplayServer::accept_loop, this, this->http_listener, false);
+        this->threads.emplace_back(&ReplayServer::accept_loop, this, this->https_listener, true);
+
+        LOG_INFO(LogCategory::Net, "Replaying " << this->archive->size() << " responses on 127.0.0.1:" << this->http_port
+                 << " (http) and :" << this->https_port << " (https), " << this->options.latency_ms << " ms RTT, "
+                 << (this->options.bandwidth_kbps > 0 ? to_string(this->options.bandwidth_kbps) + " kbit/s" : string("unlimited bandwidth"))
+                 << (this->options.http2 ? ", HTTP/2" : ""));
+        return true;
+    }
+
+    // Points the browser at this server: the pool connects here, our certificate is
+    // trusted, and the HTTP cache and what's remembered about redirects start out
+    // empty and stay in memory, so every run makes the same requests
+    void attach()
+    {
+        SslContext::instance().trustCertificate(this->certificate);
+        SslContext::instance().clearSessions();
+        ConnectionPool::instance().set_loopback(this->http_port, this->https_port);
+
+        HTTPCache::instance().set_memory_budget(0);
+        HTTPCache::instance().set_disk_directory("", 0);
+        HSTSStore::instance().set_store_path("");
+        PermanentRedirects::instance().set_store_path("");
+    }
+
+    void stop()
+    {
+        if(this->stopping.exchange(true)) return;
+
+        // Unblocks accept() and every read
+        for(SOCKET listener : { this->http_listener, this->https_listener })
+        {
+            if(listener == INVALID_SOCKET) continue;
+            shutdown(listener, 2);
+            closesocket(listener);
+        }
+        {
+            lock_guard<mutex> lock(this->server_mutex);
+            for(SOCKET connection : this->connections) shutdown(connection, 2);
+        }
+
+        // Accept loops are done now, nothing adds threads anymore
+        for(size_t i = 0; i < this->threads.size(); i++)
+        {
+            this->threads[i].join();
+        }
+        this->threads.clear();
+
+        Stats served = get_stats();
+        if(served.connections > 0)
+        {
+            LOG_INFO(LogCategory::Net, "Replay server took " << served.connections << " connections, " << served.fast_open
+                     << " with TCP Fast Open and " << served.early_data << " with 0-RTT requests; clients waited out "
+                     << served.handshake_round_trips << " handshake round trips");
+        }
+        if(served.http2_connections > 0)
+        {
+            LOG_INFO(LogCategory::Net, "Replay server took " << served.streams << " HTTP/2 streams on " << served.http2_connections
+                     << " connections, refused " << served.refused << ", sent " << served.goaways << " GOAWAYs and "
+                     << served.continuations << " CONTINUATIONs, got " << served.window_updates << " WINDOW_UPDATEs");
+        }
+    }
+
+    Stats get_stats()
+    {
+        lock_guard<mutex> lock(this->server_mutex);
+        return this->stats;
+    }
+
+    int get_http_port() const
+    {
+        return this->http_port;
+    }
+
+    int get_https_port() const
+    {
+        return this->https_port;
+    }
+
+    // Starts a server for PUSZTA_REPLAY and attaches the browser to it, nullptr if it isn't set
+    static unique_ptr<ReplayServer> start_from_environment(string& page_url)
+    {
+        const char* file = getenv("PUSZTA_REPLAY");
+        if(!file || !*file) return nullptr;
+
+        auto archive = make_shared<PageArchive>();
+        if(!archive->open(file)) return nullptr;
+
+        Options server_options;
+        if(const char* latency = getenv("PUSZTA_REPLAY_LATENCY_MS")) server_options.latency_ms = atoi(latency);
+        if(const char* bandwidth = getenv("PUSZTA_REPLAY_KBPS")) server_options.bandwidth_kbps = atoi(bandwidth);
+        if(const char* http2 = getenv("PUSZTA_REPLAY_HTTP2")) server_options.http2 = atoi(http2) != 0;
+
+        auto server = make_unique<ReplayServer>();
+        if(!server->start(archive, server_options)) return nullptr;
+
+        server->attach();
+        page_url = archive->get_page_url();
+        return server;
+    }
+};
+
+#endif
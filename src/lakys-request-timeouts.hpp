@@ -0,0 +1,138 @@
+#pragma once
+
+#ifndef LAKYS_REQUEST_TIMEOUTS_HPP
+#define LAKYS_REQUEST_TIMEOUTS_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <algorithm>
+
+using namespace std;
+
+// How long a request may wait at each step before it's given up on, and when a
+// slow one is hedged: sent again on a second connection (to another of the
+// host's addresses if it has one) and answered by whichever connection speaks
+// first. Every request we make is a GET, so sending one twice is harmless.
+//
+// The hedge delay follows the host's recent times to first byte. A request that
+// has waited longer than hedge_percentile of those is more likely stuck behind a
+// bad connection or server than just slow, and a second try usually beats it.
+// Hosts without enough samples of their own go by everyone's.
+class RequestTimeouts
+{
+public:
+    // Milliseconds, -1 for no limit
+    struct Limits
+    {
+        int connect_ms = 10000;    // TCP and TLS handshakes together
+        int first_byte_ms = 30000; // Request sent -> first byte of the response
+        int idle_ms = 30000;       // Longest quiet gap once the response is arriving
+    };
+
+private:
+    mutex timeouts_mutex;
+    Limits limits;
+
+    bool hedging = true;
+    double hedge_percentile = 0.95;
+    int min_hedge_ms = 50;     // Below that a request isn't stuck, the network is just far away
+    size_t min_samples = 20;
+    size_t max_samples = 100;  // Per host, the most recent ones
+
+    map<string, deque<double>> first_byte_samples; // By host
+    deque<double> all_samples;
+
+    RequestTimeouts() {}
+
+    static double percentile_of(const deque<double>& samples, double percentile)
+    {
+        vector<double> sorted(samples.begin(), samples.end());
+        size_t index = min(sorted.size() - 1, (size_t)(percentile * sorted.size()));
+        nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+        return sorted[index];
+    }
+
+    static void add_sample(deque<double>& samples, double ms, size_t max_samples)
+    {
+        samples.push_back(ms);
+        while(samples.size() > max_samples)
+        {
+            samples.pop_front();
+        }
+    }
+
+public:
+    static RequestTimeouts& instance()
+    {
+        static RequestTimeouts timeouts;
+        return timeouts;
+    }
+
+    Limits get_limits()
+    {
+        lock_guard<mutex> lock(this->timeouts_mutex);
+        return this->limits;
+    }
+
+    void set_limits(const Limits& limits)
+    {
+        lock_guard<mutex> lock(this->timeouts_mutex);
+        this->limits = limits;
+    }
+
+    bool is_hedging()
+    {
+        lock_guard<mutex> lock(this->timeouts_mutex);
+        return this->hedging;
+    }
+
+    // percentile: 0.95 hedges the slowest 5% of requests (to a host behaving as before)
+    void set_hedging(bool enabled, double percentile = 0.95)
+    {
+        lock_guard<mutex> lock(this->timeouts_mutex);
+        this->hedging = enabled;
+        this->hedge_percentile = min(max(percentile, 0.5), 0.999);
+    }
+
+    // How long a request to the host took to start answering
+    void record_first_byte(const string& host, double ms)
+    {
+        lock_guard<mutex> lock(this->timeouts_mutex);
+        add_sample(this->first_byte_samples[host], ms, this->max_samples);
+        add_sample(this->all_samples, ms, this->max_samples * 5);
+    }
+
+    // How long a request to the host may wait for its first byte before it's
+    // hedged, -1 if it isn't to be
+    int hedge_delay_ms(const string& host)
+    {
+        lock_guard<mutex> lock(this->timeouts_mutex);
+        if(!this->hedging) return -1;
+
+        const deque<double>* samples = &this->all_samples;
+        auto found = this->first_byte_samples.find(host);
+        if(found != this->first_byte_samples.end() && found->second.size() >= this->min_samples)
+        {
+            samples = &found->second;
+        }
+        if(samples->size() < this->min_samples) return -1;
+
+        double delay = max((double)this->min_hedge_ms, percentile_of(*samples, this->hedge_percentile));
+
+        // Not worth it for what's about to time out anyway
+        if(this->limits.first_byte_ms >= 0 && delay >= this->limits.first_byte_ms) return -1;
+        return (int)delay;
+    }
+
+    void clear_samples()
+    {
+        lock_guard<mutex> lock(this->timeouts_mutex);
+        this->first_byte_samples.clear();
+        this->all_samples.clear();
+    }
+};
+
+#endif
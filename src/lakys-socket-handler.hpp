@@ -9,13 +9,42 @@
 #include <iostream>
 #include <stdexcept>
 #include "lakys-string-helper.hpp"
+#include "lakys-logger.hpp"
 #include "PusztaParser.hpp"
 #include "socket/TcpSslClientSocket.hpp"
+#include "lakys-connection-pool.hpp"
+#include "lakys-http-reader.hpp"
+#include "lakys-http-headers.hpp"
+#include "lakys-http-cache.hpp"
+#include "lakys-network-timing.hpp"
 #include "lakys-file-loader.hpp"
+#include "lakys-page-archive.hpp"
+#include "lakys-http-recorder.hpp"
+#include "lakys-hsts.hpp"
+#include "lakys-redirect-cache.hpp"
+#include "lakys-request-timeouts.hpp"
+#include "lakys-download-manager.hpp"
 #include <map>
+#include <memory>
 
 using namespace std;
 
+// One network request on its way through HTTP: begin_exchange() decides whether
+// it has to go out at all, finish_exchange() makes sense of what came back.
+// Whoever moves the bytes in between (request() itself, or FetchEngine) keeps it.
+struct HTTPExchange
+{
+    string connection_scheme; // http or https, without view-source:
+    string cache_key;
+    bool have_cached = false;
+    CachedResponse cached;
+
+    RequestTiming timing;
+    chrono::steady_clock::time_point started;
+    chrono::steady_clock::time_point sent;
+    time_t request_time = 0;
+};
+
 class HTTP
 {
 private:
@@ -27,7 +56,7 @@ private:
 
     string body;
     string headers;
-    map<string, string> header_map;
+    HTTPHeaders header_fields; // Views into headers
 
 
     string cert_file;
@@ -37,12 +66,131 @@ private:
 
     int redirect_depth = 0;
     int max_depth = 10;
+    vector<string> redirect_chain; // URLs redirected away from, in order
+
+    // Callers doing their own I/O follow redirects themselves, see take_pending_redirect()
+    bool defer_redirects = false;
+    bool redirect_pending = false;
+
+    bool revalidate = false; // Reload: don't trust fresh cache entries, ask the server
+    bool unconditional = false; // The next request leaves the cache out, see handle_response()
+
+    // See set_download_handoff()
+    bool download_handoff = false;
+    bool download = false;
+
+    TransferProgress* progress = nullptr;
+
+    // RFC 9218 priority, for HTTP/2 servers: documents first, then what blocks rendering
+    int urgency = 0;
+    bool incremental = false;
+
+    vector<RequestTiming> timings; // One per request made, redirect hops included
+
+    void record_timing(RequestTiming& timing, chrono::steady_clock::time_point started)
+    {
+        timing.total_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        LOG_DEBUG(LogCategory::Net, timing.url << " " << timing.status << " in " << timing.total_ms << " ms");
+        if(timing.ttfb_ms >= 0)
+        {
+            RequestTimeouts::instance().record_first_byte(this->host, timing.ttfb_ms);
+        }
+        NetworkLog::instance().add(timing);
+        this->timings.push_back(timing);
+    }
+
+    // A Location field as an absolute URL
+    string resolve_location(string location) const
+    {
+        location.erase(location.find_last_not_of(" \n\r\t") + 1);
+        location.erase(0, location.find_first_not_of(" \n\r\t"));
+        if(location.empty()) return "";
+
+        // Check if the location is relative
+        if(location[0] == '/')
+        {
+            return this->scheme + "://" + authority() + location;
+        }
+        if(location.find("://") == string::npos)
+        {
+            // If it doesn't contain a scheme, assume it's relative to the current host
+            return this->scheme + "://" + authority() + "/" + location;
+        }
+        return location;
+    }
+
+    // Rewrites the URL with what earlier responses told us, before any socket is
+    // opened: HSTS hosts go to https://, and permanent redirects are followed
+    // without asking the server again
+    void apply_known_redirects()
+    {
+        // An archive holds the URLs exactly as they were fetched
+        if(ArchiveReplay::instance().get()) return;
+
+        while(true)
+        {
+            if((this->scheme == "http" || this->scheme == "view-source:http") && HSTSStore::instance().is_secure_only(this->host))
+            {
+                string upgraded = this->scheme + "s://" + this->host + (this->port == 80 ? "" : ":" + to_string(this->port)) + this->path;
+                LOG_INFO(LogCategory::Http, "HSTS: upgrading to " << upgraded);
+                this->set(upgraded);
+            }
+
+            // A reload asks the server again, in case the redirect was taken back
+            string target;
+            if(this->revalidate || (this->scheme != "http" && this->scheme != "https") || this->redirect_depth >= this->max_depth ||
+               !PermanentRedirects::instance().lookup(this->url, target))
+            {
+                return;
+            }
+
+            // Going round in circles, let the server say where it really goes
+            if(find(this->redirect_chain.begin(), this->redirect_chain.end(), target) != this->redirect_chain.end())
+            {
+                LOG_DEBUG(LogCategory::Http, "Remembered redirect " << this->url << " -> " << target << " loops, asking the server");
+                return;
+            }
+
+            LOG_INFO(LogCategory::Http, "Known permanent redirect: " << this->url << " -> " << target);
+            string from = this->url;
+            try {
+                this->set(target);
+            } catch (const exception&) {
+                PermanentRedirects::instance().forget(from);
+                this->set(from);
+                return;
+            }
+            this->redirect_chain.push_back(from);
+            this->redirect_depth += 1;
+        }
+    }
+
+    // What a network response says about later requests to the same place
+    void remember_policies(const string& connection_scheme, const string& request_url, const HTTPHeaders& fields,
+                           const string& response_headers, time_t request_time, time_t response_time)
+    {
+        if(connection_scheme == "https")
+        {
+            HSTSStore::instance().observe(this->host, fields.get(HeaderId::StrictTransportSecurity));
+        }
+
+        // view-source: pages resolve relative Locations to view-source: URLs, not worth keeping
+        int response_status = fields.get_status();
+        if((response_status == 301 || response_status == 308) && this->scheme == connection_scheme)
+        {
+            string target = resolve_location(string(fields.get(HeaderId::Location)));
+            if(!target.empty())
+            {
+                PermanentRedirects::instance().remember(request_url, target, response_headers, request_time, response_time);
+            }
+        }
+    }
 
 public:
 
     bool should_parse;
     
-    HTTP() : scheme(""), url(""), host(""), path(""), port(80) {}
+    HTTP() : scheme(""), url(""), host(""), path(""), port(80), status(0), should_parse(false) {}
 
     void set_cert_file(string cert_file)
     {
@@ -54,13 +202,118 @@ public:
         return this->url;
     }
 
+    const string& get_host() const
+    {
+        return this->host;
+    }
+
+    int get_port() const
+    {
+        return this->port;
+    }
+
+    // Status line and fields of the last response
+    const string& get_response_headers() const
+    {
+        return this->headers;
+    }
+
+    // file:// URLs are read from disk rather than requested, see open_local()
+    bool is_local() const
+    {
+        return this->scheme == "file";
+    }
+
+    // Where a file:// URL points on disk
+    string get_local_path() const
+    {
+        return local_path(this->path);
+    }
+
+    // Opens a file:// URL's file or directory for reading in place
+    bool open_local(FileView& file) const
+    {
+        string file_path = get_local_path();
+        LOG_DEBUG(LogCategory::File, "Opening " << file_path);
+        return file.open(file_path);
+    }
+
+    // Whether a file:// page is HTML to lay out, rather than text to show as it is
+    bool local_is_html(const FileView& file) const
+    {
+        return file.is_directory() || is_html_path(this->path);
+    }
+
+    // Status of the last response (after redirects), 0 if there wasn't one
+    int get_status() const
+    {
+        return this->status;
+    }
+
+    string get_header(const string& name) const
+    {
+        return string(this->header_fields.get(name));
+    }
+
+    const vector<RequestTiming>& get_timings() const
+    {
+        return this->timings;
+    }
+
+    void set_revalidate(bool revalidate)
+    {
+        this->revalidate = revalidate;
+    }
+
+    // Reports download progress there, and stops early once it's cancelled
+    void set_progress(TransferProgress* progress)
+    {
+        this->progress = progress;
+    }
+
+    // How urgent the response is (0-7, RFC 9218), and whether it's usable bit by bit.
+    // Only HTTP/2 servers hear about it, HTTP/1.1 has no way to say.
+    void set_priority(int urgency, bool incremental)
+    {
+        this->urgency = urgency;
+        this->incremental = incremental;
+    }
+
+    // Responses that are files to save rather than pages to show (see
+    // DownloadManager::is_download()) aren't read past their headers: request()
+    // returns "" with is_download() set and the headers in get_response_headers(),
+    // for the download manager to fetch the file its own way
+    void set_download_handoff(bool handoff)
+    {
+        this->download_handoff = handoff;
+    }
+
+    bool is_download() const
+    {
+        return this->download;
+    }
+
+    bool is_cancelled() const
+    {
+        return this->progress && this->progress->cancelled;
+    }
+
+    // host, or host:port when the port isn't the scheme's default
+    string authority() const
+    {
+        bool default_port = (this->port == 80 && contains(this->scheme, "http") && !contains(this->scheme, "https")) ||
+                            (this->port == 443 && contains(this->scheme, "https"));
+        if(default_port || this->scheme == "file") return this->host;
+        return this->host + ":" + to_string(this->port);
+    }
+
     void set(const string& url)
     {
         // Split by scheme
         vector<string> scheme_parts = split(url, "://");
         if(scheme_parts.size() != 2)
         {
-            cerr << "Invalid URL format: " << url << endl;
+            LOG_ERROR(LogCategory::Http, "Invalid URL format: " << url);
             throw invalid_argument("Invalid URL format");
         }
         
@@ -71,7 +324,7 @@ public:
         vector<string> valid_schemes = {"http", "https", "file", "view-source:http", "view-source:https"};
         if(this->scheme.empty() || url_without_scheme.empty() || find(valid_schemes.begin(), valid_schemes.end(), this->scheme) == valid_schemes.end())
         {
-            cerr << "Invalid URL format or unsupported scheme: " << url << endl;
+            LOG_ERROR(LogCategory::Http, "Invalid URL format or unsupported scheme: " << url);
             throw invalid_argument("Invalid URL format or unsupported scheme");
         }
 
@@ -85,14 +338,14 @@ public:
             this->port = 443;
         }
 
-        cout << "URL without scheme: " << url_without_scheme << endl;
+        LOG_DEBUG(LogCategory::Http, "URL without scheme: " << url_without_scheme);
 
         // Split the URL without scheme to get host and path
         vector<string> parts = split(url_without_scheme, "/");
         
         if(parts.empty())
         {
-            cerr << "Invalid URL format: " << url << endl;
+            LOG_ERROR(LogCategory::Http, "Invalid URL format: " << url);
             throw invalid_argument("Invalid URL format");
         }
 
@@ -106,7 +359,7 @@ public:
             try {
                 this->port = stoi(host_parts[1]);
             } catch (const invalid_argument& e) {
-                cerr << "Invalid port number in URL: " << url << endl;
+                LOG_ERROR(LogCategory::Http, "Invalid port number in URL: " << url);
                 throw invalid_argument("Invalid port number in URL");
             }
         }
@@ -126,255 +379,664 @@ public:
             this->path = "/";
         }
 
-        this->url = this->scheme + "://" + this->host + this->path;
+        this->url = this->scheme + "://" + authority() + this->path;
     }
 
     string request()
     {
-        if(this->scheme == "https" || this->scheme == "view-source:https")
+        HTTPExchange exchange;
+        string result;
+        if(!begin_exchange(exchange, result)) return result;
+
+        return request_pooled(exchange);
+    }
+
+    // Starts a request for the current URL: applies HSTS and remembered redirects,
+    // then answers from the archive or a fresh cache entry if it can. Returns false
+    // with result set when nothing has to go out on the network.
+    bool begin_exchange(HTTPExchange& exchange, string& result)
+    {
+        if(this->scheme == "file")
         {
-            return request_https();
+            LOG_DEBUG(LogCategory::File, "Opening " << this->path);
+            result = load_file(this->path);
+            return false;
         }
-        else if(this->scheme == "file")
+
+        apply_known_redirects();
+
+        exchange.connection_scheme = (this->scheme == "https" || this->scheme == "view-source:https") ? "https" : "http";
+        exchange.cache_key = exchange.connection_scheme + "://" + this->host + ":" + to_string(this->port) + this->path;
+        exchange.have_cached = !this->unconditional && HTTPCache::instance().lookup(exchange.cache_key, exchange.cached);
+        this->unconditional = false;
+
+        NetworkLog& network_log = NetworkLog::instance();
+        exchange.started = chrono::steady_clock::now();
+
+        RequestTiming& timing = exchange.timing;
+        timing.url = exchange.connection_scheme + "://" + authority() + this->path;
+        timing.start_ms = network_log.to_ms(exchange.started);
+        timing.redirect_hop = this->redirect_depth;
+
+        // Replaying a saved page: answer from the archive, and stay off the network
+        shared_ptr<const PageArchive> archive = ArchiveReplay::instance().get();
+        if(archive)
         {
-            std::cout << this->path << std::endl;
-            return load_file(this->path);
+            string_view archived_headers, archived_body;
+            timing.from_archive = true;
+
+            if(!archive->find(timing.url, archived_headers, archived_body))
+            {
+                LOG_WARN(LogCategory::Http, "Not in the archive, not fetching: " << timing.url);
+                record_timing(timing, exchange.started);
+                result = "";
+                return false;
+            }
+
+            LOG_DEBUG(LogCategory::Http, "Replaying " << timing.url << " from the archive");
+            string response_headers(archived_headers);
+            HTTPHeaders archived_fields;
+            archived_fields.parse(response_headers);
+            timing.status = archived_fields.get_status();
+            record_timing(timing, exchange.started);
+
+            result = start_parsing(response_headers, string(archived_body));
+            return false;
         }
-        else
+
+        CachedResponse& cached = exchange.cached;
+        if(exchange.have_cached && !this->revalidate && cached.is_fresh(time(nullptr)))
         {
-            return request_http();
+            LOG_DEBUG(LogCategory::Cache, "Serving " << exchange.cache_key << " from cache");
+
+            HTTPHeaders cached_fields;
+            cached_fields.parse(cached.headers);
+            timing.status = cached_fields.get_status();
+            timing.from_cache = true;
+            record_timing(timing, exchange.started);
+
+            HTTPRecorder::instance().record(timing.url, cached.headers, cached.body);
+            result = start_parsing(cached.headers, move(cached.body));
+            return false;
         }
-    }
 
-	string request_https()
-	{
-        TcpSslClientSocket socket(this->host.c_str(), this->port);
-		
+        return true;
+    }
 
-		socket.openConnection();
+    // What connecting cost, for a connection opened for this exchange. A pooled
+    // one already paid for it.
+    void connection_opened(HTTPExchange& exchange, TcpClientSocket& socket, bool reused)
+    {
+        RequestTiming& timing = exchange.timing;
+        timing.reused_connection = reused;
+        if(reused) return;
+
+        const ConnectTimings& connect_timings = socket.getTimings();
+        timing.dns_ms = connect_timings.dnsMs;
+        timing.connect_ms = connect_timings.connectMs;
+        timing.tls_ms = connect_timings.tlsMs;
+
+        TcpSslClientSocket* ssl_socket = dynamic_cast<TcpSslClientSocket*>(&socket);
+        timing.tls_resumed = ssl_socket && ssl_socket->isSessionReused();
+        timing.early_data = ssl_socket && ssl_socket->earlyDataAccepted();
+    }
 
-        if (socket.isSSLConnected()) {
+    // The exchange never got a connection. Returns what request() would.
+    string connection_failed(HTTPExchange& exchange, TcpClientSocket& socket)
+    {
+        LOG_ERROR(LogCategory::Net, "Connection to " << this->host << " failed: " << socket.getMessage());
+        exchange.timing.dns_ms = socket.getTimings().dnsMs;
+        exchange.timing.connect_ms = socket.getTimings().connectMs;
+        record_timing(exchange.timing, exchange.started);
 
-            std::cout << "SSL connection established!" << std::endl;
+        if(exchange.connection_scheme == "https")
+        {
+            return "SSL Connection could not be established.";
+        }
+        return "";
+    }
 
-            
+    // The HTTP/1.1 GET for the exchange, ready to write. It may go out with the TLS
+    // handshake (0-RTT), so it's made before there's a connection; mark_sent() once
+    // the connection is there.
+    string request_head(const HTTPExchange& exchange) const
+    {
+        string request;
+        request += "GET " + this->path + " HTTP/1.1\r\n";
+        request += "Host: " + authority() + "\r\n";
+        request += "Connection: keep-alive\r\n";
+        for(const HeaderField& field : request_fields(exchange.have_cached, exchange.cached))
+        {
+            request += field.first + ": " + field.second + "\r\n";
+        }
+        request += "\r\n";
+        LOG_TRACE(LogCategory::Http, "Request to " << this->host << ":\n" << request);
+        return request;
+    }
 
-            string request;
-            request += "GET " + this->path + " HTTP/1.1\r\n";
-            request += "Host: " + this->host + "\r\n";
-            request += "Connection: close\r\n";
-            request += "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/138.0.0.0 Safari/537.36\r\n";
+    // Time to first byte counts from here
+    void mark_sent(HTTPExchange& exchange) const
+    {
+        exchange.request_time = time(nullptr);
+        exchange.sent = chrono::steady_clock::now();
+    }
 
-            request += "\r\n";
-            cout << request;
+    // Makes sense of the HTTP/1.1 response read for the exchange: timing, cache,
+    // and the body (or error text) request() would return. complete says whether
+    // the whole response arrived.
+    string finish_exchange(HTTPExchange& exchange, HTTPResponseReader& reader, bool complete)
+    {
+        RequestTiming& timing = exchange.timing;
+        if(reader.has_first_byte())
+        {
+            timing.ttfb_ms = chrono::duration<double, milli>(reader.get_first_byte_time() - exchange.sent).count();
+            timing.download_ms = chrono::duration<double, milli>(reader.get_complete_time() - reader.get_first_byte_time()).count();
+        }
+        timing.bytes_received += reader.get_bytes_received();
+        timing.status = reader.get_status();
+        timing.timed_out = reader.has_timed_out();
+        record_timing(timing, exchange.started);
 
-            if(!socket.sendData((void*)request.c_str(), request.size()))
+        if(!reader.has_headers())
+        {
+            if(reader.has_timed_out())
             {
-                cerr << "Failed to send request to " << this->host << endl;
-                return "";
+                LOG_ERROR(LogCategory::Http, this->host << " timed out without answering");
             }
+            else
+            {
+                LOG_ERROR(LogCategory::Http, "No response received from " << this->host);
+            }
+            return "";
+        }
 
+        if(!complete)
+        {
+            LOG_WARN(LogCategory::Http, "Response from " << this->host << (reader.has_timed_out() ? " stalled and timed out" : " was cut short"));
+        }
 
-            std::string response_str;
-            const size_t CHUNK = 4096;
-            std::vector<char> buf(CHUNK);
-            int n;
+        // The body isn't logged, it can be megabytes
+        string response_headers(reader.get_headers());
+        LOG_TRACE(LogCategory::Http, "Response from " << this->host << ":\n" << response_headers << "\n(" << reader.get_body_size() << " byte body)");
 
-            while ((n = socket.receiveDataInt(buf.data(), CHUNK)) > 0) {
-                response_str.append(buf.data(), n);
-            }
+        return handle_response(exchange.connection_scheme, timing.url, exchange.cache_key, exchange.have_cached, reader.get_fields(),
+                               response_headers, reader.take_body(), complete, exchange.request_time, time(nullptr));
+    }
 
-            cout << "Response from " << this->host << ":\n" << response_str << endl;
+    // Redirects don't go out on their own: after a response that was one, the URL
+    // already points at the target, and this says to begin_exchange() again. So
+    // does a 304 there was no cached copy left for, see handle_response().
+    void set_defer_redirects(bool defer)
+    {
+        this->defer_redirects = defer;
+    }
 
-            socket.closeConnection();
+    bool take_pending_redirect()
+    {
+        bool pending = this->redirect_pending;
+        this->redirect_pending = false;
+        return pending;
+    }
 
-            if(response_str.empty())
-            {
-                cerr << "No response received from " << this->host << endl;
-                return "";
-            }
+    // Everything after the request line and Host, the same for both HTTP versions
+    vector<HeaderField> request_fields(bool have_cached, const CachedResponse& cached) const
+    {
+        vector<HeaderField> fields;
+        fields.push_back({ "Accept-Encoding", ACCEPT_ENCODING });
+        fields.push_back({ "User-Agent", USER_AGENT });
 
-            // Seperate headers and body
-            return start_parsing(response_str);
-        }
-        else
+        if(this->revalidate)
         {
-            std::cout << "SSL connection failed: " << socket.getMessage() << std::endl;
-            return "SSL Connection could not be established.";
+            fields.push_back({ "Cache-Control", "max-age=0" });
         }
-		
 
+        // Let the server answer 304 if our copy is still good
+        if(have_cached)
+        {
+            string etag = cached.header("ETag");
+            string last_modified = cached.header("Last-Modified");
+            if(!etag.empty()) fields.push_back({ "If-None-Match", etag });
+            if(!last_modified.empty()) fields.push_back({ "If-Modified-Since", last_modified });
+        }
 
-	}
+        return fields;
+    }
 
+    // A response that came off the network, whichever way: remembers what it says
+    // about the host, updates the cache and hands it to start_parsing
+    string handle_response(const string& connection_scheme, const string& request_url, const string& cache_key,
+                           bool have_cached, const HTTPHeaders& fields, const string& response_headers, string response_body,
+                           bool complete, time_t request_time, time_t response_time)
+    {
+        remember_policies(connection_scheme, request_url, fields, response_headers, request_time, response_time);
 
-    string request_http()
-	{
+        HTTPCache& cache = HTTPCache::instance();
+        int response_status = fields.get_status();
 
-        TcpClientSocket socket(this->host.c_str(), this->port);		
+        if(response_status == 304 && have_cached)
+        {
+            CachedResponse updated;
+            if(cache.freshen(cache_key, response_headers, request_time, response_time, updated))
+            {
+                LOG_DEBUG(LogCategory::Cache, "Not modified, using cached copy of " << cache_key);
+                HTTPRecorder::instance().record(request_url, updated.headers, updated.body);
+                return start_parsing(updated.headers, move(updated.body));
+            }
 
-		socket.openConnection();
+            // Evicted since the request went out: a 304 has nothing to show, so ask
+            // again without validators. A server that still says 304 gets shown it.
+            LOG_DEBUG(LogCategory::Cache, "Not modified, but the cached copy of " << cache_key << " is gone, asking for all of it");
+            this->unconditional = true;
+            if(this->defer_redirects)
+            {
+                this->redirect_pending = true;
+                return "";
+            }
+            return request();
+        }
 
-        if(this->scheme == "https")
+        if(complete && response_status == 200)
         {
-            std::cout << "SSL connection established!" << std::endl;
+            cache.store(cache_key, response_headers, response_body, request_time, response_time);
+        }
 
+        HTTPRecorder::instance().record(request_url, response_headers, response_body);
+        return start_parsing(response_headers, move(response_body));
+    }
+
+    // Sends the GET as a stream on the host's HTTP/2 session. Returns false if it
+    // never reached the server (refused, or the session went away first) and can
+    // be sent again; result is set otherwise.
+    bool request_h2(HTTP2Connection& session, HTTPExchange& exchange, string& result)
+    {
+        HTTP2Request request;
+        request.scheme = exchange.connection_scheme;
+        request.authority = authority();
+        request.path = this->path;
+        request.urgency = this->urgency;
+        request.incremental = this->incremental;
+        for(HeaderField& field : request_fields(exchange.have_cached, exchange.cached))
+        {
+            request.fields.push_back({ to_lowercase(field.first), move(field.second) });
         }
-        
 
-        string request;
-        request += "GET " + this->path + " HTTP/1.1\r\n";
-        request += "Host: " + this->host + "\r\n";
-        request += "Connection: close\r\n";
-        request += "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/138.0.0.0 Safari/537.36\r\n";
+        time_t request_time = time(nullptr);
+        chrono::steady_clock::time_point sent = chrono::steady_clock::now();
 
-        request += "\r\n";
-        cout << request;
+        uint32_t stream_id = session.submit(request, this->progress);
+        if(stream_id == 0) return false;
 
-        if(!socket.sendData((void*)request.c_str(), request.size()))
+        function<bool(const HTTP2Response&)> header_check;
+        if(hands_off_downloads())
         {
-            cerr << "Failed to send request to " << this->host << endl;
-            return "";
+            header_check = [](const HTTP2Response& response) {
+                string head = h2_head(response);
+                HTTPHeaders fields;
+                fields.parse(head);
+                return !DownloadManager::is_download(fields);
+            };
         }
+        RequestTimeouts::Limits limits = RequestTimeouts::instance().get_limits();
+        HTTP2Response response = session.wait(stream_id, limits.first_byte_ms, limits.idle_ms, header_check);
 
+        time_t response_time = time(nullptr);
+        result = "";
 
-        std::string response_str;
-        const size_t CHUNK = 4096;
-        std::vector<char> buf(CHUNK);
-        int n;
+        if(is_cancelled()) return true;
+        if(response.failed && response.retryable) return false;
 
-        while ((n = socket.receiveDataInt(buf.data(), CHUNK)) > 0) {
-            response_str.append(buf.data(), n);
+        RequestTiming& timing = exchange.timing;
+        if(response.has_first_byte)
+        {
+            timing.ttfb_ms = chrono::duration<double, milli>(response.first_byte_time - sent).count();
+            timing.download_ms = chrono::duration<double, milli>(response.complete_time - response.first_byte_time).count();
         }
+        timing.bytes_received += response.bytes_received;
+        timing.status = response.status;
+        timing.timed_out = response.timed_out;
+        record_timing(timing, exchange.started);
 
-        cout << "Response from " << this->host << ":\n" << response_str << endl;
-
-        socket.closeConnection();
+        if(response.status == 0)
+        {
+            if(response.timed_out)
+            {
+                LOG_ERROR(LogCategory::Http, this->host << " timed out without answering");
+            }
+            else
+            {
+                LOG_ERROR(LogCategory::Http, "No response received from " << this->host);
+            }
+            return true;
+        }
 
-        if(response_str.empty())
+        if(response.stopped)
         {
-            cerr << "No response received from " << this->host << endl;
-            return "";
+            result = hand_off(h2_head(response));
+            return true;
         }
 
-        if(response_str.empty())
+        if(response.failed)
         {
-            cerr << "No response received from " << this->host << endl;
-            return "";
+            LOG_WARN(LogCategory::Http, "Response from " << this->host << (response.timed_out ? " stalled and timed out" : " was cut short"));
         }
 
-        return start_parsing(response_str);
+        string response_headers = h2_head(response);
+        string content_encoding;
+        for(const HeaderField& field : response.fields)
+        {
+            if(field.first == "content-encoding") content_encoding = field.second;
+        }
+        LOG_TRACE(LogCategory::Http, "Response from " << this->host << ":\n" << response_headers << "\n(" << response.body.size() << " byte body)");
 
+        // Stream bodies are never transfer-coded, but they can still be compressed
+        string response_body;
+        ContentDecoderChain decoder;
+        if(content_encoding.empty() || !decoder.set_encoding(content_encoding) || decoder.empty())
+        {
+            if(!content_encoding.empty() && decoder.empty())
+            {
+                LOG_WARN(LogCategory::Http, "Unsupported Content-Encoding: " << content_encoding);
+            }
+            response_body = move(response.body);
+        }
+        else if(!decoder.write(response.body.data(), response.body.size(), response_body))
+        {
+            LOG_WARN(LogCategory::Http, "Could not decode the " << content_encoding << " body from " << this->host);
+            response.failed = true;
+        }
 
-	}
+        HTTPHeaders fields;
+        fields.parse(response_headers);
+        result = handle_response(exchange.connection_scheme, timing.url, exchange.cache_key, exchange.have_cached, fields,
+                                 response_headers, move(response_body), !response.failed, request_time, response_time);
+        return true;
+    }
 
-    string start_parsing(string response_str)
+    // An HTTP/2 response's status and fields laid out like an HTTP/1.1 head, that's
+    // what the cache, the archive and the parser all read
+    static string h2_head(const HTTP2Response& response)
     {
-        cout << "Staring parsing...";
-
-        size_t header_end = response_str.find("\r\n\r\n");
-        if(header_end == string::npos)
+        string head = "HTTP/2 " + to_string(response.status);
+        for(const HeaderField& field : response.fields)
         {
-            cerr << "Invalid response format from " << this->host << endl;
-            return "";
+            head += "\r\n" + field.first + ": " + field.second;
         }
-        this->headers = response_str.substr(0, header_end);
-        this->body = response_str.substr(header_end + 4); // Skip the "\r\n\r\n"
-        cout << "Headers:\n" << this->headers << endl;
-        cout << "Body:\n" << this->body << endl;
+        return head;
+    }
 
-        // Parse headers into a map
-        vector<string> header_lines = split(this->headers, "\r\n");
+    // Whether a response that's a file stops at its headers; view-source: shows anything as text
+    bool hands_off_downloads() const
+    {
+        return this->download_handoff && this->scheme != "view-source:http" && this->scheme != "view-source:https";
+    }
 
-        // HTTP version and status code
-        if(header_lines.empty())
+    // The response is a file for the download manager, only its headers are kept
+    string hand_off(const string& response_headers)
+    {
+        LOG_INFO(LogCategory::Http, this->url << " is a file, leaving it to the download manager");
+        this->headers = response_headers;
+        this->header_fields.parse(this->headers);
+        this->status = this->header_fields.get_status();
+        this->download = true;
+        this->should_parse = false;
+        return "";
+    }
+
+    // The request on socket has waited longer for its first byte than most to the
+    // host do: send it again on a fresh connection, to another of the host's
+    // addresses if it has one, and keep whichever connection starts answering
+    // first. socket ends up holding the winner, the other one is closed.
+    void hedge(HTTPExchange& exchange, unique_ptr<TcpClientSocket>& socket, const string& request, int first_byte_ms, int waited_ms)
+    {
+        ConnectionPool& pool = ConnectionPool::instance();
+        const string& connection_scheme = exchange.connection_scheme;
+
+        // Only a new connection will do, and only if the host's limit allows one more
+        unique_ptr<TcpClientSocket> idle;
+        if(pool.try_acquire(connection_scheme, this->host, this->port, idle, false) != ConnectionPool::Slot::New) return;
+
+        unique_ptr<TcpClientSocket> second = pool.make_socket(connection_scheme, this->host, this->port);
+        second->avoidAddressOf(*socket);
+
+        // An HTTP/2 answer would have to become a session first, not worth it here
+        TcpSslClientSocket* ssl_second = dynamic_cast<TcpSslClientSocket*>(second.get());
+        if(ssl_second) ssl_second->setOfferHttp2(false);
+
+        second->openConnection();
+        if(!second->isConnected() || !second->sendData((void*)request.c_str(), request.size()))
         {
-            cerr << "No headers found in response from " << this->host << endl;
-            return "";
+            pool.release(connection_scheme, this->host, this->port, move(second), false);
+            return;
         }
-        string first_line = header_lines[0];
-        vector<string> first_line_parts = split(first_line, " ");
-        if(first_line_parts.size() < 3)
+
+        LOG_INFO(LogCategory::Net, "No answer from " << this->host << " after " << waited_ms << " ms, hedging " << exchange.timing.url);
+        exchange.timing.hedged = true;
+
+        auto deadline = exchange.sent + chrono::milliseconds(first_byte_ms);
+        while(!is_cancelled())
         {
-            cerr << "Invalid first line in response from " << this->host << endl;
-            return "";
+            if(socket->waitReadable(0)) break;
+            if(second->waitReadable(0))
+            {
+                LOG_DEBUG(LogCategory::Net, "Hedged request to " << this->host << " answered first");
+                swap(socket, second);
+                break;
+            }
+
+            // The reader times the request out from here
+            int slice = 100;
+            if(first_byte_ms >= 0)
+            {
+                long long left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+                if(left <= 0) break;
+                slice = (int)min(left, 100LL);
+            }
+            TcpSocket::waitEitherReadable(*socket, *second, slice);
         }
-        this->status = stoi(first_line_parts[1]);
-        this->status_message = first_line_parts[2];
 
-        header_lines.erase(header_lines.begin());
+        pool.release(connection_scheme, this->host, this->port, move(second), false);
+    }
 
-        for(const string& line : header_lines)
+    // Sends the GET over a kept-alive connection from the pool and reads one response.
+    // The connection goes back to the pool afterwards if the response was fully framed.
+    // Hosts that negotiated HTTP/2 get a stream on their shared session instead.
+    // Slow HTTP/1.1 requests are hedged, see RequestTimeouts.
+    string request_pooled(HTTPExchange& exchange)
+    {
+        ConnectionPool& pool = ConnectionPool::instance();
+        const string& connection_scheme = exchange.connection_scheme;
+
+        int refused = 0;       // HTTP/2 streams the server turned away before looking at them
+        bool promoted = false; // This request opened the HTTP/2 session it's about to use
+
+        while(true)
         {
-            size_t colon_pos = line.find(": ");
-            if(colon_pos != string::npos)
+            if(is_cancelled()) return "";
+
+            string result;
+            shared_ptr<HTTP2Connection> session = pool.acquire_session(connection_scheme, this->host, this->port);
+            if(session)
+            {
+                exchange.timing.reused_connection = !promoted;
+                if(request_h2(*session, exchange, result)) return result;
+                if(++refused < 3) continue;
+
+                LOG_ERROR(LogCategory::Http, "HTTP/2 requests to " << this->host << " keep getting refused");
+                record_timing(exchange.timing, exchange.started);
+                return "";
+            }
+
+            // A new TLS connection to a host we've been to may carry it in its handshake
+            string request = request_head(exchange);
+            bool reused = false;
+            unique_ptr<TcpClientSocket> socket = pool.acquire(connection_scheme, this->host, this->port, &reused, request);
+
+            if(!socket->isConnected())
+            {
+                result = connection_failed(exchange, *socket);
+                pool.release(connection_scheme, this->host, this->port, move(socket), false);
+                return result;
+            }
+
+            if(!reused && connection_scheme == "https")
+            {
+                LOG_DEBUG(LogCategory::Net, "SSL connection established with " << this->host);
+            }
+            connection_opened(exchange, *socket, reused);
+
+            // ALPN picked the protocol during the handshake (a preconnected socket may
+            // have done so too): HTTP/2 connections become the host's shared session
+            TcpSslClientSocket* ssl_socket = dynamic_cast<TcpSslClientSocket*>(socket.get());
+            if(ssl_socket && ssl_socket->negotiatedProtocol() == "h2")
+            {
+                if(!pool.promote(connection_scheme, this->host, this->port, move(socket)))
+                {
+                    LOG_ERROR(LogCategory::Net, "HTTP/2 session with " << this->host << " could not be started");
+                    record_timing(exchange.timing, exchange.started);
+                    return "";
+                }
+
+                promoted = !reused;
+                continue;
+            }
+            if(ssl_socket && !reused)
             {
-                string key = line.substr(0, colon_pos);
-                string value = line.substr(colon_pos + 2);
-                this->header_map[key] = value;
+                pool.demote(connection_scheme, this->host, this->port);
             }
+
+            mark_sent(exchange);
+            bool early = !reused && ssl_socket && ssl_socket->earlyDataAccepted(); // A kept-alive one's went with an earlier request
+            if(early)
+            {
+                LOG_DEBUG(LogCategory::Net, "Request to " << this->host << " went out with the handshake (0-RTT)");
+            }
+
+            RequestTimeouts::Limits limits = RequestTimeouts::instance().get_limits();
+            HTTPResponseReader reader;
+            reader.set_progress(this->progress);
+            reader.set_timeouts(limits.first_byte_ms, limits.idle_ms, exchange.sent);
+            if(hands_off_downloads())
+            {
+                reader.set_header_check([](const HTTPResponseReader& response) {
+                    return !DownloadManager::is_download(response.get_fields());
+                });
+            }
+            bool complete = false;
+
+            if(early || socket->sendData((void*)request.c_str(), request.size()))
+            {
+                int hedge_ms = RequestTimeouts::instance().hedge_delay_ms(this->host);
+                if(hedge_ms >= 0 && !socket->waitReadable(hedge_ms) && !is_cancelled())
+                {
+                    hedge(exchange, socket, request, limits.first_byte_ms, hedge_ms);
+                }
+                complete = reader.read_from(*socket);
+            }
+
+            // Plain HTTP only sends its SYN with the request, so it's known from here
+            exchange.timing.fast_open = !reused && socket->usedFastOpen();
+            pool.release(connection_scheme, this->host, this->port, move(socket), reader.keep_alive());
+
+            if(is_cancelled()) return "";
+
+            // The server may have dropped an idle connection just as we picked it up,
+            // that's not an error, just try again on another one
+            if(!reader.has_headers() && reused && !reader.has_timed_out())
+            {
+                continue;
+            }
+
+            if(reader.was_stopped())
+            {
+                exchange.timing.status = reader.get_status();
+                exchange.timing.bytes_received += reader.get_bytes_received();
+                record_timing(exchange.timing, exchange.started);
+                return hand_off(string(reader.get_headers()));
+            }
+
+            return finish_exchange(exchange, reader, complete);
         }
+    }
+
+    string start_parsing(const string& response_headers, string response_body)
+    {
+        this->headers = response_headers;
+        this->body = move(response_body);
+
+        // HTTP version and status code
+        if(this->headers.empty())
+        {
+            LOG_ERROR(LogCategory::Http, "No headers found in response from " << this->host);
+            return "";
+        }
+        if(!this->header_fields.parse(this->headers))
+        {
+            LOG_ERROR(LogCategory::Http, "Invalid first line in response from " << this->host);
+            return "";
+        }
+        this->status = this->header_fields.get_status();
+        this->status_message = string(this->header_fields.get_reason());
 
         if(this->status == 200)
         {
-            cout << "HTTP Status: " << this->status << " " << this->status_message << endl;
-            cout << "rendering time" << endl;
+            LOG_DEBUG(LogCategory::Http, "HTTP Status: " << this->status << " " << this->status_message << " from " << this->host);
             if(!this->body.empty())
             {
+                // Hand the body over instead of copying it, it isn't needed here anymore
                 if(this->scheme == "view-source:http" || this->scheme == "view-source:https")
                 {
                     this->should_parse = false;
-                    return this->body;
+                    return move(this->body);
                 }
                 else
                 {
                     this->should_parse = true;
-                    return this->body;
+                    return move(this->body);
                 }
 
             }
             else
             {
-                cout << "No body";
+                LOG_WARN(LogCategory::Http, "No body in response from " << this->host);
                 return "Body not found. Tags:\n\n" + this->headers;
             }
         }
-        else if (this->status == 301 || this->status == 302) {
+        // Only GETs are sent, so 303's "switch to GET" and 307/308's "keep the method" change nothing
+        else if (this->status == 301 || this->status == 302 || this->status == 303 || this->status == 307 || this->status == 308) {
             if (this->redirect_depth < this->max_depth) {
-                std::string location = this->header_map["Location"];
-                // Trim whitespace
-                location.erase(location.find_last_not_of(" \n\r\t") + 1);
-                location.erase(0, location.find_first_not_of(" \n\r\t"));
+                // Field names are case-insensitive, "location:" is just as valid
+                std::string location = resolve_location(std::string(this->header_fields.get(HeaderId::Location)));
                 if (location.empty()) {
-                    std::cerr << "No Location header found for red irect" << std::endl;
+                    LOG_ERROR(LogCategory::Http, "No Location header found for redirect");
                     return "No Location header found for redirect";
                 }
 
-                // Check if the location is relative
-                if (location[0] == '/') {
-                    location = this->scheme + "://" + this->host + location;
-                } 
-                else if (location.find("://") == std::string::npos) {
-                    // If it doesn't contain a scheme, assume it's relative to the current host
-                    location = this->scheme + "://" + this->host + "/" + location;
-                }
-
-                std::cout << "Redirecting to: " << location << std::endl;
+                LOG_INFO(LogCategory::Http, "Redirecting to: " << location);
+                std::string from = this->url;
                 try {
                     this->set(location);
                 } catch (const std::exception& e) {
-                    std::cerr << "Failed to set redirect URL: " << e.what() << std::endl;
+                    LOG_ERROR(LogCategory::Http, "Failed to set redirect URL: " << e.what());
                     return "Invalid Location header for redirect";
                 }
+                this->redirect_chain.push_back(from);
                 this->redirect_depth += 1;
+                if (this->defer_redirects) {
+                    this->redirect_pending = true;
+                    return "";
+                }
                 return this->request(); // Always return the result!
             } else {
+                // A remembered redirect may be what's going round in circles, ask again next time
+                for (const std::string& hop : this->redirect_chain) {
+                    PermanentRedirects::instance().forget(hop);
+                }
                 return "Maximum amount of redirects reached.\nThe website you're visiting might've fallen into a redirect loop; Please try again.";
             }
         }
         else
         {
-            cerr << "HTTP Error " << this->status << ": " << this->status_message << endl;
+            LOG_WARN(LogCategory::Http, "HTTP Error " << this->status << ": " << this->status_message);
             return "HTTP Error " + to_string(this->status) + ": " + this->status_message;
         }
 
@@ -0,0 +1,429 @@
+#pragma once
+
+#ifndef LAKYS_SUBRESOURCE_FETCHER_HPP
+#define LAKYS_SUBRESOURCE_FETCHER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "lakys-subresource.hpp"
+#include "lakys-socket-handler.hpp"
+#include "lakys-fetch-engine.hpp"
+
+using namespace std;
+
+// Loads a page's stylesheets, scripts and images side by side. HTTP/1.1 fetches
+// go to FetchEngine, which does them all on the network thread; file:// URLs
+// and hosts that speak HTTP/2 are left to a few worker threads. Each URL is
+// fetched once per page, and no host gets more than max_per_host requests at a
+// time (the connection pool's limit), so one slow host can't hold up the
+// others. Finished resources are collected for the render thread to pick up
+// with poll().
+//
+// Whenever a host has room for another request, the queued one that matters
+// most to the first paint goes: what holds up rendering (stylesheets, fonts),
+// then images on screen, then the rest, images nearest the screen first. The
+// page itself is ahead of all of them (see ConnectionPool::try_acquire()). The
+// render thread reports what's on screen with set_viewport() as the user
+// scrolls; HTTP/2 streams already on their way are reprioritized to match.
+//
+// Every navigation starts a new page generation; anything still queued or in
+// flight for an older one is cancelled and its results are dropped.
+class SubresourceFetcher
+{
+private:
+    struct Job
+    {
+        int generation;
+        string url;
+        string origin;  // scheme://host:port, what the per-host limit counts
+        ResourceKind kind;
+        size_t token;    // Where its tag is on the page, see set_viewport()
+        uint64_t order;  // Ties go to the one the page asked for first
+    };
+
+    // A request on its way, to cancel or reprioritize
+    struct Request
+    {
+        int generation;
+        ResourceKind kind;
+        size_t token;
+    };
+
+    mutex fetch_mutex;
+    condition_variable work_ready;
+    condition_variable engine_idle;
+
+    int generation = 0;
+    deque<Job> queue;
+    set<string> seen;                               // URLs already asked for in this generation
+    map<string, int> active_per_host;
+    map<TransferProgress*, Request> in_flight;
+    int engine_jobs = 0;                            // Handed to FetchEngine, not called back yet
+    vector<PageResource> finished;
+    uint64_t next_order = 0;
+
+    // Page tokens on screen. Until a new page reports its own, the first screenful
+    // is guessed to be as long as the last page's.
+    size_t viewport_first = 0;
+    size_t viewport_last = 100;
+
+    size_t max_per_host = 6;
+    vector<thread> workers;
+    bool stopping = false;
+
+    static string origin_of(const string& url)
+    {
+        size_t scheme_end = url.find("://");
+        if(scheme_end == string::npos) return url;
+        return url.substr(0, url.find('/', scheme_end + 3));
+    }
+
+    // Caller must hold fetch_mutex, for this and the *_locked() below.
+    // Tokens between it and the screen, 0 if it's on it
+    size_t distance_locked(size_t token) const
+    {
+        if(token < this->viewport_first) return this->viewport_first - token;
+        if(token > this->viewport_last) return token - this->viewport_last;
+        return 0;
+    }
+
+    // 0 holds up rendering, 1 is an image on screen, 2 is everything else
+    // (scripts, which nothing runs yet, and images further down)
+    int rank_locked(ResourceKind kind, size_t token) const
+    {
+        switch(kind)
+        {
+            case ResourceKind::Stylesheet:
+            case ResourceKind::Font: return 0;
+            case ResourceKind::Image: return distance_locked(token) == 0 ? 1 : 2;
+            default: return 2;
+        }
+    }
+
+    // The rank as an RFC 9218 urgency, for HTTP/2 servers and FetchEngine
+    int urgency_locked(ResourceKind kind, size_t token) const
+    {
+        int rank = rank_locked(kind, token);
+        if(rank < 2) return rank + 1;
+        return kind == ResourceKind::Image ? 4 : 3;
+    }
+
+    // Whether a should be fetched before b
+    bool before_locked(const Job& a, const Job& b) const
+    {
+        int rank_a = rank_locked(a.kind, a.token);
+        int rank_b = rank_locked(b.kind, b.token);
+        if(rank_a != rank_b) return rank_a < rank_b;
+
+        size_t distance_a = a.kind == ResourceKind::Image ? distance_locked(a.token) : 0;
+        size_t distance_b = b.kind == ResourceKind::Image ? distance_locked(b.token) : 0;
+        if(distance_a != distance_b) return distance_a < distance_b;
+        return a.order < b.order;
+    }
+
+    // Caller must hold fetch_mutex. Takes the most important queued job whose host
+    // has room; HTTP/2 hosts always have room, the requests are streams on one connection.
+    bool take_next(Job& job)
+    {
+        ConnectionPool& pool = ConnectionPool::instance();
+
+        auto best = this->queue.end();
+        for(auto it = this->queue.begin(); it != this->queue.end(); ++it)
+        {
+            if(best != this->queue.end() && !before_locked(*it, *best)) continue;
+            if(this->active_per_host[it->origin] < (int)this->max_per_host || pool.is_multiplexed(it->origin))
+            {
+                best = it;
+            }
+        }
+        if(best == this->queue.end()) return false;
+
+        job = move(*best);
+        this->queue.erase(best);
+        return true;
+    }
+
+    void host_done_locked(const string& origin)
+    {
+        if(--this->active_per_host[origin] == 0)
+        {
+            this->active_per_host.erase(origin);
+        }
+
+        // A slot on that host is free again
+        this->work_ready.notify_all();
+    }
+
+    static PageResource load(const Job& job, TransferProgress* progress)
+    {
+        PageResource resource;
+        resource.url = job.url;
+        resource.kind = job.kind;
+
+        try
+        {
+            HTTP http;
+            http.set(job.url);
+            http.set_progress(progress);
+            http.set_priority(progress->urgency, job.kind == ResourceKind::Image);
+
+            string body = http.request();
+            resource.status = http.get_status();
+            resource.content_type = http.get_header("Content-Type");
+            resource.headers = http.get_response_headers();
+
+            // file:// has no status line, anything that could be read counts
+            if(job.url.rfind("file://", 0) == 0 && !body.empty())
+            {
+                resource.status = 200;
+            }
+
+            if(resource.status == 200)
+            {
+                resource.data = move(body);
+            }
+        }
+        catch (...)
+        {
+            LOG_WARN(LogCategory::Http, "Failed to fetch subresource " << job.url);
+        }
+
+        return resource;
+    }
+
+    // Whether FetchEngine can have it: http(s) to a host not known to be on HTTP/2
+    static bool for_engine(const Job& job)
+    {
+        if(job.url.rfind("http://", 0) != 0 && job.url.rfind("https://", 0) != 0) return false;
+        return !ConnectionPool::instance().is_multiplexed(job.origin);
+    }
+
+    // Caller must hold fetch_mutex. The fetch itself starts once the lock is let go,
+    // by calling the returned function: a stopped engine calls back right away.
+    function<void()> start_on_engine_locked(const Job& job)
+    {
+        shared_ptr<TransferProgress> progress = make_shared<TransferProgress>();
+        progress->urgency = urgency_locked(job.kind, job.token);
+        this->in_flight[progress.get()] = Request{ job.generation, job.kind, job.token };
+        this->engine_jobs++;
+
+        return [this, job, progress] {
+            FetchOptions options;
+            options.progress = progress.get();
+            options.urgency = progress->urgency;
+            FetchEngine::instance().fetch(job.url, options, [this, job, progress](FetchResult& result) {
+                engine_done(job, progress, result);
+            });
+        };
+    }
+
+    // On the network thread
+    void engine_done(const Job& job, const shared_ptr<TransferProgress>& progress, FetchResult& result)
+    {
+        lock_guard<mutex> lock(this->fetch_mutex);
+        this->in_flight.erase(progress.get());
+        this->engine_jobs--;
+        this->engine_idle.notify_all();
+        host_done_locked(job.origin);
+
+        if(job.generation != this->generation || progress->cancelled || result.cancelled || this->stopping) return;
+
+        // The host turned out to speak HTTP/2, a worker makes it a stream on that
+        if(result.multiplexed)
+        {
+            this->queue.push_back(job);
+            return;
+        }
+
+        PageResource resource;
+        resource.url = job.url;
+        resource.kind = job.kind;
+        resource.status = result.status;
+        resource.content_type = move(result.content_type);
+        resource.headers = move(result.headers);
+        if(resource.status == 200)
+        {
+            resource.data = move(result.body);
+        }
+        this->finished.push_back(move(resource));
+    }
+
+    void work()
+    {
+        unique_lock<mutex> lock(this->fetch_mutex);
+
+        while(true)
+        {
+            Job job;
+            while(!this->stopping && !take_next(job))
+            {
+                this->work_ready.wait(lock);
+            }
+            if(this->stopping) return;
+
+            this->active_per_host[job.origin]++;
+            if(for_engine(job))
+            {
+                function<void()> start = start_on_engine_locked(job);
+                lock.unlock();
+                start();
+                lock.lock();
+                continue;
+            }
+
+            TransferProgress progress;
+            progress.urgency = urgency_locked(job.kind, job.token);
+            this->in_flight[&progress] = Request{ job.generation, job.kind, job.token };
+            lock.unlock();
+
+            PageResource resource = load(job, &progress);
+
+            lock.lock();
+            this->in_flight.erase(&progress);
+            if(job.generation == this->generation && !progress.cancelled)
+            {
+                this->finished.push_back(move(resource));
+            }
+            host_done_locked(job.origin);
+        }
+    }
+
+    void cancel_locked()
+    {
+        this->generation++;
+        this->queue.clear();
+        this->seen.clear();
+        this->finished.clear();
+        for(auto& request : this->in_flight)
+        {
+            request.first->cancelled = true;
+        }
+    }
+
+public:
+    explicit SubresourceFetcher(size_t worker_count = 8)
+    {
+        for(size_t i = 0; i < worker_count; i++)
+        {
+            this->workers.emplace_back(&SubresourceFetcher::work, this);
+        }
+    }
+
+    SubresourceFetcher(const SubresourceFetcher&) = delete;
+    SubresourceFetcher& operator=(const SubresourceFetcher&) = delete;
+
+    ~SubresourceFetcher()
+    {
+        shutdown();
+    }
+
+    void set_max_per_host(size_t max_per_host)
+    {
+        lock_guard<mutex> lock(this->fetch_mutex);
+        this->max_per_host = max_per_host;
+        this->work_ready.notify_all();
+    }
+
+    // Starts a new page: whatever the previous one was still loading is cancelled.
+    // Returns the generation to pass to fetch().
+    int begin_page()
+    {
+        lock_guard<mutex> lock(this->fetch_mutex);
+        cancel_locked();
+        this->viewport_last -= this->viewport_first;
+        this->viewport_first = 0;
+        return this->generation;
+    }
+
+    void cancel_all()
+    {
+        lock_guard<mutex> lock(this->fetch_mutex);
+        cancel_locked();
+    }
+
+    // Queues an absolute URL for the page of that generation; token is where its
+    // tag is among the page's tokens. Returns false if it was already asked for,
+    // or the page is gone. Safe from any thread.
+    bool fetch(int generation, const string& url, ResourceKind kind, size_t token = 0)
+    {
+        lock_guard<mutex> lock(this->fetch_mutex);
+
+        if(generation != this->generation || this->stopping || url.empty()) return false;
+        if(!this->seen.insert(url).second) return false;
+
+        this->queue.push_back(Job{ generation, url, origin_of(url), kind, token, this->next_order++ });
+        this->work_ready.notify_one();
+        return true;
+    }
+
+    // The page tokens on screen now (render thread, as the user scrolls). Queued
+    // images there go ahead of the others, and the urgency of requests already on
+    // their way follows, for the HTTP/2 ones to tell their server.
+    void set_viewport(size_t first, size_t last)
+    {
+        lock_guard<mutex> lock(this->fetch_mutex);
+        last = max(first, last);
+        if(first == this->viewport_first && last == this->viewport_last) return;
+
+        this->viewport_first = first;
+        this->viewport_last = last;
+        for(auto& request : this->in_flight)
+        {
+            if(request.second.generation != this->generation) continue;
+            request.first->urgency = urgency_locked(request.second.kind, request.second.token);
+        }
+    }
+
+    // Moves the resources finished since the last call into out (render thread)
+    bool poll(vector<PageResource>& out)
+    {
+        lock_guard<mutex> lock(this->fetch_mutex);
+        if(this->finished.empty()) return false;
+
+        out = move(this->finished);
+        this->finished.clear();
+        return true;
+    }
+
+    // Queued plus in flight, for the current page
+    size_t pending()
+    {
+        lock_guard<mutex> lock(this->fetch_mutex);
+        size_t count = this->queue.size();
+        for(auto& request : this->in_flight)
+        {
+            if(request.second.generation == this->generation) count++;
+        }
+        return count;
+    }
+
+    void shutdown()
+    {
+        {
+            lock_guard<mutex> lock(this->fetch_mutex);
+            if(this->stopping) return;
+            this->stopping = true;
+            cancel_locked();
+        }
+        this->work_ready.notify_all();
+
+        for(thread& worker : this->workers)
+        {
+            worker.join();
+        }
+        this->workers.clear();
+
+        // The engine's callbacks point back here, wait for the cancelled ones
+        unique_lock<mutex> lock(this->fetch_mutex);
+        this->engine_idle.wait(lock, [&] { return this->engine_jobs == 0; });
+    }
+};
+
+#endif
@@ -0,0 +1,138 @@
+#pragma once
+
+#ifndef LAKYS_SUBRESOURCE_HPP
+#define LAKYS_SUBRESOURCE_HPP
+
+#include <string>
+#include <vector>
+#include "lakys-string-helper.hpp"
+
+using namespace std;
+
+enum class ResourceKind
+{
+    Stylesheet,  // <link rel="stylesheet" href>
+    Script,      // <script src>
+    Image,       // <img src>
+    Font         // <link rel="preload" as="font" href>
+};
+
+// Something the page refers to, as written in the markup
+struct Subresource
+{
+    ResourceKind kind;
+    string url;
+    size_t token = 0; // Index of its tag among the page's tokens, where it sits on the page
+};
+
+// A fetched subresource, handed back to the page that asked for it
+struct PageResource
+{
+    string url;
+    ResourceKind kind = ResourceKind::Image;
+    int status = 0;        // HTTP status, 0 if the request failed outright
+    string content_type;
+    string headers;        // Status line and fields, for saving the page
+    string data;           // Body, only kept for a 200
+};
+
+// Drops "." and ".." segments from a path (RFC 3986 5.2.4)
+inline string remove_dot_segments(const string& path)
+{
+    vector<string> out;
+    size_t start = 0;
+
+    while(start <= path.size())
+    {
+        size_t end = path.find('/', start);
+        if(end == string::npos) end = path.size();
+        string segment = path.substr(start, end - start);
+
+        if(segment == "..")
+        {
+            if(out.size() > 1) out.pop_back();
+            if(end == path.size()) out.push_back("");
+        }
+        else if(segment == ".")
+        {
+            if(end == path.size()) out.push_back("");
+        }
+        else
+        {
+            out.push_back(segment);
+        }
+
+        start = end + 1;
+    }
+
+    string result;
+    for(size_t i = 0; i < out.size(); i++)
+    {
+        if(i > 0) result += "/";
+        result += out[i];
+    }
+    return result.empty() ? "/" : result;
+}
+
+// Resolves a reference from a page (href/src) against the page's URL.
+// Returns "" for references we can't fetch (fragments only, data:, javascript:, ...).
+inline string resolve_url(const string& base, string reference)
+{
+    // Fragments never go to the server
+    size_t hash = reference.find('#');
+    if(hash != string::npos) reference.erase(hash);
+
+    size_t first = reference.find_first_not_of(" \t\r\n");
+    if(first == string::npos) return "";
+    reference = reference.substr(first, reference.find_last_not_of(" \t\r\n") - first + 1);
+
+    size_t scheme_end = base.find("://");
+    if(scheme_end == string::npos) return "";
+    string scheme = base.substr(0, scheme_end);
+    if(scheme.rfind("view-source:", 0) == 0) scheme = scheme.substr(12);
+
+    size_t authority_end = base.find('/', scheme_end + 3);
+    string origin = scheme + base.substr(scheme_end, authority_end == string::npos ? string::npos : authority_end - scheme_end);
+    string base_path = authority_end == string::npos ? "/" : base.substr(authority_end);
+    base_path = base_path.substr(0, base_path.find('?'));
+
+    // Absolute, or some other scheme
+    size_t colon = reference.find(':');
+    if(colon != string::npos && reference.find('/') > colon)
+    {
+        string ref_scheme = to_lowercase(reference.substr(0, colon));
+        if(ref_scheme != "http" && ref_scheme != "https" && ref_scheme != "file") return "";
+        return reference;
+    }
+
+    if(reference.rfind("//", 0) == 0)
+    {
+        return scheme + ":" + reference;
+    }
+
+    string query;
+    size_t question = reference.find('?');
+    if(question != string::npos)
+    {
+        query = reference.substr(question);
+        reference.erase(question);
+    }
+
+    string path;
+    if(reference.empty())
+    {
+        path = base_path;
+    }
+    else if(reference[0] == '/')
+    {
+        path = reference;
+    }
+    else
+    {
+        path = base_path.substr(0, base_path.rfind('/') + 1) + reference;
+    }
+
+    return origin + remove_dot_segments(path) + query;
+}
+
+#endif
@@ -22,6 +22,15 @@
 #include "stb_image.h"
 
 #include "PusztaParser.hpp"
+#include "lakys-page-loader.hpp"
+#include "lakys-preconnector.hpp"
+#include "lakys-fetch-engine.hpp"
+#include "lakys-page-cache.hpp"
+#include "lakys-page-archive.hpp"
+#include "lakys-http-recorder.hpp"
+#include "lakys-replay-server.hpp"
+#include "lakys-http2-self-test.hpp"
+#include "lakys-download-manager.hpp"
 
 // SETTINGS
 unsigned int SCR_WIDTH = 1280;
@@ -40,6 +49,8 @@ float cursor_y = cursor_y_default;
 float site_top = 0.0f; // Top of the site content
 float site_bottom = 1000.0f;
 bool show_settings = false; // Settings window visibility
+bool show_network = false; // Network panel visibility
+bool show_downloads = false; // Downloads panel visibility
 
 vector<string> history;
 int history_index = -1;
@@ -75,15 +86,33 @@ float currentFrame = 0.0f; // Time of current frame
 void DarkMode();
 void LightMode();
 
-HTTP web;
+SubresourceFetcher subresource_fetcher;
+PageLoader page_loader;
+Preconnector preconnector; // Warms up the host being typed into the URL bar
+BackForwardCache back_forward_cache; // Pages left behind in the history, ready to show again
+string current_page_url; // URL of the page on screen, "" before the first one
+string site_headers; // Response headers of the page on screen, "" for local files
+bool page_should_parse = false; // False for view-source: pages, they're shown as plain text
 std::unique_ptr<Layout> layout;
-void search(std::string url, char* url_input);
+void search(std::string url, bool reload = false);
+void show_page(PageResult& page, char* url_input);
+void leave_page();
+void go_to_history(const string& url, char* url_input);
+string save_page();
+string loading_status();
+void draw_network_panel(bool* open);
+void draw_downloads_panel(bool* open);
 Shader* text_shader = nullptr;
 std::string site_content = "";
 string site_title = "New Page";
 
 int main()
 {
+	// PUSZTA_SELF_TEST=http2 checks the HTTP/2 client against the replay server and exits
+	if (const char* self_test = getenv("PUSZTA_SELF_TEST"); self_test && std::string(self_test) == "http2")
+	{
+		return run_http2_self_test() ? 0 : 1;
+	}
 
 	// glfw: initialize and configure
 	// ------------------------------
@@ -196,6 +225,24 @@ int main()
 
 	calculate_dpi_scale(window);
 
+	// Build the shared TLS context up front so the CA bundle isn't parsed during the first navigation
+	SslContext::instance();
+
+	// Pages queue their stylesheets, scripts and images here while they're lexed
+	page_loader.set_fetcher(&subresource_fetcher);
+
+	// Downloads the last run didn't finish show up paused, ready to resume
+	DownloadManager::instance().load_unfinished();
+
+	// Benchmarking: PUSZTA_RECORD captures a session, PUSZTA_REPLAY serves one back from loopback
+	HTTPRecorder::instance().configure_from_environment();
+	string replay_url;
+	unique_ptr<ReplayServer> replay_server = ReplayServer::start_from_environment(replay_url);
+	if (replay_server && !replay_url.empty())
+	{
+		page_loader.load(replay_url);
+	}
+
 	// render loop
 	// -----------
 	while (!glfwWindowShouldClose(window))
@@ -206,7 +253,8 @@ int main()
 
 		// set title to FPS
 		char title[256];
-		sprintf(title, "%s v%s - %s (%.2f FPS)", TITLE.c_str(), VERSION.c_str(), site_title.c_str(), 1.0f / deltaTime);
+		string shown_title = page_loader.is_loading() ? loading_status() : site_title;
+		snprintf(title, sizeof(title), "%s v%s - %s (%.2f FPS)", TITLE.c_str(), VERSION.c_str(), shown_title.c_str(), 1.0f / deltaTime);
 		glfwSetWindowTitle(window, title);
 
 		// input
@@ -252,10 +300,17 @@ int main()
 		// Render text
 		if(!layout->are_tokens_empty())
 		{
-			if(web.should_parse)
+			if(page_should_parse)
 			{
 				layout->render(SCR_WIDTH, SCR_HEIGHT, dpi_scale);
 				//cout << "Content height: " << content_height << endl;
+
+				// What's on screen loads first; while another page loads, this one isn't its
+				size_t first_visible, last_visible;
+				if (!page_loader.is_loading() && layout->get_visible_tokens(first_visible, last_visible))
+				{
+					subresource_fetcher.set_viewport(first_visible, last_visible);
+				}
 			}
 			else if(!site_content.empty())
 			{
@@ -303,16 +358,46 @@ int main()
 			bool forward_pressed = ImGui::ArrowButton("##right", ImGuiDir_Right);
 			ImGui::SameLine();
 
+			// Reload turns into stop while a page is loading
+			bool loading = page_loader.is_loading();
 			ImGui::PushFont(fa_font);
-			bool reload_pressed = ImGui::Button(ICON_FA_ARROW_ROTATE_RIGHT);
+			bool reload_pressed = ImGui::Button(loading ? ICON_FA_XMARK : ICON_FA_ARROW_ROTATE_RIGHT);
 			ImGui::PopFont();
 
+			if(reload_pressed && loading)
+			{
+				page_loader.cancel();
+				reload_pressed = false;
+			}
+
 
 			ImGui::SameLine();
 
 			// URL input
 			static char url_input[256];
+
+			// Pick up the page once the loader thread is done with it
+			PageResult loaded_page;
+			if(page_loader.poll(loaded_page))
+			{
+				show_page(loaded_page, url_input);
+			}
+
+			// Subresources only belong to the page once it's on screen
+			vector<PageResource> fetched;
+			if(!page_loader.is_loading() && subresource_fetcher.poll(fetched))
+			{
+				for(PageResource& resource : fetched)
+				{
+					layout->add_resource(move(resource));
+				}
+			}
+
 			bool should_search = ImGui::InputTextWithHint("##URL", "URL", url_input, IM_ARRAYSIZE(url_input), ImGuiInputTextFlags_EnterReturnsTrue);
+			if (ImGui::IsItemEdited())
+			{
+				preconnector.hint(url_input);
+			}
 			ImGui::SetItemDefaultFocus();
 			ImGui::SameLine();
 			//if (ImGui::Button("Go") || (ImGui::IsItemActive() && ImGui::IsKeyPressed(ImGuiKey_Enter)))
@@ -323,8 +408,8 @@ int main()
 				{
 
 					// Search the URL
-					std::cout << "Searching: " << url_input << std::endl;
-					search(url_input, url_input); // Pass the URL to the search function
+					LOG_INFO(LogCategory::UI, "Searching: " << url_input);
+					search(url_input); // Pass the URL to the search function
 
 					cursor_y = cursor_y_default;
 
@@ -342,10 +427,8 @@ int main()
 				{
 					history_index--;
 					std::string url = history[history_index];
-					std::cout << "Searching: " << url << std::endl;
-					search(url, url_input); // Pass the URL to the search function
-
-					cursor_y = cursor_y_default;
+					LOG_INFO(LogCategory::UI, "Back to: " << url);
+					go_to_history(url, url_input);
 				}
 			}
 
@@ -355,10 +438,8 @@ int main()
 				{
 					history_index++;
 					std::string url = history[history_index];
-					std::cout << "Searching: " << url << std::endl;
-					search(url, url_input); // Pass the URL to the search function
-
-					cursor_y = cursor_y_default;
+					LOG_INFO(LogCategory::UI, "Forward to: " << url);
+					go_to_history(url, url_input);
 				}
 			}
 
@@ -367,8 +448,8 @@ int main()
 				if(history_index >= 0 && history_index < history.size())
 				{
 					std::string url = history[history_index];
-					std::cout << "Reloading: " << url << std::endl;
-					search(url, url_input); 
+					LOG_INFO(LogCategory::UI, "Reloading: " << url);
+					search(url, true); 
 
 					cursor_y = cursor_y_default;
 				}
@@ -380,11 +461,45 @@ int main()
 			// Calculate available space and position at the right edge
 			float avail = ImGui::GetContentRegionAvail().x;
 			float button_width = ImGui::CalcTextSize(ICON_FA_GEAR).x + ImGui::GetStyle().FramePadding.x * 2.0f;
-			ImGui::SameLine(ImGui::GetCursorPosX() + avail - button_width);
+			float network_button_width = ImGui::CalcTextSize(ICON_FA_CHART_GANTT).x + ImGui::GetStyle().FramePadding.x * 2.0f;
+			float save_button_width = ImGui::CalcTextSize(ICON_FA_FLOPPY_DISK).x + ImGui::GetStyle().FramePadding.x * 2.0f;
+			float downloads_button_width = ImGui::CalcTextSize(ICON_FA_DOWNLOAD).x + ImGui::GetStyle().FramePadding.x * 2.0f;
+			ImGui::SameLine(ImGui::GetCursorPosX() + avail - button_width - network_button_width - save_button_width - downloads_button_width - ImGui::GetStyle().ItemSpacing.x * 3.0f);
+
+			if (ImGui::Button(ICON_FA_DOWNLOAD))
+				show_downloads = !show_downloads;
+			if (ImGui::IsItemHovered())
+				ImGui::SetTooltip("%s", DownloadManager::instance().has_running() ? "Downloading..." : "Downloads");
+
+			ImGui::SameLine();
+
+			// Saves the page with everything it loaded into one archive, open it again with file://
+			static string saved_to;
+			if (ImGui::Button(ICON_FA_FLOPPY_DISK))
+				saved_to = save_page();
+			if (ImGui::IsItemHovered())
+				ImGui::SetTooltip("%s", saved_to.empty() ? "Save page" : ("Saved to " + saved_to).c_str());
+
+			ImGui::SameLine();
+
+			if (ImGui::Button(ICON_FA_CHART_GANTT))
+				show_network = !show_network;
+
+			ImGui::SameLine();
 
 			if (ImGui::Button(ICON_FA_GEAR))
 				show_settings = true;
 
+			if(show_network)
+			{
+				draw_network_panel(&show_network);
+			}
+
+			if(show_downloads)
+			{
+				draw_downloads_panel(&show_downloads);
+			}
+
 			if(show_settings)
 			{
 				// Get the main viewport and calculate the center from it
@@ -433,6 +548,79 @@ int main()
 							LightMode();
 						}
 					}
+
+					ImGui::Text("Back/forward cache:");
+					ImGui::SameLine();
+					ImGui::SetNextItemWidth(150.0f);
+
+					static int back_forward_cache_mb = (int)(back_forward_cache.get_budget() / (1024 * 1024));
+					if (ImGui::SliderInt("##bfcache", &back_forward_cache_mb, 0, 512, "%d MB"))
+					{
+						back_forward_cache.set_budget((size_t)back_forward_cache_mb * 1024 * 1024);
+					}
+					ImGui::TextDisabled("%d pages, %.1f MB", (int)back_forward_cache.size(), back_forward_cache.get_used() / (1024.0 * 1024.0));
+
+					// Remembered 301/308s skip the server, this is the way out if one went stale
+					if (ImGui::Button("Forget redirects"))
+					{
+						PermanentRedirects::instance().clear();
+					}
+					ImGui::SameLine();
+					ImGui::TextDisabled("%d remembered", (int)PermanentRedirects::instance().size());
+
+					// Open connections keep the protocol they were set up with, so start over
+					static bool offer_http2 = SslContext::instance().offersHttp2();
+					if (ImGui::Checkbox("HTTP/2", &offer_http2))
+					{
+						SslContext::instance().setOfferHttp2(offer_http2);
+						ConnectionPool::instance().clear();
+					}
+
+					// In seconds here, 0 for no limit
+					static RequestTimeouts::Limits limits = RequestTimeouts::instance().get_limits();
+					static int timeouts[] = { max(0, limits.connect_ms / 1000), max(0, limits.first_byte_ms / 1000), max(0, limits.idle_ms / 1000) };
+					const char* timeout_labels[] = { "Connect timeout:", "First byte timeout:", "Idle timeout:" };
+					bool timeouts_changed = false;
+					for (int i = 0; i < 3; i++)
+					{
+						ImGui::Text("%s", timeout_labels[i]);
+						ImGui::SameLine(150.0f);
+						ImGui::SetNextItemWidth(150.0f);
+						ImGui::PushID(i);
+						timeouts_changed |= ImGui::SliderInt("##timeout", &timeouts[i], 0, 120, timeouts[i] == 0 ? "none" : "%d s");
+						ImGui::PopID();
+					}
+					if (timeouts_changed)
+					{
+						limits.connect_ms = timeouts[0] > 0 ? timeouts[0] * 1000 : -1;
+						limits.first_byte_ms = timeouts[1] > 0 ? timeouts[1] * 1000 : -1;
+						limits.idle_ms = timeouts[2] > 0 ? timeouts[2] * 1000 : -1;
+						RequestTimeouts::instance().set_limits(limits);
+					}
+
+					// Saves handshake round trips to hosts we've been to; only GETs are sent this way
+					static bool fast_reconnects = SslContext::instance().sendsEarlyData();
+					if (ImGui::Checkbox("TCP Fast Open and TLS 0-RTT", &fast_reconnects))
+					{
+						HappyEyeballs::setFastOpen(fast_reconnects);
+						SslContext::instance().setEarlyData(fast_reconnects);
+					}
+
+					static bool hedge_requests = RequestTimeouts::instance().is_hedging();
+					if (ImGui::Checkbox("Hedge slow requests", &hedge_requests))
+					{
+						RequestTimeouts::instance().set_hedging(hedge_requests);
+					}
+
+					// Big files from servers that take Range requests are fetched in this many pieces at once
+					ImGui::Text("Download connections:");
+					ImGui::SameLine(150.0f);
+					ImGui::SetNextItemWidth(150.0f);
+					static int download_connections = DownloadManager::instance().get_max_connections();
+					if (ImGui::SliderInt("##downloadconnections", &download_connections, 1, 6))
+					{
+						DownloadManager::instance().set_max_connections(download_connections);
+					}
 	
 				}
 				ImGui::End();
@@ -463,6 +651,15 @@ int main()
 	// optional: de-allocate all resources once they've outlived their purpose:
 	// ------------------------------------------------------------------------
 	delete text_shader;
+	page_loader.shutdown();
+	DownloadManager::instance().shutdown(); // Unfinished downloads are noted down to resume next time
+	subresource_fetcher.shutdown();
+	preconnector.shutdown();
+	FetchEngine::instance().stop();
+	ConnectionPool::instance().clear();
+	HTTPRecorder::instance().stop();
+	if (replay_server) replay_server->stop();
+	NetworkThread::instance().stop(); // Last, closing HTTP/2 sessions finishes there
 
 	// glfw: terminate, clearing all previously allocated GLFW resources.
 	// ------------------------------------------------------------------
@@ -471,50 +668,427 @@ int main()
 	return 0;
 }
 
-void search(std::string url = "", char* url_input = nullptr)
+// Starts loading the URL in the background; show_page() takes over once it's done
+void search(std::string url = "", bool reload)
+{
+
+	if(!url.empty())
+	{
+		page_loader.load(url, reload);
+	}
+
+}
+
+// Puts a page the loader finished on screen (render thread only)
+void show_page(PageResult& page, char* url_input)
+{
+
+	if(page.invalid_url)
+	{
+		return;
+	}
+
+	// A file rather than a page: the page on screen stays, the download gets going
+	if(page.download >= 0)
+	{
+		show_downloads = true;
+		return;
+	}
+
+	site_content = move(page.content);
+	site_headers = move(page.headers);
+	page_should_parse = page.should_parse;
+
+	// Set text input content to the URL
+	string current_url = page.url;
+	if (url_input != nullptr && strlen(url_input) > 0) 
+	{
+		strncpy(url_input, current_url.c_str(), 255);
+		url_input[255] = '\0'; // null termination
+	}
+
+	// Save to history
+	if (history_index < 0 || history_index >= history.size() || history[history_index] != current_url) {
+		/*if (history_index < history.size() - 1) {
+			history.erase(history.begin() + history_index + 1, history.end());
+		}*/
+		history.push_back(current_url);
+		history_index = history.size() - 1; // Set to the last index
+	}
+
+	// Reloading a page replaces it, anything else sends the old one to the back/forward cache
+	if (page.url != current_page_url)
+	{
+		leave_page();
+	}
+	back_forward_cache.remove(page.url);
+	current_page_url = page.url;
+
+	layout->set_page(move(page.tokens), page.title);
+
+	site_title = layout->get_title();
+
+	LOG_INFO(LogCategory::UI, "Loaded " << page.url << " in " << (int)(NetworkLog::instance().now_ms() - NetworkLog::instance().get_navigation_start()) << " ms");
+
+	// Start the new page at the top
+	cursor_y = cursor_y_default;
+
+}
+
+// Moves the page on screen into the back/forward cache, just before something replaces it
+void leave_page()
+{
+
+	if (current_page_url.empty())
+	{
+		return;
+	}
+
+	CachedPage page;
+	page.url = current_page_url;
+	page.title = layout->get_title();
+	page.should_parse = page_should_parse;
+	page.scroll_y = cursor_y;
+	page.content = move(site_content);
+	page.headers = move(site_headers);
+	layout->take_page(page.tokens, page.resources);
+
+	back_forward_cache.store(move(page));
+	current_page_url.clear();
+
+}
+
+// Back and forward: pages still in the back/forward cache come back as they were
+// left, scroll position included, anything else is loaded again
+void go_to_history(const string& url, char* url_input)
+{
+
+	CachedPage page;
+	if (!back_forward_cache.take(url, page))
+	{
+		search(url);
+		cursor_y = cursor_y_default;
+		return;
+	}
+
+	LOG_DEBUG(LogCategory::Cache, "Restoring " << url << " from the back/forward cache");
+
+	// Whatever was still loading is abandoned, like with any other navigation
+	page_loader.cancel();
+	subresource_fetcher.cancel_all();
+	leave_page();
+
+	site_content = move(page.content);
+	site_headers = move(page.headers);
+	page_should_parse = page.should_parse;
+	layout->restore_page(move(page.tokens), page.title, move(page.resources));
+	site_title = layout->get_title();
+	current_page_url = page.url;
+	cursor_y = page.scroll_y;
+
+	if (url_input != nullptr)
+	{
+		strncpy(url_input, url.c_str(), 255);
+		url_input[255] = '\0'; // null termination
+	}
+
+}
+
+// The URL a request for url is keyed by in an archive: what HTTP makes of it, without view-source:
+static string archive_url(const string& url)
 {
 
 	try
 	{
-		if(!url.empty())
+		HTTP http;
+		http.set(url);
+		string normalized = http.get_url();
+		return normalized.rfind("view-source:", 0) == 0 ? normalized.substr(12) : normalized;
+	}
+	catch (...)
+	{
+		return "";
+	}
+
+}
+
+// Writes the page on screen, the subresources it loaded and all their response headers
+// into saved/<host>-<time>.puszta. Returns the file's path, "" if it couldn't be saved.
+string save_page()
+{
+
+	if (current_page_url.empty() || site_headers.empty())
+	{
+		LOG_WARN(LogCategory::UI, "Only pages loaded over HTTP can be saved");
+		return "";
+	}
+
+	vector<ArchivedResponse> responses;
+	responses.push_back({ archive_url(current_page_url), HTTPCache::strip_transfer_headers(site_headers), site_content });
+
+	for (const auto& resource : layout->get_resources())
+	{
+		const PageResource& fetched = resource.second;
+		string url = archive_url(fetched.url);
+		if (fetched.status != 200 || fetched.headers.empty() || url.empty()) continue;
+
+		responses.push_back({ url, HTTPCache::strip_transfer_headers(fetched.headers), fetched.data });
+	}
+
+	string host = split(responses[0].url, "://").back();
+	host = host.substr(0, host.find('/'));
+	replace(host.begin(), host.end(), ':', '_');
+
+	error_code error;
+	filesystem::create_directories("saved", error);
+	string file_path = "saved/" + host + "-" + to_string(time(nullptr)) + ".puszta";
+
+	if (!save_to_file(file_path, build_archive(responses)))
+	{
+		return "";
+	}
+
+	LOG_INFO(LogCategory::UI, "Saved " << current_page_url << " with " << responses.size() - 1 << " subresources to " << file_path);
+	return file_path;
+
+}
+
+// What the loader is up to, for the window title
+string loading_status()
+{
+
+	switch(page_loader.get_stage())
+	{
+		case PageLoader::Stage::Parsing:
+			return "Parsing...";
+
+		case PageLoader::Stage::Requesting:
 		{
-			
-			web.set(url);
-			site_content = web.request();
-			if (site_content.empty()) 
-			{
-				site_content = "Failed to load content after redirect. The website may not have sent any data, or there was a parsing error.";
-			}	
-				
-			// Set text input content to the URL
-			string current_url = web.get_url();
-			if (url_input != nullptr && strlen(url_input) > 0) 
+			size_t received = page_loader.get_received();
+			if(received == 0)
 			{
-				strncpy(url_input, current_url.c_str(), 255);
-				url_input[255] = '\0'; // null termination
+				return "Connecting to " + page_loader.get_url() + "...";
 			}
 
-			// Save to history
-			if (history_index < 0 || history_index >= history.size() || history[history_index] != current_url) {
-				/*if (history_index < history.size() - 1) {
-					history.erase(history.begin() + history_index + 1, history.end());
-				}*/
-				history.push_back(current_url);
-				history_index = history.size() - 1; // Set to the last index
+			string status = "Loading... " + to_string(received / 1024) + " KB";
+			long long expected = page_loader.get_expected();
+			if(expected > 0)
+			{
+				status += " of " + to_string(expected / 1024) + " KB";
 			}
+			return status;
+		}
+
+		default:
+			return "Loading...";
+	}
+
+}
+
+
+// Requests since the last navigation, one row each with a bar per phase
+void draw_network_panel(bool* open)
+{
+	ImGui::SetNextWindowSize(ImVec2(720, 320), ImGuiCond_FirstUseEver);
+
+	if (!ImGui::Begin("Network", open))
+	{
+		ImGui::End();
+		return;
+	}
+
+	NetworkLog& network_log = NetworkLog::instance();
+	double navigation_start = network_log.get_navigation_start();
+	vector<RequestTiming> requests = network_log.since(navigation_start);
+
+	double span = 1.0;
+	for (const RequestTiming& request : requests)
+	{
+		span = max(span, request.end_ms() - navigation_start);
+	}
+
+	ImGui::Text("%d requests, %.0f ms", (int)requests.size(), requests.empty() ? 0.0 : span);
+	ImGui::SameLine();
+	ImGui::TextDisabled("DNS / connect / TLS / waiting / download");
+
+	ImGuiTableFlags flags = ImGuiTableFlags_RowBg | ImGuiTableFlags_Borders | ImGuiTableFlags_Resizable | ImGuiTableFlags_ScrollY;
+	if (ImGui::BeginTable("##requests", 5, flags))
+	{
+		ImGui::TableSetupScrollFreeze(0, 1);
+		ImGui::TableSetupColumn("URL", ImGuiTableColumnFlags_WidthStretch, 2.0f);
+		ImGui::TableSetupColumn("Status", ImGuiTableColumnFlags_WidthFixed, 50.0f);
+		ImGui::TableSetupColumn("Size", ImGuiTableColumnFlags_WidthFixed, 70.0f);
+		ImGui::TableSetupColumn("Time", ImGuiTableColumnFlags_WidthFixed, 70.0f);
+		ImGui::TableSetupColumn("Waterfall", ImGuiTableColumnFlags_WidthStretch, 3.0f);
+		ImGui::TableHeadersRow();
+
+		const ImU32 phase_colors[] = {
+			IM_COL32(0, 150, 136, 255),   // DNS
+			IM_COL32(255, 152, 0, 255),   // Connect
+			IM_COL32(156, 39, 176, 255),  // TLS
+			IM_COL32(76, 175, 80, 255),   // Waiting
+			IM_COL32(33, 150, 243, 255),  // Download
+		};
+
+		for (const RequestTiming& request : requests)
+		{
+			ImGui::TableNextRow();
+
+			ImGui::TableSetColumnIndex(0);
+			ImGui::TextUnformatted(request.url.c_str());
 
-			layout->lex(site_content);
+			ImGui::TableSetColumnIndex(1);
+			if (request.status > 0) ImGui::Text("%d", request.status);
+			else ImGui::TextDisabled("-");
 
-			site_title = layout->get_title();
+			ImGui::TableSetColumnIndex(2);
+			if (request.from_archive) ImGui::TextDisabled("archive");
+			else if (request.from_cache) ImGui::TextDisabled("cache");
+			else if (request.bytes_received >= 1024) ImGui::Text("%.1f KB", request.bytes_received / 1024.0);
+			else ImGui::Text("%d B", (int)request.bytes_received);
 
+			ImGui::TableSetColumnIndex(3);
+			ImGui::Text("%.0f ms", request.total_ms);
+
+			ImGui::TableSetColumnIndex(4);
+			ImVec2 origin = ImGui::GetCursorScreenPos();
+			float width = ImGui::GetContentRegionAvail().x;
+			float height = ImGui::GetTextLineHeight();
+			float scale = width / (float)span;
+			ImDrawList* draw_list = ImGui::GetWindowDrawList();
+
+			float x = origin.x + (float)(request.start_ms - navigation_start) * scale;
+			if (request.from_cache || request.from_archive)
+			{
+				draw_list->AddRectFilled(ImVec2(x, origin.y), ImVec2(x + max(2.0f, (float)request.total_ms * scale), origin.y + height), IM_COL32(128, 128, 128, 255));
+			}
+			else
+			{
+				double phases[] = { request.dns_ms, request.connect_ms, request.tls_ms, request.ttfb_ms, request.download_ms };
+				for (int i = 0; i < 5; i++)
+				{
+					if (phases[i] <= 0) continue;
+					float phase_width = max(1.0f, (float)phases[i] * scale);
+					draw_list->AddRectFilled(ImVec2(x, origin.y), ImVec2(x + phase_width, origin.y + height), phase_colors[i]);
+					x += phase_width;
+				}
+			}
 
+			ImGui::Dummy(ImVec2(width, height));
+			if (ImGui::IsItemHovered())
+			{
+				ImGui::BeginTooltip();
+				ImGui::TextUnformatted(request.url.c_str());
+				if (request.redirect_hop > 0) ImGui::Text("Redirect hop %d", request.redirect_hop);
+				if (request.from_archive) ImGui::Text("Replayed from archive");
+				else if (request.from_cache) ImGui::Text("Served from cache");
+				else if (request.reused_connection) ImGui::Text("Reused connection");
+				if (request.hedged) ImGui::Text("Hedged on a second connection");
+				if (request.timed_out) ImGui::Text("Timed out");
+				if (request.dns_ms >= 0) ImGui::Text("DNS:      %.1f ms", request.dns_ms);
+				if (request.connect_ms >= 0) ImGui::Text("Connect:  %.1f ms", request.connect_ms);
+				if (request.tls_ms >= 0) ImGui::Text("TLS:      %.1f ms%s", request.tls_ms, request.tls_resumed ? " (resumed)" : "");
+				if (request.fast_open || request.early_data) ImGui::Text("%s%s", request.fast_open ? "TCP Fast Open " : "", request.early_data ? "0-RTT" : "");
+				if (request.ttfb_ms >= 0) ImGui::Text("Waiting:  %.1f ms", request.ttfb_ms);
+				if (request.download_ms >= 0) ImGui::Text("Download: %.1f ms", request.download_ms);
+				ImGui::Text("Total:    %.1f ms", request.total_ms);
+				ImGui::EndTooltip();
+			}
 		}
+
+		ImGui::EndTable();
 	}
-	catch (...)
+
+	ImGui::End();
+}
+
+
+// Downloads with their progress and throughput, and buttons to pause, resume or cancel them
+void draw_downloads_panel(bool* open)
+{
+	ImGui::SetNextWindowSize(ImVec2(560, 240), ImGuiCond_FirstUseEver);
+
+	if (!ImGui::Begin("Downloads", open))
+	{
+		ImGui::End();
+		return;
+	}
+
+	DownloadManager& downloads = DownloadManager::instance();
+	vector<DownloadManager::Info> infos = downloads.get_downloads();
+
+	if (infos.empty())
+	{
+		ImGui::TextDisabled("Nothing downloaded yet");
+	}
+	else if (ImGui::SmallButton("Clear finished"))
+	{
+		downloads.clear_finished();
+	}
+
+	for (const DownloadManager::Info& info : infos)
 	{
-		std::cerr << "Invalid URL";
+		ImGui::PushID(info.id);
+		ImGui::Separator();
+		ImGui::TextUnformatted(info.path.c_str());
+
+		double received_mb = info.received / (1024.0 * 1024.0);
+		string status;
+		switch (info.state)
+		{
+			case DownloadManager::State::Running:
+			{
+				char text[128];
+				snprintf(text, sizeof(text), "%.1f MB/s, %d connection%s", info.bytes_per_second / (1024.0 * 1024.0), info.connections, info.connections == 1 ? "" : "s");
+				status = text;
+				break;
+			}
+			case DownloadManager::State::Paused:
+				status = "Paused";
+				break;
+			case DownloadManager::State::Done:
+				status = "Done";
+				break;
+			case DownloadManager::State::Failed:
+				status = "Failed: " + info.error;
+				break;
+			case DownloadManager::State::Cancelled:
+				status = "Cancelled";
+				break;
+		}
+
+		char overlay[64];
+		if (info.size > 0)
+		{
+			snprintf(overlay, sizeof(overlay), "%.1f of %.1f MB", received_mb, info.size / (1024.0 * 1024.0));
+		}
+		else
+		{
+			snprintf(overlay, sizeof(overlay), "%.1f MB", received_mb);
+		}
+		float fraction = info.size > 0 ? (float)((double)info.received / info.size) : (info.state == DownloadManager::State::Done ? 1.0f : 0.0f);
+		ImGui::ProgressBar(fraction, ImVec2(-1.0f, 0.0f), overlay);
+		ImGui::TextDisabled("%s", status.c_str());
+
+		if (info.state == DownloadManager::State::Running)
+		{
+			ImGui::SameLine();
+			if (ImGui::SmallButton("Pause")) downloads.pause(info.id);
+		}
+		else if (info.state == DownloadManager::State::Paused || info.state == DownloadManager::State::Failed)
+		{
+			ImGui::SameLine();
+			if (ImGui::SmallButton("Resume")) downloads.resume(info.id);
+		}
+		if (info.state != DownloadManager::State::Done && info.state != DownloadManager::State::Cancelled)
+		{
+			ImGui::SameLine();
+			if (ImGui::SmallButton("Cancel")) downloads.cancel(info.id);
+		}
+		ImGui::PopID();
 	}
 
+	ImGui::End();
 }
 
 
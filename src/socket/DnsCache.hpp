@@ -0,0 +1,316 @@
+/*
+ * Process-wide cache in front of getaddrinfo()
+ */
+
+#pragma once
+
+#include "SocketCompat.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One address getaddrinfo() gave us, copied out so the addrinfo list can be freed
+struct ResolvedAddress {
+    int family;
+    int socktype;
+    int protocol;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+// Remembers lookups so every socket to the same host (redirect hops, subresources,
+// reloads) doesn't block on the resolver again. Failures are cached for a shorter time.
+// getaddrinfo() doesn't tell us the record TTLs, so the lifetimes are configurable
+// instead. Safe to use from several threads; lookups for the same host are shared.
+class DnsCache {
+private:
+    struct Entry {
+        std::vector<ResolvedAddress> addresses; // Without ports
+        int error;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    std::map<std::string, Entry> _entries;
+    std::map<std::string, std::shared_future<Entry>> _inFlight;
+    std::mutex _mutex;
+
+    std::chrono::seconds _ttl;
+    std::chrono::seconds _negativeTtl;
+
+    // Background lookups run on these, started as they're needed and kept for the next ones
+    static const size_t MaxWorkers = 8;
+    std::vector<std::thread> _workers;
+    std::deque<std::function<void()>> _jobs;
+    std::mutex _jobsMutex;
+    std::condition_variable _jobsChanged;
+    size_t _idleWorkers = 0;
+    bool _stopping = false;
+
+    DnsCache() : _ttl(60), _negativeTtl(10) {
+#ifdef _WIN32
+        // Lookups can happen on a prefetch thread before any socket has started Winsock
+        WSADATA wsaData;
+        WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    }
+
+    // Lookups already started are waited for
+    ~DnsCache() {
+        {
+            std::lock_guard<std::mutex> lock(_jobsMutex);
+            _stopping = true;
+            _jobsChanged.notify_all();
+        }
+        for (std::thread& worker : _workers) {
+            worker.join();
+        }
+    }
+
+    static std::string keyFor(const std::string& host, int family) {
+        return host + "#" + std::to_string(family);
+    }
+
+    // Caller must hold _mutex. An expired entry is dropped.
+    bool findFresh(const std::string& key, Entry& entry) {
+        auto found = _entries.find(key);
+        if (found == _entries.end()) return false;
+        if (std::chrono::steady_clock::now() >= found->second.expires) {
+            _entries.erase(found);
+            return false;
+        }
+        entry = found->second;
+        return true;
+    }
+
+    void runWorker() {
+        std::unique_lock<std::mutex> lock(_jobsMutex);
+        while (true) {
+            _idleWorkers++;
+            _jobsChanged.wait(lock, [&] { return _stopping || !_jobs.empty(); });
+            _idleWorkers--;
+            if (_jobs.empty()) return; // Stopping, and nothing left to do
+
+            std::function<void()> job = std::move(_jobs.front());
+            _jobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+    // Runs the job on a worker, a new one if all of them are busy and there's room.
+    // False once the cache is going away.
+    bool startJob(std::function<void()> job) {
+        std::lock_guard<std::mutex> lock(_jobsMutex);
+        if (_stopping) return false;
+
+        _jobs.push_back(std::move(job));
+        if (_idleWorkers < _jobs.size() && _workers.size() < MaxWorkers) {
+            _workers.emplace_back(&DnsCache::runWorker, this);
+        }
+        _jobsChanged.notify_one();
+        return true;
+    }
+
+    static Entry lookup(const std::string& host, int family) {
+        Entry entry;
+
+        struct addrinfo hints = {0};
+        hints.ai_family = family;
+        hints.ai_socktype = SOCK_STREAM;
+
+        struct addrinfo* result = NULL;
+        entry.error = getaddrinfo(host.c_str(), NULL, &hints, &result);
+
+        if (entry.error == 0) {
+            for (struct addrinfo* info = result; info != NULL; info = info->ai_next) {
+                ResolvedAddress address;
+                memset(&address, 0, sizeof(address));
+                address.family = info->ai_family;
+                address.socktype = info->ai_socktype;
+                address.protocol = info->ai_protocol;
+                address.addrlen = (socklen_t)info->ai_addrlen;
+                memcpy(&address.addr, info->ai_addr, info->ai_addrlen);
+                entry.addresses.push_back(address);
+            }
+            freeaddrinfo(result);
+        }
+
+        return entry;
+    }
+
+    static void applyPort(std::vector<ResolvedAddress>& addresses, int port) {
+        for (ResolvedAddress& address : addresses) {
+            if (address.family == AF_INET) {
+                ((struct sockaddr_in*)&address.addr)->sin_port = htons((unsigned short)port);
+            } else if (address.family == AF_INET6) {
+                ((struct sockaddr_in6*)&address.addr)->sin6_port = htons((unsigned short)port);
+            }
+        }
+    }
+
+public:
+    DnsCache(const DnsCache&) = delete;
+    DnsCache& operator=(const DnsCache&) = delete;
+
+    static DnsCache& instance() {
+        static DnsCache cache;
+        return cache;
+    }
+
+    void setTtl(int seconds, int negativeSeconds) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _ttl = std::chrono::seconds(seconds);
+        _negativeTtl = std::chrono::seconds(negativeSeconds);
+    }
+
+    // Fills addresses (with the port set) and returns 0, or the getaddrinfo() error
+    int resolve(const std::string& host, int port, int family, std::vector<ResolvedAddress>& addresses) {
+        std::string key = keyFor(host, family);
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        Entry cached;
+        if (findFresh(key, cached)) {
+            addresses = cached.addresses;
+            applyPort(addresses, port);
+            return cached.error;
+        }
+
+        // Someone is already asking the resolver, wait for their answer
+        auto inFlight = _inFlight.find(key);
+        if (inFlight != _inFlight.end()) {
+            std::shared_future<Entry> pending = inFlight->second;
+            lock.unlock();
+
+            const Entry& entry = pending.get();
+            addresses = entry.addresses;
+            applyPort(addresses, port);
+            return entry.error;
+        }
+
+        std::promise<Entry> promise;
+        _inFlight[key] = promise.get_future().share();
+
+        // The lookup itself runs without the lock held
+        lock.unlock();
+        Entry entry = lookup(host, family);
+        lock.lock();
+
+        entry.expires = std::chrono::steady_clock::now() + (entry.error == 0 ? _ttl : _negativeTtl);
+        _entries[key] = entry;
+        _inFlight.erase(key);
+        promise.set_value(entry);
+        lock.unlock();
+
+        addresses = entry.addresses;
+        applyPort(addresses, port);
+        return entry.error;
+    }
+
+    // Looks up AAAA and A records side by side (RFC 8305 section 3). Once one family
+    // has answered, the other gets resolutionDelayMs more before we go without it;
+    // a late answer still lands in the cache for next time. Families already in
+    // the cache are answered from it right here, only the others go to a worker.
+    int resolveDualStack(const std::string& host, int port, std::vector<ResolvedAddress>& addresses, int resolutionDelayMs = 50) {
+        struct Result {
+            std::vector<ResolvedAddress> addresses;
+            int error = 0;
+            bool done = false;
+        };
+        struct Shared {
+            std::mutex mutex;
+            std::condition_variable changed;
+            Result results[2]; // IPv6, IPv4
+        };
+        auto shared = std::make_shared<Shared>();
+        const int families[2] = { AF_INET6, AF_INET };
+
+        // No worker has the results yet
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (int i = 0; i < 2; i++) {
+                Entry cached;
+                if (!findFresh(keyFor(host, families[i]), cached)) continue;
+
+                Result& result = shared->results[i];
+                result.addresses = cached.addresses;
+                applyPort(result.addresses, port);
+                result.error = cached.error;
+                result.done = true;
+            }
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (shared->results[i].done) continue;
+
+            int family = families[i];
+            bool started = startJob([this, shared, host, port, family, i]() {
+                Result result;
+                result.error = resolve(host, port, family, result.addresses);
+                result.done = true;
+
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                shared->results[i] = result;
+                shared->changed.notify_all();
+            });
+            if (!started) {
+                shared->results[i].error = EAI_AGAIN;
+                shared->results[i].done = true;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        shared->changed.wait(lock, [&] { return shared->results[0].done || shared->results[1].done; });
+        shared->changed.wait_for(lock, std::chrono::milliseconds(resolutionDelayMs),
+            [&] { return shared->results[0].done && shared->results[1].done; });
+
+        addresses.clear();
+        int error = 0;
+        for (const Result& result : shared->results) {
+            if (!result.done) continue;
+            if (result.error == 0) {
+                addresses.insert(addresses.end(), result.addresses.begin(), result.addresses.end());
+            } else {
+                error = result.error;
+            }
+        }
+
+        return addresses.empty() ? (error != 0 ? error : EAI_NONAME) : 0;
+    }
+
+    // Starts resolving in the background so a later resolve() finds the answer cached
+    void prefetch(const std::string& host) {
+        for (int family : { AF_INET6, AF_INET }) {
+            startJob([this, host, family]() {
+                std::vector<ResolvedAddress> ignored;
+                resolve(host, 0, family, ignored);
+            });
+        }
+    }
+
+    void forget(const std::string& host) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto it = _entries.begin(); it != _entries.end(); ) {
+            if (it->first.compare(0, host.size() + 1, host + "#") == 0) {
+                it = _entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _entries.clear();
+    }
+};
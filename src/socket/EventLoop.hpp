@@ -0,0 +1,544 @@
+/*
+ * Readiness notification for many non-blocking sockets on one thread
+ *
+ * Three backends behind one interface: poll() everywhere (WSAPoll on Windows),
+ * epoll on Linux, and io_uring on Linux 5.11+ (poll requests on the ring, so
+ * OpenSSL can keep doing its own reads and writes). Watches are level-triggered
+ * on all of them: a socket keeps being reported while it's ready.
+ */
+
+#pragma once
+
+#include "SocketCompat.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#define EVENT_LOOP_HAS_IO_URING 1
+#endif
+#endif
+
+class EventLoop {
+public:
+    enum Events {
+        Readable = 1,
+        Writable = 2
+    };
+
+    // Gets what the socket is ready for. Errors and hangups come as both, so
+    // whichever call the owner makes next finds out.
+    typedef std::function<void(int events)> Callback;
+
+    virtual ~EventLoop() {
+        closeWaker();
+    }
+
+    virtual const char* name() const = 0;
+
+    // The socket has to stay open until it's unwatched. One watch per socket.
+    bool watch(SOCKET sock, int events, Callback callback) {
+        if (_watches.count(sock)) return false;
+
+        Watch& entry = _watches[sock];
+        entry.token = _nextToken++;
+        entry.events = events;
+        entry.callback = std::make_shared<Callback>(std::move(callback));
+        _tokens[entry.token] = sock;
+
+        if (!add(sock, entry)) {
+            _tokens.erase(entry.token);
+            _watches.erase(sock);
+            return false;
+        }
+        return true;
+    }
+
+    bool modify(SOCKET sock, int events) {
+        auto found = _watches.find(sock);
+        if (found == _watches.end()) return false;
+        if (found->second.events == events) return true;
+
+        found->second.events = events;
+        return change(sock, found->second);
+    }
+
+    void unwatch(SOCKET sock) {
+        auto found = _watches.find(sock);
+        if (found == _watches.end()) return;
+
+        remove(sock, found->second);
+        _tokens.erase(found->second.token);
+        _watches.erase(found);
+    }
+
+    bool isWatching(SOCKET sock) const {
+        return _watches.count(sock) > 0;
+    }
+
+    // Waits up to timeoutMs (-1 for as long as it takes) and runs the callbacks of
+    // the ready sockets. Returns how many ran, -1 if waiting failed.
+    virtual int poll(int timeoutMs) = 0;
+
+    // Makes a poll() that's waiting on another thread return. Safe from any thread.
+    void wake() {
+        if (_wakeWrite == INVALID_SOCKET) return;
+        char byte = 1;
+#ifdef _WIN32
+        send(_wakeWrite, &byte, 1, 0);
+#else
+        ssize_t ignored = write(_wakeWrite, &byte, 1);
+        (void)ignored;
+#endif
+    }
+
+    // "io_uring", "epoll" or "poll"; "" picks the best one there is. Falls back to
+    // the next best if the one asked for isn't available (e.g. io_uring disabled).
+    static std::unique_ptr<EventLoop> create(const std::string& preferred = "");
+
+protected:
+    struct Watch {
+        uint64_t token = 0; // Tells completions for a watch apart from ones for an earlier socket with the same number
+        int events = 0;
+        std::shared_ptr<Callback> callback;
+        bool armed = false; // io_uring: a poll request is on the ring
+    };
+
+    std::unordered_map<SOCKET, Watch> _watches;
+    std::unordered_map<uint64_t, SOCKET> _tokens;
+    uint64_t _nextToken = 2;
+
+    virtual bool add(SOCKET sock, Watch& entry) = 0;
+    virtual bool change(SOCKET sock, Watch& entry) = 0;
+    virtual void remove(SOCKET sock, Watch& entry) = 0;
+
+    // Runs the watch's callback if it still exists. Callbacks may watch and unwatch
+    // anything, their own socket included.
+    bool dispatch(uint64_t token, int events) {
+        auto found = _tokens.find(token);
+        if (found == _tokens.end()) return false;
+
+        auto watch = _watches.find(found->second);
+        if (watch == _watches.end() || watch->second.token != token) return false;
+
+        std::shared_ptr<Callback> callback = watch->second.callback;
+        (*callback)(events);
+        return true;
+    }
+
+private:
+    SOCKET _wakeRead = INVALID_SOCKET;
+    SOCKET _wakeWrite = INVALID_SOCKET;
+
+    static void closeSocket(SOCKET sock) {
+#ifdef _WIN32
+        closesocket(sock);
+#else
+        close(sock);
+#endif
+    }
+
+    void closeWaker() {
+        if (_wakeRead != INVALID_SOCKET) closeSocket(_wakeRead);
+        if (_wakeWrite != INVALID_SOCKET && _wakeWrite != _wakeRead) closeSocket(_wakeWrite);
+        _wakeRead = _wakeWrite = INVALID_SOCKET;
+    }
+
+protected:
+    // A pipe (a UDP socket talking to itself on Windows) that wake() writes to
+    bool startWaker() {
+#ifdef _WIN32
+        SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (sock == INVALID_SOCKET) return false;
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int length = sizeof(address);
+        if (bind(sock, (sockaddr*)&address, sizeof(address)) != 0 ||
+            getsockname(sock, (sockaddr*)&address, &length) != 0 ||
+            connect(sock, (sockaddr*)&address, sizeof(address)) != 0) {
+            closesocket(sock);
+            return false;
+        }
+
+        u_long nonBlocking = 1;
+        ioctlsocket(sock, FIONBIO, &nonBlocking);
+        _wakeRead = _wakeWrite = sock;
+#else
+        int fds[2];
+        if (pipe(fds) != 0) return false;
+        for (int fd : fds) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        _wakeRead = fds[0];
+        _wakeWrite = fds[1];
+#endif
+
+        SOCKET wakeRead = _wakeRead;
+        return watch(wakeRead, Readable, [wakeRead](int) {
+            char buffer[64];
+#ifdef _WIN32
+            while (recv(wakeRead, buffer, sizeof(buffer), 0) > 0) {}
+#else
+            while (read(wakeRead, buffer, sizeof(buffer)) > 0) {}
+#endif
+        });
+    }
+};
+
+// Portable: builds the descriptor list for every wait
+class PollEventLoop : public EventLoop {
+public:
+    const char* name() const override {
+        return "poll";
+    }
+
+    int poll(int timeoutMs) override {
+        std::vector<pollfd> fds;
+        std::vector<uint64_t> tokens;
+        fds.reserve(_watches.size());
+        tokens.reserve(_watches.size());
+
+        for (const auto& entry : _watches) {
+            pollfd fd = {};
+            fd.fd = entry.first;
+            if (entry.second.events & Readable) fd.events |= POLLIN;
+            if (entry.second.events & Writable) fd.events |= POLLOUT;
+            fds.push_back(fd);
+            tokens.push_back(entry.second.token);
+        }
+
+#ifdef _WIN32
+        int ready = WSAPoll(fds.data(), (ULONG)fds.size(), timeoutMs);
+#else
+        int ready = ::poll(fds.data(), (nfds_t)fds.size(), timeoutMs);
+        if (ready < 0 && errno == EINTR) return 0;
+#endif
+        if (ready <= 0) return ready;
+
+        int dispatched = 0;
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (fds[i].revents == 0) continue;
+
+            int events = 0;
+            if (fds[i].revents & POLLIN) events |= Readable;
+            if (fds[i].revents & POLLOUT) events |= Writable;
+            if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) events = Readable | Writable;
+
+            if (dispatch(tokens[i], events)) dispatched++;
+        }
+        return dispatched;
+    }
+
+protected:
+    bool add(SOCKET, Watch&) override { return true; }
+    bool change(SOCKET, Watch&) override { return true; }
+    void remove(SOCKET, Watch&) override {}
+};
+
+#ifdef __linux__
+
+class EpollEventLoop : public EventLoop {
+public:
+    EpollEventLoop() {
+        _epoll = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    ~EpollEventLoop() override {
+        if (_epoll >= 0) close(_epoll);
+    }
+
+    bool isOpen() const {
+        return _epoll >= 0;
+    }
+
+    const char* name() const override {
+        return "epoll";
+    }
+
+    int poll(int timeoutMs) override {
+        epoll_event events[128];
+        int ready = epoll_wait(_epoll, events, 128, timeoutMs);
+        if (ready < 0) return errno == EINTR ? 0 : -1;
+
+        int dispatched = 0;
+        for (int i = 0; i < ready; i++) {
+            int ready_events = 0;
+            if (events[i].events & EPOLLIN) ready_events |= Readable;
+            if (events[i].events & EPOLLOUT) ready_events |= Writable;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) ready_events = Readable | Writable;
+
+            if (dispatch(events[i].data.u64, ready_events)) dispatched++;
+        }
+        return dispatched;
+    }
+
+protected:
+    int _epoll;
+
+    static epoll_event toEpoll(const Watch& entry) {
+        epoll_event event = {};
+        if (entry.events & Readable) event.events |= EPOLLIN;
+        if (entry.events & Writable) event.events |= EPOLLOUT;
+        event.data.u64 = entry.token;
+        return event;
+    }
+
+    bool add(SOCKET sock, Watch& entry) override {
+        epoll_event event = toEpoll(entry);
+        return epoll_ctl(_epoll, EPOLL_CTL_ADD, sock, &event) == 0;
+    }
+
+    bool change(SOCKET sock, Watch& entry) override {
+        epoll_event event = toEpoll(entry);
+        return epoll_ctl(_epoll, EPOLL_CTL_MOD, sock, &event) == 0;
+    }
+
+    void remove(SOCKET sock, Watch&) override {
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, sock, nullptr);
+    }
+};
+
+#ifdef EVENT_LOOP_HAS_IO_URING
+
+// One-shot poll requests on an io_uring, re-armed after every completion (and
+// after the callback had its say), which makes them level-triggered. Talks to
+// the kernel directly rather than through liburing.
+class IoUringEventLoop : public EventLoop {
+public:
+    explicit IoUringEventLoop(unsigned entries = 256) {
+        io_uring_params params = {};
+        _ring = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (_ring < 0) return;
+
+        // Timeouts on the wait need IORING_ENTER_EXT_ARG (5.11)
+        if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            close(_ring);
+            _ring = -1;
+            return;
+        }
+
+        _ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                             params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        _ringMemory = mmap(nullptr, _ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+        _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        _sqes = (io_uring_sqe*)mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES);
+        if (_ringMemory == MAP_FAILED || _sqes == MAP_FAILED) {
+            release();
+            return;
+        }
+
+        char* base = (char*)_ringMemory;
+        _sqHead = (unsigned*)(base + params.sq_off.head);
+        _sqTail = (unsigned*)(base + params.sq_off.tail);
+        _sqMask = *(unsigned*)(base + params.sq_off.ring_mask);
+        _sqEntries = *(unsigned*)(base + params.sq_off.ring_entries);
+        _sqArray = (unsigned*)(base + params.sq_off.array);
+        _cqHead = (unsigned*)(base + params.cq_off.head);
+        _cqTail = (unsigned*)(base + params.cq_off.tail);
+        _cqMask = *(unsigned*)(base + params.cq_off.ring_mask);
+        _cqes = (io_uring_cqe*)(base + params.cq_off.cqes);
+    }
+
+    ~IoUringEventLoop() override {
+        release();
+    }
+
+    bool isOpen() const {
+        return _ring >= 0;
+    }
+
+    const char* name() const override {
+        return "io_uring";
+    }
+
+    int poll(int timeoutMs) override {
+        // Everything that fired last time, or changed since, goes back on the ring
+        for (auto& entry : _watches) {
+            if (!entry.second.armed) arm(entry.first, entry.second);
+        }
+
+        __kernel_timespec timeout = {};
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+
+        io_uring_getevents_arg arg = {};
+        arg.ts = timeoutMs < 0 ? 0 : (uint64_t)(uintptr_t)&timeout;
+
+        unsigned toSubmit = _pending;
+        _pending = 0;
+        int result = (int)syscall(__NR_io_uring_enter, _ring, toSubmit, 1,
+                                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (result < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) return -1;
+
+        // Collect first: callbacks change the watches, and re-arming waits for the next round
+        std::vector<std::pair<uint64_t, int>> ready;
+        unsigned head = *_cqHead;
+        unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = _cqes[head & _cqMask];
+            if (cqe.user_data & 1) continue; // A removal finishing
+            ready.push_back({ cqe.user_data, cqe.res });
+        }
+        __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+
+        int dispatched = 0;
+        for (const auto& completion : ready) {
+            auto token = _tokens.find(completion.first >> 1);
+            if (token == _tokens.end()) continue;
+            auto watch = _watches.find(token->second);
+            if (watch == _watches.end() || watch->second.token != token->first) continue;
+            watch->second.armed = false;
+
+            if (completion.second == -ECANCELED) continue;
+
+            int events = 0;
+            if (completion.second < 0) events = Readable | Writable;
+            else {
+                if (completion.second & POLLIN) events |= Readable;
+                if (completion.second & POLLOUT) events |= Writable;
+                if (completion.second & (POLLERR | POLLHUP | POLLNVAL)) events = Readable | Writable;
+            }
+
+            if (dispatch(token->first, events)) dispatched++;
+        }
+        return dispatched;
+    }
+
+protected:
+    int _ring = -1;
+    void* _ringMemory = MAP_FAILED;
+    size_t _ringSize = 0;
+    io_uring_sqe* _sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t _sqesSize = 0;
+
+    unsigned* _sqHead = nullptr;
+    unsigned* _sqTail = nullptr;
+    unsigned _sqMask = 0;
+    unsigned _sqEntries = 0;
+    unsigned* _sqArray = nullptr;
+    unsigned* _cqHead = nullptr;
+    unsigned* _cqTail = nullptr;
+    unsigned _cqMask = 0;
+    io_uring_cqe* _cqes = nullptr;
+
+    unsigned _pending = 0; // Queued but not yet handed to the kernel
+
+    void release() {
+        if (_sqes != MAP_FAILED) munmap(_sqes, _sqesSize);
+        if (_ringMemory != MAP_FAILED) munmap(_ringMemory, _ringSize);
+        if (_ring >= 0) close(_ring);
+        _sqes = (io_uring_sqe*)MAP_FAILED;
+        _ringMemory = MAP_FAILED;
+        _ring = -1;
+    }
+
+    io_uring_sqe* nextSqe() {
+        unsigned tail = *_sqTail;
+        if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) {
+            // Full: hand what's queued over to make room
+            syscall(__NR_io_uring_enter, _ring, _pending, 0, 0, nullptr, 0);
+            _pending = 0;
+            if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) return nullptr;
+        }
+
+        unsigned index = tail & _sqMask;
+        io_uring_sqe* sqe = &_sqes[index];
+        *sqe = {};
+        _sqArray[index] = index;
+        __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+        _pending++;
+        return sqe;
+    }
+
+    // Even user_data is a poll for that watch token, odd is a removal nobody waits for
+    void arm(SOCKET sock, Watch& entry) {
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) return;
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = sock;
+        unsigned mask = 0;
+        if (entry.events & Readable) mask |= POLLIN;
+        if (entry.events & Writable) mask |= POLLOUT;
+        sqe->poll32_events = mask;
+        sqe->user_data = entry.token << 1;
+        entry.armed = true;
+    }
+
+    void disarm(Watch& entry) {
+        if (!entry.armed) return;
+
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) return;
+
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = entry.token << 1;
+        sqe->user_data = 1;
+        entry.armed = false;
+    }
+
+    bool add(SOCKET, Watch&) override {
+        return true; // Armed on the next poll()
+    }
+
+    bool change(SOCKET sock, Watch& entry) override {
+        // The old request goes, and completions for it are ignored from now on
+        disarm(entry);
+        _tokens.erase(entry.token);
+        entry.token = _nextToken++;
+        _tokens[entry.token] = sock;
+        return true;
+    }
+
+    void remove(SOCKET, Watch& entry) override {
+        disarm(entry);
+    }
+};
+
+#endif // EVENT_LOOP_HAS_IO_URING
+
+#endif // __linux__
+
+inline std::unique_ptr<EventLoop> EventLoop::create(const std::string& preferred) {
+    std::unique_ptr<EventLoop> loop;
+
+#if defined(__linux__) && defined(EVENT_LOOP_HAS_IO_URING)
+    if (preferred == "io_uring") {
+        std::unique_ptr<IoUringEventLoop> ring(new IoUringEventLoop());
+        if (ring->isOpen()) loop = std::move(ring);
+    }
+#endif
+#ifdef __linux__
+    if (!loop && preferred != "poll") {
+        std::unique_ptr<EpollEventLoop> epoll(new EpollEventLoop());
+        if (epoll->isOpen()) loop = std::move(epoll);
+    }
+#endif
+    if (!loop) {
+        loop.reset(new PollEventLoop());
+    }
+
+    if (!loop->startWaker()) return nullptr;
+    return loop;
+}
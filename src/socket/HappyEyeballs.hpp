@@ -0,0 +1,292 @@
+/*
+ * RFC 8305 ("Happy Eyeballs v2") connection racing
+ */
+
+#pragma once
+
+#include "SocketCompat.hpp"
+#include "DnsCache.hpp"
+
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+class HappyEyeballs {
+public:
+    // RFC 8305 section 5 recommends 250 ms between attempts
+    static constexpr int ConnectionAttemptDelayMs = 250;
+
+    static bool setNonBlocking(SOCKET sock, bool nonBlocking) {
+#ifdef _WIN32
+        u_long mode = nonBlocking ? 1 : 0;
+        return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+        int flags = fcntl(sock, F_GETFL, 0);
+        if (flags < 0) return false;
+        flags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+        return fcntl(sock, F_SETFL, flags) == 0;
+#endif
+    }
+
+    // Alternates address families starting with IPv6, keeping the resolver's
+    // order within each family (RFC 8305 section 4)
+    static std::vector<ResolvedAddress> interleave(const std::vector<ResolvedAddress>& addresses) {
+        std::vector<ResolvedAddress> v6, v4, ordered;
+        for (const ResolvedAddress& address : addresses) {
+            (address.family == AF_INET6 ? v6 : v4).push_back(address);
+        }
+
+        size_t i = 0, j = 0;
+        while (i < v6.size() || j < v4.size()) {
+            if (i < v6.size()) ordered.push_back(v6[i++]);
+            if (j < v4.size()) ordered.push_back(v4[j++]);
+        }
+        return ordered;
+    }
+
+    // interleave(), with addresses equal to avoid (if given) moved to the back: a
+    // second connection to the host should go somewhere else if it can
+    static std::vector<ResolvedAddress> order(const std::vector<ResolvedAddress>& addresses, const struct sockaddr_storage* avoid) {
+        std::vector<ResolvedAddress> ordered = interleave(addresses);
+        if (!avoid) return ordered;
+
+        std::stable_partition(ordered.begin(), ordered.end(), [avoid](const ResolvedAddress& address) {
+            return !sameAddress(address.addr, *avoid);
+        });
+        return ordered;
+    }
+
+    // TCP Fast Open, where the OS has it (Linux): once a server has handed us a
+    // cookie, connect() to it returns right away and the first write goes out in
+    // the SYN, saving a round trip. Servers without a cookie connect as usual.
+    static void setFastOpen(bool enabled) {
+        fastOpenEnabled() = enabled;
+    }
+
+    static bool usesFastOpen() {
+        return fastOpenEnabled();
+    }
+
+    // Starts one non-blocking connect, for callers that wait on the socket themselves.
+    // INVALID_SOCKET if it failed right away (error says why). Otherwise connected
+    // says whether it's done already; if not, it is once the socket turns writable
+    // and attemptError() is 0.
+    static SOCKET startAttempt(const ResolvedAddress& address, bool& connected, int& error) {
+        connected = false;
+        error = 0;
+
+        SOCKET sock = socket(address.family, address.socktype, address.protocol);
+        if (sock == INVALID_SOCKET) {
+            error = socketError();
+            return INVALID_SOCKET;
+        }
+        if (!setNonBlocking(sock, true)) {
+            error = socketError();
+            closeSocket(sock);
+            return INVALID_SOCKET;
+        }
+
+#ifdef TCP_FASTOPEN_CONNECT
+        if (fastOpenEnabled()) {
+            int enable = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (const char *)&enable, sizeof(enable));
+        }
+#endif
+
+        int result = ::connect(sock, (const struct sockaddr *)&address.addr, (int)address.addrlen);
+        if (result == 0) {
+            connected = true;
+            return sock;
+        }
+        if (inProgress()) {
+            return sock;
+        }
+
+        error = socketError();
+        closeSocket(sock);
+        return INVALID_SOCKET;
+    }
+
+    // How a started attempt ended, 0 if it connected
+    static int attemptError(SOCKET sock) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&error, &length);
+        return error;
+    }
+
+    static void closeSocket(SOCKET sock) {
+#ifdef _WIN32
+        closesocket(sock);
+#else
+        close(sock);
+#endif
+    }
+
+    // Races non-blocking connects to the addresses, starting a new attempt every
+    // ConnectionAttemptDelayMs or as soon as the previous one fails. Returns the first
+    // socket to connect (back in blocking mode) and closes the rest, or INVALID_SOCKET.
+    // timeoutMs < 0 waits as long as the OS keeps the attempts alive.
+    static SOCKET connect(const std::vector<ResolvedAddress>& resolved, int timeoutMs, char* message, size_t messageSize,
+                          const struct sockaddr_storage* avoid = NULL) {
+        typedef std::chrono::steady_clock Clock;
+
+        struct Attempt {
+            SOCKET sock;
+            size_t address;
+        };
+
+        std::vector<ResolvedAddress> addresses = order(resolved, avoid);
+        std::vector<Attempt> pending;
+        size_t next = 0;
+        int lastError = 0;
+
+        Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+        Clock::time_point nextAttemptAt = Clock::now();
+
+        while (true) {
+            Clock::time_point now = Clock::now();
+
+            // Start the next attempt if it's due (or nothing else is in flight)
+            if (next < addresses.size() && (now >= nextAttemptAt || pending.empty())) {
+                bool connected;
+                int error;
+                SOCKET sock = startAttempt(addresses[next], connected, error);
+
+                if (connected) {
+                    closeAll(pending);
+                    setNonBlocking(sock, false);
+                    return sock;
+                }
+
+                if (sock != INVALID_SOCKET) {
+                    pending.push_back({ sock, next });
+                } else {
+                    lastError = error;
+                }
+
+                next++;
+                nextAttemptAt = Clock::now() + std::chrono::milliseconds(ConnectionAttemptDelayMs);
+                continue;
+            }
+
+            if (pending.empty()) {
+                // Every address has failed
+                snprintf(message, messageSize, "connect() failed with error: %d; please make sure server is running", lastError);
+                return INVALID_SOCKET;
+            }
+
+            if (timeoutMs >= 0 && now >= deadline) {
+                closeAll(pending);
+                snprintf(message, messageSize, "connect() timed out");
+                return INVALID_SOCKET;
+            }
+
+            // Wait for one of the attempts to finish, or for the next one to be due
+            Clock::time_point wakeAt = next < addresses.size() ? nextAttemptAt : Clock::time_point::max();
+            if (timeoutMs >= 0 && deadline < wakeAt) wakeAt = deadline;
+
+            struct timeval timeout;
+            struct timeval* timeoutPtr = NULL;
+            if (wakeAt != Clock::time_point::max()) {
+                long long waitUs = std::chrono::duration_cast<std::chrono::microseconds>(wakeAt - now).count();
+                if (waitUs < 0) waitUs = 0;
+                timeout.tv_sec = (long)(waitUs / 1000000);
+                timeout.tv_usec = (long)(waitUs % 1000000);
+                timeoutPtr = &timeout;
+            }
+
+            fd_set writeSet, errorSet;
+            FD_ZERO(&writeSet);
+            FD_ZERO(&errorSet);
+            SOCKET highest = 0;
+            for (const Attempt& attempt : pending) {
+                FD_SET(attempt.sock, &writeSet);
+                FD_SET(attempt.sock, &errorSet);
+                if (attempt.sock > highest) highest = attempt.sock;
+            }
+
+            int ready = select((int)highest + 1, NULL, &writeSet, &errorSet, timeoutPtr);
+            if (ready <= 0) continue;
+
+            for (size_t i = 0; i < pending.size(); ) {
+                SOCKET sock = pending[i].sock;
+                if (!FD_ISSET(sock, &writeSet) && !FD_ISSET(sock, &errorSet)) {
+                    i++;
+                    continue;
+                }
+
+                int error = attemptError(sock);
+
+                if (error == 0 && FD_ISSET(sock, &writeSet)) {
+                    pending.erase(pending.begin() + i);
+                    closeAll(pending);
+                    setNonBlocking(sock, false);
+                    return sock;
+                }
+
+                // This one failed, don't wait out the delay before trying the next address
+                lastError = error;
+                closeSocket(sock);
+                pending.erase(pending.begin() + i);
+                nextAttemptAt = Clock::now();
+            }
+        }
+    }
+
+private:
+    static std::atomic<bool>& fastOpenEnabled() {
+        static std::atomic<bool> enabled(true);
+        return enabled;
+    }
+
+    // Same host and port; the rest of a sockaddr can differ without meaning anything
+    static bool sameAddress(const struct sockaddr_storage& a, const struct sockaddr_storage& b) {
+        if (a.ss_family != b.ss_family) return false;
+
+        if (a.ss_family == AF_INET) {
+            const struct sockaddr_in& a4 = (const struct sockaddr_in&)a;
+            const struct sockaddr_in& b4 = (const struct sockaddr_in&)b;
+            return a4.sin_port == b4.sin_port && memcmp(&a4.sin_addr, &b4.sin_addr, sizeof(a4.sin_addr)) == 0;
+        }
+        if (a.ss_family == AF_INET6) {
+            const struct sockaddr_in6& a6 = (const struct sockaddr_in6&)a;
+            const struct sockaddr_in6& b6 = (const struct sockaddr_in6&)b;
+            return a6.sin6_port == b6.sin6_port && memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof(a6.sin6_addr)) == 0;
+        }
+        return false;
+    }
+
+    static bool inProgress() {
+#ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        return errno == EINPROGRESS;
+#endif
+    }
+
+    static int socketError() {
+#ifdef _WIN32
+        return WSAGetLastError();
+#else
+        return errno;
+#endif
+    }
+
+    template <typename Attempts>
+    static void closeAll(Attempts& attempts) {
+        for (const auto& attempt : attempts) {
+            closeSocket(attempt.sock);
+        }
+        attempts.clear();
+    }
+};
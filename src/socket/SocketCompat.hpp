@@ -22,6 +22,7 @@
 typedef int SOCKET;
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -83,13 +84,17 @@ class Socket {
 
     public:
 
-        void closeConnection(void)
+        virtual ~Socket() {}
+
+        virtual void closeConnection(void)
         {
+            if (_sock == INVALID_SOCKET) return;
 #ifdef _WIN32
             closesocket(_sock);
 #else
             close(_sock);
 #endif
+            _sock = INVALID_SOCKET;
         }
 
         char * getMessage(void)
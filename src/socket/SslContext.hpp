@@ -0,0 +1,177 @@
+#pragma once
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#include <atomic>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+
+// One SSL_CTX shared by every TLS connection in the process. The CA bundle is
+// parsed once when the context is built, and client sessions are cached per
+// host:port so repeat connections can resume instead of doing a full handshake.
+class SslContext {
+private:
+    SSL_CTX* _ctx;
+    int _sessionKeyIndex;
+
+    std::mutex _sessionMutex;
+    std::map<std::string, SSL_SESSION*> _sessions;
+
+    std::atomic<bool> _offerHttp2;
+    std::atomic<bool> _earlyData;
+
+    SslContext() : _ctx(nullptr), _sessionKeyIndex(-1), _offerHttp2(true), _earlyData(true) {
+        // Initialize OpenSSL library
+        SSL_library_init();
+        SSL_load_error_strings();
+        OpenSSL_add_all_algorithms();
+
+        _ctx = SSL_CTX_new(TLS_client_method());
+        if (!_ctx) {
+            fprintf(stderr, "SSL_CTX_new failed\n");
+            return;
+        }
+
+        // Set minimum TLS version
+        SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+
+        if (SSL_CTX_load_verify_locations(_ctx, "assets/ca_cert.pem", nullptr) != 1) {
+            fprintf(stderr, "Failed to load CA bundle\n");
+        }
+        SSL_CTX_set_verify(_ctx, SSL_VERIFY_PEER, nullptr);
+
+        // Set once here: other threads make connections from the context. Turning
+        // h2 off is done per connection, see TcpSslClientSocket::prepareSSL().
+        static const unsigned char withHttp2[] = "\x02h2\x08http/1.1";
+        SSL_CTX_set_alpn_protos(_ctx, withHttp2, sizeof(withHttp2) - 1); // Size without the terminating zero
+
+        // We keep the sessions ourselves so they can be looked up by host:port;
+        // TLS 1.3 tickets only show up after the handshake, so this has to be a callback
+        _sessionKeyIndex = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(_ctx, onNewSession);
+    }
+
+    ~SslContext() {
+        clearSessions();
+        if (_ctx) {
+            SSL_CTX_free(_ctx);
+            _ctx = nullptr;
+        }
+    }
+
+    static int onNewSession(SSL* ssl, SSL_SESSION* session) {
+        SslContext& context = instance();
+        const std::string* key = (const std::string*)SSL_get_ex_data(ssl, context._sessionKeyIndex);
+        if (!key || !SSL_SESSION_is_resumable(session)) {
+            return 0; // Not kept, OpenSSL frees it
+        }
+
+        context.storeSession(*key, session);
+        return 1; // We own the reference now
+    }
+
+    static bool isExpired(SSL_SESSION* session) {
+        return (long)time(nullptr) > SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+    }
+
+public:
+    SslContext(const SslContext&) = delete;
+    SslContext& operator=(const SslContext&) = delete;
+
+    static SslContext& instance() {
+        static SslContext context;
+        return context;
+    }
+
+    SSL_CTX* get() {
+        return _ctx;
+    }
+
+    // What ALPN offers new connections: h2 first, or HTTP/1.1 only. Safe while
+    // other threads connect, the context itself isn't touched.
+    void setOfferHttp2(bool offer) {
+        _offerHttp2 = offer;
+    }
+
+    bool offersHttp2() const {
+        return _offerHttp2;
+    }
+
+    // Whether a request may go out as TLS 1.3 early data (0-RTT) when resuming a
+    // session whose server allows it, see TcpSslClientSocket::setEarlyData()
+    void setEarlyData(bool enabled) {
+        _earlyData = enabled;
+    }
+
+    bool sendsEarlyData() const {
+        return _earlyData;
+    }
+
+    // Trusts one more certificate on top of the CA bundle, e.g. a replay server's self-signed one
+    bool trustCertificate(X509* certificate) {
+        if (!_ctx || !certificate) return false;
+        return X509_STORE_add_cert(SSL_CTX_get_cert_store(_ctx), certificate) == 1;
+    }
+
+    // Tags the SSL object with its cache key so new sessions/tickets land in the
+    // right slot. The string has to outlive the SSL object.
+    void attachSessionKey(SSL* ssl, const std::string* key) {
+        SSL_set_ex_data(ssl, _sessionKeyIndex, (void*)key);
+    }
+
+    // Returns a session to resume for the key (caller frees it), or nullptr.
+    // TLS 1.3 tickets are meant to be used once, so those are handed over and forgotten.
+    SSL_SESSION* takeSession(const std::string& key) {
+        std::lock_guard<std::mutex> lock(_sessionMutex);
+
+        auto found = _sessions.find(key);
+        if (found == _sessions.end()) return nullptr;
+
+        SSL_SESSION* session = found->second;
+        if (isExpired(session)) {
+            SSL_SESSION_free(session);
+            _sessions.erase(found);
+            return nullptr;
+        }
+
+        if (SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION) {
+            _sessions.erase(found);
+        } else {
+            SSL_SESSION_up_ref(session);
+        }
+        return session;
+    }
+
+    // Takes ownership of one reference to the session
+    void storeSession(const std::string& key, SSL_SESSION* session) {
+        std::lock_guard<std::mutex> lock(_sessionMutex);
+
+        auto found = _sessions.find(key);
+        if (found != _sessions.end()) {
+            SSL_SESSION_free(found->second);
+        }
+        _sessions[key] = session;
+    }
+
+    void removeSession(const std::string& key) {
+        std::lock_guard<std::mutex> lock(_sessionMutex);
+
+        auto found = _sessions.find(key);
+        if (found != _sessions.end()) {
+            SSL_SESSION_free(found->second);
+            _sessions.erase(found);
+        }
+    }
+
+    void clearSessions() {
+        std::lock_guard<std::mutex> lock(_sessionMutex);
+        for (auto& entry : _sessions) {
+            SSL_SESSION_free(entry.second);
+        }
+        _sessions.clear();
+    }
+};
@@ -9,6 +9,7 @@
 #pragma once
 
 #include "TcpSocket.hpp"
+#include "HappyEyeballs.hpp"
 
 #ifndef _WIN32
 static void closesocket(int socket) { close(socket); }
@@ -17,27 +18,91 @@ static void closesocket(int socket) { close(socket); }
 
 class TcpClientSocket : public TcpSocket {
 
+    protected:
+
+        // How long all connection attempts together may take, -1 leaves it to the OS
+        int _connectTimeoutMs;
+
+        // An address to try last, see avoidAddressOf()
+        struct sockaddr_storage _avoid;
+        bool _avoiding;
+
     public:
 
         TcpClientSocket(const char * host, const short port)
-            : TcpSocket(host, port)        
+            : TcpSocket(host, port), _connectTimeoutMs(-1), _avoiding(false)
+        {
+        }
+
+        void setConnectTimeout(int milliseconds)
+        {
+            _connectTimeoutMs = milliseconds;
+        }
+
+        // Where the host resolved to, for callers that connect by themselves
+        const std::vector<ResolvedAddress>& getAddresses() const
+        {
+            return _addresses;
+        }
+
+        // The addresses in the order to try them, see HappyEyeballs::order()
+        std::vector<ResolvedAddress> getConnectOrder() const
+        {
+            return HappyEyeballs::order(_addresses, _avoiding ? &_avoid : NULL);
+        }
+
+        // Prefers any other address over the one that connection went to, for a
+        // second connection that shouldn't share the first one's fate
+        void avoidAddressOf(const TcpSocket& other)
+        {
+            socklen_t length;
+            _avoiding = other.getPeerAddress(_avoid, length);
+        }
+
+        // Takes over a socket someone else connected (an event loop racing the
+        // addresses without blocking), as if openConnection() had done it
+        virtual void adoptConnection(SOCKET sock, double connectMs)
+        {
+            _sock = sock;
+            _conn = sock;
+            _timings.connectMs = connectMs;
+            _connected = true;
+        }
+
+        // Or they couldn't: every address failed, the last one with error
+        void connectionFailed(int error, double connectMs)
+        {
+            _timings.connectMs = connectMs;
+            sprintf_s(_message, "connect() failed with error: %d; please make sure server is running", error);
+        }
+
+        void connectionTimedOut(double connectMs)
+        {
+            _timings.connectMs = connectMs;
+            sprintf_s(_message, "connect() timed out");
+        }
+
+        // Non-blocking sockets are for the readSome()/writeSome() callers, the rest
+        // of the API expects blocking ones
+        void setBlocking(bool blocking)
         {
+            HappyEyeballs::setNonBlocking(_conn, !blocking);
         }
 
         virtual void openConnection(void)
         {
 
-            // Check if socket initialization was successful
-            if (_sock == INVALID_SOCKET || _addressInfo == NULL) {
+            // Check if address resolution was successful
+            if (_addresses.empty()) {
                 sprintf_s(_message, "Socket initialization failed; cannot connect");
                 return;
             }
 
-            // Connect to server, returning on failure
-            if (connect(_sock, _addressInfo->ai_addr, (int)_addressInfo->ai_addrlen) == SOCKET_ERROR) {
-                closesocket(_sock);
-                _sock = INVALID_SOCKET;
-                sprintf_s(_message, "connect() failed; please make sure server is running");
+            // Race the addresses against each other, returning on failure
+            std::chrono::steady_clock::time_point connectStart = std::chrono::steady_clock::now();
+            _sock = HappyEyeballs::connect(_addresses, _connectTimeoutMs, _message, sizeof(_message), _avoiding ? &_avoid : NULL);
+            _timings.connectMs = elapsedMs(connectStart);
+            if (_sock == INVALID_SOCKET) {
                 return;
             }
 
@@ -9,6 +9,23 @@
 #pragma once
 
 #include "SocketCompat.hpp"
+#include "DnsCache.hpp"
+
+#include <chrono>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+// How long each step of setting up a connection took, -1 if it didn't happen
+struct ConnectTimings {
+    double dnsMs = -1;
+    double connectMs = -1;
+    double tlsMs = -1;
+};
 
 class TcpSocket : public Socket {
 
@@ -19,10 +36,17 @@ class TcpSocket : public Socket {
 
         SOCKET _conn;
 
-        struct addrinfo * _addressInfo;
+        std::vector<ResolvedAddress> _addresses;
 
         bool _connected;
 
+        ConnectTimings _timings;
+
+        static double elapsedMs(std::chrono::steady_clock::time_point since)
+        {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+        }
+
         TcpSocket(const char * host, const short port)
         {
             sprintf_s(_host, "%s", host);
@@ -30,33 +54,23 @@ class TcpSocket : public Socket {
 
             // No connection yet
             _sock = INVALID_SOCKET;
+            _conn = INVALID_SOCKET;
             _connected = false;
             *_message = 0;
 
             // Initialize Winsock, returning on failure
             if (!initWinsock()) return;
 
-            // Set up client address info
-            struct addrinfo hints = {0};
-            hints.ai_family = AF_INET;
-            hints.ai_socktype = SOCK_STREAM;
-
-            // Resolve the server address and port, returning on failure
-            _addressInfo = NULL;
-            int iResult = getaddrinfo(_host, _port, &hints, &_addressInfo);
-            if ( iResult != 0 ) {
+            // Resolve the server's IPv6 and IPv4 addresses, returning on failure.
+            // The socket itself is created when connecting, once we know which address wins.
+            std::chrono::steady_clock::time_point resolveStart = std::chrono::steady_clock::now();
+            int iResult = DnsCache::instance().resolveDualStack(_host, port, _addresses);
+            _timings.dnsMs = elapsedMs(resolveStart);
+            if ( iResult != 0 || _addresses.empty() ) {
                 sprintf_s(_message, "getaddrinfo() failed with error: %d", iResult);
                 cleanup();
                 return;
             }
-
-            // Create a SOCKET for connecting to server, returning on failure
-            _sock = socket(_addressInfo->ai_family, _addressInfo->ai_socktype, _addressInfo->ai_protocol);
-            if (_sock == INVALID_SOCKET) {
-                sprintf_s(_message, "socket() failed");
-                cleanup();
-                return;
-            }
         }
 
     public:
@@ -72,7 +86,7 @@ class TcpSocket : public Socket {
             return (size_t)recv(_conn, (char *)buf, len, 0) == len;
         }
 
-        int receiveDataInt(void* buf, size_t len) {
+        virtual int receiveDataInt(void* buf, size_t len) {
 
             int n = recv(_conn, (char *)buf, len, 0);
             if (n <= 0) {
@@ -81,9 +95,141 @@ class TcpSocket : public Socket {
             return n;
         }
 
+        void closeConnection(void) override
+        {
+            Socket::closeConnection();
+            _conn = INVALID_SOCKET;
+            _connected = false;
+        }
+
         virtual bool isConnected()
         {
             return _connected;
         }
 
+        SOCKET getDescriptor() const
+        {
+            return _conn;
+        }
+
+        // For non-blocking sockets: bytes read, 0 if nothing is there yet,
+        // -1 once the connection is closed or broken
+        virtual int readSome(void* buf, size_t len)
+        {
+            int n = recv(_conn, (char *)buf, (int)len, 0);
+            if (n > 0) return n;
+            if (n < 0 && wouldBlock()) return 0;
+            return -1;
+        }
+
+        // For non-blocking sockets: bytes written, 0 if there's no room right now, -1 on error
+        virtual int writeSome(const void* buf, size_t len)
+        {
+            int n = send(_conn, (const char *)buf, (int)len, 0);
+            if (n >= 0) return n;
+            return wouldBlock() ? 0 : -1;
+        }
+
+        // Who the connection is with
+        bool getPeerAddress(struct sockaddr_storage& address, socklen_t& length) const
+        {
+            length = sizeof(address);
+            return _conn != INVALID_SOCKET && getpeername(_conn, (struct sockaddr *)&address, &length) == 0;
+        }
+
+        // Whether our first bytes went out in the SYN and the server took them (TCP
+        // Fast Open). Known once the handshake is through; always false off Linux.
+        bool usedFastOpen() const
+        {
+            return _conn != INVALID_SOCKET && synCarriedData(_conn);
+        }
+
+        // The same for any connected socket, either end of it
+        static bool synCarriedData(SOCKET sock)
+        {
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+            struct tcp_info info;
+            socklen_t length = sizeof(info);
+            if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &length) != 0) return false;
+            return (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+#else
+            return false;
+#endif
+        }
+
+        // Makes blocking reads give up after that long, 0 to wait as long as it takes
+        void setReceiveTimeout(int timeoutMs)
+        {
+            if (_conn == INVALID_SOCKET) return;
+#ifdef _WIN32
+            DWORD timeout = (DWORD)timeoutMs;
+#else
+            struct timeval timeout;
+            timeout.tv_sec = timeoutMs / 1000;
+            timeout.tv_usec = (timeoutMs % 1000) * 1000;
+#endif
+            setsockopt(_conn, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+        }
+
+        static bool wouldBlock()
+        {
+#ifdef _WIN32
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+        }
+
+        const ConnectTimings& getTimings() const
+        {
+            return _timings;
+        }
+
+        // An idle keep-alive connection should have nothing to read. If it is
+        // readable, the server has closed it (or sent garbage) and it can't be reused.
+        virtual bool isStale()
+        {
+            if (!_connected || _conn == INVALID_SOCKET) return true;
+
+            fd_set readSet;
+            FD_ZERO(&readSet);
+            FD_SET(_conn, &readSet);
+            struct timeval timeout = {0, 0};
+
+            int ready = select((int)_conn + 1, &readSet, NULL, NULL, &timeout);
+            return ready != 0;
+        }
+
+        // Waits up to timeoutMs for something to read (or the peer closing)
+        virtual bool waitReadable(int timeoutMs)
+        {
+            if (_conn == INVALID_SOCKET) return true; // Let the read fail right away
+
+            fd_set readSet;
+            FD_ZERO(&readSet);
+            FD_SET(_conn, &readSet);
+            struct timeval timeout;
+            timeout.tv_sec = timeoutMs / 1000;
+            timeout.tv_usec = (timeoutMs % 1000) * 1000;
+
+            return select((int)_conn + 1, &readSet, NULL, NULL, &timeout) != 0;
+        }
+
+        // Waits up to timeoutMs for either socket to have something to read. Which
+        // one it was is for waitReadable(0) to say, it knows what counts as data.
+        static void waitEitherReadable(const TcpSocket& first, const TcpSocket& second, int timeoutMs)
+        {
+            fd_set readSet;
+            FD_ZERO(&readSet);
+            FD_SET(first._conn, &readSet);
+            FD_SET(second._conn, &readSet);
+            SOCKET highest = first._conn > second._conn ? first._conn : second._conn;
+
+            struct timeval timeout;
+            timeout.tv_sec = timeoutMs / 1000;
+            timeout.tv_usec = (timeoutMs % 1000) * 1000;
+
+            select((int)highest + 1, &readSet, NULL, NULL, &timeout);
+        }
+
 };
\ No newline at end of file
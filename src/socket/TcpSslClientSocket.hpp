@@ -2,20 +2,30 @@
 
 #include "TcpClientSocket.hpp"
 #include "TcpSslSocket.hpp"
+#include "SslContext.hpp"
+#include <string>
 
 // Use multiple inheritance to get both client functionality and SSL functionality
 class TcpSslClientSocket : public TcpClientSocket {
 private:
-    SSL_CTX* _sslContext;
+    SSL_CTX* _sslContext; // Shared, owned by SslContext
     SSL* _ssl;
     bool _sslInitialized;
+    std::string _sessionKey;
+    std::chrono::steady_clock::time_point _handshakeStart;
+    bool _offerHttp2; // Whether ALPN may offer h2, when the context does
+    std::string _earlyData; // See setEarlyData()
+    bool _earlyDataPending;
+    bool _earlyDataSent;
 
 public:
     TcpSslClientSocket(const char* host, const short port)
-        : TcpClientSocket(host, port), _sslContext(nullptr), _ssl(nullptr), _sslInitialized(false) {
-        initializeSSL();
-        setupSSLContext(true); // Client mode
-        setTrustStore();
+        : TcpClientSocket(host, port), _sslContext(SslContext::instance().get()), _ssl(nullptr), _sslInitialized(false), _offerHttp2(true),
+          _earlyDataPending(false), _earlyDataSent(false) {
+        _sessionKey = std::string(_host) + ":" + _port;
+        if (!_sslContext) {
+            sprintf_s(_message, "SSL_CTX_new failed");
+        }
     }
 
     ~TcpSslClientSocket() {
@@ -30,21 +40,24 @@ public:
             return; // TCP connection failed
         }
         
-        // Create SSL object and attach to socket
-        if (!createSSL()) {
+        if (!prepareSSL()) {
             _connected = false;
             return;
         }
-        
-        // Set hostname for SNI (Server Name Indication)
-        if (SSL_set_tlsext_host_name(_ssl, _host) != 1) {
-            sprintf_s(_message, "SSL_set_tlsext_host_name failed");
-            _connected = false;
-            return;
+
+        // Perform SSL handshake, within what's left of the connect timeout
+        if (_connectTimeoutMs >= 0) {
+            int remainingMs = _connectTimeoutMs - (int)_timings.connectMs;
+            setReceiveTimeout(remainingMs > 1 ? remainingMs : 1);
         }
-        
-        // Perform SSL handshake
-        if (performSSLHandshake()) {
+        std::chrono::steady_clock::time_point handshakeStart = std::chrono::steady_clock::now();
+        bool handshakeDone = performSSLHandshake();
+        _timings.tlsMs = elapsedMs(handshakeStart);
+        if (_connectTimeoutMs >= 0) {
+            setReceiveTimeout(0);
+        }
+
+        if (handshakeDone) {
             _sslInitialized = true;
             sprintf_s(_message, "SSL connection established");
         } else {
@@ -52,6 +65,17 @@ public:
         }
     }
 
+    void closeConnection() override {
+        // Shut down TLS while the descriptor is still ours, then close it
+        if (_ssl) {
+            SSL_shutdown(_ssl);
+            SSL_free(_ssl);
+            _ssl = nullptr;
+        }
+        _sslInitialized = false;
+        TcpClientSocket::closeConnection();
+    }
+
     // Override data methods for SSL
     bool sendData(void* buf, size_t len) override {
         if (!_ssl) return false;
@@ -63,7 +87,7 @@ public:
         return SSL_read(_ssl, buf, len) == (int)len;
     }
 
-	int receiveDataInt(void* buf, size_t len) {
+	int receiveDataInt(void* buf, size_t len) override {
         if (!_ssl) return -1;
         //return SSL_read(_ssl, buf, len) == (int)len;
 
@@ -76,49 +100,169 @@ public:
 		return n;
     }
 
+    // OpenSSL may already hold decrypted bytes the socket won't signal again
+    // Only application data (or the connection closing) counts, not the session
+    // tickets that make the socket readable too, see hasApplicationData()
+    bool waitReadable(int timeoutMs) override {
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+        while (true) {
+            if (_ssl && SSL_pending(_ssl) > 0) return true;
+
+            long long remainingMs = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if (!TcpClientSocket::waitReadable(remainingMs > 0 ? (int)remainingMs : 0)) return false;
+            if (!_ssl || !_sslInitialized || hasApplicationData()) return true;
+            if (remainingMs <= 0) return false;
+        }
+    }
+
+    // A TLS 1.3 server sends its session tickets after the handshake, so an idle
+    // connection can be readable without anything being wrong. Let OpenSSL eat
+    // those records; only application data or a close means it's stale.
+    bool isStale() override {
+        if (TcpClientSocket::isStale() == false) return false;
+        if (!_ssl || !_sslInitialized) return true;
+        return hasApplicationData();
+    }
+
+    // Which ALPN offers a connection makes, before openConnection(). HTTP/1.1-only
+    // callers leave h2 out so the server can't pick it.
+    void setOfferHttp2(bool offerHttp2) {
+        _offerHttp2 = offerHttp2;
+    }
+
+    // A request to send as TLS 1.3 early data (0-RTT), set before openConnection()
+    // or beginHandshake(). It only goes out when resuming a session whose server
+    // takes early data and settled on HTTP/1.1, and has to be safe to replay (a
+    // GET). Afterwards, send it the usual way unless earlyDataAccepted().
+    // That stays true for the connection's life, it only speaks for the request
+    // that opened it; the next one on a kept-alive connection goes out as usual.
+    void setEarlyData(const std::string& request) {
+        _earlyData = request;
+    }
+
+    bool earlyDataAccepted() const {
+        return _ssl != nullptr && _earlyDataSent && SSL_get_early_data_status(_ssl) == SSL_EARLY_DATA_ACCEPTED;
+    }
+
     bool isSSLConnected() const {
         return _ssl != nullptr && _sslInitialized;
     }
 
-private:
-    bool initializeSSL() {
-        // Initialize OpenSSL library
-        SSL_library_init();
-        SSL_load_error_strings();
-        OpenSSL_add_all_algorithms();
+    bool isSessionReused() const {
+        return _ssl != nullptr && SSL_session_reused(_ssl) == 1;
+    }
+
+    // What ALPN settled on, "h2" or "http/1.1" ("" if the server didn't take part)
+    std::string negotiatedProtocol() const {
+        if (!_ssl) return "";
+        const unsigned char* protocol = nullptr;
+        unsigned int length = 0;
+        SSL_get0_alpn_selected(_ssl, &protocol, &length);
+        return protocol ? std::string((const char*)protocol, length) : "";
+    }
+
+    // For non-blocking use (HTTP/2 sessions, FetchEngine) the caller makes sure
+    // only one thread at a time is inside these.
+    // Bytes read, 0 if nothing is there yet, -1 once the connection is closed or broken
+    int readSome(void* buf, size_t len) override {
+        if (!_ssl) return -1;
+
+        int n = SSL_read(_ssl, buf, (int)len);
+        if (n > 0) return n;
+
+        int error = SSL_get_error(_ssl, n);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) return 0;
+        return -1;
+    }
+
+    // A record at a time; after a 0, call again with the same bytes once writable
+    int writeSome(const void* buf, size_t len) override {
+        if (!_ssl) return -1;
+
+        int n = SSL_write(_ssl, buf, (int)len);
+        if (n > 0) return n;
+
+        int error = SSL_get_error(_ssl, n);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) return 0;
+        return -1;
+    }
+
+    // Non-blocking handshake on a connection from adoptConnection(): begin once,
+    // then continue whenever the socket is ready the way wantWrite says.
+    // HTTP/2 can be left out of ALPN for callers that only speak HTTP/1.1.
+    bool beginHandshake(bool offerHttp2) {
+        _offerHttp2 = offerHttp2;
+        if (!prepareSSL()) return false;
+
+        _handshakeStart = std::chrono::steady_clock::now();
         return true;
     }
 
-    void cleanup() {
-        if (_ssl) {
-            SSL_shutdown(_ssl);
-            SSL_free(_ssl);
-            _ssl = nullptr;
+    // 1 when done, 0 to wait for the socket, -1 if the handshake failed
+    int continueHandshake(bool& wantWrite) {
+        wantWrite = false;
+        if (!_ssl) return -1;
+
+        if (_earlyDataPending) {
+            int written = writeEarlyData(wantWrite);
+            if (written == 0) return 0;
+            if (written < 0) {
+                SslContext::instance().removeSession(_sessionKey);
+                _connected = false;
+                return -1;
+            }
+        }
+
+        int result = SSL_connect(_ssl);
+        if (result == 1) {
+            _timings.tlsMs = elapsedMs(_handshakeStart);
+            _sslInitialized = true;
+            sprintf_s(_message, "SSL connection established");
+            return 1;
         }
-        if (_sslContext) {
-            SSL_CTX_free(_sslContext);
-            _sslContext = nullptr;
+
+        int error = SSL_get_error(_ssl, result);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            wantWrite = error == SSL_ERROR_WANT_WRITE;
+            return 0;
         }
+
+        SslContext::instance().removeSession(_sessionKey);
+        sprintf_s(_message, "SSL handshake failed with error: %d", error);
+        _connected = false;
+        return -1;
     }
 
-    bool setupSSLContext(bool isClient = true) {
-        const SSL_METHOD* method;
-        
-        if (isClient) {
-            method = TLS_client_method();
-        } else {
-            method = TLS_server_method();
+    // Writes everything on a non-blocking socket, waiting for room as needed
+    bool writeAll(const void* buf, size_t len) {
+        if (!_ssl) return false;
+
+        while (true) {
+            int n = SSL_write(_ssl, buf, (int)len);
+            if (n > 0) return true; // Without partial writes enabled it's all or nothing
+
+            int error = SSL_get_error(_ssl, n);
+            if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) return false;
+
+            fd_set set;
+            FD_ZERO(&set);
+            FD_SET(_conn, &set);
+            struct timeval timeout = {5, 0};
+            int ready = error == SSL_ERROR_WANT_WRITE
+                ? select((int)_conn + 1, NULL, &set, NULL, &timeout)
+                : select((int)_conn + 1, &set, NULL, NULL, &timeout);
+            if (ready <= 0) return false;
         }
-        
-        _sslContext = SSL_CTX_new(method);
-        if (!_sslContext) {
-            sprintf_s(_message, "SSL_CTX_new failed");
-            return false;
+    }
+
+private:
+    void cleanup() {
+        if (_ssl) {
+            SSL_shutdown(_ssl);
+            SSL_free(_ssl);
+            _ssl = nullptr;
         }
-        
-        // Set minimum TLS version
-        SSL_CTX_set_min_proto_version(_sslContext, TLS1_2_VERSION);
-        return true;
     }
 
     bool createSSL() {
@@ -139,28 +283,109 @@ private:
         return true;
     }
 
-    void setTrustStore() {
-        if (_sslContext) {
-			if (SSL_CTX_load_verify_locations(_sslContext, "assets/ca_cert.pem", nullptr) != 1) {
-				fprintf(stderr, "Failed to load CA bundle\n");
-				// handle error
-			}
-			SSL_CTX_set_verify(_sslContext, SSL_VERIFY_PEER, nullptr);
+    // For a blocking socket that's readable: takes in whatever TLS records are
+    // there, and says whether any of it is for the application (or a close)
+    bool hasApplicationData() {
+        char byte;
+        HappyEyeballs::setNonBlocking(_conn, true);
+        int result = SSL_peek(_ssl, &byte, 1);
+        int error = SSL_get_error(_ssl, result);
+        HappyEyeballs::setNonBlocking(_conn, false);
+
+        return !(result <= 0 && error == SSL_ERROR_WANT_READ);
+    }
+
+    // The resumed session has to allow that much early data, and the request is
+    // written in HTTP/1.1, so that's what the session has to have agreed on
+    bool canSendEarlyData() const {
+        if (_earlyData.empty() || !SslContext::instance().sendsEarlyData()) return false;
+
+        SSL_SESSION* session = SSL_get_session(_ssl);
+        if (!session || SSL_SESSION_get_max_early_data(session) < _earlyData.size()) return false;
+
+        const unsigned char* protocol = nullptr;
+        size_t length = 0;
+        SSL_SESSION_get0_alpn_selected(session, &protocol, &length);
+        return !protocol || std::string((const char*)protocol, length) == "http/1.1";
+    }
+
+    // 1 once the ClientHello and the early data are out, 0 to wait for the socket, -1 on failure
+    int writeEarlyData(bool& wantWrite) {
+        size_t written = 0;
+        int result = SSL_write_early_data(_ssl, _earlyData.data(), _earlyData.size(), &written);
+        if (result == 1) {
+            _earlyDataPending = false;
+            _earlyDataSent = true;
+            return 1;
+        }
+
+        int error = SSL_get_error(_ssl, result);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            wantWrite = error == SSL_ERROR_WANT_WRITE;
+            return 0;
         }
+
+        _earlyDataPending = false;
+        sprintf_s(_message, "SSL early data could not be sent, error: %d", error);
+        return -1;
+    }
+
+    // SSL object on the connected socket, with SNI and a cached session to resume
+    bool prepareSSL() {
+        // Create SSL object and attach to socket
+        if (!createSSL()) {
+            return false;
+        }
+
+        // Set hostname for SNI (Server Name Indication)
+        if (SSL_set_tlsext_host_name(_ssl, _host) != 1) {
+            sprintf_s(_message, "SSL_set_tlsext_host_name failed");
+            return false;
+        }
+
+        if (!_offerHttp2 || !SslContext::instance().offersHttp2()) {
+            static const unsigned char http1Only[] = "\x08http/1.1";
+            SSL_set_alpn_protos(_ssl, http1Only, sizeof(http1Only) - 1);
+        }
+
+        // Offer a cached session so the server can skip the full handshake
+        SslContext& context = SslContext::instance();
+        context.attachSessionKey(_ssl, &_sessionKey);
+        SSL_SESSION* session = context.takeSession(_sessionKey);
+        if (session) {
+            SSL_set_session(_ssl, session);
+            SSL_SESSION_free(session);
+        }
+        _earlyDataPending = session && canSendEarlyData();
+
+        return true;
     }
 
     bool performSSLHandshake() {
+        // The socket blocks, so this is all done or failed on return
+        if (_earlyDataPending) {
+            bool wantWrite;
+            if (writeEarlyData(wantWrite) != 1) {
+                SslContext::instance().removeSession(_sessionKey);
+                return false;
+            }
+        }
+
         int result = SSL_connect(_ssl);
         
         if (result == 1) {
             return true; // Handshake successful
         }
+
+        // Don't keep offering a session the server wouldn't take
+        SslContext::instance().removeSession(_sessionKey);
         
         int ssl_error = SSL_get_error(_ssl, result);
         switch (ssl_error) {
             case SSL_ERROR_WANT_READ:
             case SSL_ERROR_WANT_WRITE:
-                sprintf_s(_message, "SSL handshake would block");
+                // The socket blocks, so only the receive timeout gets us here
+                sprintf_s(_message, "SSL handshake timed out");
                 break;
             case SSL_ERROR_ZERO_RETURN:
                 sprintf_s(_message, "SSL connection closed");